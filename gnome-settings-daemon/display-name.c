@@ -36,12 +36,14 @@
 static const char *
 find_vendor (const char *code)
 {
+    static GsdPnpIds *pnp_ids = NULL;
     const char *vendor_name;
-    GsdPnpIds *pnp_ids;
 
-    pnp_ids = gsd_pnp_ids_new ();
-    vendor_name = gsd_pnp_ids_get_pnp_id (pnp_ids, code);
-    g_object_unref (pnp_ids);
+    /* Kept around, so that the table isn't loaded again for every
+     * display and the names can be used without copying them */
+    if (pnp_ids == NULL)
+        pnp_ids = gsd_pnp_ids_new ();
+    vendor_name = gsd_pnp_ids_lookup (pnp_ids, code);
 
     if (vendor_name)
         return vendor_name;
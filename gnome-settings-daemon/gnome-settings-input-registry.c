@@ -0,0 +1,243 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <gdk/gdk.h>
+#include <gdk/gdkx.h>
+
+#include <X11/extensions/XInput2.h>
+
+#include "gnome-settings-input-registry.h"
+
+/* This lives in libgsd rather than in the plugins' libcommon, so that
+ * there is a single registry for the whole daemon */
+#define INPUT_REGISTRY_KEY "gnome-settings-input-registry"
+
+typedef struct {
+        gboolean     has_xinput;
+        int          xi_opcode;
+
+        XDeviceInfo *devices;
+        int          n_devices;
+        gboolean     devices_valid;
+
+        /* device ID -> device node */
+        GHashTable  *device_nodes;
+        /* interned check name -> (device ID -> result + 1) */
+        GHashTable  *device_checks;
+} InputRegistry;
+
+static void
+input_registry_forget_device (InputRegistry *registry,
+                              int            deviceid)
+{
+        GHashTableIter iter;
+        gpointer checks;
+
+        g_hash_table_remove (registry->device_nodes, GINT_TO_POINTER (deviceid));
+
+        g_hash_table_iter_init (&iter, registry->device_checks);
+        while (g_hash_table_iter_next (&iter, NULL, &checks))
+                g_hash_table_remove (checks, GINT_TO_POINTER (deviceid));
+}
+
+static GdkFilterReturn
+input_registry_filter (GdkXEvent *xevent,
+                       GdkEvent  *event,
+                       gpointer   data)
+{
+        InputRegistry *registry = data;
+        XEvent *xev = (XEvent *) xevent;
+        XIHierarchyEvent *ev;
+        int i;
+
+        if (xev->type != GenericEvent ||
+            xev->xcookie.extension != registry->xi_opcode ||
+            xev->xcookie.evtype != XI_HierarchyChanged)
+                return GDK_FILTER_CONTINUE;
+
+        registry->devices_valid = FALSE;
+
+        ev = (XIHierarchyEvent *) xev->xcookie.data;
+        if (ev == NULL) {
+                /* No way to tell which devices changed */
+                g_hash_table_remove_all (registry->device_nodes);
+                g_hash_table_remove_all (registry->device_checks);
+                return GDK_FILTER_CONTINUE;
+        }
+
+        for (i = 0; i < ev->num_info; i++) {
+                if (ev->info[i].flags & (XISlaveAdded | XISlaveRemoved |
+                                         XIMasterAdded | XIMasterRemoved))
+                        input_registry_forget_device (registry, ev->info[i].deviceid);
+        }
+
+        return GDK_FILTER_CONTINUE;
+}
+
+static void
+input_registry_free (InputRegistry *registry)
+{
+        if (registry->xi_opcode >= 0)
+                gdk_window_remove_filter (NULL, input_registry_filter, registry);
+        if (registry->devices != NULL)
+                XFreeDeviceList (registry->devices);
+        g_hash_table_destroy (registry->device_nodes);
+        g_hash_table_destroy (registry->device_checks);
+        g_free (registry);
+}
+
+static void
+input_registry_probe (InputRegistry *registry,
+                      Display       *xdisplay)
+{
+        int event, error;
+        int major, minor;
+
+        registry->xi_opcode = -1;
+        registry->has_xinput = XQueryExtension (xdisplay, "XInputExtension",
+                                                &registry->xi_opcode, &event, &error);
+        if (!registry->has_xinput) {
+                registry->xi_opcode = -1;
+                return;
+        }
+
+        gdk_error_trap_push ();
+        major = 2;
+        minor = 3;
+        if (XIQueryVersion (xdisplay, &major, &minor) != Success ||
+            (major * 1000 + minor) < 2000)
+                registry->xi_opcode = -1;
+        gdk_error_trap_pop_ignored ();
+}
+
+static InputRegistry *
+input_registry_get (void)
+{
+        GdkDisplay *display;
+        InputRegistry *registry;
+
+        display = gdk_display_get_default ();
+        registry = g_object_get_data (G_OBJECT (display), INPUT_REGISTRY_KEY);
+        if (registry != NULL)
+                return registry;
+
+        registry = g_new0 (InputRegistry, 1);
+        input_registry_probe (registry, GDK_DISPLAY_XDISPLAY (display));
+        registry->device_nodes = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+        registry->device_checks = g_hash_table_new_full (NULL, NULL, NULL,
+                                                         (GDestroyNotify) g_hash_table_destroy);
+
+        /* GDK already selects for hierarchy events on the root window */
+        if (registry->xi_opcode >= 0)
+                gdk_window_add_filter (NULL, input_registry_filter, registry);
+
+        g_object_set_data_full (G_OBJECT (display), INPUT_REGISTRY_KEY,
+                                registry, (GDestroyNotify) input_registry_free);
+
+        return registry;
+}
+
+gboolean
+gnome_settings_input_registry_has_xinput (void)
+{
+        return input_registry_get ()->has_xinput;
+}
+
+/* The returned list belongs to the registry */
+XDeviceInfo *
+gnome_settings_input_registry_list_devices (int *n_devices)
+{
+        InputRegistry *registry;
+
+        registry = input_registry_get ();
+        if (!registry->devices_valid) {
+                if (registry->devices != NULL)
+                        XFreeDeviceList (registry->devices);
+                registry->devices = XListInputDevices (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()),
+                                                       &registry->n_devices);
+                if (registry->devices == NULL)
+                        registry->n_devices = 0;
+                registry->devices_valid = (registry->xi_opcode >= 0);
+        }
+
+        *n_devices = registry->n_devices;
+        return registry->devices;
+}
+
+char *
+gnome_settings_input_registry_get_device_node (int deviceid)
+{
+        return g_strdup (g_hash_table_lookup (input_registry_get ()->device_nodes,
+                                              GINT_TO_POINTER (deviceid)));
+}
+
+void
+gnome_settings_input_registry_set_device_node (int         deviceid,
+                                               const char *node)
+{
+        InputRegistry *registry;
+
+        registry = input_registry_get ();
+        if (registry->xi_opcode >= 0)
+                g_hash_table_insert (registry->device_nodes,
+                                     GINT_TO_POINTER (deviceid), g_strdup (node));
+}
+
+gboolean
+gnome_settings_input_registry_get_check (const char *check,
+                                         int         deviceid,
+                                         gboolean   *result)
+{
+        GHashTable *checks;
+        gpointer cached;
+
+        checks = g_hash_table_lookup (input_registry_get ()->device_checks,
+                                      g_intern_string (check));
+        if (checks == NULL)
+                return FALSE;
+
+        cached = g_hash_table_lookup (checks, GINT_TO_POINTER (deviceid));
+        if (cached == NULL)
+                return FALSE;
+
+        *result = GPOINTER_TO_INT (cached) - 1;
+        return TRUE;
+}
+
+void
+gnome_settings_input_registry_set_check (const char *check,
+                                         int         deviceid,
+                                         gboolean    result)
+{
+        InputRegistry *registry;
+        GHashTable *checks;
+
+        registry = input_registry_get ();
+        if (registry->xi_opcode < 0)
+                return;
+
+        check = g_intern_string (check);
+        checks = g_hash_table_lookup (registry->device_checks, check);
+        if (checks == NULL) {
+                checks = g_hash_table_new (NULL, NULL);
+                g_hash_table_insert (registry->device_checks, (gpointer) check, checks);
+        }
+
+        g_hash_table_insert (checks, GINT_TO_POINTER (deviceid), GINT_TO_POINTER (result ? 2 : 1));
+}
@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __GNOME_SETTINGS_INPUT_REGISTRY_H
+#define __GNOME_SETTINGS_INPUT_REGISTRY_H
+
+#include <glib.h>
+#include <X11/extensions/XInput.h>
+
+G_BEGIN_DECLS
+
+/* A cache of the XInput devices and of what the plugins found out about
+ * them, shared by all the plugins of the daemon and invalidated on XI2
+ * hierarchy changes. Without XInput 2, nothing is cached. */
+
+gboolean        gnome_settings_input_registry_has_xinput      (void);
+XDeviceInfo    *gnome_settings_input_registry_list_devices    (int        *n_devices);
+
+char           *gnome_settings_input_registry_get_device_node (int         deviceid);
+void            gnome_settings_input_registry_set_device_node (int         deviceid,
+                                                               const char *node);
+
+gboolean        gnome_settings_input_registry_get_check       (const char *check,
+                                                               int         deviceid,
+                                                               gboolean   *result);
+void            gnome_settings_input_registry_set_check       (const char *check,
+                                                               int         deviceid,
+                                                               gboolean    result);
+
+G_END_DECLS
+
+#endif /* __GNOME_SETTINGS_INPUT_REGISTRY_H */
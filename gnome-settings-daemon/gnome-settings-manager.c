@@ -29,6 +29,7 @@
 #include <glib/gi18n.h>
 #include <glib-object.h>
 #include <gio/gio.h>
+#include <gdk/gdkx.h>
 
 #include "gnome-settings-plugin.h"
 #include "gnome-settings-plugin-info.h"
@@ -52,6 +53,15 @@ static const gchar introspection_xml[] =
 "    <signal name='PluginDeactivated'>"
 "      <arg name='name' type='s'/>"
 "    </signal>"
+"    <method name='GetPluginTimings'>"
+"      <arg name='timings' direction='out' type='a{st}'/>"
+"    </method>"
+"    <method name='DumpTrace'>"
+"      <arg name='trace' direction='out' type='s'/>"
+"    </method>"
+"    <method name='GetXRequestCount'>"
+"      <arg name='count' direction='out' type='t'/>"
+"    </method>"
 "  </interface>"
 "</node>";
 
@@ -70,6 +80,11 @@ struct GnomeSettingsManagerPrivate
         GsdPnpIds                  *pnp_ids;
         GSList                     *plugins;
         GQueue                     *signal_queue;
+
+        /* Plugins still waiting to be activated, in priority order */
+        GList                      *pending;
+        guint                       activate_id;
+        gint64                      activate_start;
 };
 
 static void     gnome_settings_manager_class_init  (GnomeSettingsManagerClass *klass);
@@ -217,7 +232,19 @@ contained (const char * const *items,
 static gboolean
 is_schema (const char *schema)
 {
-        return contained (g_settings_list_schemas (), schema);
+        GSettingsSchemaSource *source;
+        GSettingsSchema *found;
+
+        source = g_settings_schema_source_get_default ();
+        if (source == NULL)
+                return FALSE;
+
+        found = g_settings_schema_source_lookup (source, schema, TRUE);
+        if (found == NULL)
+                return FALSE;
+
+        g_settings_schema_unref (found);
+        return TRUE;
 }
 
 static gboolean
@@ -330,6 +357,102 @@ _load_dir (GnomeSettingsManager *manager,
         gnome_settings_profile_end (NULL);
 }
 
+static gboolean
+is_pending (GnomeSettingsManager *manager,
+            const char           *location)
+{
+        GList *l;
+
+        for (l = manager->priv->pending; l != NULL; l = l->next) {
+                if (g_strcmp0 (gnome_settings_plugin_info_get_location (l->data), location) == 0)
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+/* Dependencies that aren't loaded at all (not installed, not whitelisted)
+ * don't hold a plugin back, only ones that are still waiting to start */
+static gboolean
+dependencies_resolved (GnomeSettingsManager    *manager,
+                       GnomeSettingsPluginInfo *info)
+{
+        const char * const *deps;
+        guint i;
+
+        deps = gnome_settings_plugin_info_get_dependencies (info);
+        if (deps == NULL)
+                return TRUE;
+
+        for (i = 0; deps[i] != NULL; i++) {
+                if (is_pending (manager, deps[i]))
+                        return FALSE;
+        }
+
+        return TRUE;
+}
+
+static gboolean
+activate_pending_plugins (GnomeSettingsManager *manager)
+{
+        GnomeSettingsManagerPrivate *priv = manager->priv;
+        GnomeSettingsPluginInfo *info;
+        GList *l;
+
+        /* Skip over disabled plugins, and activate a single enabled
+         * one per main loop iteration, so that D-Bus and the session
+         * registration keep being serviced in between */
+        while (priv->pending != NULL) {
+                for (l = priv->pending; l != NULL; l = l->next) {
+                        if (dependencies_resolved (manager, l->data))
+                                break;
+                }
+
+                if (l == NULL) {
+                        l = priv->pending;
+                        g_warning ("Dependency cycle involving plugin %s, activating it anyway",
+                                   gnome_settings_plugin_info_get_location (l->data));
+                }
+
+                info = l->data;
+                priv->pending = g_list_delete_link (priv->pending, l);
+
+                maybe_activate_plugin (info, NULL);
+                if (gnome_settings_plugin_info_get_enabled (info))
+                        break;
+        }
+
+        if (priv->pending != NULL)
+                return TRUE;
+
+        g_debug ("All plugins activated in %" G_GINT64_FORMAT " ms",
+                 (g_get_monotonic_time () - priv->activate_start) / 1000);
+        gnome_settings_profile_end ("activating plugins");
+
+        priv->activate_id = 0;
+        return FALSE;
+}
+
+static void
+_queue_all (GnomeSettingsManager *manager)
+{
+        GSList *l;
+
+        manager->priv->plugins = g_slist_sort (manager->priv->plugins, (GCompareFunc) compare_priority);
+
+        /* Activation happens from the main loop, in priority order
+         * except where a plugin has to wait for its dependencies */
+        for (l = manager->priv->plugins; l != NULL; l = l->next)
+                manager->priv->pending = g_list_prepend (manager->priv->pending, l->data);
+        manager->priv->pending = g_list_reverse (manager->priv->pending);
+
+        if (manager->priv->pending != NULL) {
+                gnome_settings_profile_start ("activating plugins");
+                manager->priv->activate_start = g_get_monotonic_time ();
+                manager->priv->activate_id = g_idle_add ((GSourceFunc) activate_pending_plugins, manager);
+        }
+}
+
 static void
 _load_all (GnomeSettingsManager *manager)
 {
@@ -338,8 +461,8 @@ _load_all (GnomeSettingsManager *manager)
         /* load system plugins */
         _load_dir (manager, GNOME_SETTINGS_PLUGINDIR G_DIR_SEPARATOR_S);
 
-        manager->priv->plugins = g_slist_sort (manager->priv->plugins, (GCompareFunc) compare_priority);
-        g_slist_foreach (manager->priv->plugins, (GFunc) maybe_activate_plugin, NULL);
+        _queue_all (manager);
+
         gnome_settings_profile_end (NULL);
 }
 
@@ -355,11 +478,90 @@ _unload_plugin (GnomeSettingsPluginInfo *info, gpointer user_data)
 static void
 _unload_all (GnomeSettingsManager *manager)
 {
+         if (manager->priv->activate_id != 0) {
+                 g_source_remove (manager->priv->activate_id);
+                 manager->priv->activate_id = 0;
+         }
+         g_list_free (manager->priv->pending);
+         manager->priv->pending = NULL;
+
          g_slist_foreach (manager->priv->plugins, (GFunc) _unload_plugin, NULL);
          g_slist_free (manager->priv->plugins);
          manager->priv->plugins = NULL;
 }
 
+static GVariant *
+get_plugin_timings (GnomeSettingsManager *manager)
+{
+        GVariantBuilder builder;
+        GSList *l;
+
+        g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{st}"));
+
+        for (l = manager->priv->plugins; l != NULL; l = l->next) {
+                GnomeSettingsPluginInfo *info = l->data;
+
+                if (!gnome_settings_plugin_info_is_active (info))
+                        continue;
+
+                g_variant_builder_add (&builder, "{st}",
+                                       gnome_settings_plugin_info_get_location (info),
+                                       (guint64) gnome_settings_plugin_info_get_activation_time (info));
+        }
+
+        return g_variant_new ("(a{st})", &builder);
+}
+
+static void
+handle_method_call (GDBusConnection       *connection,
+                    const gchar           *sender,
+                    const gchar           *object_path,
+                    const gchar           *interface_name,
+                    const gchar           *method_name,
+                    GVariant              *parameters,
+                    GDBusMethodInvocation *invocation,
+                    GnomeSettingsManager  *manager)
+{
+        gint64 span;
+
+        g_debug ("Calling method '%s' for settings manager", method_name);
+
+        span = gnome_settings_profile_span_begin ();
+
+        if (g_strcmp0 (method_name, "GetPluginTimings") == 0) {
+                g_dbus_method_invocation_return_value (invocation,
+                                                       get_plugin_timings (manager));
+        } else if (g_strcmp0 (method_name, "DumpTrace") == 0) {
+                char *trace;
+
+                trace = gnome_settings_profile_dump ();
+                g_dbus_method_invocation_return_value (invocation,
+                                                       g_variant_new ("(s)", trace));
+                g_free (trace);
+        } else if (g_strcmp0 (method_name, "GetXRequestCount") == 0) {
+                GdkDisplay *display;
+                guint64 count = 0;
+
+                /* Requests sent so far on the display connection
+                 * shared by all the plugins */
+                display = gdk_display_get_default ();
+                if (display != NULL)
+                        count = NextRequest (GDK_DISPLAY_XDISPLAY (display)) - 1;
+
+                g_dbus_method_invocation_return_value (invocation,
+                                                       g_variant_new ("(t)", count));
+        }
+
+        gnome_settings_profile_span_end ("dbus", g_intern_string (method_name), span);
+}
+
+static const GDBusInterfaceVTable interface_vtable =
+{
+        (GDBusInterfaceMethodCallFunc) handle_method_call,
+        NULL,
+        NULL
+};
+
 static void
 on_bus_gotten (GObject             *source_object,
                GAsyncResult        *res,
@@ -381,8 +583,8 @@ on_bus_gotten (GObject             *source_object,
         g_dbus_connection_register_object (connection,
                                            GSD_DBUS_PATH,
                                            manager->priv->introspection_data->interfaces[0],
-                                           NULL,
-                                           NULL,
+                                           &interface_vtable,
+                                           manager,
                                            NULL,
                                            NULL);
 
@@ -53,8 +53,14 @@ struct GnomeSettingsPluginInfoPrivate
         char                    *copyright;
         char                    *website;
 
+        /* Modules that have to be activated before this one */
+        char                   **dependencies;
+
         GnomeSettingsPlugin     *plugin;
 
+        /* How long the last activation took, in microseconds */
+        gint64                   activation_time;
+
         int                      enabled : 1;
         int                      active : 1;
 
@@ -107,6 +113,7 @@ gnome_settings_plugin_info_finalize (GObject *object)
         g_free (info->priv->website);
         g_free (info->priv->copyright);
         g_strfreev (info->priv->authors);
+        g_strfreev (info->priv->dependencies);
 
         if (info->priv->settings != NULL) {
                 g_object_unref (info->priv->settings);
@@ -243,6 +250,9 @@ gnome_settings_plugin_info_fill_from_file (GnomeSettingsPluginInfo *info,
                 g_debug ("Could not find 'Website' in %s", filename);
         }
 
+        /* Get Depends */
+        info->priv->dependencies = g_key_file_get_string_list (plugin_file, PLUGIN_GROUP, "Depends", NULL, NULL);
+
         /* Get Priority */
         priority = g_key_file_get_integer (plugin_file, PLUGIN_GROUP, "Priority", NULL);
         if (priority >= PLUGIN_PRIORITY_MAX) {
@@ -318,7 +328,14 @@ gnome_settings_plugin_info_set_settings_prefix (GnomeSettingsPluginInfo *info,
 static void
 _deactivate_plugin (GnomeSettingsPluginInfo *info)
 {
+        gint64 span;
+
+        span = gnome_settings_profile_span_begin ();
         gnome_settings_plugin_deactivate (info->priv->plugin);
+        gnome_settings_profile_span_end ("plugin-deactivate",
+                                         g_intern_string (info->priv->location),
+                                         span);
+
         g_signal_emit (info, signals [DEACTIVATED], 0);
 }
 
@@ -394,18 +411,27 @@ static gboolean
 _activate_plugin (GnomeSettingsPluginInfo *info)
 {
         gboolean res = TRUE;
+        gint64   start;
+        gint64   span;
 
         if (!info->priv->available) {
                 /* Plugin is not available, don't try to activate/load it */
                 return FALSE;
         }
 
+        start = g_get_monotonic_time ();
+        span = gnome_settings_profile_span_begin ();
+
         if (info->priv->plugin == NULL) {
                 res = load_plugin_module (info);
         }
 
         if (res) {
                 gnome_settings_plugin_activate (info->priv->plugin);
+                info->priv->activation_time = g_get_monotonic_time () - start;
+                gnome_settings_profile_span_end ("plugin-activate",
+                                                 g_intern_string (info->priv->location),
+                                                 span);
                 g_signal_emit (info, signals [ACTIVATED], 0);
         } else {
                 g_warning ("Error activating plugin '%s'", info->priv->name);
@@ -509,6 +535,22 @@ gnome_settings_plugin_info_get_location (GnomeSettingsPluginInfo *info)
         return info->priv->location;
 }
 
+const char * const *
+gnome_settings_plugin_info_get_dependencies (GnomeSettingsPluginInfo *info)
+{
+        g_return_val_if_fail (GNOME_IS_SETTINGS_PLUGIN_INFO (info), NULL);
+
+        return (const char * const *) info->priv->dependencies;
+}
+
+gint64
+gnome_settings_plugin_info_get_activation_time (GnomeSettingsPluginInfo *info)
+{
+        g_return_val_if_fail (GNOME_IS_SETTINGS_PLUGIN_INFO (info), 0);
+
+        return info->priv->activation_time;
+}
+
 int
 gnome_settings_plugin_info_get_priority (GnomeSettingsPluginInfo *info)
 {
@@ -66,6 +66,8 @@ const char     **gnome_settings_plugin_info_get_authors     (GnomeSettingsPlugin
 const char      *gnome_settings_plugin_info_get_website     (GnomeSettingsPluginInfo *info);
 const char      *gnome_settings_plugin_info_get_copyright   (GnomeSettingsPluginInfo *info);
 const char      *gnome_settings_plugin_info_get_location    (GnomeSettingsPluginInfo *info);
+const char * const *gnome_settings_plugin_info_get_dependencies (GnomeSettingsPluginInfo *info);
+gint64           gnome_settings_plugin_info_get_activation_time (GnomeSettingsPluginInfo *info);
 int              gnome_settings_plugin_info_get_priority    (GnomeSettingsPluginInfo *info);
 
 void             gnome_settings_plugin_info_set_priority    (GnomeSettingsPluginInfo *info,
@@ -30,10 +30,174 @@
 #include <unistd.h>
 
 #include <glib.h>
-#include <glib/gstdio.h>
 
 #include "gnome-settings-profile.h"
 
+/* Must be a power of two */
+#define TRACE_RING_SIZE 8192
+/* Room for names that aren't static, longer ones are truncated */
+#define TRACE_TEXT_SIZE 64
+
+typedef struct {
+        /* Index + 1 of the event stored in the slot, 0 while it is
+         * being written */
+        volatile gint  seq;
+        char           phase;
+        const char    *category;
+        const char    *name; /* NULL when the name is in text */
+        char           text[TRACE_TEXT_SIZE];
+        gint64         ts;
+        gint64         dur;
+        gpointer       thread;
+} TraceEvent;
+
+static TraceEvent   trace_ring[TRACE_RING_SIZE];
+static volatile gint trace_head = 0;
+static gint         trace_enabled = -1;
+
+static gboolean
+trace_is_enabled (void)
+{
+        if (G_UNLIKELY (trace_enabled < 0))
+                trace_enabled = g_strcmp0 (g_getenv ("GSD_TRACE"), "0") != 0;
+
+        return trace_enabled;
+}
+
+/* With copy_name, the name is copied into the slot instead of being
+ * referenced, for names that don't outlive the call */
+static void
+trace_record (char        phase,
+              const char *category,
+              const char *name,
+              gboolean    copy_name,
+              gint64      ts,
+              gint64      dur)
+{
+        TraceEvent *event;
+        guint idx;
+
+        idx = (guint) g_atomic_int_add (&trace_head, 1);
+        event = &trace_ring[idx & (TRACE_RING_SIZE - 1)];
+
+        g_atomic_int_set (&event->seq, 0);
+        event->phase = phase;
+        event->category = category;
+        if (copy_name) {
+                g_strlcpy (event->text, name, sizeof (event->text));
+                event->name = NULL;
+        } else {
+                event->name = name;
+        }
+        event->ts = ts;
+        event->dur = dur;
+        event->thread = g_thread_self ();
+        g_atomic_int_set (&event->seq, (gint) (idx + 1));
+}
+
+gint64
+gnome_settings_profile_span_begin (void)
+{
+        if (!trace_is_enabled ())
+                return 0;
+
+        return g_get_monotonic_time ();
+}
+
+void
+gnome_settings_profile_span_end (const char *category,
+                                 const char *name,
+                                 gint64      begin)
+{
+        if (begin == 0)
+                return;
+
+        trace_record ('X', category, name, FALSE, begin, g_get_monotonic_time () - begin);
+}
+
+void
+gnome_settings_profile_span_record (const char *category,
+                                    const char *name,
+                                    gint64      begin,
+                                    gint64      duration)
+{
+        if (begin == 0 || !trace_is_enabled ())
+                return;
+
+        trace_record ('X', category, name, FALSE, begin, duration);
+}
+
+static void
+append_json_string (GString    *str,
+                    const char *value)
+{
+        const char *p;
+
+        g_string_append_c (str, '"');
+        for (p = value ? value : ""; *p != '\0'; p++) {
+                if (*p == '"' || *p == '\\')
+                        g_string_append_printf (str, "\\%c", *p);
+                else if ((guchar) *p < 0x20)
+                        g_string_append_printf (str, "\\u%04x", (guchar) *p);
+                else
+                        g_string_append_c (str, *p);
+        }
+        g_string_append_c (str, '"');
+}
+
+/* Dumps the ring buffer in the Trace Event Format understood by
+ * chrome://tracing and Perfetto, oldest event first */
+char *
+gnome_settings_profile_dump (void)
+{
+        GString *str;
+        guint head, first, i;
+        gboolean needs_comma = FALSE;
+        int pid;
+
+        pid = getpid ();
+        head = (guint) g_atomic_int_get (&trace_head);
+        first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+        str = g_string_new ("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+        for (i = first; i != head; i++) {
+                TraceEvent *slot, event;
+
+                slot = &trace_ring[i & (TRACE_RING_SIZE - 1)];
+
+                /* Skip slots that were overwritten or are being written,
+                 * either before or while we copy them */
+                if ((guint) g_atomic_int_get (&slot->seq) != i + 1)
+                        continue;
+                event = *slot;
+                if ((guint) g_atomic_int_get (&slot->seq) != i + 1)
+                        continue;
+
+                if (needs_comma)
+                        g_string_append_c (str, ',');
+                needs_comma = TRUE;
+
+                g_string_append (str, "{\"name\":");
+                append_json_string (str, event.name != NULL ? event.name : event.text);
+                g_string_append (str, ",\"cat\":");
+                append_json_string (str, event.category);
+                g_string_append_printf (str,
+                                        ",\"ph\":\"%c\",\"ts\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%u",
+                                        event.phase, event.ts, pid,
+                                        GPOINTER_TO_UINT (event.thread));
+                if (event.phase == 'X')
+                        g_string_append_printf (str, ",\"dur\":%" G_GINT64_FORMAT, event.dur);
+                else if (event.phase == 'i')
+                        g_string_append (str, ",\"s\":\"t\"");
+                g_string_append_c (str, '}');
+        }
+
+        g_string_append (str, "]}");
+
+        return g_string_free (str, FALSE);
+}
+
 void
 _gnome_settings_profile_log (const char *func,
                              const char *note,
@@ -43,6 +207,10 @@ _gnome_settings_profile_log (const char *func,
         va_list args;
         char   *str;
         char   *formatted;
+        char    phase;
+
+        if (!trace_is_enabled ())
+                return;
 
         if (format == NULL) {
                 formatted = g_strdup ("");
@@ -53,13 +221,20 @@ _gnome_settings_profile_log (const char *func,
         }
 
         if (func != NULL) {
-                str = g_strdup_printf ("MARK: %s %s: %s %s", g_get_prgname(), func, note ? note : "", formatted);
+                str = g_strdup_printf ("%s %s", func, formatted);
         } else {
-                str = g_strdup_printf ("MARK: %s: %s %s", g_get_prgname(), note ? note : "", formatted);
+                str = g_strdup (formatted);
         }
 
         g_free (formatted);
 
-        g_access (str, F_OK);
+        if (g_strcmp0 (note, "start") == 0)
+                phase = 'B';
+        else if (g_strcmp0 (note, "end") == 0)
+                phase = 'E';
+        else
+                phase = 'i';
+
+        trace_record (phase, "profile", str, TRUE, g_get_monotonic_time (), 0);
         g_free (str);
 }
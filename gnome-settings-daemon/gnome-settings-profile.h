@@ -48,6 +48,21 @@ void            _gnome_settings_profile_log    (const char *func,
                                                 const char *format,
                                                 ...) G_GNUC_PRINTF (3, 4);
 
+/* Spans are recorded into an in-memory ring buffer, whether or not
+ * ENABLE_PROFILING is set. Category and name have to be static or
+ * interned strings, as only the pointers are stored. */
+gint64          gnome_settings_profile_span_begin (void);
+void            gnome_settings_profile_span_end   (const char *category,
+                                                   const char *name,
+                                                   gint64      begin);
+/* For spans timed elsewhere, begin being in monotonic time */
+void            gnome_settings_profile_span_record (const char *category,
+                                                    const char *name,
+                                                    gint64      begin,
+                                                    gint64      duration);
+
+char           *gnome_settings_profile_dump       (void);
+
 G_END_DECLS
 
 #endif /* __GNOME_SETTINGS_PROFILE_H */
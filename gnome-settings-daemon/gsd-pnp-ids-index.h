@@ -0,0 +1,54 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __GSD_PNP_IDS_INDEX_H
+#define __GSD_PNP_IDS_INDEX_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Layout of the vendor index that GsdPnpIds builds from pnp.ids in the
+ * user's cache directory, and maps read-only from then on:
+ *
+ *   GsdPnpIdsIndexHeader
+ *   GsdPnpIdsIndexEntry[n_entries], sorted by id
+ *   the vendor names, nul-terminated
+ *
+ * Numbers are in the byte order of the machine that built it, which
+ * byte_order tells. source_mtime and source_size are those of the
+ * pnp.ids it was built from, so that a stale index gets rebuilt. */
+
+#define GSD_PNP_IDS_INDEX_MAGIC      "GSDPNP\0\1"
+#define GSD_PNP_IDS_INDEX_BYTE_ORDER 0x01020304
+
+typedef struct {
+        gchar   magic[8];
+        guint32 byte_order;
+        guint32 n_entries;
+        guint64 source_mtime;
+        guint64 source_size;
+} GsdPnpIdsIndexHeader;
+
+typedef struct {
+        gchar   id[4];          /* nul-terminated */
+        guint32 name_offset;    /* from the start of the file */
+} GsdPnpIdsIndexEntry;
+
+G_END_DECLS
+
+#endif /* __GSD_PNP_IDS_INDEX_H */
@@ -19,9 +19,15 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <glib-object.h>
+#include <glib/gstdio.h>
 
 #include "gsd-pnp-ids.h"
+#include "gsd-pnp-ids-index.h"
 
 static void gsd_pnp_ids_finalize (GObject *object);
 
@@ -29,6 +35,14 @@ static void gsd_pnp_ids_finalize (GObject *object);
 
 struct _GsdPnpIdsPrivate
 {
+        gboolean    loaded;
+
+        /* the index in the user's cache, see gsd-pnp-ids-index.h */
+        GMappedFile *index;
+        const GsdPnpIdsIndexEntry *entries;
+        guint        n_entries;
+
+        /* or pnp.ids itself, when there's no usable index */
         gchar      *table_data;
         GHashTable *pnp_table;
 };
@@ -44,7 +58,7 @@ struct Vendor
     const char vendor_name[28];
 };
 
-/* This list of vendor codes derived from lshw
+/* This list of vendor codes derived from lshw, sorted by vendor_id
  *
  * http://ezix.org/project/wiki/HardwareLiSter
  *
@@ -55,155 +69,313 @@ struct Vendor
  */
 static const struct Vendor vendors[] =
 {
-    { "AIC", "AG Neovo" },
-    { "ACR", "Acer" },
-    { "DEL", "DELL" },
-    { "SAM", "SAMSUNG" },
-    { "SNY", "SONY" },
-    { "SEC", "Epson" },
-    { "WAC", "Wacom" },
-    { "NEC", "NEC" },
-    { "CMO", "CMO" },        /* Chi Mei */
-    { "BNQ", "BenQ" },
-
+    { "???", "Unknown" },
     { "ABP", "Advansys" },
     { "ACC", "Accton" },
     { "ACE", "Accton" },
+    { "ACR", "Acer" },
+    { "ACT", "Targa" },
+    { "ADI", "ADI" },
     { "ADP", "Adaptec" },
     { "ADV", "AMD" },
+    { "AIC", "AG Neovo" },
     { "AIR", "AIR" },
     { "AMI", "AMI" },
+    { "AOC", "AOC Intl" },
+    { "API", "Acer America" },
+    { "APP", "Apple Computer" },
+    { "ART", "ArtMedia" },
+    { "AST", "AST Research" },
     { "ASU", "ASUS" },
     { "ATI", "ATI" },
     { "ATK", "Allied Telesyn" },
     { "AZT", "Aztech" },
     { "BAN", "Banya" },
+    { "BNQ", "BenQ" },
     { "BRI", "Boca Research" },
     { "BUS", "Buslogic" },
     { "CCI", "Cache Computers Inc." },
     { "CHA", "Chase" },
     { "CMD", "CMD Technology, Inc." },
+    { "CMO", "CMO" },
     { "COG", "Cogent" },
+    { "CPL", "Compal" },
     { "CPQ", "Compaq" },
     { "CRS", "Crescendo" },
     { "CSC", "Crystal" },
     { "CSI", "CSI" },
     { "CTL", "Creative Labs" },
+    { "CTX", "Chuntex Electronic Co." },
     { "DBI", "Digi" },
-    { "DEC", "Digital Equipment" },
     { "DBK", "Databook" },
-    { "EGL", "Eagle Technology" },
-    { "ELS", "ELSA" },
-    { "ESS", "ESS" },
-    { "FAR", "Farallon" },
-    { "FDC", "Future Domain" },
-    { "HWP", "Hewlett-Packard" },
-    { "IBM", "IBM" },
-    { "INT", "Intel" },
-    { "ISA", "Iomega" },
-    { "LEN", "Lenovo" },
-    { "MDG", "Madge" },
-    { "MDY", "Microdyne" },
-    { "MET", "Metheus" },
-    { "MIC", "Micronics" },
-    { "MLX", "Mylex" },
-    { "NVL", "Novell" },
-    { "OLC", "Olicom" },
-    { "PRO", "Proteon" },
-    { "RII", "Racal" },
-    { "RTL", "Realtek" },
-    { "SCM", "SCM" },
-    { "SKD", "SysKonnect" },
-    { "SGI", "SGI" },
-    { "SMC", "SMC" },
-    { "SNI", "Siemens Nixdorf" },
-    { "STL", "Stallion Technologies" },
-    { "SUN", "Sun" },
-    { "SUP", "SupraExpress" },
-    { "SVE", "SVEC" },
-    { "TCC", "Thomas-Conrad" },
-    { "TCI", "Tulip" },
-    { "TCM", "3Com" },
-    { "TCO", "Thomas-Conrad" },
-    { "TEC", "Tecmar" },
-    { "TRU", "Truevision" },
-    { "TOS", "Toshiba" },
-    { "TYN", "Tyan" },
-    { "UBI", "Ungermann-Bass" },
-    { "USC", "UltraStor" },
-    { "VDM", "Vadem" },
-    { "VMI", "Vermont" },
-    { "WDC", "Western Digital" },
-    { "ZDS", "Zeos" },
-
-    /* From http://faydoc.tripod.com/structures/01/0136.htm */
-    { "ACT", "Targa" },
-    { "ADI", "ADI" },
-    { "AOC", "AOC Intl" },
-    { "API", "Acer America" },
-    { "APP", "Apple Computer" },
-    { "ART", "ArtMedia" },
-    { "AST", "AST Research" },
-    { "CPL", "Compal" },
-    { "CTX", "Chuntex Electronic Co." },
+    { "DEC", "Digital Equipment" },
+    { "DEL", "DELL" },
     { "DPC", "Delta Electronics" },
     { "DWE", "Daewoo" },
     { "ECS", "ELITEGROUP" },
+    { "EGL", "Eagle Technology" },
     { "EIZ", "EIZO" },
+    { "ELS", "ELSA" },
+    { "ESS", "ESS" },
+    { "FAR", "Farallon" },
     { "FCM", "Funai" },
+    { "FDC", "Future Domain" },
     { "GSM", "LG Electronics" },
     { "GWY", "Gateway 2000" },
     { "HEI", "Hyundai" },
     { "HIT", "Hitachi" },
     { "HSL", "Hansol" },
     { "HTC", "Hitachi" },
+    { "HWP", "Hewlett-Packard" },
+    { "IBM", "IBM" },
     { "ICL", "Fujitsu ICL" },
+    { "INT", "Intel" },
+    { "ISA", "Iomega" },
     { "IVM", "Idek Iiyama" },
     { "KFC", "KFC Computek" },
+    { "LEN", "Lenovo" },
     { "LKM", "ADLAS" },
     { "LNK", "LINK Tech" },
     { "LTN", "Lite-On" },
     { "MAG", "MAG InnoVision" },
     { "MAX", "Maxdata" },
+    { "MDG", "Madge" },
+    { "MDY", "Microdyne" },
     { "MEI", "Panasonic" },
     { "MEL", "Mitsubishi" },
+    { "MET", "Metheus" },
+    { "MIC", "Micronics" },
     { "MIR", "miro" },
+    { "MLX", "Mylex" },
     { "MTC", "MITAC" },
     { "NAN", "NANAO" },
-    { "NEC", "NEC Tech" },
+    { "NEC", "NEC" },
     { "NOK", "Nokia" },
+    { "NVL", "Novell" },
+    { "OLC", "Olicom" },
     { "OQI", "OPTIQUEST" },
     { "PBN", "Packard Bell" },
     { "PGS", "Princeton" },
     { "PHL", "Philips" },
+    { "PRO", "Proteon" },
     { "REL", "Relisys" },
+    { "RII", "Racal" },
+    { "RTL", "Realtek" },
+    { "SAM", "SAMSUNG" },
+    { "SCM", "SCM" },
     { "SDI", "Samtron" },
+    { "SEC", "Epson" },
+    { "SGI", "SGI" },
+    { "SKD", "SysKonnect" },
+    { "SMC", "SMC" },
     { "SMI", "Smile" },
+    { "SNI", "Siemens Nixdorf" },
+    { "SNY", "SONY" },
     { "SPT", "Sceptre" },
     { "SRC", "Shamrock Technology" },
+    { "STL", "Stallion Technologies" },
     { "STP", "Sceptre" },
+    { "SUN", "Sun" },
+    { "SUP", "SupraExpress" },
+    { "SVE", "SVEC" },
     { "TAT", "Tatung" },
+    { "TCC", "Thomas-Conrad" },
+    { "TCI", "Tulip" },
+    { "TCM", "3Com" },
+    { "TCO", "Thomas-Conrad" },
+    { "TEC", "Tecmar" },
+    { "TOS", "Toshiba" },
     { "TRL", "Royal Information Company" },
+    { "TRU", "Truevision" },
     { "TSB", "Toshiba, Inc." },
+    { "TYN", "Tyan" },
+    { "UBI", "Ungermann-Bass" },
     { "UNM", "Unisys" },
+    { "USC", "UltraStor" },
+    { "VDM", "Vadem" },
+    { "VMI", "Vermont" },
     { "VSC", "ViewSonic" },
+    { "WAC", "Wacom" },
+    { "WDC", "Western Digital" },
     { "WTC", "Wen Tech" },
     { "ZCM", "Zenith Data Systems" },
-
-    { "???", "Unknown" },
+    { "ZDS", "Zeos" },
 };
 
+static gchar *
+get_index_filename (void)
+{
+        const gchar *filename;
+
+        /* for running the benchmark with an index of its own */
+        filename = g_getenv ("GSD_PNP_IDS_INDEX");
+        if (filename != NULL)
+                return g_strdup (filename);
+
+        return g_build_filename (g_get_user_cache_dir (),
+                                 "unity-settings-daemon",
+                                 "pnp.ids.index",
+                                 NULL);
+}
+
+/* Maps the index, if it was built from @source as it is now. The
+ * pages are shared with every other process doing the same. */
+static gboolean
+gsd_pnp_ids_load_index (GsdPnpIds      *pnp_ids,
+                        const gchar    *filename,
+                        const GStatBuf *source)
+{
+        GsdPnpIdsPrivate *priv = pnp_ids->priv;
+        const GsdPnpIdsIndexHeader *header;
+        const gchar *contents;
+        GError *error = NULL;
+        gsize length;
+
+        priv->index = g_mapped_file_new (filename, FALSE, &error);
+        if (priv->index == NULL) {
+                g_debug ("no PNP ids index: %s", error->message);
+                g_error_free (error);
+                return FALSE;
+        }
+
+        contents = g_mapped_file_get_contents (priv->index);
+        length = g_mapped_file_get_length (priv->index);
+        header = (const GsdPnpIdsIndexHeader *) contents;
+
+        if (length < sizeof (GsdPnpIdsIndexHeader) ||
+            memcmp (header->magic, GSD_PNP_IDS_INDEX_MAGIC, sizeof (header->magic)) != 0 ||
+            header->byte_order != GSD_PNP_IDS_INDEX_BYTE_ORDER ||
+            header->n_entries > (length - sizeof (GsdPnpIdsIndexHeader)) / sizeof (GsdPnpIdsIndexEntry) ||
+            contents[length - 1] != '\0') {
+                g_debug ("ignoring invalid PNP ids index %s", filename);
+                goto fail;
+        }
+
+        /* hwdata got updated since the index was built */
+        if (header->source_mtime != (guint64) source->st_mtime ||
+            header->source_size != (guint64) source->st_size) {
+                g_debug ("ignoring PNP ids index %s, %s changed", filename, PNP_IDS);
+                goto fail;
+        }
+
+        priv->entries = (const GsdPnpIdsIndexEntry *) (contents + sizeof (GsdPnpIdsIndexHeader));
+        priv->n_entries = header->n_entries;
+
+        g_debug ("mapped %u items from %s", priv->n_entries, filename);
+
+        return TRUE;
+fail:
+        g_mapped_file_unref (priv->index);
+        priv->index = NULL;
+        return FALSE;
+}
+
+static gint
+compare_key (gconstpointer a,
+             gconstpointer b)
+{
+        return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+/* Writes what was parsed into pnp_table out as an index, for the next
+ * process to map. Failing is fine, that one will parse pnp.ids too. */
+static void
+gsd_pnp_ids_write_index (GsdPnpIds      *pnp_ids,
+                         const gchar    *filename,
+                         const GStatBuf *source)
+{
+        GsdPnpIdsPrivate *priv = pnp_ids->priv;
+        GsdPnpIdsIndexHeader header;
+        GHashTableIter iter;
+        GPtrArray *ids;
+        GString *index;
+        GError *error = NULL;
+        gchar *dirname;
+        gpointer key;
+        guint32 offset;
+        guint i;
+
+        dirname = g_path_get_dirname (filename);
+        if (g_mkdir_with_parents (dirname, 0755) < 0) {
+                g_debug ("could not create %s: %s", dirname, g_strerror (errno));
+                g_free (dirname);
+                return;
+        }
+        g_free (dirname);
+
+        ids = g_ptr_array_sized_new (g_hash_table_size (priv->pnp_table));
+        g_hash_table_iter_init (&iter, priv->pnp_table);
+        while (g_hash_table_iter_next (&iter, &key, NULL))
+                g_ptr_array_add (ids, key);
+        g_ptr_array_sort (ids, compare_key);
+
+        memset (&header, 0, sizeof (header));
+        memcpy (header.magic, GSD_PNP_IDS_INDEX_MAGIC, sizeof (header.magic));
+        header.byte_order = GSD_PNP_IDS_INDEX_BYTE_ORDER;
+        header.n_entries = ids->len;
+        header.source_mtime = source->st_mtime;
+        header.source_size = source->st_size;
+
+        index = g_string_new (NULL);
+        g_string_append_len (index, (const gchar *) &header, sizeof (header));
+
+        offset = sizeof (header) + ids->len * sizeof (GsdPnpIdsIndexEntry);
+        for (i = 0; i < ids->len; i++) {
+                const gchar *id = g_ptr_array_index (ids, i);
+                GsdPnpIdsIndexEntry entry;
+
+                memset (&entry, 0, sizeof (entry));
+                strncpy (entry.id, id, 3);
+                entry.name_offset = offset;
+                g_string_append_len (index, (const gchar *) &entry, sizeof (entry));
+
+                offset += strlen (g_hash_table_lookup (priv->pnp_table, id)) + 1;
+        }
+
+        for (i = 0; i < ids->len; i++) {
+                const gchar *name = g_hash_table_lookup (priv->pnp_table, g_ptr_array_index (ids, i));
+                g_string_append_len (index, name, strlen (name) + 1);
+        }
+
+        /* written to a temporary file and renamed, so that nobody maps
+         * half an index */
+        if (!g_file_set_contents (filename, index->str, index->len, &error)) {
+                g_debug ("could not write PNP ids index: %s", error->message);
+                g_error_free (error);
+        } else {
+                g_debug ("wrote %u items to %s", ids->len, filename);
+        }
+
+        g_string_free (index, TRUE);
+        g_ptr_array_unref (ids);
+}
+
 static gboolean
 gsd_pnp_ids_load (GsdPnpIds *pnp_ids, GError **error)
 {
         gchar *retval = NULL;
         GsdPnpIdsPrivate *priv = pnp_ids->priv;
+        gchar *index_filename;
+        gboolean have_source;
+        GStatBuf buf;
         guint i;
 
+        /* the index is kept in the user's cache and made from whatever
+         * pnp.ids is installed, so it follows hwdata updates */
+        index_filename = get_index_filename ();
+        have_source = g_stat (PNP_IDS, &buf) == 0;
+        if (have_source &&
+            gsd_pnp_ids_load_index (pnp_ids, index_filename, &buf)) {
+                g_free (index_filename);
+                return TRUE;
+        }
+
         /* load the contents */
         g_debug ("loading: %s", PNP_IDS);
-        if (g_file_get_contents (PNP_IDS, &priv->table_data, NULL, error) == FALSE)
+        if (g_file_get_contents (PNP_IDS, &priv->table_data, NULL, error) == FALSE) {
+                g_free (index_filename);
                 return FALSE;
+        }
 
         /* parse into lines */
         retval = priv->table_data;
@@ -228,62 +400,95 @@ gsd_pnp_ids_load (GsdPnpIds *pnp_ids, GError **error)
 
         g_debug ("Added %i items to the vendor hashtable", i);
 
+        if (have_source)
+                gsd_pnp_ids_write_index (pnp_ids, index_filename, &buf);
+        g_free (index_filename);
+
         return TRUE;
 }
 
+static int
+compare_id (const void *key,
+            const void *member)
+{
+        /* both vendors[] and the index entries start with the ID */
+        return strncmp (key, member, 4);
+}
+
 static const char *
 find_vendor (const char *pnp_id)
 {
-        guint i;
+        const struct Vendor *vendor;
 
-        for (i = 0; i < G_N_ELEMENTS (vendors); i++) {
-                if (g_strcmp0 (vendors[i].vendor_id, pnp_id) == 0)
-                        return vendors[i].vendor_name;
-        }
+        vendor = bsearch (pnp_id, vendors, G_N_ELEMENTS (vendors), sizeof (vendors[0]), compare_id);
 
-        return NULL;
+        return vendor != NULL ? vendor->vendor_name : NULL;
 }
 
 /**
- * gsd_pnp_ids_get_pnp_id:
+ * gsd_pnp_ids_lookup:
  * @pnp_ids: a #GsdPnpIds object
  * @pnp_id: the PNP ID to look for
  *
- * Find the full manufacturer name for the given PNP ID.
+ * Find the full manufacturer name for the given PNP ID, without
+ * copying it.
  *
- * Returns: (transfer full): a new string representing the manufacturer name,
- * or %NULL when not found.
+ * Returns: (transfer none): the manufacturer name, valid as long as
+ * @pnp_ids is, or %NULL when not found.
  */
-gchar *
-gsd_pnp_ids_get_pnp_id (GsdPnpIds *pnp_ids, const gchar *pnp_id)
+const gchar *
+gsd_pnp_ids_lookup (GsdPnpIds *pnp_ids, const gchar *pnp_id)
 {
         GsdPnpIdsPrivate *priv = pnp_ids->priv;
-        const char *found;
+        const char *found = NULL;
         GError *error = NULL;
-        guint size;
 
         g_return_val_if_fail (GSD_IS_PNP_IDS (pnp_ids), NULL);
         g_return_val_if_fail (pnp_id != NULL, NULL);
 
         /* if table is empty, try to load it */
-        size = g_hash_table_size (priv->pnp_table);
-        if (size == 0) {
+        if (!priv->loaded) {
                 if (gsd_pnp_ids_load (pnp_ids, &error) == FALSE) {
                         g_warning ("Failed to load PNP ids: %s", error->message);
                         g_error_free (error);
                         return NULL;
                 }
+                priv->loaded = TRUE;
         }
 
         /* look this up in the table */
-        found = g_hash_table_lookup (priv->pnp_table, pnp_id);
-        if (found == NULL) {
-                found = find_vendor (pnp_id);
-                if (found == NULL)
-                        return NULL;
+        if (priv->index != NULL) {
+                const GsdPnpIdsIndexEntry *entry;
+
+                entry = bsearch (pnp_id, priv->entries, priv->n_entries,
+                                 sizeof (GsdPnpIdsIndexEntry), compare_id);
+                if (entry != NULL &&
+                    entry->name_offset < g_mapped_file_get_length (priv->index))
+                        found = g_mapped_file_get_contents (priv->index) + entry->name_offset;
+        } else {
+                found = g_hash_table_lookup (priv->pnp_table, pnp_id);
         }
 
-        return g_strdup (found);
+        if (found == NULL)
+                found = find_vendor (pnp_id);
+
+        return found;
+}
+
+/**
+ * gsd_pnp_ids_get_pnp_id:
+ * @pnp_ids: a #GsdPnpIds object
+ * @pnp_id: the PNP ID to look for
+ *
+ * Find the full manufacturer name for the given PNP ID.
+ *
+ * Returns: (transfer full): a new string representing the manufacturer name,
+ * or %NULL when not found.
+ */
+gchar *
+gsd_pnp_ids_get_pnp_id (GsdPnpIds *pnp_ids, const gchar *pnp_id)
+{
+        return g_strdup (gsd_pnp_ids_lookup (pnp_ids, pnp_id));
 }
 
 static void
@@ -313,6 +518,8 @@ gsd_pnp_ids_finalize (GObject *object)
         GsdPnpIds *pnp_ids = GSD_PNP_IDS (object);
         GsdPnpIdsPrivate *priv = pnp_ids->priv;
 
+        if (priv->index != NULL)
+                g_mapped_file_unref (priv->index);
         g_free (priv->table_data);
         g_hash_table_unref (priv->pnp_table);
 
@@ -51,6 +51,8 @@ GType         gsd_pnp_ids_get_type                    (void);
 GsdPnpIds     *gsd_pnp_ids_new                         (void);
 gchar        *gsd_pnp_ids_get_pnp_id                  (GsdPnpIds   *pnp_ids,
                                                      const gchar *pnp_id);
+const gchar  *gsd_pnp_ids_lookup                      (GsdPnpIds   *pnp_ids,
+                                                     const gchar *pnp_id);
 
 G_END_DECLS
 
@@ -451,6 +451,451 @@ out:
     return result;
 }
 
+/* Binary cache of the parsed configuration file
+ *
+ * Parsing a file with hundreds of configurations with GMarkup shows up in
+ * hotplug latency, so the parsed result is stored next to the XML file in a
+ * form that can be mapped and searched in place.  The cache records the
+ * size, mtime and inode of the XML file it was built from, and is rebuilt
+ * whenever those don't match.  The layout is:
+ *
+ *   CacheHeader
+ *   CacheConfig  configs[n_configs]       (in file order)
+ *   CacheIndex   index[n_configs]         (sorted by identity, then config)
+ *   CacheOutput  outputs[n_outputs]
+ *   char         strings[strings_size]    (NUL-terminated output names)
+ *
+ * The identity of a configuration is a hash of what output_match() looks
+ * at, so that the configuration for the current set of monitors can be
+ * found without visiting every entry.
+ */
+
+#define CONFIG_CACHE_SUFFIX	".cache"
+#define CONFIG_CACHE_MAGIC	"GSDRRCFG"
+#define CONFIG_CACHE_VERSION	1
+
+#define CACHE_OUTPUT_ON		(1 << 0)
+#define CACHE_OUTPUT_CONNECTED	(1 << 1)
+#define CACHE_OUTPUT_PRIMARY	(1 << 2)
+
+typedef struct {
+    char	magic[8];
+    guint32	version;
+    guint32	n_configs;
+    guint32	n_outputs;
+    guint32	strings_size;
+    guint64	xml_size;
+    gint64	xml_mtime;
+    guint64	xml_inode;
+} CacheHeader;
+
+typedef struct {
+    guint32	first_output;
+    guint32	n_outputs;
+    guint32	clone;
+    guint32	identity;
+} CacheConfig;
+
+typedef struct {
+    guint32	identity;
+    guint32	config;
+} CacheIndex;
+
+typedef struct {
+    guint32	name;
+    gchar	vendor[4];
+    guint32	product;
+    guint32	serial;
+    gint32	width;
+    gint32	height;
+    gint32	rate;
+    gint32	x;
+    gint32	y;
+    guint32	rotation;
+    guint32	flags;
+} CacheOutput;
+
+typedef struct {
+    GMappedFile *	mapped;
+    const CacheHeader *	header;
+    const CacheConfig *	configs;
+    const CacheIndex *	index;
+    const CacheOutput *	outputs;
+    const char *	strings;
+} ConfigCache;
+
+static char *
+config_cache_get_filename (const char *filename)
+{
+    return g_strconcat (filename, CONFIG_CACHE_SUFFIX, NULL);
+}
+
+static guint32
+output_identity (const char *name,
+		 gboolean    connected,
+		 const char *vendor,
+		 guint       product,
+		 guint       serial)
+{
+    guint32 h;
+
+    h = g_str_hash (name);
+    h = h * 31 + (connected ? 1 : 0);
+    h = h * 31 + g_str_hash (vendor);
+    h = h * 31 + product;
+    h = h * 31 + serial;
+
+    /* Mix a little, as the outputs get summed up */
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static guint32
+config_identity (GsdRROutputInfo **outputs)
+{
+    guint32 identity = 0;
+    int i;
+
+    /* Order-independent, as matching goes by output name */
+    for (i = 0; outputs[i] != NULL; i++)
+	identity += output_identity (outputs[i]->priv->name,
+				     outputs[i]->priv->connected,
+				     outputs[i]->priv->vendor,
+				     outputs[i]->priv->product,
+				     outputs[i]->priv->serial);
+
+    return identity;
+}
+
+static int
+compare_cache_index (gconstpointer a,
+		     gconstpointer b)
+{
+    const CacheIndex *ia = a;
+    const CacheIndex *ib = b;
+
+    if (ia->identity != ib->identity)
+	return ia->identity < ib->identity ? -1 : 1;
+    if (ia->config != ib->config)
+	return ia->config < ib->config ? -1 : 1;
+    return 0;
+}
+
+static void
+config_cache_free (ConfigCache *cache)
+{
+    g_mapped_file_unref (cache->mapped);
+    g_free (cache);
+}
+
+static ConfigCache *
+config_cache_open (const char *filename)
+{
+    ConfigCache *cache = NULL;
+    GMappedFile *mapped;
+    const CacheHeader *header;
+    const char *contents;
+    char *cache_filename;
+    GStatBuf buf;
+    guint64 expected;
+    gsize len;
+    guint i;
+
+    if (g_stat (filename, &buf) != 0)
+	return NULL;
+
+    cache_filename = config_cache_get_filename (filename);
+    mapped = g_mapped_file_new (cache_filename, FALSE, NULL);
+    g_free (cache_filename);
+    if (mapped == NULL)
+	return NULL;
+
+    contents = g_mapped_file_get_contents (mapped);
+    len = g_mapped_file_get_length (mapped);
+
+    if (len < sizeof (CacheHeader))
+	goto invalid;
+
+    header = (const CacheHeader *) contents;
+    if (memcmp (header->magic, CONFIG_CACHE_MAGIC, sizeof (header->magic)) != 0 ||
+	header->version != CONFIG_CACHE_VERSION)
+	goto invalid;
+
+    if (header->xml_size != (guint64) buf.st_size ||
+	header->xml_mtime != (gint64) buf.st_mtime ||
+	header->xml_inode != (guint64) buf.st_ino)
+    {
+	g_debug ("Configuration cache for %s is stale", filename);
+	goto invalid;
+    }
+
+    expected = sizeof (CacheHeader) +
+	       (guint64) header->n_configs * (sizeof (CacheConfig) + sizeof (CacheIndex)) +
+	       (guint64) header->n_outputs * sizeof (CacheOutput) +
+	       header->strings_size;
+    if (expected != len)
+	goto invalid;
+
+    cache = g_new0 (ConfigCache, 1);
+    cache->header = header;
+    cache->configs = (const CacheConfig *) (contents + sizeof (CacheHeader));
+    cache->index = (const CacheIndex *) (cache->configs + header->n_configs);
+    cache->outputs = (const CacheOutput *) (cache->index + header->n_configs);
+    cache->strings = (const char *) (cache->outputs + header->n_outputs);
+
+    if (header->strings_size == 0 ||
+	cache->strings[header->strings_size - 1] != '\0')
+	goto invalid;
+
+    for (i = 0; i < header->n_configs; i++)
+    {
+	if ((guint64) cache->configs[i].first_output + cache->configs[i].n_outputs > header->n_outputs ||
+	    cache->index[i].config >= header->n_configs)
+	    goto invalid;
+    }
+
+    for (i = 0; i < header->n_outputs; i++)
+    {
+	if (cache->outputs[i].name >= header->strings_size ||
+	    cache->outputs[i].vendor[3] != '\0')
+	    goto invalid;
+    }
+
+    cache->mapped = mapped;
+
+    return cache;
+
+invalid:
+    g_free (cache);
+    g_mapped_file_unref (mapped);
+    return NULL;
+}
+
+static void
+cache_output_from_info (CacheOutput     *out,
+			GsdRROutputInfo *info,
+			GString         *strings)
+{
+    memset (out, 0, sizeof (CacheOutput));
+
+    out->name = strings->len;
+    g_string_append_len (strings, info->priv->name, strlen (info->priv->name) + 1);
+
+    memcpy (out->vendor, info->priv->vendor, sizeof (out->vendor));
+    out->vendor[3] = '\0';
+    out->product = info->priv->product;
+    out->serial = info->priv->serial;
+    out->rotation = info->priv->rotation;
+
+    if (info->priv->connected)
+	out->flags |= CACHE_OUTPUT_CONNECTED;
+
+    if (info->priv->on)
+    {
+	out->flags |= CACHE_OUTPUT_ON;
+	out->width = info->priv->width;
+	out->height = info->priv->height;
+	out->rate = info->priv->rate;
+	out->x = info->priv->x;
+	out->y = info->priv->y;
+    }
+
+    if (info->priv->primary)
+	out->flags |= CACHE_OUTPUT_PRIMARY;
+}
+
+/* Called with the configurations as parsed from @filename */
+static void
+config_cache_write (const char   *filename,
+		    GsdRRConfig **configs)
+{
+    CacheHeader header;
+    GArray *cache_configs, *index, *outputs;
+    GString *strings, *contents;
+    char *cache_filename;
+    GError *error = NULL;
+    GStatBuf buf;
+    guint i;
+
+    if (g_stat (filename, &buf) != 0)
+	return;
+
+    cache_configs = g_array_new (FALSE, TRUE, sizeof (CacheConfig));
+    index = g_array_new (FALSE, TRUE, sizeof (CacheIndex));
+    outputs = g_array_new (FALSE, TRUE, sizeof (CacheOutput));
+    strings = g_string_new (NULL);
+
+    for (i = 0; configs[i] != NULL; i++)
+    {
+	CacheConfig config;
+	CacheIndex entry;
+	int j;
+
+	config.first_output = outputs->len;
+	config.n_outputs = 0;
+	config.clone = configs[i]->priv->clone;
+	config.identity = config_identity (configs[i]->priv->outputs);
+
+	for (j = 0; configs[i]->priv->outputs[j] != NULL; j++)
+	{
+	    CacheOutput out;
+
+	    cache_output_from_info (&out, configs[i]->priv->outputs[j], strings);
+	    g_array_append_val (outputs, out);
+	    config.n_outputs++;
+	}
+
+	g_array_append_val (cache_configs, config);
+
+	entry.identity = config.identity;
+	entry.config = i;
+	g_array_append_val (index, entry);
+    }
+
+    g_array_sort (index, compare_cache_index);
+
+    /* Keep the string table valid even when empty */
+    if (strings->len == 0)
+	g_string_append_c (strings, '\0');
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, CONFIG_CACHE_MAGIC, sizeof (header.magic));
+    header.version = CONFIG_CACHE_VERSION;
+    header.n_configs = cache_configs->len;
+    header.n_outputs = outputs->len;
+    header.strings_size = strings->len;
+    header.xml_size = buf.st_size;
+    header.xml_mtime = buf.st_mtime;
+    header.xml_inode = buf.st_ino;
+
+    contents = g_string_new_len ((const char *) &header, sizeof (header));
+    g_string_append_len (contents, cache_configs->data, cache_configs->len * sizeof (CacheConfig));
+    g_string_append_len (contents, index->data, index->len * sizeof (CacheIndex));
+    g_string_append_len (contents, outputs->data, outputs->len * sizeof (CacheOutput));
+    g_string_append_len (contents, strings->str, strings->len);
+
+    cache_filename = config_cache_get_filename (filename);
+    if (!g_file_set_contents (cache_filename, contents->str, contents->len, &error))
+    {
+	g_debug ("Could not write configuration cache %s: %s", cache_filename, error->message);
+	g_error_free (error);
+    }
+    g_free (cache_filename);
+
+    g_string_free (contents, TRUE);
+    g_string_free (strings, TRUE);
+    g_array_free (outputs, TRUE);
+    g_array_free (index, TRUE);
+    g_array_free (cache_configs, TRUE);
+}
+
+static GsdRROutputInfo *find_output (GsdRRConfig *config, const char *name);
+
+/* Same as gsd_rr_config_match (stored, current), on the mapped data */
+static gboolean
+config_cache_match (ConfigCache *cache,
+		    guint        n,
+		    GsdRRConfig *current)
+{
+    const CacheConfig *config = &cache->configs[n];
+    guint i;
+
+    for (i = 0; i < config->n_outputs; i++)
+    {
+	const CacheOutput *out = &cache->outputs[config->first_output + i];
+	GsdRROutputInfo *output;
+
+	output = find_output (current, cache->strings + out->name);
+	if (output == NULL ||
+	    strcmp (out->vendor, output->priv->vendor) != 0 ||
+	    out->product != output->priv->product ||
+	    out->serial != output->priv->serial ||
+	    !!(out->flags & CACHE_OUTPUT_CONNECTED) != !!output->priv->connected)
+	    return FALSE;
+    }
+
+    return TRUE;
+}
+
+static GsdRROutputInfo **
+config_cache_get_outputs (ConfigCache *cache,
+			  guint        n)
+{
+    const CacheConfig *config = &cache->configs[n];
+    GsdRROutputInfo **outputs;
+    guint i;
+
+    outputs = g_new0 (GsdRROutputInfo *, config->n_outputs + 1);
+
+    for (i = 0; i < config->n_outputs; i++)
+    {
+	const CacheOutput *out = &cache->outputs[config->first_output + i];
+	GsdRROutputInfo *output;
+
+	output = g_object_new (GSD_TYPE_RR_OUTPUT_INFO, NULL);
+	output->priv->name = g_strdup (cache->strings + out->name);
+	memcpy (output->priv->vendor, out->vendor, sizeof (out->vendor));
+	output->priv->product = out->product;
+	output->priv->serial = out->serial;
+	output->priv->width = out->width;
+	output->priv->height = out->height;
+	output->priv->rate = out->rate;
+	output->priv->x = out->x;
+	output->priv->y = out->y;
+	output->priv->rotation = out->rotation;
+	output->priv->on = (out->flags & CACHE_OUTPUT_ON) != 0;
+	output->priv->connected = (out->flags & CACHE_OUTPUT_CONNECTED) != 0;
+	output->priv->primary = (out->flags & CACHE_OUTPUT_PRIMARY) != 0;
+
+	outputs[i] = output;
+    }
+
+    return outputs;
+}
+
+/* Returns the index of the first stored configuration matching @current,
+ * or -1.  gsd_rr_config_save() drops the entries matching the one it
+ * saves, so an entry with the same identity as @current is the first one
+ * to match, and we only need to scan when there is none. */
+static int
+config_cache_lookup (ConfigCache *cache,
+		     GsdRRConfig *current)
+{
+    guint32 identity;
+    guint lo, hi, i;
+
+    identity = config_identity (current->priv->outputs);
+
+    lo = 0;
+    hi = cache->header->n_configs;
+    while (lo < hi)
+    {
+	guint mid = lo + (hi - lo) / 2;
+
+	if (cache->index[mid].identity < identity)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    for (i = lo; i < cache->header->n_configs && cache->index[i].identity == identity; i++)
+    {
+	if (config_cache_match (cache, cache->index[i].config, current))
+	    return cache->index[i].config;
+    }
+
+    for (i = 0; i < cache->header->n_configs; i++)
+    {
+	if (config_cache_match (cache, i, current))
+	    return i;
+    }
+
+    return -1;
+}
+
 static void
 gsd_rr_config_init (GsdRRConfig *self)
 {
@@ -668,6 +1113,7 @@ gsd_rr_config_load_filename (GsdRRConfig *result, const char *filename, GError *
 {
     GsdRRConfig *current;
     GsdRRConfig **configs;
+    ConfigCache *cache;
     gboolean found = FALSE;
 
     g_return_val_if_fail (GSD_IS_RR_CONFIG (result), FALSE);
@@ -676,12 +1122,37 @@ gsd_rr_config_load_filename (GsdRRConfig *result, const char *filename, GError *
 
     current = gsd_rr_config_new_current (result->priv->screen, error);
 
+    cache = current ? config_cache_open (filename) : NULL;
+    if (cache)
+    {
+	int n;
+
+	n = config_cache_lookup (cache, current);
+	if (n >= 0)
+	{
+	    result->priv->clone = cache->configs[n].clone;
+	    result->priv->outputs = config_cache_get_outputs (cache, n);
+	    found = TRUE;
+	}
+	else
+	{
+	    g_set_error (error, GSD_RR_ERROR, GSD_RR_ERROR_NO_MATCHING_CONFIG,
+			 _("none of the saved display configurations matched the active configuration"));
+	}
+
+	config_cache_free (cache);
+	g_object_unref (current);
+	return found;
+    }
+
     configs = configurations_read_from_file (filename, error);
 
     if (configs)
     {
 	int i;
 
+	config_cache_write (filename, configs);
+
 	for (i = 0; configs[i] != NULL; ++i)
 	{
 	    if (gsd_rr_config_match (configs[i], current))
@@ -1234,6 +1705,7 @@ gsd_rr_config_save (GsdRRConfig *configuration, GError **error)
     int i;
     gchar *intended_filename;
     gchar *backup_filename;
+    gchar *cache_filename;
     gboolean result;
 
     g_return_val_if_fail (GSD_IS_RR_CONFIG (configuration), FALSE);
@@ -1244,6 +1716,11 @@ gsd_rr_config_save (GsdRRConfig *configuration, GError **error)
     backup_filename = gsd_rr_config_get_backup_filename ();
     intended_filename = gsd_rr_config_get_intended_filename ();
 
+    /* Rebuilt from the new file on the next load */
+    cache_filename = config_cache_get_filename (intended_filename);
+    g_unlink (cache_filename);
+    g_free (cache_filename);
+
     configurations = configurations_read_from_file (intended_filename, NULL); /* NULL-GError */
     
     g_string_append_printf (output, "<monitors version=\"1\">\n");
@@ -1292,6 +1769,12 @@ gsd_rr_config_apply_with_time (GsdRRConfig *config,
     g_return_val_if_fail (GSD_IS_RR_CONFIG (config), FALSE);
     g_return_val_if_fail (GSD_IS_RR_SCREEN (screen), FALSE);
 
+    /* Nothing from the previous apply may show through if this one
+     * fails before touching the server, or has nothing to do */
+    screen->priv->last_grab_begin = 0;
+    screen->priv->last_grab_duration = 0;
+    screen->priv->last_apply_rolled_back = FALSE;
+
     outputs = make_outputs (config);
 
     assignment = crtc_assignment_new (screen, outputs, error);
@@ -1576,33 +2059,40 @@ crtc_assignment_free (CrtcAssignment *assign)
     g_free (assign);
 }
 
-typedef struct {
-    guint32 timestamp;
-    gboolean has_error;
-    GError **error;
-} ConfigureCrtcState;
-
-static void
-configure_crtc (gpointer key,
-		gpointer value,
-		gpointer data)
+/* Whether @crtc is already showing what @info asks for, with exactly
+ * the same outputs, so that applying @info would change nothing */
+static gboolean
+crtc_is_unchanged (GsdRRScreen *screen,
+		   GsdRRCrtc   *crtc,
+		   CrtcInfo    *info)
 {
-    GsdRRCrtc *crtc = key;
-    CrtcInfo *info = value;
-    ConfigureCrtcState *state = data;
+    GsdRROutput **outputs;
+    int x, y;
+    int i, n_current;
 
-    if (state->has_error)
-	return;
+    if (gsd_rr_crtc_get_current_mode (crtc) != info->mode ||
+	gsd_rr_crtc_get_current_rotation (crtc) != info->rotation)
+	return FALSE;
+
+    gsd_rr_crtc_get_position (crtc, &x, &y);
+    if (x != info->x || y != info->y)
+	return FALSE;
+
+    for (i = 0; i < info->outputs->len; ++i)
+    {
+	if (gsd_rr_output_get_crtc (info->outputs->pdata[i]) != crtc)
+	    return FALSE;
+    }
+
+    n_current = 0;
+    outputs = gsd_rr_screen_list_outputs (screen);
+    for (i = 0; outputs[i] != NULL; ++i)
+    {
+	if (gsd_rr_output_get_crtc (outputs[i]) == crtc)
+	    n_current++;
+    }
 
-    if (!gsd_rr_crtc_set_config_with_time (crtc,
-					     state->timestamp,
-					     info->x, info->y,
-					     info->mode,
-					     info->rotation,
-					     (GsdRROutput **)info->outputs->pdata,
-					     info->outputs->len,
-					     state->error))
-	state->has_error = TRUE;
+    return n_current == info->outputs->len;
 }
 
 static gboolean
@@ -1990,14 +2480,215 @@ fail:
     return NULL;
 }
 
+static void
+get_current_screen_size (GsdRRScreen *screen, int *width, int *height)
+{
+    Window root;
+    int x, y;
+    unsigned int w, h, border, depth;
+
+    gdk_error_trap_push ();
+    if (!XGetGeometry (screen->priv->xdisplay, screen->priv->xroot,
+		       &root, &x, &y, &w, &h, &border, &depth))
+	w = h = 0;
+    gdk_error_trap_pop_ignored ();
+
+    *width = w;
+    *height = h;
+}
+
+/* What a CRTC was showing before a configuration got applied, so that it
+ * can be put back */
+typedef struct {
+    GsdRRCrtc *crtc;
+    GsdRRMode *mode;
+    int x;
+    int y;
+    GsdRRRotation rotation;
+    GPtrArray *outputs;
+} CrtcSnapshot;
+
+static void
+crtc_snapshot_take (GArray *snapshots, GsdRRScreen *screen, GsdRRCrtc *crtc)
+{
+    GsdRROutput **outputs = gsd_rr_screen_list_outputs (screen);
+    CrtcSnapshot snapshot;
+    int i;
+
+    for (i = 0; i < snapshots->len; ++i)
+    {
+	if (g_array_index (snapshots, CrtcSnapshot, i).crtc == crtc)
+	    return;
+    }
+
+    snapshot.crtc = crtc;
+    snapshot.mode = gsd_rr_crtc_get_current_mode (crtc);
+    gsd_rr_crtc_get_position (crtc, &snapshot.x, &snapshot.y);
+    snapshot.rotation = gsd_rr_crtc_get_current_rotation (crtc);
+    snapshot.outputs = g_ptr_array_new ();
+
+    for (i = 0; outputs[i] != NULL; ++i)
+    {
+	if (gsd_rr_output_get_crtc (outputs[i]) == crtc)
+	    g_ptr_array_add (snapshot.outputs, outputs[i]);
+    }
+
+    g_array_append_val (snapshots, snapshot);
+}
+
+static void
+crtc_snapshots_free (GArray *snapshots)
+{
+    int i;
+
+    for (i = 0; i < snapshots->len; ++i)
+	g_ptr_array_free (g_array_index (snapshots, CrtcSnapshot, i).outputs, TRUE);
+
+    g_array_free (snapshots, TRUE);
+}
+
+/* Reads back what the server ended up with, as requests may fail without
+ * an error reaching us */
+static gboolean
+crtc_assignment_verify (CrtcAssignment *assign,
+			GPtrArray      *to_disable,
+			GPtrArray      *to_configure,
+			int             width,
+			int             height,
+			GError        **error)
+{
+    GsdRRCrtc *crtc;
+    int i;
+
+    for (i = 0; i < to_configure->len; ++i)
+    {
+	CrtcInfo *info;
+
+	crtc = to_configure->pdata[i];
+	info = g_hash_table_lookup (assign->info, crtc);
+
+	if (!_gsd_rr_crtc_check_config (crtc, info->x, info->y, info->mode, info->rotation,
+					(GsdRROutput **)info->outputs->pdata, info->outputs->len))
+	    goto fail;
+    }
+
+    for (i = 0; i < to_disable->len; ++i)
+    {
+	crtc = to_disable->pdata[i];
+
+	if (!g_hash_table_lookup (assign->info, crtc) &&
+	    !_gsd_rr_crtc_check_config (crtc, 0, 0, NULL, GSD_RR_ROTATION_0, NULL, 0))
+	    goto fail;
+    }
+
+    if (width > 0)
+    {
+	int current_width, current_height;
+
+	get_current_screen_size (assign->screen, &current_width, &current_height);
+	if (current_width != width || current_height != height)
+	{
+	    g_set_error (error, GSD_RR_ERROR, GSD_RR_ERROR_VERIFY_FAILED,
+			 _("the screen size is %dx%d instead of %dx%d"),
+			 current_width, current_height, width, height);
+	    return FALSE;
+	}
+    }
+
+    return TRUE;
+
+fail:
+    g_set_error (error, GSD_RR_ERROR, GSD_RR_ERROR_VERIFY_FAILED,
+		 _("CRTC %d did not take the requested configuration"),
+		 gsd_rr_crtc_get_id (crtc));
+    return FALSE;
+}
+
+/* Puts back the CRTCs, screen size and primary output from before a
+ * failed apply; returns whether the server agrees it did */
+static gboolean
+crtc_assignment_roll_back (CrtcAssignment *assign,
+			   GArray         *snapshots,
+			   int             width,
+			   int             height,
+			   GsdRROutput    *primary,
+			   guint32         timestamp)
+{
+    GError *error = NULL;
+    gboolean success = TRUE;
+    int i;
+
+    /* Everything touched goes off first, as the new configuration may
+     * be outside the old screen */
+    for (i = 0; i < snapshots->len; ++i)
+    {
+	CrtcSnapshot *snapshot = &g_array_index (snapshots, CrtcSnapshot, i);
+
+	if (!gsd_rr_crtc_set_config_with_time (snapshot->crtc, timestamp, 0, 0, NULL, GSD_RR_ROTATION_0, NULL, 0, &error))
+	{
+	    g_warning ("Could not turn off CRTC %d while rolling back: %s",
+		       gsd_rr_crtc_get_id (snapshot->crtc), error->message);
+	    g_clear_error (&error);
+	}
+    }
+
+    if (width > 0)
+	gsd_rr_screen_set_size (assign->screen, width, height,
+				(width / DPI_FALLBACK) * 25.4 + 0.5,
+				(height / DPI_FALLBACK) * 25.4 + 0.5);
+
+    for (i = 0; i < snapshots->len; ++i)
+    {
+	CrtcSnapshot *snapshot = &g_array_index (snapshots, CrtcSnapshot, i);
+
+	if (snapshot->mode == NULL)
+	    continue;
+
+	if (!gsd_rr_crtc_set_config_with_time (snapshot->crtc, timestamp,
+					       snapshot->x, snapshot->y,
+					       snapshot->mode,
+					       snapshot->rotation,
+					       (GsdRROutput **)snapshot->outputs->pdata,
+					       snapshot->outputs->len,
+					       &error))
+	{
+	    g_warning ("Could not restore CRTC %d: %s",
+		       gsd_rr_crtc_get_id (snapshot->crtc), error->message);
+	    g_clear_error (&error);
+	    success = FALSE;
+	}
+    }
+
+    gsd_rr_screen_set_primary_output (assign->screen, primary);
+
+    for (i = 0; success && i < snapshots->len; ++i)
+    {
+	CrtcSnapshot *snapshot = &g_array_index (snapshots, CrtcSnapshot, i);
+
+	success = _gsd_rr_crtc_check_config (snapshot->crtc, snapshot->x, snapshot->y,
+					     snapshot->mode, snapshot->rotation,
+					     (GsdRROutput **)snapshot->outputs->pdata,
+					     snapshot->outputs->len);
+    }
+
+    return success;
+}
+
 static gboolean
 crtc_assignment_apply (CrtcAssignment *assign, guint32 timestamp, GError **error)
 {
+    GsdRRScreenPrivate *priv = assign->screen->priv;
     GsdRRCrtc **all_crtcs = gsd_rr_screen_list_crtcs (assign->screen);
+    GsdRROutput **all_outputs = gsd_rr_screen_list_outputs (assign->screen);
+    GPtrArray *to_disable, *to_configure;
+    GArray *snapshots;
+    GsdRROutput *old_primary;
     int width, height;
+    int current_width, current_height;
     int i;
     int min_width, max_width, min_height, max_height;
     int width_mm, height_mm;
+    gboolean resize, primary_changed;
     gboolean success = TRUE;
 
     /* Compute size of the screen */
@@ -2016,25 +2707,36 @@ crtc_assignment_apply (CrtcAssignment *assign, guint32 timestamp, GError **error
 
     /* FMQ: do we need to check the sizes instead of clamping them? */
 
-    /* Grab the server while we fiddle with the CRTCs and the screen, so that
-     * apps that listen for RANDR notifications will only receive the final
-     * status.
+    /* Work out what actually differs from the current state before
+     * grabbing, so that monitors that keep their configuration aren't
+     * blanked and other clients are frozen for as short as possible.
+     *
+     * CRTCs that are not used in the new setup get turned off, as do
+     * changed ones that currently display outside the new screen, since
+     * the screen can't shrink around them. CRTCs that already show the
+     * right thing are left alone.
      */
+    to_disable = g_ptr_array_new ();
+    to_configure = g_ptr_array_new ();
 
-    gdk_x11_display_grab (gdk_screen_get_display (assign->screen->priv->gdk_screen));
-
-    /* Turn off all crtcs that are currently displaying outside the new screen,
-     * or are not used in the new setup
-     */
     for (i = 0; all_crtcs[i] != NULL; ++i)
     {
 	GsdRRCrtc *crtc = all_crtcs[i];
 	GsdRRMode *mode = gsd_rr_crtc_get_current_mode (crtc);
-	int x, y;
+	CrtcInfo *info = g_hash_table_lookup (assign->info, crtc);
+
+	if (info)
+	{
+	    if (crtc_is_unchanged (assign->screen, crtc, info))
+		continue;
+
+	    g_ptr_array_add (to_configure, crtc);
+	}
 
 	if (mode)
 	{
-	    int w, h;
+	    int x, y, w, h;
+
 	    gsd_rr_crtc_get_position (crtc, &x, &y);
 
 	    w = gsd_rr_mode_get_width (mode);
@@ -2046,46 +2748,116 @@ crtc_assignment_apply (CrtcAssignment *assign, guint32 timestamp, GError **error
 		h = w;
 		w = tmp;
 	    }
-	    
-	    if (x + w > width || y + h > height || !g_hash_table_lookup (assign->info, crtc))
-	    {
-		if (!gsd_rr_crtc_set_config_with_time (crtc, timestamp, 0, 0, NULL, GSD_RR_ROTATION_0, NULL, 0, error))
-		{
-		    success = FALSE;
-		    break;
-		}
-		
-	    }
+
+	    if (x + w > width || y + h > height || !info)
+		g_ptr_array_add (to_disable, crtc);
 	}
     }
 
-    /* The 'physical size' of an X screen is meaningless if that screen
-     * can consist of many monitors. So just pick a size that make the
-     * dpi 96.
-     *
-     * Firefox and Evince apparently believe what X tells them.
-     */
-    width_mm = (width / DPI_FALLBACK) * 25.4 + 0.5;
-    height_mm = (height / DPI_FALLBACK) * 25.4 + 0.5;
+    get_current_screen_size (assign->screen, &current_width, &current_height);
+    resize = (width != current_width || height != current_height);
 
-    if (success)
+    old_primary = NULL;
+    for (i = 0; all_outputs[i] != NULL; ++i)
     {
-	ConfigureCrtcState state;
+	if (gsd_rr_output_get_is_primary (all_outputs[i]))
+	    old_primary = all_outputs[i];
+    }
+    primary_changed = (assign->primary != old_primary);
 
-	gsd_rr_screen_set_size (assign->screen, width, height, width_mm, height_mm);
+    g_debug ("Applying configuration: %u CRTCs to turn off, %u to configure, %s",
+	     to_disable->len, to_configure->len,
+	     resize ? "resizing the screen" : "keeping the screen size");
 
-	state.timestamp = timestamp;
-	state.has_error = FALSE;
-	state.error = error;
-	
-	g_hash_table_foreach (assign->info, configure_crtc, &state);
+    /* Whatever gets touched is recorded first, so that a failure half
+     * way doesn't leave the screen half configured */
+    snapshots = g_array_new (FALSE, FALSE, sizeof (CrtcSnapshot));
+    for (i = 0; i < to_disable->len; ++i)
+	crtc_snapshot_take (snapshots, assign->screen, to_disable->pdata[i]);
+    for (i = 0; i < to_configure->len; ++i)
+	crtc_snapshot_take (snapshots, assign->screen, to_configure->pdata[i]);
 
-	success = !state.has_error;
-    }
+    if (to_disable->len > 0 || to_configure->len > 0 || resize)
+    {
+	/* Grab the server while we fiddle with the CRTCs and the screen, so that
+	 * apps that listen for RANDR notifications will only receive the final
+	 * status.
+	 */
 
-    gsd_rr_screen_set_primary_output (assign->screen, assign->primary);
+	priv->last_grab_begin = g_get_monotonic_time ();
+	gdk_x11_display_grab (gdk_screen_get_display (priv->gdk_screen));
+
+	for (i = 0; i < to_disable->len; ++i)
+	{
+	    if (!gsd_rr_crtc_set_config_with_time (to_disable->pdata[i], timestamp, 0, 0, NULL, GSD_RR_ROTATION_0, NULL, 0, error))
+	    {
+		success = FALSE;
+		break;
+	    }
+	}
+
+	/* The 'physical size' of an X screen is meaningless if that screen
+	 * can consist of many monitors. So just pick a size that make the
+	 * dpi 96.
+	 *
+	 * Firefox and Evince apparently believe what X tells them.
+	 */
+	width_mm = (width / DPI_FALLBACK) * 25.4 + 0.5;
+	height_mm = (height / DPI_FALLBACK) * 25.4 + 0.5;
+
+	if (success && resize)
+	    gsd_rr_screen_set_size (assign->screen, width, height, width_mm, height_mm);
+
+	for (i = 0; success && i < to_configure->len; ++i)
+	{
+	    GsdRRCrtc *crtc = to_configure->pdata[i];
+	    CrtcInfo *info = g_hash_table_lookup (assign->info, crtc);
+
+	    success = gsd_rr_crtc_set_config_with_time (crtc,
+							timestamp,
+							info->x, info->y,
+							info->mode,
+							info->rotation,
+							(GsdRROutput **)info->outputs->pdata,
+							info->outputs->len,
+							error);
+	}
+
+	if (success && primary_changed)
+	    gsd_rr_screen_set_primary_output (assign->screen, assign->primary);
+
+	if (success)
+	    success = crtc_assignment_verify (assign, to_disable, to_configure,
+					      resize ? width : 0, height, error);
+
+	if (!success)
+	{
+	    priv->last_apply_rolled_back =
+		crtc_assignment_roll_back (assign, snapshots,
+					   resize ? current_width : 0, current_height,
+					   old_primary, timestamp);
+
+	    if (priv->last_apply_rolled_back)
+		g_debug ("Applying the configuration failed, rolled back to the previous one");
+	    else
+		g_warning ("Applying the configuration failed, and the previous one could not be fully restored");
+	}
+
+	gdk_x11_display_ungrab (gdk_screen_get_display (priv->gdk_screen));
+	priv->last_grab_duration = g_get_monotonic_time () - priv->last_grab_begin;
+
+	g_debug ("Held the server grab for %" G_GINT64_FORMAT " us",
+		 priv->last_grab_duration);
+    }
+    else if (primary_changed)
+    {
+	/* A single request, nothing to keep atomic */
+	gsd_rr_screen_set_primary_output (assign->screen, assign->primary);
+    }
 
-    gdk_x11_display_ungrab (gdk_screen_get_display (assign->screen->priv->gdk_screen));
+    crtc_snapshots_free (snapshots);
+    g_ptr_array_free (to_disable, TRUE);
+    g_ptr_array_free (to_configure, TRUE);
 
     return success;
 }
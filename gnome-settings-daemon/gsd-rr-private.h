@@ -42,6 +42,15 @@ struct GsdRRScreenPrivate
     
     Atom                        connector_type_atom;
     gboolean                    dpms_capable;
+
+    /* Server grab of the last applied configuration, in monotonic
+     * time; both are 0 if it didn't need one */
+    gint64                      last_grab_begin;
+    gint64                      last_grab_duration;
+
+    /* Whether the last configuration failed and the previous one
+     * was put back */
+    gboolean                    last_apply_rolled_back;
 };
 
 struct _GsdRROutputInfoPrivate
@@ -76,4 +85,12 @@ struct _GsdRRConfigPrivate
 
 gboolean _gsd_rr_output_name_is_laptop (const char *name);
 
+gboolean _gsd_rr_crtc_check_config (GsdRRCrtc      *crtc,
+				    int               x,
+				    int               y,
+				    GsdRRMode      *mode,
+				    GsdRRRotation   rotation,
+				    GsdRROutput   **outputs,
+				    int               n_outputs);
+
 #endif
@@ -1076,6 +1076,45 @@ gsd_rr_screen_get_timestamps (GsdRRScreen *screen,
 	*config_timestamp_ret = priv->info->resources->configTimestamp;
 }
 
+/**
+ * gsd_rr_screen_get_last_grab:
+ * @screen: a #GsdRRScreen
+ * @begin_ret: (out): Location in which to store the monotonic time at which the server was grabbed
+ * @duration_ret: (out): Location in which to store how long the grab was held, in microseconds
+ *
+ * Tells how long the X server was grabbed while the last configuration
+ * was applied to @screen. Both are 0 if that configuration only changed
+ * the primary output, or nothing at all.
+ */
+void
+gsd_rr_screen_get_last_grab (GsdRRScreen *screen,
+			     gint64      *begin_ret,
+			     gint64      *duration_ret)
+{
+    g_return_if_fail (GSD_IS_RR_SCREEN (screen));
+
+    if (begin_ret)
+	*begin_ret = screen->priv->last_grab_begin;
+
+    if (duration_ret)
+	*duration_ret = screen->priv->last_grab_duration;
+}
+
+/**
+ * gsd_rr_screen_get_last_apply_rolled_back:
+ * @screen: a #GsdRRScreen
+ *
+ * Returns: %TRUE if the last configuration applied to @screen failed
+ * part way and the one before it was restored.
+ */
+gboolean
+gsd_rr_screen_get_last_apply_rolled_back (GsdRRScreen *screen)
+{
+    g_return_val_if_fail (GSD_IS_RR_SCREEN (screen), FALSE);
+
+    return screen->priv->last_apply_rolled_back;
+}
+
 static gboolean
 force_timestamp_update (GsdRRScreen *screen)
 {
@@ -2317,6 +2356,61 @@ gsd_rr_crtc_set_config_with_time (GsdRRCrtc      *crtc,
     return result;
 }
 
+/* Reads the configuration of @crtc back from the server and checks
+ * that it is the given one; a %NULL @mode means turned off */
+gboolean
+_gsd_rr_crtc_check_config (GsdRRCrtc      *crtc,
+			   int               x,
+			   int               y,
+			   GsdRRMode      *mode,
+			   GsdRRRotation   rotation,
+			   GsdRROutput   **outputs,
+			   int               n_outputs)
+{
+    XRRCrtcInfo *info;
+    gboolean result;
+    int i, j;
+
+    g_return_val_if_fail (crtc != NULL, FALSE);
+
+    gdk_error_trap_push ();
+    info = XRRGetCrtcInfo (DISPLAY (crtc), crtc->info->resources, crtc->id);
+    gdk_error_trap_pop_ignored ();
+
+    if (!info)
+	return FALSE;
+
+    if (mode == NULL)
+    {
+	result = (info->mode == None);
+	XRRFreeCrtcInfo (info);
+	return result;
+    }
+
+    result = (info->mode == mode->id &&
+	      info->x == x &&
+	      info->y == y &&
+	      info->rotation == xrotation_from_rotation (rotation) &&
+	      info->noutput == n_outputs);
+
+    for (i = 0; result && i < n_outputs; ++i)
+    {
+	result = FALSE;
+	for (j = 0; j < info->noutput; ++j)
+	{
+	    if (info->outputs[j] == outputs[i]->id)
+	    {
+		result = TRUE;
+		break;
+	    }
+	}
+    }
+
+    XRRFreeCrtcInfo (info);
+
+    return result;
+}
+
 GsdRRMode *
 gsd_rr_crtc_get_current_mode (GsdRRCrtc *crtc)
 {
@@ -2618,6 +2712,22 @@ gsd_rr_crtc_set_gamma (GsdRRCrtc *crtc, int size,
     XRRFreeGamma (gamma);
 }
 
+/**
+ * gsd_rr_crtc_get_gamma_size:
+ * @crtc: a #GsdRRCrtc
+ *
+ * Returns: the size of the gamma ramps of the CRTC, as read on the
+ * last screen refresh. Unlike gsd_rr_crtc_get_gamma(), this does not
+ * need a round-trip to the X server.
+ */
+int
+gsd_rr_crtc_get_gamma_size (GsdRRCrtc *crtc)
+{
+    g_return_val_if_fail (crtc != NULL, 0);
+
+    return crtc->gamma_size;
+}
+
 gboolean
 gsd_rr_crtc_get_gamma (GsdRRCrtc *crtc, int *size,
 			 unsigned short **red, unsigned short **green,
@@ -80,6 +80,7 @@ typedef enum {
     GSD_RR_ERROR_CRTC_ASSIGNMENT,	/* could not assign CRTCs to outputs */
     GSD_RR_ERROR_NO_MATCHING_CONFIG,	/* none of the saved configurations matched the current configuration */
     GSD_RR_ERROR_NO_DPMS_EXTENSION,	/* DPMS extension is not present */
+    GSD_RR_ERROR_VERIFY_FAILED,		/* the server did not end up in the requested configuration */
 } GsdRRError;
 
 #define GSD_RR_CONNECTOR_TYPE_PANEL "Panel"  /* This is a laptop's built-in LCD */
@@ -128,6 +129,10 @@ void            gsd_rr_screen_get_ranges         (GsdRRScreen         *screen,
 void            gsd_rr_screen_get_timestamps     (GsdRRScreen         *screen,
 						    guint32               *change_timestamp_ret,
 						    guint32               *config_timestamp_ret);
+void            gsd_rr_screen_get_last_grab      (GsdRRScreen         *screen,
+						    gint64                *begin_ret,
+						    gint64                *duration_ret);
+gboolean        gsd_rr_screen_get_last_apply_rolled_back (GsdRRScreen *screen);
 
 void            gsd_rr_screen_set_primary_output (GsdRRScreen         *screen,
                                                     GsdRROutput         *output);
@@ -209,6 +214,7 @@ GsdRRRotation gsd_rr_crtc_get_rotations        (GsdRRCrtc           *crtc);
 gboolean        gsd_rr_crtc_supports_rotation    (GsdRRCrtc           *crtc,
 						    GsdRRRotation        rotation);
 
+int             gsd_rr_crtc_get_gamma_size       (GsdRRCrtc           *crtc);
 gboolean        gsd_rr_crtc_get_gamma            (GsdRRCrtc           *crtc,
 						    int                   *size,
 						    unsigned short       **red,
@@ -0,0 +1,221 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Checks that the settings manager activates a plugin after the ones it
+ * Depends on, even when its priority would have it start first, and
+ * that GetPluginTimings() returns the activation time of each active
+ * plugin. The plugins are never loaded, the test records the order the
+ * manager asks for them instead. Needs dbus-daemon for a private bus.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "gnome-settings-plugin-info.h"
+
+/* Locations of the plugins, in the order the manager activated them */
+static GPtrArray *activated;
+
+static gboolean
+recording_get_enabled (GnomeSettingsPluginInfo *info)
+{
+        return g_object_get_data (G_OBJECT (info), "test-enabled") != NULL;
+}
+
+static gboolean
+recording_activate (GnomeSettingsPluginInfo *info)
+{
+        g_ptr_array_add (activated, (gpointer) gnome_settings_plugin_info_get_location (info));
+        g_object_set_data (G_OBJECT (info), "test-active", GUINT_TO_POINTER (activated->len));
+        return TRUE;
+}
+
+static gboolean
+recording_deactivate (GnomeSettingsPluginInfo *info)
+{
+        g_object_set_data (G_OBJECT (info), "test-active", NULL);
+        return TRUE;
+}
+
+static gboolean
+recording_is_active (GnomeSettingsPluginInfo *info)
+{
+        return g_object_get_data (G_OBJECT (info), "test-active") != NULL;
+}
+
+/* The n-th plugin to be activated took n milliseconds */
+static gint64
+recording_get_activation_time (GnomeSettingsPluginInfo *info)
+{
+        return GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (info), "test-active")) * 1000;
+}
+
+#define gnome_settings_plugin_info_get_enabled recording_get_enabled
+#define gnome_settings_plugin_info_activate recording_activate
+#define gnome_settings_plugin_info_deactivate recording_deactivate
+#define gnome_settings_plugin_info_is_active recording_is_active
+#define gnome_settings_plugin_info_get_activation_time recording_get_activation_time
+
+#include "gnome-settings-manager.c"
+
+static char *plugin_dir;
+
+static void
+add_plugin (GnomeSettingsManager *manager,
+            const char           *module,
+            int                   priority,
+            const char           *depends,
+            gboolean              enabled)
+{
+        GnomeSettingsPluginInfo *info;
+        GError *error = NULL;
+        char *filename;
+        char *contents;
+
+        contents = g_strdup_printf ("[GNOME Settings Plugin]\n"
+                                    "Module=%s\n"
+                                    "IAge=0\n"
+                                    "Priority=%d\n"
+                                    "%s%s%s"
+                                    "Name=%s\n",
+                                    module,
+                                    priority,
+                                    depends ? "Depends=" : "",
+                                    depends ? depends : "",
+                                    depends ? "\n" : "",
+                                    module);
+        filename = g_strdup_printf ("%s/%s" PLUGIN_EXT, plugin_dir, module);
+        g_file_set_contents (filename, contents, -1, &error);
+        g_assert_no_error (error);
+
+        info = gnome_settings_plugin_info_new_from_file (filename);
+        g_assert (info != NULL);
+        if (enabled)
+                g_object_set_data (G_OBJECT (info), "test-enabled", GINT_TO_POINTER (TRUE));
+
+        /* as _load_file () does */
+        manager->priv->plugins = g_slist_prepend (manager->priv->plugins, info);
+
+        g_unlink (filename);
+        g_free (filename);
+        g_free (contents);
+}
+
+static void
+timings_cb (GDBusConnection *connection,
+            GAsyncResult    *res,
+            GVariant       **reply)
+{
+        GError *error = NULL;
+
+        *reply = g_dbus_connection_call_finish (connection, res, &error);
+        g_assert_no_error (error);
+}
+
+static void
+test_depends (void)
+{
+        GnomeSettingsManager *manager;
+        GVariant *reply = NULL;
+        GVariant *timings;
+        guint64 usec;
+
+        activated = g_ptr_array_new ();
+        manager = gnome_settings_manager_new ();
+
+        /* "early" would start first by priority, but it needs "late",
+         * and "disabled" comes before both but is never activated */
+        add_plugin (manager, "early", 10, "late;", TRUE);
+        add_plugin (manager, "late", 20, NULL, TRUE);
+        add_plugin (manager, "disabled", 5, NULL, FALSE);
+
+        _queue_all (manager);
+        g_assert_cmpuint (activated->len, ==, 0);
+        while (manager->priv->activate_id != 0 || manager->priv->connection == NULL)
+                g_main_context_iteration (NULL, TRUE);
+
+        g_assert_cmpuint (activated->len, ==, 2);
+        g_assert_cmpstr (g_ptr_array_index (activated, 0), ==, "late");
+        g_assert_cmpstr (g_ptr_array_index (activated, 1), ==, "early");
+
+        /* the reply is serviced by this same main loop */
+        g_dbus_connection_call (manager->priv->connection,
+                                g_dbus_connection_get_unique_name (manager->priv->connection),
+                                GSD_DBUS_PATH,
+                                GSD_DBUS_NAME,
+                                "GetPluginTimings",
+                                NULL,
+                                G_VARIANT_TYPE ("(a{st})"),
+                                G_DBUS_CALL_FLAGS_NONE,
+                                -1,
+                                NULL,
+                                (GAsyncReadyCallback) timings_cb,
+                                &reply);
+        while (reply == NULL)
+                g_main_context_iteration (NULL, TRUE);
+
+        timings = g_variant_get_child_value (reply, 0);
+        g_assert_cmpuint (g_variant_n_children (timings), ==, 2);
+        g_assert (g_variant_lookup (timings, "late", "t", &usec));
+        g_assert_cmpuint (usec, ==, 1000);
+        g_assert (g_variant_lookup (timings, "early", "t", &usec));
+        g_assert_cmpuint (usec, ==, 2000);
+        g_assert (!g_variant_lookup (timings, "disabled", "t", &usec));
+        g_variant_unref (timings);
+        g_variant_unref (reply);
+
+        gnome_settings_manager_stop (manager);
+        g_object_unref (manager);
+        g_ptr_array_free (activated, TRUE);
+}
+
+int
+main (int argc, char **argv)
+{
+        GTestDBus *bus;
+        char *dbus_daemon;
+        int ret;
+
+        g_test_init (&argc, &argv, NULL);
+
+        dbus_daemon = g_find_program_in_path ("dbus-daemon");
+        if (dbus_daemon == NULL) {
+                g_print ("dbus-daemon not installed, skipping\n");
+                return 77;
+        }
+        g_free (dbus_daemon);
+
+        plugin_dir = g_dir_make_tmp ("test-plugin-depends-XXXXXX", NULL);
+        g_assert (plugin_dir != NULL);
+
+        bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+        g_test_dbus_up (bus);
+
+        g_test_add_func ("/manager/depends", test_depends);
+        ret = g_test_run ();
+
+        g_test_dbus_down (bus);
+        g_object_unref (bus);
+        g_rmdir (plugin_dir);
+        g_free (plugin_dir);
+
+        return ret;
+}
@@ -0,0 +1,187 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Compares startup memory and lookup latency of the PNP vendor index
+ * against parsing pnp.ids into a hash table, like GsdPnpIds used to.
+ * Each loader runs in a process of its own so that the memory numbers
+ * aren't mixed up; set GSD_PNP_IDS_INDEX to use an index somewhere
+ * else than in the user's cache.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib-object.h>
+
+#include "gsd-pnp-ids.h"
+
+#define N_ITERATIONS 20
+
+/* Resident memory that isn't shared with other processes, in kB */
+static long
+get_private_kb (void)
+{
+        long size, resident, shared;
+        FILE *f;
+
+        f = fopen ("/proc/self/statm", "r");
+        if (f == NULL)
+                return 0;
+        if (fscanf (f, "%ld %ld %ld", &size, &resident, &shared) != 3)
+                resident = shared = 0;
+        fclose (f);
+
+        return (resident - shared) * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+/* Every three letter ID, most of which aren't vendors */
+static void
+next_id (char *id)
+{
+        int i;
+
+        for (i = 2; i >= 0; i--) {
+                if (id[i] < 'Z') {
+                        id[i]++;
+                        return;
+                }
+                id[i] = 'A';
+        }
+}
+
+static void
+run_text (void)
+{
+        GHashTable *table;
+        GTimer *timer;
+        gchar *data;
+        gchar *line;
+        long before;
+        double load_ms;
+        char id[4];
+        guint i, found = 0;
+
+        before = get_private_kb ();
+        timer = g_timer_new ();
+
+        table = g_hash_table_new (g_str_hash, g_str_equal);
+        if (!g_file_get_contents (PNP_IDS, &data, NULL, NULL)) {
+                g_printerr ("Could not read %s\n", PNP_IDS);
+                return;
+        }
+        for (line = strtok (data, "\n"); line != NULL; line = strtok (NULL, "\n")) {
+                if (line[0] && line[1] && line[2] && line[3] == '\t' && line[4]) {
+                        line[3] = '\0';
+                        g_hash_table_insert (table, line, line + 4);
+                }
+        }
+
+        load_ms = g_timer_elapsed (timer, NULL) * 1000.0;
+
+        g_timer_start (timer);
+        for (i = 0; i < N_ITERATIONS; i++) {
+                strcpy (id, "AAA");
+                do {
+                        gchar *name = g_strdup (g_hash_table_lookup (table, id));
+                        found += (name != NULL);
+                        g_free (name);
+                        next_id (id);
+                } while (strcmp (id, "AAA") != 0);
+        }
+
+        g_print ("text:\t%.3f ms to load, %ld kB private, %.1f ns per lookup (%u found)\n",
+                 load_ms, get_private_kb () - before,
+                 g_timer_elapsed (timer, NULL) * 1e9 / (N_ITERATIONS * 26 * 26 * 26),
+                 found / N_ITERATIONS);
+
+        g_timer_destroy (timer);
+}
+
+static void
+run_index (void)
+{
+        GsdPnpIds *pnp_ids;
+        GTimer *timer;
+        long before;
+        double load_ms;
+        char id[4];
+        guint i, found = 0;
+
+        pnp_ids = gsd_pnp_ids_new ();
+
+        before = get_private_kb ();
+        timer = g_timer_new ();
+
+        /* the first lookup loads */
+        gsd_pnp_ids_lookup (pnp_ids, "AAA");
+        load_ms = g_timer_elapsed (timer, NULL) * 1000.0;
+
+        g_timer_start (timer);
+        for (i = 0; i < N_ITERATIONS; i++) {
+                strcpy (id, "AAA");
+                do {
+                        found += (gsd_pnp_ids_lookup (pnp_ids, id) != NULL);
+                        next_id (id);
+                } while (strcmp (id, "AAA") != 0);
+        }
+
+        g_print ("index:\t%.3f ms to load, %ld kB private, %.1f ns per lookup (%u found)\n",
+                 load_ms, get_private_kb () - before,
+                 g_timer_elapsed (timer, NULL) * 1e9 / (N_ITERATIONS * 26 * 26 * 26),
+                 found / N_ITERATIONS);
+
+        g_timer_destroy (timer);
+        g_object_unref (pnp_ids);
+}
+
+int
+main (int argc, char **argv)
+{
+        gchar *args[3] = { argv[0], NULL, NULL };
+        GError *error = NULL;
+
+#if !GLIB_CHECK_VERSION (2, 35, 0)
+        g_type_init ();
+#endif
+
+        if (argc > 1 && g_strcmp0 (argv[1], "text") == 0) {
+                run_text ();
+        } else if (argc > 1 && g_strcmp0 (argv[1], "index") == 0) {
+                run_index ();
+        } else {
+                GsdPnpIds *pnp_ids;
+
+                /* have the index built, so that it only gets mapped
+                 * while measuring */
+                pnp_ids = gsd_pnp_ids_new ();
+                gsd_pnp_ids_lookup (pnp_ids, "AAA");
+                g_object_unref (pnp_ids);
+
+                args[1] = "text";
+                if (!g_spawn_sync (NULL, args, NULL, 0, NULL, NULL, NULL, NULL, NULL, &error) ||
+                    (args[1] = "index",
+                     !g_spawn_sync (NULL, args, NULL, 0, NULL, NULL, NULL, NULL, NULL, &error))) {
+                        g_printerr ("Could not run %s: %s\n", argv[0], error->message);
+                        g_error_free (error);
+                        return 1;
+                }
+        }
+
+        return 0;
+}
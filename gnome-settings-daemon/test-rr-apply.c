@@ -0,0 +1,368 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Checks that applying a display configuration only sends RandR requests
+ * for the CRTCs and screen size that actually change, and that a failed
+ * apply puts the previous configuration back. Needs an X server with
+ * RandR 1.2 and an active output, such as Xvfb; the cases that change
+ * modes only run where an output has more than one, as with the dummy
+ * X.org driver.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+
+#include <glib.h>
+
+/* Every CRTC and screen size request goes through here */
+static GArray *set_crtcs;
+static guint n_set_screen_size;
+
+/* The next request for this CRTC fails, be it setting a mode or turning
+ * it off */
+static RRCrtc fail_crtc = None;
+
+static Status
+counting_set_crtc_config (Display            *dpy,
+                          XRRScreenResources *resources,
+                          RRCrtc              crtc,
+                          Time                timestamp,
+                          int                 x,
+                          int                 y,
+                          RRMode              mode,
+                          Rotation            rotation,
+                          RROutput           *outputs,
+                          int                 noutputs)
+{
+        g_array_append_val (set_crtcs, crtc);
+
+        if (crtc == fail_crtc) {
+                fail_crtc = None;
+                return RRSetConfigFailed;
+        }
+
+        return XRRSetCrtcConfig (dpy, resources, crtc, timestamp,
+                                 x, y, mode, rotation, outputs, noutputs);
+}
+
+static void
+counting_set_screen_size (Display *dpy,
+                          Window   window,
+                          int      width,
+                          int      height,
+                          int      mm_width,
+                          int      mm_height)
+{
+        n_set_screen_size++;
+
+        XRRSetScreenSize (dpy, window, width, height, mm_width, mm_height);
+}
+
+#define XRRSetCrtcConfig counting_set_crtc_config
+#define XRRSetScreenSize counting_set_screen_size
+
+#include "gsd-rr.c"
+#include "gsd-rr-config.c"
+#include "gsd-rr-output-info.c"
+
+#undef XRRSetCrtcConfig
+#undef XRRSetScreenSize
+
+static GsdRRScreen *screen;
+
+static void
+reset_counters (void)
+{
+        g_array_set_size (set_crtcs, 0);
+        n_set_screen_size = 0;
+}
+
+static GsdRRConfig *
+get_current (void)
+{
+        GError *error = NULL;
+        GsdRRConfig *config;
+
+        gsd_rr_screen_refresh (screen, &error);
+        g_assert_no_error (error);
+
+        config = gsd_rr_config_new_current (screen, &error);
+        g_assert_no_error (error);
+
+        return config;
+}
+
+static void
+apply (GsdRRConfig *config)
+{
+        GError *error = NULL;
+
+        reset_counters ();
+        g_assert (gsd_rr_config_apply_with_time (config, screen, GDK_CURRENT_TIME, &error));
+        g_assert_no_error (error);
+}
+
+static void
+test_unchanged (void)
+{
+        GsdRRConfig *config;
+        gint64 duration;
+
+        config = get_current ();
+        gsd_rr_config_ensure_primary (config);
+
+        /* the first time round, the primary output may get set */
+        apply (config);
+        g_assert_cmpuint (set_crtcs->len, ==, 0);
+        g_assert_cmpuint (n_set_screen_size, ==, 0);
+        g_object_unref (config);
+
+        config = get_current ();
+        apply (config);
+        g_assert_cmpuint (set_crtcs->len, ==, 0);
+        g_assert_cmpuint (n_set_screen_size, ==, 0);
+
+        gsd_rr_screen_get_last_grab (screen, NULL, &duration);
+        g_assert_cmpint (duration, ==, 0);
+
+        g_object_unref (config);
+}
+
+/* Turns off the last active output in @config, and returns the CRTC it
+ * was using, or None if there is no active output */
+static RRCrtc
+turn_off_last_output (GsdRRConfig *config)
+{
+        GsdRROutputInfo **outputs;
+        GsdRROutput *output;
+        char *name;
+        int i, last;
+
+        outputs = gsd_rr_config_get_outputs (config);
+
+        last = -1;
+        for (i = 0; outputs[i] != NULL; i++) {
+                if (gsd_rr_output_info_is_active (outputs[i]))
+                        last = i;
+        }
+
+        if (last < 0)
+                return None;
+
+        name = gsd_rr_output_info_get_name (outputs[last]);
+        output = gsd_rr_screen_get_output_by_name (screen, name);
+        g_free (name);
+
+        /* with a single output, as under Xvfb, that one goes off and
+         * the screen shrinks to its minimum */
+        gsd_rr_output_info_set_active (outputs[last], FALSE);
+        gsd_rr_config_ensure_primary (config);
+
+        return gsd_rr_crtc_get_id (gsd_rr_output_get_crtc (output));
+}
+
+static void
+test_one_output_off (void)
+{
+        GsdRRConfig *before, *config;
+        RRCrtc crtc_id;
+        int i;
+        gint64 duration;
+
+        before = get_current ();
+        config = get_current ();
+
+        crtc_id = turn_off_last_output (config);
+        if (crtc_id == None) {
+                g_test_message ("Needs an active output, skipping");
+                g_object_unref (config);
+                g_object_unref (before);
+                return;
+        }
+
+        /* turning off one output touches its CRTC and at most the screen
+         * size, nothing else */
+        apply (config);
+
+        for (i = 0; i < set_crtcs->len; i++)
+                g_assert_cmpuint (g_array_index (set_crtcs, RRCrtc, i), ==, crtc_id);
+        g_assert_cmpuint (set_crtcs->len, ==, 1);
+        g_assert_cmpuint (n_set_screen_size, <=, 1);
+
+        gsd_rr_screen_get_last_grab (screen, NULL, &duration);
+        g_assert_cmpint (duration, >, 0);
+
+        /* and back on, for the tests that follow */
+        apply (before);
+        g_assert_cmpuint (set_crtcs->len, ==, 1);
+
+        g_object_unref (config);
+        g_object_unref (before);
+}
+
+static void
+test_rollback_output_off (void)
+{
+        GsdRRConfig *before, *config, *after;
+        GError *error = NULL;
+        gint64 duration;
+
+        before = get_current ();
+        gsd_rr_config_ensure_primary (before);
+        apply (before);
+
+        config = get_current ();
+        fail_crtc = turn_off_last_output (config);
+        if (fail_crtc == None) {
+                g_test_message ("Needs an active output, skipping");
+                g_object_unref (config);
+                g_object_unref (before);
+                return;
+        }
+
+        reset_counters ();
+        g_assert (!gsd_rr_config_apply_with_time (config, screen, GDK_CURRENT_TIME, &error));
+        g_assert_error (error, GSD_RR_ERROR, GSD_RR_ERROR_RANDR_ERROR);
+        g_clear_error (&error);
+        g_assert (fail_crtc == None);
+
+        g_assert (gsd_rr_screen_get_last_apply_rolled_back (screen));
+
+        after = get_current ();
+        g_assert (gsd_rr_config_equal (before, after));
+
+        /* nothing of the failed apply shows through the next one */
+        apply (after);
+        g_assert_cmpuint (set_crtcs->len, ==, 0);
+        g_assert (!gsd_rr_screen_get_last_apply_rolled_back (screen));
+        gsd_rr_screen_get_last_grab (screen, NULL, &duration);
+        g_assert_cmpint (duration, ==, 0);
+
+        g_object_unref (after);
+        g_object_unref (config);
+        g_object_unref (before);
+}
+
+static void
+test_rollback (void)
+{
+        GsdRROutputInfo **outputs;
+        GsdRRConfig *before, *config, *after;
+        GsdRROutput *output;
+        GsdRRMode *current, **modes;
+        GError *error = NULL;
+        char *name;
+        int i, j, x, y, width, height;
+
+        before = get_current ();
+        gsd_rr_config_ensure_primary (before);
+        apply (before);
+
+        config = get_current ();
+        outputs = gsd_rr_config_get_outputs (config);
+
+        /* switch the first output that has another mode to it */
+        output = NULL;
+        for (i = 0; outputs[i] != NULL && output == NULL; i++) {
+                if (!gsd_rr_output_info_is_active (outputs[i]))
+                        continue;
+
+                name = gsd_rr_output_info_get_name (outputs[i]);
+                output = gsd_rr_screen_get_output_by_name (screen, name);
+                g_free (name);
+
+                current = gsd_rr_output_get_current_mode (output);
+                modes = gsd_rr_output_list_modes (output);
+                for (j = 0; modes[j] != NULL; j++) {
+                        if (gsd_rr_mode_get_width (modes[j]) != gsd_rr_mode_get_width (current) ||
+                            gsd_rr_mode_get_height (modes[j]) != gsd_rr_mode_get_height (current))
+                                break;
+                }
+
+                if (modes[j] == NULL) {
+                        output = NULL;
+                        continue;
+                }
+
+                gsd_rr_output_info_get_geometry (outputs[i], &x, &y, &width, &height);
+                gsd_rr_output_info_set_geometry (outputs[i], x, y,
+                                                 gsd_rr_mode_get_width (modes[j]),
+                                                 gsd_rr_mode_get_height (modes[j]));
+                gsd_rr_output_info_set_refresh_rate (outputs[i], gsd_rr_mode_get_freq (modes[j]));
+        }
+
+        if (output == NULL) {
+                g_test_message ("Needs an output with two modes, skipping");
+                g_object_unref (config);
+                g_object_unref (before);
+                return;
+        }
+
+        fail_crtc = gsd_rr_crtc_get_id (gsd_rr_output_get_crtc (output));
+
+        reset_counters ();
+        g_assert (!gsd_rr_config_apply_with_time (config, screen, GDK_CURRENT_TIME, &error));
+        g_assert_error (error, GSD_RR_ERROR, GSD_RR_ERROR_RANDR_ERROR);
+        g_clear_error (&error);
+
+        g_assert (gsd_rr_screen_get_last_apply_rolled_back (screen));
+
+        after = get_current ();
+        g_assert (gsd_rr_config_equal (before, after));
+
+        g_object_unref (after);
+        g_object_unref (config);
+        g_object_unref (before);
+}
+
+int
+main (int argc, char **argv)
+{
+        GError *error = NULL;
+        GsdRRConfig *config;
+        int ret;
+
+        gtk_init (&argc, &argv);
+        g_test_init (&argc, &argv, NULL);
+
+        set_crtcs = g_array_new (FALSE, FALSE, sizeof (RRCrtc));
+
+        screen = gsd_rr_screen_new (gdk_screen_get_default (), &error);
+        if (screen == NULL) {
+                g_printerr ("Could not get the RandR screen: %s\n", error->message);
+                g_error_free (error);
+                return 1;
+        }
+
+        /* put things back the way they were at the end */
+        config = get_current ();
+
+        g_test_add_func ("/rr-apply/unchanged", test_unchanged);
+        g_test_add_func ("/rr-apply/one-output-off", test_one_output_off);
+        g_test_add_func ("/rr-apply/rollback-output-off", test_rollback_output_off);
+        g_test_add_func ("/rr-apply/rollback", test_rollback);
+
+        ret = g_test_run ();
+
+        gsd_rr_config_apply_with_time (config, screen, GDK_CURRENT_TIME, NULL);
+        g_object_unref (config);
+        g_object_unref (screen);
+        g_array_unref (set_crtcs);
+
+        return ret;
+}
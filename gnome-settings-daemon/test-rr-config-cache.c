@@ -0,0 +1,208 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Times loading the stored display configuration from a synthetic
+ * monitors file, with and without the binary cache.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib/gstdio.h>
+#include <gtk/gtk.h>
+
+#include "gsd-rr-config.h"
+
+#define N_CONFIGS    1000
+#define N_ITERATIONS 50
+
+static void
+emit_output (GString         *str,
+             GsdRROutputInfo *output)
+{
+        char *name;
+        char vendor[4];
+        int x, y, width, height;
+
+        name = gsd_rr_output_info_get_name (output);
+        g_string_append_printf (str, "      <output name=\"%s\">\n", name);
+
+        gsd_rr_output_info_get_vendor (output, vendor);
+        if (gsd_rr_output_info_is_connected (output) && vendor[0] != '\0') {
+                g_string_append_printf (str, "          <vendor>%s</vendor>\n", vendor);
+                g_string_append_printf (str, "          <product>0x%04x</product>\n",
+                                        gsd_rr_output_info_get_product (output));
+                g_string_append_printf (str, "          <serial>0x%08x</serial>\n",
+                                        gsd_rr_output_info_get_serial (output));
+        }
+
+        if (gsd_rr_output_info_is_connected (output) && gsd_rr_output_info_is_active (output)) {
+                gsd_rr_output_info_get_geometry (output, &x, &y, &width, &height);
+                g_string_append_printf (str,
+                                        "          <width>%d</width>\n"
+                                        "          <height>%d</height>\n"
+                                        "          <rate>%d</rate>\n"
+                                        "          <x>%d</x>\n"
+                                        "          <y>%d</y>\n"
+                                        "          <rotation>normal</rotation>\n",
+                                        width, height,
+                                        gsd_rr_output_info_get_refresh_rate (output),
+                                        x, y);
+        }
+
+        g_string_append (str, "      </output>\n");
+        g_free (name);
+}
+
+/* N_CONFIGS configurations for docks we've never seen, followed by
+ * the one for the current outputs, which is the worst case for a
+ * linear scan */
+static char *
+generate_file (GsdRRConfig *current)
+{
+        GsdRROutputInfo **outputs;
+        GString *str;
+        int i, j;
+
+        str = g_string_new ("<monitors version=\"1\">\n");
+
+        for (i = 0; i < N_CONFIGS; i++) {
+                g_string_append (str, "  <configuration>\n      <clone>no</clone>\n");
+                for (j = 0; j < 3; j++) {
+                        g_string_append_printf (str,
+                                                "      <output name=\"DP-%d\">\n"
+                                                "          <vendor>BNC</vendor>\n"
+                                                "          <product>0x%04x</product>\n"
+                                                "          <serial>0x%08x</serial>\n"
+                                                "          <width>1920</width>\n"
+                                                "          <height>1080</height>\n"
+                                                "          <rate>60</rate>\n"
+                                                "          <x>%d</x>\n"
+                                                "          <y>0</y>\n"
+                                                "          <rotation>normal</rotation>\n"
+                                                "          <primary>%s</primary>\n"
+                                                "      </output>\n",
+                                                j, i & 0xffff, g_random_int (),
+                                                j * 1920, j == 0 ? "yes" : "no");
+                }
+                g_string_append (str, "  </configuration>\n");
+        }
+
+        g_string_append (str, "  <configuration>\n      <clone>no</clone>\n");
+        outputs = gsd_rr_config_get_outputs (current);
+        for (i = 0; outputs[i] != NULL; i++)
+                emit_output (str, outputs[i]);
+        g_string_append (str, "  </configuration>\n</monitors>\n");
+
+        return g_string_free (str, FALSE);
+}
+
+static double
+time_load (GsdRRScreen *screen,
+           const char  *filename,
+           const char  *cache_filename,
+           gboolean     use_cache)
+{
+        GTimer *timer;
+        double elapsed;
+        int i;
+
+        timer = g_timer_new ();
+        g_timer_stop (timer);
+
+        for (i = 0; i < N_ITERATIONS; i++) {
+                GsdRRConfig *config;
+                GError *error = NULL;
+
+                if (!use_cache)
+                        g_unlink (cache_filename);
+
+                config = g_object_new (GSD_TYPE_RR_CONFIG, "screen", screen, NULL);
+
+                g_timer_continue (timer);
+                if (!gsd_rr_config_load_filename (config, filename, &error)) {
+                        g_warning ("Failed to load %s: %s", filename, error->message);
+                        g_error_free (error);
+                }
+                g_timer_stop (timer);
+
+                g_object_unref (config);
+        }
+
+        elapsed = g_timer_elapsed (timer, NULL);
+        g_timer_destroy (timer);
+
+        return elapsed * 1000.0 / N_ITERATIONS;
+}
+
+int
+main (int argc, char **argv)
+{
+        GsdRRScreen *screen;
+        GsdRRConfig *current;
+        GError *error = NULL;
+        char *dir, *filename, *cache_filename, *contents;
+
+        gtk_init (&argc, &argv);
+
+        screen = gsd_rr_screen_new (gdk_screen_get_default (), &error);
+        if (screen == NULL) {
+                g_printerr ("Could not get the RandR screen: %s\n", error->message);
+                g_error_free (error);
+                return 1;
+        }
+
+        current = gsd_rr_config_new_current (screen, &error);
+        if (current == NULL) {
+                g_printerr ("Could not get the current configuration: %s\n", error->message);
+                g_error_free (error);
+                return 1;
+        }
+
+        dir = g_dir_make_tmp ("gsd-rr-config-XXXXXX", &error);
+        if (dir == NULL) {
+                g_printerr ("Could not create a temporary directory: %s\n", error->message);
+                g_error_free (error);
+                return 1;
+        }
+
+        filename = g_build_filename (dir, "monitors.xml", NULL);
+        cache_filename = g_strconcat (filename, ".cache", NULL);
+
+        contents = generate_file (current);
+        g_file_set_contents (filename, contents, -1, NULL);
+        g_print ("%d configurations, %" G_GSIZE_FORMAT " bytes of XML\n",
+                 N_CONFIGS + 1, strlen (contents));
+        g_free (contents);
+
+        g_print ("XML parse:\t%.3f ms per load\n",
+                 time_load (screen, filename, cache_filename, FALSE));
+        g_print ("Binary cache:\t%.3f ms per load\n",
+                 time_load (screen, filename, cache_filename, TRUE));
+
+        g_unlink (cache_filename);
+        g_unlink (filename);
+        g_rmdir (dir);
+
+        g_free (cache_filename);
+        g_free (filename);
+        g_free (dir);
+        g_object_unref (current);
+        g_object_unref (screen);
+
+        return 0;
+}
@@ -57,7 +57,8 @@ struct GsdA11yKeyboardManagerPrivate
         gboolean          stickykeys_shortcut_val;
         gboolean          slowkeys_shortcut_val;
 
-        XkbDescRec       *desc;
+        XkbDescRec       *desc;   /* controls at startup, restored on stop */
+        XkbDescRec       *shadow; /* what the server has now */
 
         GSettings        *settings;
 
@@ -79,6 +80,7 @@ static void     gsd_a11y_keyboard_manager_class_init  (GsdA11yKeyboardManagerCla
 static void     gsd_a11y_keyboard_manager_init        (GsdA11yKeyboardManager      *a11y_keyboard_manager);
 static void     gsd_a11y_keyboard_manager_finalize    (GObject             *object);
 static void     set_server_from_gsettings (GsdA11yKeyboardManager *manager);
+static void     update_shadow             (GsdA11yKeyboardManager *manager);
 
 G_DEFINE_TYPE (GsdA11yKeyboardManager, gsd_a11y_keyboard_manager, G_TYPE_OBJECT)
 
@@ -89,8 +91,12 @@ device_added_cb (GdkDeviceManager       *device_manager,
                  GdkDevice              *device,
                  GsdA11yKeyboardManager *manager)
 {
-        if (gdk_device_get_source (device) == GDK_SOURCE_KEYBOARD)
+        /* The new keyboard might have come with controls of its own */
+        if (gdk_device_get_source (device) == GDK_SOURCE_KEYBOARD &&
+            manager->priv->shadow != NULL) {
+                update_shadow (manager);
                 set_server_from_gsettings (manager);
+        }
 }
 
 static void
@@ -126,27 +132,75 @@ xkb_enabled (GsdA11yKeyboardManager *manager)
         return TRUE;
 }
 
+/* Only the controls are needed, not the whole keymap */
 static XkbDescRec *
 get_xkb_desc_rec (GsdA11yKeyboardManager *manager)
 {
         XkbDescRec *desc;
-        Status      status = Success;
+        Status      status;
+
+        desc = XkbAllocKeyboard ();
+        g_return_val_if_fail (desc != NULL, NULL);
+        desc->device_spec = XkbUseCoreKbd;
 
         gdk_error_trap_push ();
-        desc = XkbGetMap (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), XkbAllMapComponentsMask, XkbUseCoreKbd);
-        if (desc != NULL) {
-                desc->ctrls = NULL;
-                status = XkbGetControls (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), XkbAllControlsMask, desc);
-        }
+        status = XkbGetControls (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), XkbAllControlsMask, desc);
         gdk_error_trap_pop_ignored ();
 
-        g_return_val_if_fail (desc != NULL, NULL);
-        g_return_val_if_fail (desc->ctrls != NULL, NULL);
-        g_return_val_if_fail (status == Success, NULL);
+        if (status != Success || desc->ctrls == NULL) {
+                g_warning ("Could not get the XKB controls");
+                XkbFreeKeyboard (desc, XkbAllComponentsMask, True);
+                return NULL;
+        }
 
         return desc;
 }
 
+static void
+update_shadow (GsdA11yKeyboardManager *manager)
+{
+        gdk_error_trap_push ();
+        XkbGetControls (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()),
+                        XkbAllControlsMask,
+                        manager->priv->shadow);
+        gdk_error_trap_pop_ignored ();
+}
+
+/* The parts of @new that differ from @old, as the mask XkbSetControls()
+ * wants. The options in ax_options are split the way the server applies
+ * them. */
+static unsigned long
+get_changed_controls (XkbControlsRec *old,
+                      XkbControlsRec *new)
+{
+        unsigned long which = 0;
+
+        if (old->enabled_ctrls != new->enabled_ctrls)
+                which |= XkbControlsEnabledMask;
+        if (old->slow_keys_delay != new->slow_keys_delay)
+                which |= XkbSlowKeysMask;
+        if (old->debounce_delay != new->debounce_delay)
+                which |= XkbBounceKeysMask;
+        if (old->mk_delay != new->mk_delay ||
+            old->mk_interval != new->mk_interval ||
+            old->mk_time_to_max != new->mk_time_to_max ||
+            old->mk_max_speed != new->mk_max_speed ||
+            old->mk_curve != new->mk_curve)
+                which |= XkbMouseKeysAccelMask;
+        if ((old->ax_options ^ new->ax_options) & XkbAX_SKOptionsMask)
+                which |= XkbStickyKeysMask;
+        if ((old->ax_options ^ new->ax_options) & XkbAX_FBOptionsMask)
+                which |= XkbAccessXFeedbackMask;
+        if (old->ax_timeout != new->ax_timeout ||
+            old->axt_ctrls_mask != new->axt_ctrls_mask ||
+            old->axt_ctrls_values != new->axt_ctrls_values ||
+            old->axt_opts_mask != new->axt_opts_mask ||
+            old->axt_opts_values != new->axt_opts_values)
+                which |= XkbAccessXTimeoutMask;
+
+        return which;
+}
+
 static int
 get_int (GSettings  *settings,
          char const *key)
@@ -158,20 +212,26 @@ get_int (GSettings  *settings,
         return res;
 }
 
+/* Only keys that differ get written, so that the server echoing our own
+ * changes back doesn't rewrite everything */
 static gboolean
 set_int (GSettings      *settings,
          char const     *key,
          int             val)
 {
         int prev_val;
+        gint64 span;
 
         prev_val = g_settings_get_int (settings, key);
+        if (val == prev_val)
+                return FALSE;
+
+        span = gnome_settings_profile_span_begin ();
+        g_debug ("%s changed", key);
         g_settings_set_int (settings, key, val);
-        if (val != prev_val) {
-                g_debug ("%s changed", key);
-        }
+        gnome_settings_profile_span_end ("a11y-keyboard", "gsettings-write", span);
 
-        return val != prev_val;
+        return TRUE;
 }
 
 static gboolean
@@ -181,14 +241,18 @@ set_bool (GSettings      *settings,
 {
         gboolean bval = (val != 0);
         gboolean prev_val;
+        gint64 span;
 
         prev_val = g_settings_get_boolean (settings, key);
-        g_settings_set_boolean (settings, key, bval ? TRUE : FALSE);
-        if (bval != prev_val) {
-                g_debug ("%s changed", key);
-                return TRUE;
-        }
-        return (bval != prev_val);
+        if (bval == prev_val)
+                return FALSE;
+
+        span = gnome_settings_profile_span_begin ();
+        g_debug ("%s changed", key);
+        g_settings_set_boolean (settings, key, bval);
+        gnome_settings_profile_span_end ("a11y-keyboard", "gsettings-write", span);
+
+        return TRUE;
 }
 
 static unsigned long
@@ -213,19 +277,29 @@ set_ctrl_from_gsettings (XkbDescRec   *desc,
         return result;
 }
 
+/* Works on a copy of the shadow controls and sends the server only
+ * what differs from them */
 static void
 set_server_from_gsettings (GsdA11yKeyboardManager *manager)
 {
-        XkbDescRec      *desc;
+        XkbDescRec       desc_rec;
+        XkbControlsRec   ctrls;
+        XkbDescRec      *desc = &desc_rec;
+        unsigned long    which;
         gboolean         enable_accessX;
         GSettings       *settings;
+        gint64           span;
+
+        if (manager->priv->shadow == NULL)
+                return;
 
         gnome_settings_profile_start (NULL);
+        span = gnome_settings_profile_span_begin ();
 
-        desc = get_xkb_desc_rec (manager);
-        if (!desc) {
-                return;
-        }
+        ctrls = *manager->priv->shadow->ctrls;
+        memset (&desc_rec, 0, sizeof (desc_rec));
+        desc->device_spec = XkbUseCoreKbd;
+        desc->ctrls = &ctrls;
 
         settings = manager->priv->settings;
 
@@ -317,16 +391,20 @@ set_server_from_gsettings (GsdA11yKeyboardManager *manager)
         g_debug ("CHANGE to : 0x%x (2)", desc->ctrls->ax_options);
         */
 
-        gdk_error_trap_push ();
-        XkbSetControls (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()),
-                        DEFAULT_XKB_SET_CONTROLS_MASK,
-                        desc);
+        which = get_changed_controls (manager->priv->shadow->ctrls, &ctrls);
+        if (which != 0) {
+                g_debug ("Setting XKB controls 0x%lx", which);
 
-        XkbFreeKeyboard (desc, XkbAllComponentsMask, True);
+                gdk_error_trap_push ();
+                XkbSetControls (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()),
+                                which,
+                                desc);
+                gdk_error_trap_pop_ignored ();
 
-        XSync (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), FALSE);
-        gdk_error_trap_pop_ignored ();
+                *manager->priv->shadow->ctrls = ctrls;
+        }
 
+        gnome_settings_profile_span_end ("a11y-keyboard", "set-server", span);
         gnome_settings_profile_end (NULL);
 }
 
@@ -528,7 +606,7 @@ set_gsettings_from_server (GsdA11yKeyboardManager *manager)
         gboolean        stickykeys_changed;
         GSettings      *settings;
 
-        desc = get_xkb_desc_rec (manager);
+        desc = manager->priv->shadow;
         if (! desc) {
                 return;
         }
@@ -633,8 +711,6 @@ set_gsettings_from_server (GsdA11yKeyboardManager *manager)
                 }
         }
 
-        XkbFreeKeyboard (desc, XkbAllComponentsMask, True);
-
         g_settings_apply (settings);
         g_object_unref (settings);
 }
@@ -656,10 +732,18 @@ cb_xkb_event_filter (GdkXEvent              *xevent,
          * explicit user input event, so require a non-zero event_type.
          */
         if (xev->xany.type == (manager->priv->xkbEventBase + XkbEventCode) &&
-            xkbEv->any.xkb_type == XkbControlsNotify &&
-            xkbEv->ctrls.event_type != 0) {
-                g_debug ("XKB state changed");
-                set_gsettings_from_server (manager);
+            xkbEv->any.xkb_type == XkbControlsNotify) {
+                /* Toggling a control comes with its new state; anything
+                 * else, like other clients changing delays, needs the
+                 * controls fetched again */
+                manager->priv->shadow->ctrls->enabled_ctrls = xkbEv->ctrls.enabled_ctrls;
+                if (xkbEv->ctrls.changed_ctrls & ~XkbControlsEnabledMask)
+                        update_shadow (manager);
+
+                if (xkbEv->ctrls.event_type != 0) {
+                        g_debug ("XKB state changed");
+                        set_gsettings_from_server (manager);
+                }
         } else if (xev->xany.type == (manager->priv->xkbEventBase + XkbEventCode) &&
                    xkbEv->any.xkb_type == XkbAccessXNotify) {
                 if (xkbEv->accessx.detail == XkbAXN_AXKWarning) {
@@ -700,8 +784,15 @@ start_a11y_keyboard_idle_cb (GsdA11yKeyboardManager *manager)
 
         set_devicepresence_handler (manager);
 
-        /* Get the original configuration from the server */
-        manager->priv->desc = get_xkb_desc_rec (manager);
+        /* Get the original configuration from the server, and keep
+         * a copy of it to compare our changes against */
+        manager->priv->shadow = get_xkb_desc_rec (manager);
+        if (manager->priv->shadow == NULL)
+                goto out;
+
+        manager->priv->desc = XkbAllocKeyboard ();
+        XkbAllocControls (manager->priv->desc, XkbAllControlsMask);
+        *manager->priv->desc->ctrls = *manager->priv->shadow->ctrls;
 
         event_mask = XkbControlsNotifyMask;
         event_mask |= XkbAccessXNotifyMask; /* make default when AXN_AXKWarning works */
@@ -747,25 +838,24 @@ gsd_a11y_keyboard_manager_stop (GsdA11yKeyboardManager *manager)
         g_debug ("Stopping a11y_keyboard manager");
 
         if (p->desc != NULL) {
-                XkbDescRec *desc;
-
-                desc = get_xkb_desc_rec (manager);
-                if (desc != NULL) {
-                        if (p->desc->ctrls->enabled_ctrls != desc->ctrls->enabled_ctrls) {
-                                gdk_error_trap_push ();
-                                XkbSetControls (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()),
-                                                DEFAULT_XKB_SET_CONTROLS_MASK,
-                                                p->desc);
-
-                                XSync (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), FALSE);
-                                gdk_error_trap_pop_ignored ();
-                        }
-                        XkbFreeKeyboard (desc, XkbAllComponentsMask, True);
+                if (p->desc->ctrls->enabled_ctrls != p->shadow->ctrls->enabled_ctrls) {
+                        gdk_error_trap_push ();
+                        XkbSetControls (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()),
+                                        DEFAULT_XKB_SET_CONTROLS_MASK,
+                                        p->desc);
+
+                        XSync (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), FALSE);
+                        gdk_error_trap_pop_ignored ();
                 }
                 XkbFreeKeyboard (p->desc, XkbAllComponentsMask, True);
                 p->desc = NULL;
         }
 
+        if (p->shadow != NULL) {
+                XkbFreeKeyboard (p->shadow, XkbAllComponentsMask, True);
+                p->shadow = NULL;
+        }
+
         if (p->start_idle_id != 0) {
                 g_source_remove (p->start_idle_id);
                 p->start_idle_id = 0;
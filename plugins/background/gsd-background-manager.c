@@ -41,11 +41,22 @@
 #define GNOME_DESKTOP_USE_UNSTABLE_API
 #include <libgnome-desktop/gnome-bg.h>
 #include <X11/Xatom.h>
+#include <cairo-xlib.h>
+#include <glib/gstdio.h>
 
 #include "gnome-settings-bus.h"
 #include "gnome-settings-profile.h"
 #include "gsd-background-manager.h"
 
+/* Number of rendered wallpapers kept around, so that going back to the
+ * previous monitor layout doesn't need the picture decoded again. Each
+ * one is as big as the screen. */
+#define RENDER_CACHE_SIZE 2
+
+/* How long to wait before looking up the user again when AccountsService
+ * is there but fails to */
+#define ACCOUNTS_RETRY_DELAY 2 /* seconds */
+
 #define GSD_BACKGROUND_MANAGER_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), GSD_TYPE_BACKGROUND_MANAGER, GsdBackgroundManagerPrivate))
 
 struct GsdBackgroundManagerPrivate
@@ -55,8 +66,25 @@ struct GsdBackgroundManagerPrivate
 
         GnomeBGCrossfade *fade;
 
+        /* Wallpapers rendered in a worker thread, see draw_background() */
+        GPtrArray   *render_cancellables; /* per screen, NULL when idle */
+        GQueue       render_cache;        /* RenderCacheEntry, most recent first */
+
         GDBusProxy  *proxy;
         guint        proxy_signal_id;
+
+        /* AccountsService publication of the picture, see
+         * set_accountsservice_background() */
+        GDBusConnection *system_bus;
+        GCancellable *accounts_cancellable;
+        guint        accounts_watch_id;
+        guint        accounts_retry_id;
+        gboolean     accounts_available;
+        gchar       *accounts_user_path;
+        gchar       *accounts_background; /* latest, not sent yet */
+        gchar       *accounts_sending;    /* in flight */
+        gboolean     accounts_pending;
+        gboolean     accounts_busy;
 };
 
 static void     gsd_background_manager_class_init  (GsdBackgroundManagerClass *klass);
@@ -181,6 +209,395 @@ on_crossfade_finished (GsdBackgroundManager *manager)
         manager->priv->fade = NULL;
 }
 
+static void
+set_root_surface (GsdBackgroundManager *manager,
+                  GdkScreen            *screen,
+                  cairo_surface_t      *surface,
+                  gboolean              use_crossfade)
+{
+        if (use_crossfade) {
+
+                if (manager->priv->fade != NULL) {
+                        g_object_unref (manager->priv->fade);
+                }
+
+                manager->priv->fade = gnome_bg_set_surface_as_root_with_crossfade (screen, surface);
+                g_signal_connect_swapped (manager->priv->fade, "finished",
+                                          G_CALLBACK (on_crossfade_finished),
+                                          manager);
+        } else {
+                gnome_bg_set_surface_as_root (screen, surface);
+        }
+}
+
+/* Synchronous drawing through GnomeBG, for what the worker can't do */
+static void
+draw_screen_background (GsdBackgroundManager *manager,
+                        GdkScreen            *screen,
+                        gboolean              use_crossfade)
+{
+        cairo_surface_t *surface;
+
+        surface = gnome_bg_create_surface (manager->priv->bg,
+                                           gdk_screen_get_root_window (screen),
+                                           gdk_screen_get_width (screen),
+                                           gdk_screen_get_height (screen),
+                                           TRUE);
+        set_root_surface (manager, screen, surface, use_crossfade);
+        cairo_surface_destroy (surface);
+}
+
+typedef struct {
+        gchar                   *key;
+        GnomeBG                 *bg;
+        GDesktopBackgroundStyle  placement;
+        int                      width;
+        int                      height;
+        int                      n_monitors;
+        GdkRectangle            *monitors;
+        int                      screen_num;
+        gboolean                 use_crossfade;
+} RenderJob;
+
+typedef struct {
+        gchar           *key;
+        cairo_surface_t *surface;
+} RenderCacheEntry;
+
+static void
+render_job_free (RenderJob *job)
+{
+        g_free (job->key);
+        g_clear_object (&job->bg);
+        g_free (job->monitors);
+        g_free (job);
+}
+
+static void
+render_cache_entry_free (RenderCacheEntry *entry)
+{
+        g_free (entry->key);
+        cairo_surface_destroy (entry->surface);
+        g_free (entry);
+}
+
+/* Takes a snapshot of everything the worker needs, or returns NULL
+ * if GnomeBG has to draw this background itself */
+static RenderJob *
+render_job_new (GsdBackgroundManager *manager,
+                GdkScreen            *screen,
+                gboolean              use_crossfade)
+{
+        GsdBackgroundManagerPrivate *p = manager->priv;
+        RenderJob *job;
+        GString *key;
+        GStatBuf buf;
+        const gchar *filename;
+        gchar *primary, *secondary;
+        int i;
+
+        /* Slideshows change with time, which needs p->bg */
+        filename = gnome_bg_get_filename (p->bg);
+        if (filename == NULL ||
+            gnome_bg_changes_with_time (p->bg) ||
+            g_stat (filename, &buf) < 0)
+                return NULL;
+
+        /* The worker draws with a GnomeBG of its own, so that it
+         * doesn't share the file cache of p->bg with the main thread */
+        job = g_new0 (RenderJob, 1);
+        job->bg = gnome_bg_new ();
+        gnome_bg_load_from_preferences (job->bg, p->settings);
+        job->placement = gnome_bg_get_placement (job->bg);
+        job->width = gdk_screen_get_width (screen);
+        job->height = gdk_screen_get_height (screen);
+        job->screen_num = gdk_screen_get_number (screen);
+        job->use_crossfade = use_crossfade;
+
+        job->n_monitors = gdk_screen_get_n_monitors (screen);
+        job->monitors = g_new (GdkRectangle, job->n_monitors);
+        for (i = 0; i < job->n_monitors; i++)
+                gdk_screen_get_monitor_geometry (screen, i, &job->monitors[i]);
+
+        /* The modification time is there so that a picture that was
+         * overwritten in place doesn't come from the cache */
+        primary = g_settings_get_string (p->settings, "primary-color");
+        secondary = g_settings_get_string (p->settings, "secondary-color");
+        key = g_string_new (NULL);
+        g_string_append_printf (key, "%s:%" G_GINT64_FORMAT ":%d:%d:%s:%s:%dx%d",
+                                filename, (gint64) buf.st_mtime,
+                                job->placement,
+                                g_settings_get_enum (p->settings, "color-shading-type"),
+                                primary, secondary,
+                                job->width, job->height);
+        for (i = 0; i < job->n_monitors; i++)
+                g_string_append_printf (key, ":%d,%d,%dx%d",
+                                        job->monitors[i].x, job->monitors[i].y,
+                                        job->monitors[i].width, job->monitors[i].height);
+        job->key = g_string_free (key, FALSE);
+        g_free (primary);
+        g_free (secondary);
+
+        return job;
+}
+
+/* Runs in a worker thread: has GnomeBG decode, scale and place the
+ * picture into a pixbuf the size of the screen, one monitor at a time
+ * like it does for the root window. This doesn't touch p->bg or the X
+ * connection, which both belong to the main thread. */
+static void
+render_background_thread (GTask        *task,
+                          gpointer      source_object,
+                          gpointer      task_data,
+                          GCancellable *cancellable)
+{
+        RenderJob *job = task_data;
+        GdkPixbuf *pixbuf;
+        cairo_surface_t *surface;
+        cairo_t *cr;
+        gint64 span;
+        int i;
+
+        span = gnome_settings_profile_span_begin ();
+
+        pixbuf = gdk_pixbuf_new (GDK_COLORSPACE_RGB, FALSE, 8, job->width, job->height);
+        gdk_pixbuf_fill (pixbuf, 0x000000ff);
+
+        if (job->placement == G_DESKTOP_BACKGROUND_STYLE_SPANNED) {
+                gnome_bg_draw (job->bg, pixbuf, NULL, FALSE);
+        } else {
+                GdkRectangle screen_area = { 0, 0, job->width, job->height };
+
+                for (i = 0; i < job->n_monitors; i++) {
+                        GdkRectangle area;
+                        GdkPixbuf *monitor;
+
+                        if (g_cancellable_is_cancelled (cancellable))
+                                break;
+                        if (!gdk_rectangle_intersect (&job->monitors[i], &screen_area, &area))
+                                continue;
+
+                        monitor = gdk_pixbuf_new_subpixbuf (pixbuf, area.x, area.y,
+                                                            area.width, area.height);
+                        gnome_bg_draw (job->bg, monitor, NULL, FALSE);
+                        g_object_unref (monitor);
+                }
+        }
+
+        if (g_task_return_error_if_cancelled (task)) {
+                g_object_unref (pixbuf);
+                return;
+        }
+
+        surface = cairo_image_surface_create (CAIRO_FORMAT_RGB24, job->width, job->height);
+        cr = cairo_create (surface);
+        gdk_cairo_set_source_pixbuf (cr, pixbuf, 0, 0);
+        cairo_paint (cr);
+        cairo_destroy (cr);
+        g_object_unref (pixbuf);
+
+        gnome_settings_profile_span_end ("background", "render", span);
+
+        g_task_return_pointer (task, surface, (GDestroyNotify) cairo_surface_destroy);
+}
+
+static cairo_surface_t *
+lookup_render_cache (GsdBackgroundManager *manager,
+                     const gchar          *key)
+{
+        GQueue *cache = &manager->priv->render_cache;
+        GList *l;
+
+        for (l = cache->head; l != NULL; l = l->next) {
+                RenderCacheEntry *entry = l->data;
+
+                if (g_strcmp0 (entry->key, key) == 0) {
+                        g_queue_unlink (cache, l);
+                        g_queue_push_head_link (cache, l);
+                        return entry->surface;
+                }
+        }
+
+        return NULL;
+}
+
+static void
+add_render_cache (GsdBackgroundManager *manager,
+                  const gchar          *key,
+                  cairo_surface_t      *surface)
+{
+        GQueue *cache = &manager->priv->render_cache;
+        RenderCacheEntry *entry;
+
+        entry = g_new0 (RenderCacheEntry, 1);
+        entry->key = g_strdup (key);
+        entry->surface = cairo_surface_reference (surface);
+        g_queue_push_head (cache, entry);
+
+        while (cache->length > RENDER_CACHE_SIZE)
+                render_cache_entry_free (g_queue_pop_tail (cache));
+}
+
+static void
+clear_render_cache (GsdBackgroundManager *manager)
+{
+        RenderCacheEntry *entry;
+
+        while ((entry = g_queue_pop_head (&manager->priv->render_cache)) != NULL)
+                render_cache_entry_free (entry);
+}
+
+/* Each screen has its own render request, a new one only cancels the
+ * one for the same screen */
+static void
+cancel_render (GsdBackgroundManager *manager,
+               int                   screen_num)
+{
+        GPtrArray *cancellables = manager->priv->render_cancellables;
+        GCancellable *cancellable;
+
+        if (screen_num >= (int) cancellables->len)
+                return;
+
+        cancellable = g_ptr_array_index (cancellables, screen_num);
+        if (cancellable != NULL) {
+                g_cancellable_cancel (cancellable);
+                g_object_unref (cancellable);
+                g_ptr_array_index (cancellables, screen_num) = NULL;
+        }
+}
+
+static void
+cancel_all_renders (GsdBackgroundManager *manager)
+{
+        int i;
+
+        for (i = 0; i < (int) manager->priv->render_cancellables->len; i++)
+                cancel_render (manager, i);
+}
+
+static GCancellable *
+start_render (GsdBackgroundManager *manager,
+              int                   screen_num)
+{
+        GPtrArray *cancellables = manager->priv->render_cancellables;
+        GCancellable *cancellable;
+
+        cancel_render (manager, screen_num);
+
+        if (screen_num >= (int) cancellables->len)
+                g_ptr_array_set_size (cancellables, screen_num + 1);
+
+        cancellable = g_cancellable_new ();
+        g_ptr_array_index (cancellables, screen_num) = cancellable;
+
+        return cancellable;
+}
+
+/* The same as GnomeBG does for root surfaces: the pixmap is created on
+ * a connection of its own that is closed with RetainPermanent, so that
+ * it survives us and whoever replaces the background can free it */
+static cairo_surface_t *
+create_root_surface (GdkScreen *screen,
+                     int        width,
+                     int        height)
+{
+        Display *display;
+        Pixmap   pixmap;
+        int      screen_num;
+        int      depth;
+
+        screen_num = gdk_screen_get_number (screen);
+
+        gdk_flush ();
+
+        display = XOpenDisplay (gdk_display_get_name (gdk_screen_get_display (screen)));
+        if (display == NULL) {
+                g_warning ("Unable to open display '%s' for the background pixmap",
+                           gdk_display_get_name (gdk_screen_get_display (screen)));
+                return NULL;
+        }
+
+        depth = DefaultDepth (display, screen_num);
+        pixmap = XCreatePixmap (display, RootWindow (display, screen_num),
+                                width, height, depth);
+        XFlush (display);
+        XSetCloseDownMode (display, RetainPermanent);
+        XCloseDisplay (display);
+
+        return cairo_xlib_surface_create (GDK_SCREEN_XDISPLAY (screen),
+                                          pixmap,
+                                          GDK_VISUAL_XVISUAL (gdk_screen_get_system_visual (screen)),
+                                          width, height);
+}
+
+/* All that's left for the main loop: copying the rendered image into
+ * the root pixmap */
+static void
+publish_rendered_background (GsdBackgroundManager *manager,
+                             GdkScreen            *screen,
+                             cairo_surface_t      *image,
+                             gboolean              use_crossfade)
+{
+        cairo_surface_t *surface;
+        cairo_t *cr;
+        gint64 span;
+
+        span = gnome_settings_profile_span_begin ();
+
+        surface = create_root_surface (screen,
+                                       cairo_image_surface_get_width (image),
+                                       cairo_image_surface_get_height (image));
+        if (surface == NULL)
+                return;
+
+        cr = cairo_create (surface);
+        cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+        cairo_set_source_surface (cr, image, 0, 0);
+        cairo_paint (cr);
+        cairo_destroy (cr);
+
+        set_root_surface (manager, screen, surface, use_crossfade);
+        cairo_surface_destroy (surface);
+
+        gnome_settings_profile_span_end ("background", "publish", span);
+}
+
+static void
+on_background_rendered (GObject      *source_object,
+                        GAsyncResult *res,
+                        gpointer      user_data)
+{
+        GsdBackgroundManager *manager = GSD_BACKGROUND_MANAGER (source_object);
+        RenderJob *job = g_task_get_task_data (G_TASK (res));
+        GdkScreen *screen;
+        cairo_surface_t *surface;
+        GError *error = NULL;
+
+        /* Only fails if a newer render for the screen was started
+         * meanwhile, or the manager was stopped */
+        surface = g_task_propagate_pointer (G_TASK (res), &error);
+        if (surface == NULL) {
+                g_error_free (error);
+                return;
+        }
+
+        /* Still ours, as it wasn't cancelled */
+        cancel_render (manager, job->screen_num);
+
+        add_render_cache (manager, job->key, surface);
+
+        if (!dont_draw_background (manager)) {
+                screen = gdk_display_get_screen (gdk_display_get_default (), job->screen_num);
+                publish_rendered_background (manager, screen, surface, job->use_crossfade);
+        }
+
+        cairo_surface_destroy (surface);
+}
+
+/* Decoding and scaling the picture is done in a worker thread, and
+ * the result is kept in a small cache keyed on everything that goes
+ * into it. Slideshows and plain colors are still drawn by GnomeBG. */
 static void
 draw_background (GsdBackgroundManager *manager,
                  gboolean              use_crossfade)
@@ -188,7 +605,7 @@ draw_background (GsdBackgroundManager *manager,
         GdkDisplay *display;
         int         n_screens;
         int         i;
-
+        gint64      span;
 
         if (nautilus_is_drawing_background (manager) ||
             dont_draw_background (manager)) {
@@ -196,42 +613,44 @@ draw_background (GsdBackgroundManager *manager,
         }
 
         gnome_settings_profile_start (NULL);
+        span = gnome_settings_profile_span_begin ();
 
         display = gdk_display_get_default ();
         n_screens = gdk_display_get_n_screens (display);
 
         for (i = 0; i < n_screens; ++i) {
                 GdkScreen *screen;
-                GdkWindow *root_window;
+                RenderJob *job;
                 cairo_surface_t *surface;
+                GTask *task;
 
                 screen = gdk_display_get_screen (display, i);
 
-                root_window = gdk_screen_get_root_window (screen);
-
-                surface = gnome_bg_create_surface (manager->priv->bg,
-                                                   root_window,
-                                                   gdk_screen_get_width (screen),
-                                                   gdk_screen_get_height (screen),
-                                                   TRUE);
+                /* Whatever is drawn now, an older render for this
+                 * screen mustn't replace it */
+                cancel_render (manager, i);
 
-                if (use_crossfade) {
-
-                        if (manager->priv->fade != NULL) {
-                                g_object_unref (manager->priv->fade);
-                        }
+                job = render_job_new (manager, screen, use_crossfade);
+                if (job == NULL) {
+                        draw_screen_background (manager, screen, use_crossfade);
+                        continue;
+                }
 
-                        manager->priv->fade = gnome_bg_set_surface_as_root_with_crossfade (screen, surface);
-                        g_signal_connect_swapped (manager->priv->fade, "finished",
-                                                  G_CALLBACK (on_crossfade_finished),
-                                                  manager);
-                } else {
-                        gnome_bg_set_surface_as_root (screen, surface);
+                surface = lookup_render_cache (manager, job->key);
+                if (surface != NULL) {
+                        g_debug ("Using cached background for screen %d", i);
+                        publish_rendered_background (manager, screen, surface, use_crossfade);
+                        render_job_free (job);
+                        continue;
                 }
 
-                cairo_surface_destroy (surface);
+                task = g_task_new (manager, start_render (manager, i), on_background_rendered, NULL);
+                g_task_set_task_data (task, job, (GDestroyNotify) render_job_free);
+                g_task_run_in_thread (task, render_background_thread);
+                g_object_unref (task);
         }
 
+        gnome_settings_profile_span_end ("background", "draw", span);
         gnome_settings_profile_end (NULL);
 }
 
@@ -396,83 +815,308 @@ draw_background_changed (GSettings            *settings,
                 setup_bg_and_draw_background (manager);
 }
 
+static void publish_accountsservice_background (GsdBackgroundManager *manager);
+
+static gboolean
+accounts_error_is_retryable (GError *error)
+{
+        return g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_SERVICE_UNKNOWN) ||
+               g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_NAME_HAS_NO_OWNER);
+}
+
+/* Called when a publication failed, puts the value back unless a
+ * newer one came in meanwhile */
+static void
+requeue_accountsservice_background (GsdBackgroundManager *manager,
+                                    const gchar          *background)
+{
+        if (manager->priv->accounts_pending)
+                return;
+
+        g_free (manager->priv->accounts_background);
+        manager->priv->accounts_background = g_strdup (background);
+        manager->priv->accounts_pending = TRUE;
+}
+
+static void
+on_set_background_file (GObject      *source_object,
+                        GAsyncResult *res,
+                        gpointer      user_data)
+{
+        GsdBackgroundManager *manager = user_data;
+        GVariant *variant;
+        GError *error = NULL;
+
+        variant = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &error);
+        if (variant == NULL) {
+                if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                        g_error_free (error);
+                        return;
+                }
+                g_warning ("Failed to set the background '%s': %s",
+                           manager->priv->accounts_sending, error->message);
+                g_error_free (error);
+        } else {
+                g_variant_unref (variant);
+        }
+
+        g_clear_pointer (&manager->priv->accounts_sending, g_free);
+        manager->priv->accounts_busy = FALSE;
+
+        /* the picture may have changed again while we were busy */
+        publish_accountsservice_background (manager);
+}
+
+static void
+on_set_background_property (GObject      *source_object,
+                            GAsyncResult *res,
+                            gpointer      user_data)
+{
+        GsdBackgroundManager *manager = user_data;
+        GVariant *variant;
+        GError *error = NULL;
+
+        variant = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &error);
+        if (variant == NULL) {
+                if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                        g_error_free (error);
+                        return;
+                }
+                g_warning ("Failed to set the background '%s': %s",
+                           manager->priv->accounts_sending, error->message);
+
+                if (accounts_error_is_retryable (error)) {
+                        /* try again once the service is back */
+                        requeue_accountsservice_background (manager, manager->priv->accounts_sending);
+                        g_clear_pointer (&manager->priv->accounts_user_path, g_free);
+                        g_clear_pointer (&manager->priv->accounts_sending, g_free);
+                        manager->priv->accounts_busy = FALSE;
+                        g_error_free (error);
+                        return;
+                }
+                g_error_free (error);
+        } else {
+                g_variant_unref (variant);
+        }
+
+        /* Also attempt the old method (patch not upstreamed into AccountsService */
+        g_dbus_connection_call (manager->priv->system_bus,
+                                "org.freedesktop.Accounts",
+                                manager->priv->accounts_user_path,
+                                "org.freedesktop.Accounts.User",
+                                "SetBackgroundFile",
+                                g_variant_new ("(s)", manager->priv->accounts_sending),
+                                G_VARIANT_TYPE ("()"),
+                                G_DBUS_CALL_FLAGS_NONE,
+                                -1,
+                                manager->priv->accounts_cancellable,
+                                on_set_background_file,
+                                manager);
+}
+
+/* Busy until then, so that changes meanwhile don't retry early */
+static gboolean
+retry_accountsservice_background (gpointer user_data)
+{
+        GsdBackgroundManager *manager = user_data;
+
+        manager->priv->accounts_retry_id = 0;
+        manager->priv->accounts_busy = FALSE;
+        publish_accountsservice_background (manager);
+
+        return FALSE;
+}
+
+static void
+on_find_user_by_name (GObject      *source_object,
+                      GAsyncResult *res,
+                      gpointer      user_data)
+{
+        GsdBackgroundManager *manager = user_data;
+        GVariant *variant;
+        GError *error = NULL;
+
+        variant = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, &error);
+        if (variant == NULL) {
+                if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                        g_error_free (error);
+                        return;
+                }
+                g_warning ("Could not contact accounts service to look up '%s': %s",
+                           g_get_user_name (), error->message);
+
+                /* keep the value, and retry when the service appears,
+                 * or in a little while if it's there but failed */
+                if (accounts_error_is_retryable (error)) {
+                        manager->priv->accounts_busy = FALSE;
+                } else {
+                        manager->priv->accounts_retry_id =
+                                g_timeout_add_seconds (ACCOUNTS_RETRY_DELAY,
+                                                       retry_accountsservice_background,
+                                                       manager);
+                }
+                g_error_free (error);
+                return;
+        }
+
+        g_variant_get (variant, "(o)", &manager->priv->accounts_user_path);
+        g_variant_unref (variant);
+
+        manager->priv->accounts_busy = FALSE;
+        publish_accountsservice_background (manager);
+}
+
+/* Sends the latest wanted background to AccountsService, one
+ * publication at a time, so a burst of changes only sends the last one
+ */
+static void
+publish_accountsservice_background (GsdBackgroundManager *manager)
+{
+        GsdBackgroundManagerPrivate *p = manager->priv;
+
+        if (p->accounts_busy || !p->accounts_pending)
+                return;
+
+        /* wait for the bus, or for the service to appear */
+        if (p->system_bus == NULL || !p->accounts_available)
+                return;
+
+        p->accounts_busy = TRUE;
+
+        if (p->accounts_user_path == NULL) {
+                g_dbus_connection_call (p->system_bus,
+                                        "org.freedesktop.Accounts",
+                                        "/org/freedesktop/Accounts",
+                                        "org.freedesktop.Accounts",
+                                        "FindUserByName",
+                                        g_variant_new ("(s)", g_get_user_name ()),
+                                        G_VARIANT_TYPE ("(o)"),
+                                        G_DBUS_CALL_FLAGS_NONE,
+                                        -1,
+                                        p->accounts_cancellable,
+                                        on_find_user_by_name,
+                                        manager);
+                return;
+        }
+
+        p->accounts_sending = p->accounts_background;
+        p->accounts_background = NULL;
+        p->accounts_pending = FALSE;
+
+        g_debug ("Publishing background '%s' to AccountsService", p->accounts_sending);
+
+        g_dbus_connection_call (p->system_bus,
+                                "org.freedesktop.Accounts",
+                                p->accounts_user_path,
+                                "org.freedesktop.DBus.Properties",
+                                "Set",
+                                g_variant_new ("(ssv)",
+                                               "org.freedesktop.DisplayManager.AccountsService",
+                                               "BackgroundFile",
+                                               g_variant_new_string (p->accounts_sending)),
+                                G_VARIANT_TYPE ("()"),
+                                G_DBUS_CALL_FLAGS_NONE,
+                                -1,
+                                p->accounts_cancellable,
+                                on_set_background_property,
+                                manager);
+}
+
+static void
+on_accounts_appeared (GDBusConnection *connection,
+                      const gchar     *name,
+                      const gchar     *name_owner,
+                      gpointer         user_data)
+{
+        GsdBackgroundManager *manager = user_data;
+
+        manager->priv->accounts_available = TRUE;
+        publish_accountsservice_background (manager);
+}
+
 static void
-set_accountsservice_background (const gchar *background)
-{
-  GDBusConnection *bus;
-  GVariant *variant;
-  GError *error = NULL;
-  gchar *object_path = NULL;
-
-  bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &error);
-  if (bus == NULL) {
-    g_warning ("Failed to get system bus: %s", error->message);
-    g_error_free (error);
-    return;
-  }
-
-  variant = g_dbus_connection_call_sync (bus,
-                                         "org.freedesktop.Accounts",
-                                         "/org/freedesktop/Accounts",
-                                         "org.freedesktop.Accounts",
-                                         "FindUserByName",
-                                         g_variant_new ("(s)", g_get_user_name ()),
-                                         G_VARIANT_TYPE ("(o)"),
-                                         G_DBUS_CALL_FLAGS_NONE,
-                                         -1,
-                                         NULL,
-                                         &error);
-  if (variant == NULL) {
-    g_warning ("Could not contact accounts service to look up '%s': %s",
-               g_get_user_name (), error->message);
-    g_error_free (error);
-    g_object_unref (bus);
-    return;
-  }
-  g_variant_get (variant, "(o)", &object_path);
-  g_variant_unref (variant);
-
-  variant = g_dbus_connection_call_sync (bus,
-                                         "org.freedesktop.Accounts",
-                                         object_path,
-                                         "org.freedesktop.DBus.Properties",
-                                         "Set",
-                                         g_variant_new ("(ssv)",
-                                                        "org.freedesktop.DisplayManager.AccountsService",
-                                                        "BackgroundFile",
-                                                        g_variant_new_string (background ? background : "")),
-                                         G_VARIANT_TYPE ("()"),
-                                         G_DBUS_CALL_FLAGS_NONE,
-                                         -1,
-                                         NULL,
-                                         &error);
-  if (variant != NULL)
-    g_variant_unref (variant);
-  else {
-    g_warning ("Failed to set the background '%s': %s", background, error->message);
-    g_clear_error (&error);
-  }
-
-  /* Also attempt the old method (patch not upstreamed into AccountsService */
-  variant = g_dbus_connection_call_sync (bus,
-                                         "org.freedesktop.Accounts",
-                                         object_path,
-                                         "org.freedesktop.Accounts.User",
-                                         "SetBackgroundFile",
-                                         g_variant_new ("(s)", background ? background : ""),
-                                         G_VARIANT_TYPE ("()"),
-                                         G_DBUS_CALL_FLAGS_NONE,
-                                         -1,
-                                         NULL,
-                                         &error);
-  if (variant != NULL)
-    g_variant_unref (variant);
-  else {
-    g_warning ("Failed to set the background '%s': %s", background, error->message);
-    g_clear_error (&error);
-  }
-
-  g_object_unref (bus);
+on_accounts_vanished (GDBusConnection *connection,
+                      const gchar     *name,
+                      gpointer         user_data)
+{
+        GsdBackgroundManager *manager = user_data;
+
+        manager->priv->accounts_available = FALSE;
+        g_clear_pointer (&manager->priv->accounts_user_path, g_free);
+}
+
+static void
+on_system_bus_gotten (GObject      *source_object,
+                      GAsyncResult *res,
+                      gpointer      user_data)
+{
+        GsdBackgroundManager *manager = user_data;
+        GDBusConnection *bus;
+        GError *error = NULL;
+
+        bus = g_bus_get_finish (res, &error);
+        if (bus == NULL) {
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        g_warning ("Failed to get system bus: %s", error->message);
+                g_error_free (error);
+                return;
+        }
+
+        manager->priv->system_bus = bus;
+        manager->priv->accounts_watch_id =
+                g_bus_watch_name_on_connection (bus,
+                                                "org.freedesktop.Accounts",
+                                                G_BUS_NAME_WATCHER_FLAGS_AUTO_START,
+                                                on_accounts_appeared,
+                                                on_accounts_vanished,
+                                                manager,
+                                                NULL);
+}
+
+static void
+set_accountsservice_background (GsdBackgroundManager *manager,
+                                const gchar          *background)
+{
+        g_free (manager->priv->accounts_background);
+        manager->priv->accounts_background = g_strdup (background ? background : "");
+        manager->priv->accounts_pending = TRUE;
+
+        if (manager->priv->accounts_cancellable == NULL) {
+                manager->priv->accounts_cancellable = g_cancellable_new ();
+                g_bus_get (G_BUS_TYPE_SYSTEM,
+                           manager->priv->accounts_cancellable,
+                           on_system_bus_gotten,
+                           manager);
+                return;
+        }
+
+        publish_accountsservice_background (manager);
+}
+
+static void
+stop_accountsservice_background (GsdBackgroundManager *manager)
+{
+        GsdBackgroundManagerPrivate *p = manager->priv;
+
+        if (p->accounts_cancellable != NULL) {
+                g_cancellable_cancel (p->accounts_cancellable);
+                g_clear_object (&p->accounts_cancellable);
+        }
+        if (p->accounts_watch_id != 0) {
+                g_bus_unwatch_name (p->accounts_watch_id);
+                p->accounts_watch_id = 0;
+        }
+        if (p->accounts_retry_id != 0) {
+                g_source_remove (p->accounts_retry_id);
+                p->accounts_retry_id = 0;
+        }
+        g_clear_object (&p->system_bus);
+        g_clear_pointer (&p->accounts_user_path, g_free);
+        g_clear_pointer (&p->accounts_background, g_free);
+        g_clear_pointer (&p->accounts_sending, g_free);
+        p->accounts_pending = FALSE;
+        p->accounts_busy = FALSE;
+        p->accounts_available = FALSE;
 }
 
 static void
@@ -480,12 +1124,13 @@ picture_uri_changed (GSettings            *settings,
                      const char           *key,
                      GsdBackgroundManager *manager)
 {
-        const char *picture_uri = g_settings_get_string (settings, key);
+        char *picture_uri = g_settings_get_string (settings, key);
         GFile *picture_file = g_file_new_for_uri (picture_uri);
         char *picture_path = g_file_get_path (picture_file);
-        set_accountsservice_background (picture_path);
+        set_accountsservice_background (manager, picture_path);
         g_free (picture_path);
         g_object_unref (picture_file);
+        g_free (picture_uri);
 }
 
 gboolean
@@ -532,6 +1177,10 @@ gsd_background_manager_stop (GsdBackgroundManager *manager)
         g_debug ("Stopping background manager");
 
         disconnect_screen_signals (manager);
+        stop_accountsservice_background (manager);
+
+        cancel_all_renders (manager);
+        clear_render_cache (manager);
 
         if (manager->priv->proxy) {
                 disconnect_session_manager_listener (manager);
@@ -582,6 +1231,8 @@ static void
 gsd_background_manager_init (GsdBackgroundManager *manager)
 {
         manager->priv = GSD_BACKGROUND_MANAGER_GET_PRIVATE (manager);
+        manager->priv->render_cancellables = g_ptr_array_new ();
+        g_queue_init (&manager->priv->render_cache);
 }
 
 static void
@@ -596,6 +1247,8 @@ gsd_background_manager_finalize (GObject *object)
 
         g_return_if_fail (background_manager->priv != NULL);
 
+        g_ptr_array_unref (background_manager->priv->render_cancellables);
+
         G_OBJECT_CLASS (gsd_background_manager_parent_class)->finalize (object);
 }
 
@@ -0,0 +1,162 @@
+#!/usr/bin/env python
+'''GNOME settings daemon tests for background plugin.'''
+
+__license__ = 'GPL v2 or later'
+
+import unittest
+import subprocess
+import sys
+import time
+import os
+import os.path
+
+project_root = os.path.dirname(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+builddir = os.environ.get('BUILDDIR', os.path.dirname(__file__))
+
+sys.path.insert(0, os.path.join(project_root, 'tests'))
+sys.path.insert(0, builddir)
+import gsdtestcase
+
+import dbus
+import dbusmock
+
+from gi.repository import Gio
+
+USER_PATH = '/org/freedesktop/Accounts/User1000'
+DM_IFACE = 'org.freedesktop.DisplayManager.AccountsService'
+
+ACCOUNTS_TEMPLATE = '''
+import dbus
+
+BUS_NAME = 'org.freedesktop.Accounts'
+MAIN_OBJ = '/org/freedesktop/Accounts'
+MAIN_IFACE = 'org.freedesktop.Accounts'
+SYSTEM_BUS = True
+
+
+def load(mock, parameters):
+    # lookup_delay slows the user lookup down, fail_lookups makes the
+    # first ones fail
+    mock.lookup_failures = parameters.get('fail_lookups', 0)
+    mock.AddMethod(MAIN_IFACE, 'FindUserByName', 's', 'o',
+                   'time.sleep(%%g)\\n'
+                   'if self.lookup_failures > 0:\\n'
+                   '    self.lookup_failures -= 1\\n'
+                   '    raise dbus.exceptions.DBusException("busy", name="org.freedesktop.Accounts.Error.Failed")\\n'
+                   'ret = dbus.ObjectPath("%s")' %% parameters.get('lookup_delay', 0))
+    mock.AddObject('%s', 'org.freedesktop.Accounts.User', {},
+                   [('SetBackgroundFile', 's', '', '')])
+    mock.objects['%s'].AddProperty('%s', 'BackgroundFile', '')
+''' % (USER_PATH, USER_PATH, USER_PATH, DM_IFACE)
+
+
+class BackgroundPluginTest(gsdtestcase.GSDTestCase):
+    '''Test the background plugin'''
+
+    def setUp(self):
+        self.accounts = None
+        self.settings_background = Gio.Settings('org.gnome.desktop.background')
+
+        self.plugin_log_write = open(os.path.join(self.workdir, 'plugin_background.log'), 'wb')
+        self.daemon = subprocess.Popen(
+            [os.path.join(builddir, 'usd-test-background')],
+            stdout=self.plugin_log_write,
+            stderr=subprocess.STDOUT)
+        time.sleep(1)
+
+    def tearDown(self):
+        daemon_running = self.daemon.poll() == None
+        if daemon_running:
+            self.daemon.terminate()
+            self.daemon.wait()
+        self.plugin_log_write.close()
+
+        self.stop_accounts()
+
+        self.settings_background.reset('picture-uri')
+        Gio.Settings.sync()
+
+        self.assertTrue(daemon_running, 'daemon died during the test')
+
+    def start_accounts(self, **parameters):
+        '''Start a mock AccountsService on the system bus
+
+        This uses a template, so that the user object is there as soon as
+        the name appears.
+        '''
+        template = os.path.join(self.workdir, 'mock_accounts.py')
+        with open(template, 'w') as f:
+            f.write(ACCOUNTS_TEMPLATE)
+
+        (self.accounts, obj_accounts) = self.spawn_server_template(
+            template, parameters, stdout=subprocess.PIPE)
+
+        obj_user = self.system_bus_con.get_object('org.freedesktop.Accounts', USER_PATH)
+        self.user_mock = dbus.Interface(obj_user, dbusmock.MOCK_IFACE)
+        self.user_props = dbus.Interface(obj_user, dbus.PROPERTIES_IFACE)
+
+    def stop_accounts(self):
+        if self.accounts:
+            self.accounts.terminate()
+            self.accounts.wait()
+            self.accounts = None
+
+    def set_picture(self, path):
+        self.settings_background['picture-uri'] = 'file://' + path
+        Gio.Settings.sync()
+
+    def wait_for_background(self, path, timeout=5):
+        while timeout > 0:
+            if self.user_props.Get(DM_IFACE, 'BackgroundFile') == path:
+                break
+            time.sleep(0.1)
+            timeout -= 0.1
+        return self.user_props.Get(DM_IFACE, 'BackgroundFile')
+
+    def set_background_file_calls(self):
+        return [c[2][0] for c in self.user_mock.GetCalls() if c[1] == 'SetBackgroundFile']
+
+    def test_publish_latest(self):
+        '''A burst of changes ends with the last picture published'''
+
+        # the burst lands while the user is being looked up
+        self.start_accounts(lookup_delay=2)
+
+        for i in range(50):
+            self.set_picture('/tmp/background-%i.png' % i)
+
+        self.assertEqual(self.wait_for_background('/tmp/background-49.png'),
+                         '/tmp/background-49.png')
+        time.sleep(0.5)
+        calls = self.set_background_file_calls()
+        self.assertEqual(calls[-1], '/tmp/background-49.png')
+        # at most what was current when the lookup returned, then the last
+        self.assertLessEqual(len(calls), 2)
+        self.assertEqual(self.user_props.Get(DM_IFACE, 'BackgroundFile'),
+                         '/tmp/background-49.png')
+
+    def test_lookup_retried(self):
+        '''A failed user lookup is retried while the service is there'''
+
+        self.start_accounts(fail_lookups=1)
+        self.set_picture('/tmp/background-retry.png')
+
+        self.assertEqual(self.wait_for_background('/tmp/background-retry.png'),
+                         '/tmp/background-retry.png')
+
+    def test_service_appears_later(self):
+        '''Changes made without AccountsService get sent when it appears'''
+
+        self.set_picture('/tmp/background-early.png')
+        self.set_picture('/tmp/background-late.png')
+        time.sleep(0.5)
+
+        self.start_accounts()
+
+        self.assertEqual(self.wait_for_background('/tmp/background-late.png'),
+                         '/tmp/background-late.png')
+        self.assertEqual(self.set_background_file_calls(), ['/tmp/background-late.png'])
+
+
+if __name__ == '__main__':
+    unittest.main(testRunner=unittest.TextTestRunner(stream=sys.stdout, verbosity=2))
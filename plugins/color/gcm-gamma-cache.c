@@ -0,0 +1,388 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <glib-object.h>
+#include <gio/gio.h>
+#include <lcms2.h>
+
+#include "gcm-gamma-cache.h"
+
+static void     gcm_gamma_cache_finalize        (GObject     *object);
+
+#define GCM_GAMMA_CACHE_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), GCM_TYPE_GAMMA_CACHE, GcmGammaCachePrivate))
+
+/* Enough for a few outputs with a profile and a linear ramp each */
+#define GCM_GAMMA_CACHE_MAX_RAMPS       8
+
+struct _GcmGammaCachePrivate
+{
+        GHashTable                      *ramps; /* key = "checksum:size", value = GcmGammaRamp */
+        GQueue                          *lru;   /* keys of ramps, most recently used first */
+        GHashTable                      *checksums; /* key = filename, value = GcmGammaChecksum */
+        guint                            hits;
+        guint                            misses;
+};
+
+/* The MD5 of a profile without a FILE_checksum, valid for as long as
+ * the file keeps the same size and modification time */
+typedef struct {
+        guint64          mtime;
+        guint32          mtime_usec;
+        goffset          size;
+        gchar           *checksum;
+} GcmGammaChecksum;
+
+G_DEFINE_TYPE (GcmGammaCache, gcm_gamma_cache, G_TYPE_OBJECT)
+
+GQuark
+gcm_gamma_cache_error_quark (void)
+{
+        static GQuark quark = 0;
+        if (!quark)
+                quark = g_quark_from_static_string ("gcm_gamma_cache_error");
+        return quark;
+}
+
+static GcmGammaRamp *
+gcm_gamma_ramp_new (guint size)
+{
+        GcmGammaRamp *ramp;
+
+        ramp = g_new0 (GcmGammaRamp, 1);
+        ramp->size = size;
+        ramp->red = g_new (guint16, size);
+        ramp->green = g_new (guint16, size);
+        ramp->blue = g_new (guint16, size);
+        return ramp;
+}
+
+static void
+gcm_gamma_ramp_free (GcmGammaRamp *ramp)
+{
+        g_free (ramp->red);
+        g_free (ramp->green);
+        g_free (ramp->blue);
+        g_free (ramp);
+}
+
+static void
+gcm_gamma_checksum_free (GcmGammaChecksum *checksum)
+{
+        g_free (checksum->checksum);
+        g_free (checksum);
+}
+
+static GcmGammaRamp *
+gcm_gamma_ramp_new_from_data (const gchar *filename,
+                              const gchar *data,
+                              gsize len,
+                              guint size,
+                              GError **error)
+{
+        GcmGammaRamp *ramp = NULL;
+        const cmsToneCurve **vcgt;
+        cmsFloat32Number in;
+        cmsHPROFILE lcms_profile;
+        guint i;
+
+        /* parse the contents already read for the checksum */
+        lcms_profile = cmsOpenProfileFromMem (data, len);
+        if (lcms_profile == NULL) {
+                g_set_error (error, GCM_GAMMA_CACHE_ERROR, 0,
+                             "failed to open %s", filename);
+                goto out;
+        }
+
+        /* get tone curves from profile */
+        vcgt = cmsReadTag (lcms_profile, cmsSigVcgtTag);
+        if (vcgt == NULL || vcgt[0] == NULL) {
+                g_set_error (error, GCM_GAMMA_CACHE_ERROR, 0,
+                             "%s does not have any VCGT data", filename);
+                goto out;
+        }
+
+        /* the intermediate guint32 keeps the rounding of the old
+         * GsdRROutputClutItem based code */
+        ramp = gcm_gamma_ramp_new (size);
+        for (i = 0; i < size; i++) {
+                in = (gdouble) i / (gdouble) (size - 1);
+                ramp->red[i] = (guint32) (cmsEvalToneCurveFloat(vcgt[0], in) * (gdouble) 0xffff);
+                ramp->green[i] = (guint32) (cmsEvalToneCurveFloat(vcgt[1], in) * (gdouble) 0xffff);
+                ramp->blue[i] = (guint32) (cmsEvalToneCurveFloat(vcgt[2], in) * (gdouble) 0xffff);
+        }
+out:
+        if (lcms_profile != NULL)
+                cmsCloseProfile (lcms_profile);
+        return ramp;
+}
+
+/* Looks up a ramp and makes it the most recently used one */
+static GcmGammaRamp *
+gcm_gamma_cache_lookup (GcmGammaCache *cache, const gchar *key)
+{
+        GcmGammaCachePrivate *priv = cache->priv;
+        gpointer stored_key;
+        gpointer ramp;
+        GList *link;
+
+        if (!g_hash_table_lookup_extended (priv->ramps, key, &stored_key, &ramp))
+                return NULL;
+
+        link = g_queue_find (priv->lru, stored_key);
+        g_queue_unlink (priv->lru, link);
+        g_queue_push_head_link (priv->lru, link);
+        priv->hits++;
+        return ramp;
+}
+
+/* Takes @key, and drops the least recently used ramp when full */
+static void
+gcm_gamma_cache_insert (GcmGammaCache *cache, gchar *key, GcmGammaRamp *ramp)
+{
+        GcmGammaCachePrivate *priv = cache->priv;
+
+        g_hash_table_insert (priv->ramps, key, ramp);
+        g_queue_push_head (priv->lru, key);
+        if (g_queue_get_length (priv->lru) > GCM_GAMMA_CACHE_MAX_RAMPS)
+                g_hash_table_remove (priv->ramps, g_queue_pop_tail (priv->lru));
+}
+
+/* Returns the remembered MD5 of @filename if the file didn't change
+ * since, and fills @info for gcm_gamma_cache_remember_checksum() */
+static const gchar *
+gcm_gamma_cache_lookup_checksum (GcmGammaCache *cache,
+                                 const gchar *filename,
+                                 GFileInfo **info)
+{
+        GcmGammaChecksum *checksum;
+        GFile *file;
+
+        file = g_file_new_for_path (filename);
+        *info = g_file_query_info (file,
+                                   G_FILE_ATTRIBUTE_STANDARD_SIZE ","
+                                   G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+                                   G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC,
+                                   G_FILE_QUERY_INFO_NONE,
+                                   NULL,
+                                   NULL);
+        g_object_unref (file);
+        if (*info == NULL)
+                return NULL;
+
+        checksum = g_hash_table_lookup (cache->priv->checksums, filename);
+        if (checksum == NULL ||
+            checksum->size != g_file_info_get_size (*info) ||
+            checksum->mtime != g_file_info_get_attribute_uint64 (*info, G_FILE_ATTRIBUTE_TIME_MODIFIED) ||
+            checksum->mtime_usec != g_file_info_get_attribute_uint32 (*info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC))
+                return NULL;
+        return checksum->checksum;
+}
+
+static const gchar *
+gcm_gamma_cache_remember_checksum (GcmGammaCache *cache,
+                                   const gchar *filename,
+                                   GFileInfo *info,
+                                   const gchar *data,
+                                   gsize len)
+{
+        GcmGammaChecksum *checksum;
+
+        /* forget profiles that went away rather than grow forever */
+        if (g_hash_table_size (cache->priv->checksums) >= GCM_GAMMA_CACHE_MAX_RAMPS)
+                g_hash_table_remove_all (cache->priv->checksums);
+
+        checksum = g_new0 (GcmGammaChecksum, 1);
+        checksum->checksum = g_compute_checksum_for_data (G_CHECKSUM_MD5,
+                                                          (const guchar *) data,
+                                                          len);
+        if (info != NULL) {
+                checksum->size = g_file_info_get_size (info);
+                checksum->mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+                checksum->mtime_usec = g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+        } else {
+                /* never matches, so the next lookup reads it again */
+                checksum->size = -1;
+        }
+        g_hash_table_insert (cache->priv->checksums, g_strdup (filename), checksum);
+        return checksum->checksum;
+}
+
+/**
+ * gcm_gamma_cache_get_for_profile:
+ * @checksum: the profile checksum, or %NULL to compute it from @filename
+ *
+ * Returns the VCGT of the profile sampled to @size entries, reading
+ * the profile only if no ramp with the same checksum and size was
+ * generated before. Without @checksum, the MD5 of the file is only
+ * computed again once the file changed. The ramp is owned by the
+ * cache, and valid until the next call.
+ **/
+const GcmGammaRamp *
+gcm_gamma_cache_get_for_profile (GcmGammaCache  *cache,
+                                 const gchar    *filename,
+                                 const gchar    *checksum,
+                                 guint           size,
+                                 GError        **error)
+{
+        GcmGammaCachePrivate *priv = cache->priv;
+        GcmGammaRamp *ramp = NULL;
+        GFileInfo *info = NULL;
+        gchar *data = NULL;
+        gchar *key = NULL;
+        gsize len;
+
+        g_return_val_if_fail (GCM_IS_GAMMA_CACHE (cache), NULL);
+        g_return_val_if_fail (filename != NULL, NULL);
+
+        /* invalid size */
+        if (size < 2) {
+                g_set_error (error, GCM_GAMMA_CACHE_ERROR, 0,
+                             "invalid gamma size %u", size);
+                goto out;
+        }
+
+        if (checksum == NULL)
+                checksum = gcm_gamma_cache_lookup_checksum (cache, filename, &info);
+
+        if (checksum != NULL) {
+                key = g_strdup_printf ("%s:%u", checksum, size);
+                ramp = gcm_gamma_cache_lookup (cache, key);
+                if (ramp != NULL)
+                        goto out;
+        }
+
+        /* the profile is read once, for both its checksum and its VCGT */
+        if (!g_file_get_contents (filename, &data, &len, error))
+                goto out;
+        if (checksum == NULL) {
+                checksum = gcm_gamma_cache_remember_checksum (cache, filename, info, data, len);
+                key = g_strdup_printf ("%s:%u", checksum, size);
+                ramp = gcm_gamma_cache_lookup (cache, key);
+                if (ramp != NULL)
+                        goto out;
+        }
+
+        priv->misses++;
+        ramp = gcm_gamma_ramp_new_from_data (filename, data, len, size, error);
+        if (ramp == NULL)
+                goto out;
+        gcm_gamma_cache_insert (cache, key, ramp);
+        key = NULL;
+out:
+        if (info != NULL)
+                g_object_unref (info);
+        g_free (key);
+        g_free (data);
+        return ramp;
+}
+
+/**
+ * gcm_gamma_cache_get_linear:
+ *
+ * Returns a linear ramp of @size entries, owned by the cache.
+ **/
+const GcmGammaRamp *
+gcm_gamma_cache_get_linear (GcmGammaCache *cache, guint size)
+{
+        GcmGammaCachePrivate *priv = cache->priv;
+        GcmGammaRamp *ramp;
+        guint32 value;
+        gchar *key;
+        guint i;
+
+        g_return_val_if_fail (GCM_IS_GAMMA_CACHE (cache), NULL);
+        g_return_val_if_fail (size >= 2, NULL);
+
+        key = g_strdup_printf ("linear:%u", size);
+        ramp = gcm_gamma_cache_lookup (cache, key);
+        if (ramp != NULL) {
+                g_free (key);
+                return ramp;
+        }
+
+        priv->misses++;
+        ramp = gcm_gamma_ramp_new (size);
+        for (i = 0; i < size; i++) {
+                value = (i * 0xffff) / (size - 1);
+                ramp->red[i] = value;
+                ramp->green[i] = value;
+                ramp->blue[i] = value;
+        }
+        gcm_gamma_cache_insert (cache, key, ramp);
+        return ramp;
+}
+
+guint
+gcm_gamma_cache_get_hits (GcmGammaCache *cache)
+{
+        g_return_val_if_fail (GCM_IS_GAMMA_CACHE (cache), 0);
+        return cache->priv->hits;
+}
+
+guint
+gcm_gamma_cache_get_misses (GcmGammaCache *cache)
+{
+        g_return_val_if_fail (GCM_IS_GAMMA_CACHE (cache), 0);
+        return cache->priv->misses;
+}
+
+static void
+gcm_gamma_cache_class_init (GcmGammaCacheClass *klass)
+{
+        GObjectClass *object_class = G_OBJECT_CLASS (klass);
+        object_class->finalize = gcm_gamma_cache_finalize;
+        g_type_class_add_private (klass, sizeof (GcmGammaCachePrivate));
+}
+
+static void
+gcm_gamma_cache_init (GcmGammaCache *cache)
+{
+        cache->priv = GCM_GAMMA_CACHE_GET_PRIVATE (cache);
+        cache->priv->ramps = g_hash_table_new_full (g_str_hash,
+                                                    g_str_equal,
+                                                    g_free,
+                                                    (GDestroyNotify) gcm_gamma_ramp_free);
+        cache->priv->lru = g_queue_new ();
+        cache->priv->checksums = g_hash_table_new_full (g_str_hash,
+                                                        g_str_equal,
+                                                        g_free,
+                                                        (GDestroyNotify) gcm_gamma_checksum_free);
+}
+
+static void
+gcm_gamma_cache_finalize (GObject *object)
+{
+        GcmGammaCache *cache = GCM_GAMMA_CACHE (object);
+
+        g_queue_free (cache->priv->lru);
+        g_hash_table_destroy (cache->priv->ramps);
+        g_hash_table_destroy (cache->priv->checksums);
+
+        G_OBJECT_CLASS (gcm_gamma_cache_parent_class)->finalize (object);
+}
+
+GcmGammaCache *
+gcm_gamma_cache_new (void)
+{
+        GcmGammaCache *cache;
+        cache = g_object_new (GCM_TYPE_GAMMA_CACHE, NULL);
+        return GCM_GAMMA_CACHE (cache);
+}
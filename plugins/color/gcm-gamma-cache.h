@@ -0,0 +1,74 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __GCM_GAMMA_CACHE_H
+#define __GCM_GAMMA_CACHE_H
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define GCM_TYPE_GAMMA_CACHE            (gcm_gamma_cache_get_type ())
+#define GCM_GAMMA_CACHE(o)              (G_TYPE_CHECK_INSTANCE_CAST ((o), GCM_TYPE_GAMMA_CACHE, GcmGammaCache))
+#define GCM_GAMMA_CACHE_CLASS(k)        (G_TYPE_CHECK_CLASS_CAST((k), GCM_TYPE_GAMMA_CACHE, GcmGammaCacheClass))
+#define GCM_IS_GAMMA_CACHE(o)           (G_TYPE_CHECK_INSTANCE_TYPE ((o), GCM_TYPE_GAMMA_CACHE))
+#define GCM_IS_GAMMA_CACHE_CLASS(k)     (G_TYPE_CHECK_CLASS_TYPE ((k), GCM_TYPE_GAMMA_CACHE))
+#define GCM_GAMMA_CACHE_GET_CLASS(o)    (G_TYPE_INSTANCE_GET_CLASS ((o), GCM_TYPE_GAMMA_CACHE, GcmGammaCacheClass))
+
+typedef struct _GcmGammaCachePrivate    GcmGammaCachePrivate;
+typedef struct _GcmGammaCache           GcmGammaCache;
+typedef struct _GcmGammaCacheClass      GcmGammaCacheClass;
+
+struct _GcmGammaCache
+{
+         GObject                 parent;
+         GcmGammaCachePrivate   *priv;
+};
+
+struct _GcmGammaCacheClass
+{
+        GObjectClass    parent_class;
+};
+
+/* A gamma ramp, ready to be uploaded with gsd_rr_crtc_set_gamma() */
+typedef struct {
+        guint            size;
+        guint16         *red;
+        guint16         *green;
+        guint16         *blue;
+} GcmGammaRamp;
+
+#define GCM_GAMMA_CACHE_ERROR           (gcm_gamma_cache_error_quark ())
+
+GType                    gcm_gamma_cache_get_type       (void);
+GQuark                   gcm_gamma_cache_error_quark    (void);
+GcmGammaCache           *gcm_gamma_cache_new            (void);
+const GcmGammaRamp      *gcm_gamma_cache_get_for_profile (GcmGammaCache  *cache,
+                                                         const gchar    *filename,
+                                                         const gchar    *checksum,
+                                                         guint           size,
+                                                         GError        **error);
+const GcmGammaRamp      *gcm_gamma_cache_get_linear     (GcmGammaCache  *cache,
+                                                         guint           size);
+guint                    gcm_gamma_cache_get_hits       (GcmGammaCache  *cache);
+guint                    gcm_gamma_cache_get_misses     (GcmGammaCache  *cache);
+
+G_END_DECLS
+
+#endif /* __GCM_GAMMA_CACHE_H */
@@ -23,10 +23,16 @@
 
 #include <glib-object.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <utime.h>
 #include <gtk/gtk.h>
+#include <glib/gstdio.h>
+#include <lcms2.h>
 
 #include "gcm-edid.h"
 #include "gcm-dmi.h"
+#include "gcm-gamma-cache.h"
 
 static void
 gcm_test_dmi_func (void)
@@ -97,6 +103,124 @@ gcm_test_edid_func (void)
         g_object_unref (edid);
 }
 
+static void
+gcm_test_gamma_cache_func (void)
+{
+        GcmGammaCache *cache;
+        const GcmGammaRamp *ramp;
+        const GcmGammaRamp *ramp2;
+        cmsHPROFILE lcms_profile;
+        cmsToneCurve *curves[3];
+        const cmsToneCurve **vcgt;
+        cmsFloat32Number in;
+        GError *error = NULL;
+        gchar *filename;
+        struct utimbuf times;
+        guint32 value;
+        guint16 red;
+        guint hits;
+        guint misses;
+        guint size = 256;
+        gint fd;
+        guint i;
+
+        /* write a profile with a non-linear VCGT */
+        fd = g_file_open_tmp ("gcm-self-test-XXXXXX.icc", &filename, &error);
+        g_assert_no_error (error);
+        close (fd);
+        lcms_profile = cmsCreate_sRGBProfile ();
+        curves[0] = cmsBuildGamma (NULL, 1.8);
+        curves[1] = cmsBuildGamma (NULL, 2.2);
+        curves[2] = cmsBuildGamma (NULL, 2.4);
+        g_assert (cmsWriteTag (lcms_profile, cmsSigVcgtTag, curves));
+        g_assert (cmsSaveProfileToFile (lcms_profile, filename));
+        cmsCloseProfile (lcms_profile);
+
+        cache = gcm_gamma_cache_new ();
+
+        /* first lookup generates the ramp */
+        ramp = gcm_gamma_cache_get_for_profile (cache, filename, NULL, size, &error);
+        g_assert_no_error (error);
+        g_assert (ramp != NULL);
+        g_assert_cmpint (ramp->size, ==, size);
+        g_assert_cmpint (gcm_gamma_cache_get_hits (cache), ==, 0);
+        g_assert_cmpint (gcm_gamma_cache_get_misses (cache), ==, 1);
+
+        /* same as sampling the stored curves directly */
+        lcms_profile = cmsOpenProfileFromFile (filename, "r");
+        g_assert (lcms_profile != NULL);
+        vcgt = cmsReadTag (lcms_profile, cmsSigVcgtTag);
+        g_assert (vcgt != NULL);
+        for (i = 0; i < size; i++) {
+                in = (gdouble) i / (gdouble) (size - 1);
+                value = cmsEvalToneCurveFloat (vcgt[0], in) * (gdouble) 0xffff;
+                g_assert_cmpint (ramp->red[i], ==, (guint16) value);
+                value = cmsEvalToneCurveFloat (vcgt[1], in) * (gdouble) 0xffff;
+                g_assert_cmpint (ramp->green[i], ==, (guint16) value);
+                value = cmsEvalToneCurveFloat (vcgt[2], in) * (gdouble) 0xffff;
+                g_assert_cmpint (ramp->blue[i], ==, (guint16) value);
+        }
+        cmsCloseProfile (lcms_profile);
+
+        /* second lookup is a hit */
+        ramp2 = gcm_gamma_cache_get_for_profile (cache, filename, NULL, size, &error);
+        g_assert_no_error (error);
+        g_assert (ramp2 == ramp);
+        g_assert_cmpint (gcm_gamma_cache_get_hits (cache), ==, 1);
+
+        /* a different gamma size is not */
+        ramp2 = gcm_gamma_cache_get_for_profile (cache, filename, NULL, 1024, &error);
+        g_assert_no_error (error);
+        g_assert (ramp2 != ramp);
+        g_assert_cmpint (ramp2->size, ==, 1024);
+        g_assert_cmpint (gcm_gamma_cache_get_misses (cache), ==, 2);
+
+        /* linear ramp */
+        ramp = gcm_gamma_cache_get_linear (cache, size);
+        g_assert_cmpint (ramp->red[0], ==, 0);
+        g_assert_cmpint (ramp->red[size - 1], ==, 0xffff);
+        g_assert_cmpint (ramp->blue[size / 2], ==, ((size / 2) * 0xffff) / (size - 1));
+        g_assert (gcm_gamma_cache_get_linear (cache, size) == ramp);
+
+        /* the cache only keeps the most recently used ramps */
+        for (i = 2; i < 34; i++)
+                g_assert (gcm_gamma_cache_get_linear (cache, i) != NULL);
+        misses = gcm_gamma_cache_get_misses (cache);
+        ramp = gcm_gamma_cache_get_for_profile (cache, filename, NULL, size, &error);
+        g_assert_no_error (error);
+        g_assert_cmpint (gcm_gamma_cache_get_misses (cache), ==, misses + 1);
+        red = ramp->red[size / 2];
+
+        /* a changed profile is checksummed again */
+        for (i = 0; i < 3; i++)
+                cmsFreeToneCurve (curves[i]);
+        lcms_profile = cmsCreate_sRGBProfile ();
+        curves[0] = cmsBuildGamma (NULL, 1.0);
+        curves[1] = cmsBuildGamma (NULL, 1.0);
+        curves[2] = cmsBuildGamma (NULL, 1.0);
+        g_assert (cmsWriteTag (lcms_profile, cmsSigVcgtTag, curves));
+        g_assert (cmsSaveProfileToFile (lcms_profile, filename));
+        cmsCloseProfile (lcms_profile);
+        times.actime = times.modtime = time (NULL) + 10;
+        g_assert_cmpint (g_utime (filename, &times), ==, 0);
+        ramp = gcm_gamma_cache_get_for_profile (cache, filename, NULL, size, &error);
+        g_assert_no_error (error);
+        g_assert_cmpint (gcm_gamma_cache_get_misses (cache), ==, misses + 2);
+        g_assert_cmpint (ramp->red[size / 2], !=, red);
+
+        /* and an unchanged one isn't */
+        hits = gcm_gamma_cache_get_hits (cache);
+        g_assert (gcm_gamma_cache_get_for_profile (cache, filename, NULL, size, &error) == ramp);
+        g_assert_no_error (error);
+        g_assert_cmpint (gcm_gamma_cache_get_hits (cache), ==, hits + 1);
+
+        for (i = 0; i < 3; i++)
+                cmsFreeToneCurve (curves[i]);
+        g_object_unref (cache);
+        g_unlink (filename);
+        g_free (filename);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -105,6 +229,7 @@ main (int argc, char **argv)
 
         g_test_add_func ("/color/dmi", gcm_test_dmi_func);
         g_test_add_func ("/color/edid", gcm_test_edid_func);
+        g_test_add_func ("/color/gamma-cache", gcm_test_gamma_cache_func);
 
         return g_test_run ();
 }
@@ -36,6 +36,7 @@
 #include "gcm-profile-store.h"
 #include "gcm-dmi.h"
 #include "gcm-edid.h"
+#include "gcm-gamma-cache.h"
 #include "gsd-rr.h"
 
 #define GSD_COLOR_MANAGER_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), GSD_TYPE_COLOR_MANAGER, GsdColorManagerPrivate))
@@ -56,6 +57,7 @@ struct GsdColorManagerPrivate
         GdkWindow       *gdk_window;
         gboolean         session_is_active;
         GHashTable      *device_assign_hash;
+        GcmGammaCache   *gamma_cache;
 };
 
 enum {
@@ -74,12 +76,6 @@ static gpointer manager_object = NULL;
 #define GCM_ICC_PROFILE_IN_X_VERSION_MAJOR      0
 #define GCM_ICC_PROFILE_IN_X_VERSION_MINOR      3
 
-typedef struct {
-        guint32          red;
-        guint32          green;
-        guint32          blue;
-} GsdRROutputClutItem;
-
 GQuark
 gsd_color_manager_error_quark (void)
 {
@@ -551,192 +547,108 @@ out:
         return ret;
 }
 
-static GPtrArray *
-gcm_session_generate_vcgt (CdProfile *profile, guint size)
-{
-        GsdRROutputClutItem *tmp;
-        GPtrArray *array = NULL;
-        const cmsToneCurve **vcgt;
-        cmsFloat32Number in;
-        guint i;
-        const gchar *filename;
-        cmsHPROFILE lcms_profile = NULL;
-
-        /* invalid size */
-        if (size == 0)
-                goto out;
-
-        /* not an actual profile */
-        filename = cd_profile_get_filename (profile);
-        if (filename == NULL)
-                goto out;
-
-        /* open file */
-        lcms_profile = cmsOpenProfileFromFile (filename, "r");
-        if (lcms_profile == NULL)
-                goto out;
-
-        /* get tone curves from profile */
-        vcgt = cmsReadTag (lcms_profile, cmsSigVcgtTag);
-        if (vcgt == NULL || vcgt[0] == NULL) {
-                g_debug ("profile does not have any VCGT data");
-                goto out;
-        }
-
-        /* create array */
-        array = g_ptr_array_new_with_free_func (g_free);
-        for (i = 0; i < size; i++) {
-                in = (gdouble) i / (gdouble) (size - 1);
-                tmp = g_new0 (GsdRROutputClutItem, 1);
-                tmp->red = cmsEvalToneCurveFloat(vcgt[0], in) * (gdouble) 0xffff;
-                tmp->green = cmsEvalToneCurveFloat(vcgt[1], in) * (gdouble) 0xffff;
-                tmp->blue = cmsEvalToneCurveFloat(vcgt[2], in) * (gdouble) 0xffff;
-                g_ptr_array_add (array, tmp);
-        }
-out:
-        if (lcms_profile != NULL)
-                cmsCloseProfile (lcms_profile);
-        return array;
-}
-
 static guint
 gsd_rr_output_get_gamma_size (GsdRROutput *output)
 {
         GsdRRCrtc *crtc;
-        gint len = 0;
 
         crtc = gsd_rr_output_get_crtc (output);
         if (crtc == NULL)
                 return 0;
-        gsd_rr_crtc_get_gamma (crtc,
-                                 &len,
-                                 NULL, NULL, NULL);
-        return (guint) len;
+        return (guint) gsd_rr_crtc_get_gamma_size (crtc);
 }
 
 static gboolean
 gcm_session_output_set_gamma (GsdRROutput *output,
-                              GPtrArray *array,
+                              const GcmGammaRamp *ramp,
                               GError **error)
 {
-        gboolean ret = TRUE;
-        guint16 *red = NULL;
-        guint16 *green = NULL;
-        guint16 *blue = NULL;
-        guint i;
-        GsdRROutputClutItem *data;
         GsdRRCrtc *crtc;
 
-        /* no length? */
-        if (array->len == 0) {
-                ret = FALSE;
-                g_set_error_literal (error,
-                                     GSD_COLOR_MANAGER_ERROR,
-                                     GSD_COLOR_MANAGER_ERROR_FAILED,
-                                     "no data in the CLUT array");
-                goto out;
-        }
-
-        /* convert to a type X understands */
-        red = g_new (guint16, array->len);
-        green = g_new (guint16, array->len);
-        blue = g_new (guint16, array->len);
-        for (i = 0; i < array->len; i++) {
-                data = g_ptr_array_index (array, i);
-                red[i] = data->red;
-                green[i] = data->green;
-                blue[i] = data->blue;
-        }
-
         /* send to LUT */
         crtc = gsd_rr_output_get_crtc (output);
         if (crtc == NULL) {
-                ret = FALSE;
                 g_set_error (error,
                              GSD_COLOR_MANAGER_ERROR,
                              GSD_COLOR_MANAGER_ERROR_FAILED,
                              "failed to get ctrc for %s",
                              gsd_rr_output_get_name (output));
-                goto out;
+                return FALSE;
         }
-        gsd_rr_crtc_set_gamma (crtc, array->len,
-                                 red, green, blue);
-out:
-        g_free (red);
-        g_free (green);
-        g_free (blue);
-        return ret;
+        gsd_rr_crtc_set_gamma (crtc, ramp->size,
+                                 ramp->red, ramp->green, ramp->blue);
+        return TRUE;
 }
 
 static gboolean
-gcm_session_device_set_gamma (GsdRROutput *output,
+gcm_session_device_set_gamma (GsdColorManager *manager,
+                              GsdRROutput *output,
                               CdProfile *profile,
                               GError **error)
 {
-        gboolean ret = FALSE;
+        const GcmGammaRamp *ramp;
+        const gchar *filename;
         guint size;
-        GPtrArray *clut = NULL;
+        GError *error_local = NULL;
 
         /* create a lookup table */
         size = gsd_rr_output_get_gamma_size (output);
-        if (size == 0) {
-                ret = TRUE;
-                goto out;
-        }
-        clut = gcm_session_generate_vcgt (profile, size);
-        if (clut == NULL) {
+        if (size < 2)
+                return TRUE;
+
+        /* not an actual profile */
+        filename = cd_profile_get_filename (profile);
+        if (filename == NULL) {
                 g_set_error_literal (error,
                                      GSD_COLOR_MANAGER_ERROR,
                                      GSD_COLOR_MANAGER_ERROR_FAILED,
-                                     "failed to generate vcgt");
-                goto out;
+                                     "failed to generate vcgt: no profile filename");
+                return FALSE;
         }
 
+        /* the ramp only needs regenerating when the profile contents
+         * or the gamma size change */
+        ramp = gcm_gamma_cache_get_for_profile (manager->priv->gamma_cache,
+                                                filename,
+                                                cd_profile_get_metadata_item (profile,
+                                                                              CD_PROFILE_METADATA_FILE_CHECKSUM),
+                                                size,
+                                                &error_local);
+        if (ramp == NULL) {
+                g_set_error (error,
+                             GSD_COLOR_MANAGER_ERROR,
+                             GSD_COLOR_MANAGER_ERROR_FAILED,
+                             "failed to generate vcgt: %s",
+                             error_local->message);
+                g_error_free (error_local);
+                return FALSE;
+        }
+
+        g_debug ("gamma cache: %u hits, %u misses",
+                 gcm_gamma_cache_get_hits (manager->priv->gamma_cache),
+                 gcm_gamma_cache_get_misses (manager->priv->gamma_cache));
+
         /* apply the vcgt to this output */
-        ret = gcm_session_output_set_gamma (output, clut, error);
-        if (!ret)
-                goto out;
-out:
-        if (clut != NULL)
-                g_ptr_array_unref (clut);
-        return ret;
+        return gcm_session_output_set_gamma (output, ramp, error);
 }
 
 static gboolean
-gcm_session_device_reset_gamma (GsdRROutput *output,
+gcm_session_device_reset_gamma (GsdColorManager *manager,
+                                GsdRROutput *output,
                                 GError **error)
 {
-        gboolean ret;
-        guint i;
+        const GcmGammaRamp *ramp;
         guint size;
-        guint32 value;
-        GPtrArray *clut;
-        GsdRROutputClutItem *data;
 
         /* create a linear ramp */
         g_debug ("falling back to dummy ramp");
-        clut = g_ptr_array_new_with_free_func (g_free);
         size = gsd_rr_output_get_gamma_size (output);
-        if (size == 0) {
-                ret = TRUE;
-                goto out;
-        }
-        for (i = 0; i < size; i++) {
-                value = (i * 0xffff) / (size - 1);
-                data = g_new0 (GsdRROutputClutItem, 1);
-                data->red = value;
-                data->green = value;
-                data->blue = value;
-                g_ptr_array_add (clut, data);
-        }
+        if (size < 2)
+                return TRUE;
+        ramp = gcm_gamma_cache_get_linear (manager->priv->gamma_cache, size);
 
         /* apply the vcgt to this output */
-        ret = gcm_session_output_set_gamma (output, clut, error);
-        if (!ret)
-                goto out;
-out:
-        g_ptr_array_unref (clut);
-        return ret;
+        return gcm_session_output_set_gamma (output, ramp, error);
 }
 
 static GsdRROutput *
@@ -937,7 +849,8 @@ gcm_session_device_assign_profile_connect_cb (GObject *object,
         /* create a vcgt for this icc file */
         ret = cd_profile_get_has_vcgt (profile);
         if (ret) {
-                ret = gcm_session_device_set_gamma (output,
+                ret = gcm_session_device_set_gamma (manager,
+                                                    output,
                                                     profile,
                                                     &error);
                 if (!ret) {
@@ -948,7 +861,8 @@ gcm_session_device_assign_profile_connect_cb (GObject *object,
                         goto out;
                 }
         } else {
-                ret = gcm_session_device_reset_gamma (output,
+                ret = gcm_session_device_reset_gamma (manager,
+                                                      output,
                                                       &error);
                 if (!ret) {
                         g_warning ("failed to reset %s gamma tables: %s",
@@ -1111,7 +1025,8 @@ gcm_session_device_assign_connect_cb (GObject *object,
                 }
 
                 /* reset, as we want linear profiles for profiling */
-                ret = gcm_session_device_reset_gamma (output,
+                ret = gcm_session_device_reset_gamma (manager,
+                                                      output,
                                                       &error);
                 if (!ret) {
                         g_warning ("failed to reset %s gamma tables: %s",
@@ -2161,6 +2076,9 @@ gsd_color_manager_init (GsdColorManager *manager)
                                                           g_free,
                                                           NULL);
 
+        /* reading the VCGT and sampling it is expensive */
+        priv->gamma_cache = gcm_gamma_cache_new ();
+
         /* use DMI data for internal panels */
         priv->dmi = gcm_dmi_new ();
 
@@ -2203,6 +2121,7 @@ gsd_color_manager_finalize (GObject *object)
         g_clear_object (&manager->priv->profile_store);
         g_clear_object (&manager->priv->dmi);
         g_clear_object (&manager->priv->session);
+        g_clear_object (&manager->priv->gamma_cache);
         g_clear_pointer (&manager->priv->edid_cache, g_hash_table_destroy);
         g_clear_pointer (&manager->priv->device_assign_hash, g_hash_table_destroy);
         g_clear_object (&manager->priv->x11_screen);
@@ -30,6 +30,7 @@
 #include <X11/extensions/XInput2.h>
 
 #include "gsd-input-helper.h"
+#include "gnome-settings-input-registry.h"
 
 #define INPUT_DEVICES_SCHEMA "org.gnome.settings-daemon.peripherals.input-devices"
 #define KEY_HOTPLUG_COMMAND  "hotplug-command"
@@ -42,6 +43,30 @@
 typedef gboolean (* InfoIdentifyFunc) (XDeviceInfo *device_info);
 typedef gboolean (* DeviceIdentifyFunc) (XDevice *xdevice);
 
+static gboolean
+device_check (const char         *check_name,
+              DeviceIdentifyFunc  device_func,
+              int                 deviceid)
+{
+        XDevice *device;
+        gboolean retval;
+
+        if (gnome_settings_input_registry_get_check (check_name, deviceid, &retval))
+                return retval;
+
+        gdk_error_trap_push ();
+        device = XOpenDevice (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), deviceid);
+        if (gdk_error_trap_pop () || (device == NULL))
+                return FALSE;
+
+        retval = (device_func) (device);
+        xdevice_close (device);
+
+        gnome_settings_input_registry_set_check (check_name, deviceid, retval);
+
+        return retval;
+}
+
 gboolean
 device_set_property (XDevice        *xdevice,
                      const char     *device_name,
@@ -54,8 +79,7 @@ device_set_property (XDevice        *xdevice,
         unsigned long nitems, bytes_after;
         unsigned char *data;
 
-        prop = XInternAtom (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()),
-                            property->name, False);
+        prop = gdk_x11_get_xatom_by_name (property->name);
         if (!prop)
                 return FALSE;
 
@@ -174,7 +198,7 @@ device_is_touchpad (XDevice *xdevice)
         /* we don't check on the type being XI_TOUCHPAD here,
          * but having a "Synaptics Off" property should be enough */
 
-        prop = XInternAtom (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), "Synaptics Off", False);
+        prop = gdk_x11_get_xatom_by_name ("Synaptics Off");
         if (!prop)
                 return FALSE;
 
@@ -194,26 +218,26 @@ device_is_touchpad (XDevice *xdevice)
 gboolean
 device_info_is_touchpad (XDeviceInfo *device_info)
 {
-        return (device_info->type == XInternAtom (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), XI_TOUCHPAD, False));
+        return (device_info->type == gdk_x11_get_xatom_by_name (XI_TOUCHPAD));
 }
 
 gboolean
 device_info_is_touchscreen (XDeviceInfo *device_info)
 {
-        return (device_info->type == XInternAtom (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), XI_TOUCHSCREEN, False));
+        return (device_info->type == gdk_x11_get_xatom_by_name (XI_TOUCHSCREEN));
 }
 
 gboolean
 device_info_is_tablet (XDeviceInfo *device_info)
 {
         /* Note that this doesn't match Wacom tablets */
-        return (device_info->type == XInternAtom (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), XI_TABLET, False));
+        return (device_info->type == gdk_x11_get_xatom_by_name (XI_TABLET));
 }
 
 gboolean
 device_info_is_mouse (XDeviceInfo *device_info)
 {
-        return (device_info->type == XInternAtom (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), XI_MOUSE, False));
+        return (device_info->type == gdk_x11_get_xatom_by_name (XI_MOUSE));
 }
 
 gboolean
@@ -221,7 +245,7 @@ device_info_is_trackball (XDeviceInfo *device_info)
 {
         gboolean retval;
 
-        retval = (device_info->type == XInternAtom (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), XI_TRACKBALL, False));
+        retval = (device_info->type == gdk_x11_get_xatom_by_name (XI_TRACKBALL));
         if (retval == FALSE &&
             device_info->name != NULL) {
                 char *lowercase;
@@ -234,8 +258,11 @@ device_info_is_trackball (XDeviceInfo *device_info)
         return retval;
 }
 
+/* Results of @device_func are shared with the other plugins under
+ * @check_name */
 static gboolean
 device_type_is_present (InfoIdentifyFunc info_func,
+                        const char *check_name,
                         DeviceIdentifyFunc device_func)
 {
         XDeviceInfo *device_info;
@@ -243,18 +270,16 @@ device_type_is_present (InfoIdentifyFunc info_func,
         guint i;
         gboolean retval;
 
-        if (supports_xinput_devices () == FALSE)
+        if (gnome_settings_input_registry_has_xinput () == FALSE)
                 return TRUE;
 
         retval = FALSE;
 
-        device_info = XListInputDevices (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), &n_devices);
+        device_info = gnome_settings_input_registry_list_devices (&n_devices);
         if (device_info == NULL)
                 return FALSE;
 
         for (i = 0; i < n_devices; i++) {
-                XDevice *device;
-
                 /* Check with the device info first */
                 retval = (info_func) (&device_info[i]);
                 if (retval == FALSE)
@@ -264,17 +289,10 @@ device_type_is_present (InfoIdentifyFunc info_func,
                 if (device_func == NULL)
                         break;
 
-                gdk_error_trap_push ();
-                device = XOpenDevice (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), device_info[i].id);
-                if (gdk_error_trap_pop () || (device == NULL))
-                        continue;
-
-                retval = (device_func) (device);
-                xdevice_close (device);
+                retval = device_check (check_name, device_func, device_info[i].id);
                 if (retval)
                         break;
         }
-        XFreeDeviceList (device_info);
 
         return retval;
 }
@@ -283,28 +301,28 @@ gboolean
 touchscreen_is_present (void)
 {
         return device_type_is_present (device_info_is_touchscreen,
-                                       NULL);
+                                       NULL, NULL);
 }
 
 gboolean
 touchpad_is_present (void)
 {
         return device_type_is_present (device_info_is_touchpad,
-                                       device_is_touchpad);
+                                       "touchpad", device_is_touchpad);
 }
 
 gboolean
 mouse_is_present (void)
 {
         return device_type_is_present (device_info_is_mouse,
-                                       NULL);
+                                       NULL, NULL);
 }
 
 gboolean
 trackball_is_present (void)
 {
         return device_type_is_present (device_info_is_trackball,
-                                       NULL);
+                                       NULL, NULL);
 }
 
 char *
@@ -317,9 +335,13 @@ xdevice_get_device_node (int deviceid)
         unsigned char *data;
         char          *ret;
 
+        ret = gnome_settings_input_registry_get_device_node (deviceid);
+        if (ret != NULL)
+                return ret;
+
         gdk_display_sync (gdk_display_get_default ());
 
-        prop = XInternAtom (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), "Device Node", False);
+        prop = gdk_x11_get_xatom_by_name ("Device Node");
         if (!prop)
                 return NULL;
 
@@ -347,6 +369,10 @@ xdevice_get_device_node (int deviceid)
 
         ret = g_strdup ((char *) data);
 
+        /* The node might not be set yet on a device that was just
+         * added, so only remember the ones we found */
+        gnome_settings_input_registry_set_device_node (deviceid, ret);
+
         XFree (data);
         return ret;
 
@@ -390,7 +416,7 @@ xdevice_get_last_tool_id (int  deviceid)
 
         gdk_display_sync (gdk_display_get_default ());
 
-        prop = XInternAtom (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), WACOM_SERIAL_IDS_PROP, False);
+        prop = gdk_x11_get_xatom_by_name (WACOM_SERIAL_IDS_PROP);
         if (!prop)
                 return -1;
 
@@ -449,7 +475,7 @@ set_device_enabled (int device_id,
         Atom prop;
         guchar value;
 
-        prop = XInternAtom (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), "Device Enabled", False);
+        prop = gdk_x11_get_xatom_by_name ("Device Enabled");
         if (!prop)
                 return FALSE;
 
@@ -560,7 +586,7 @@ get_disabled_devices (GdkDeviceManager *manager)
 
         ret = NULL;
 
-        device_info = XListInputDevices (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), &n_devices);
+        device_info = gnome_settings_input_registry_list_devices (&n_devices);
         if (device_info == NULL)
                 return ret;
 
@@ -580,8 +606,6 @@ get_disabled_devices (GdkDeviceManager *manager)
                 ret = g_list_prepend (ret, GINT_TO_POINTER (device_info[i].id));
         }
 
-        XFreeDeviceList (device_info);
-
         return ret;
 }
 
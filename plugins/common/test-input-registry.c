@@ -0,0 +1,172 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Counts the X requests the input helpers make, with the device registry
+ * warm, and after a hierarchy change invalidated it, and checks that the
+ * registry they fill is the one libgsd shares between all the plugins.
+ * Needs an X server with XInput 2, such as Xvfb.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "gsd-input-helper.c"
+#include "gnome-settings-input-registry.c"
+
+#include <gtk/gtk.h>
+
+/* Each round asks what every plugin asks on startup or hotplug */
+#define N_ROUNDS 10
+
+static Display *xdisplay;
+
+static void
+query_round (void)
+{
+        touchpad_is_present ();
+        touchscreen_is_present ();
+        mouse_is_present ();
+        trackball_is_present ();
+}
+
+static gulong
+count_requests (void)
+{
+        gulong before;
+        int i;
+
+        before = NextRequest (xdisplay);
+        for (i = 0; i < N_ROUNDS; i++)
+                query_round ();
+
+        return NextRequest (xdisplay) - before;
+}
+
+static void
+send_hierarchy_event (int deviceid,
+                      int flags)
+{
+        InputRegistry *registry;
+        XIHierarchyInfo info;
+        XIHierarchyEvent ev;
+        XEvent xevent;
+
+        registry = input_registry_get ();
+
+        memset (&info, 0, sizeof (info));
+        info.deviceid = deviceid;
+        info.flags = flags;
+
+        memset (&ev, 0, sizeof (ev));
+        ev.type = GenericEvent;
+        ev.extension = registry->xi_opcode;
+        ev.evtype = XI_HierarchyChanged;
+        ev.flags = flags;
+        ev.num_info = 1;
+        ev.info = &info;
+
+        memset (&xevent, 0, sizeof (xevent));
+        xevent.xcookie.type = GenericEvent;
+        xevent.xcookie.extension = registry->xi_opcode;
+        xevent.xcookie.evtype = XI_HierarchyChanged;
+        xevent.xcookie.data = &ev;
+
+        input_registry_filter (&xevent, NULL, registry);
+}
+
+static void
+test_warm (void)
+{
+        gulong requests;
+
+        query_round ();
+
+        requests = count_requests ();
+        g_test_message ("%d rounds with a warm registry: %lu X requests", N_ROUNDS, requests);
+        g_assert_cmpuint (requests, ==, 0);
+}
+
+static void
+test_hotplug (void)
+{
+        gulong requests;
+
+        query_round ();
+
+        /* one listing for the whole burst of queries that follows */
+        send_hierarchy_event (1000, XISlaveAdded);
+        requests = count_requests ();
+        g_test_message ("%d rounds after a hotplug: %lu X requests", N_ROUNDS, requests);
+        g_assert_cmpuint (requests, >=, 1);
+        g_assert_cmpuint (requests, <=, 2);
+
+        /* a change that isn't an addition or removal still relists */
+        send_hierarchy_event (1000, XISlaveAttached);
+        g_assert_cmpuint (count_requests (), >=, 1);
+        g_assert_cmpuint (count_requests (), ==, 0);
+}
+
+static void
+test_shared (void)
+{
+        XDeviceInfo *devices;
+        gboolean result;
+        gulong before;
+        int n_devices;
+
+        query_round ();
+
+        /* every plugin's copy of the helpers looks in the same place */
+        g_assert (g_object_get_data (G_OBJECT (gdk_display_get_default ()), INPUT_REGISTRY_KEY) == input_registry_get ());
+
+        /* so another plugin gets the listing the helpers just made */
+        before = NextRequest (xdisplay);
+        devices = gnome_settings_input_registry_list_devices (&n_devices);
+        g_assert_cmpuint (NextRequest (xdisplay) - before, ==, 0);
+        g_assert (devices != NULL);
+        g_assert_cmpint (n_devices, >, 0);
+
+        /* and the device checks it made, by name rather than by
+         * function, which differ between copies */
+        g_assert (!gnome_settings_input_registry_get_check ("touchpad", devices[0].id, &result));
+        gnome_settings_input_registry_set_check ("touchpad", devices[0].id, TRUE);
+        g_assert (gnome_settings_input_registry_get_check ("touchpad", devices[0].id, &result));
+        g_assert (result);
+        g_assert (device_check ("touchpad", device_is_touchpad, devices[0].id));
+
+        /* until the device goes away */
+        send_hierarchy_event (devices[0].id, XISlaveRemoved);
+        g_assert (!gnome_settings_input_registry_get_check ("touchpad", devices[0].id, &result));
+}
+
+int
+main (int argc, char **argv)
+{
+        int opcode;
+
+        gtk_init (&argc, &argv);
+        g_test_init (&argc, &argv, NULL);
+
+        xdisplay = GDK_DISPLAY_XDISPLAY (gdk_display_get_default ());
+
+        if (!supports_xinput2_devices (&opcode)) {
+                g_print ("No XInput 2 on this X server, skipping\n");
+                return 77;
+        }
+
+        g_test_add_func ("/input-registry/warm", test_warm);
+        g_test_add_func ("/input-registry/hotplug", test_hotplug);
+        g_test_add_func ("/input-registry/shared", test_shared);
+
+        return g_test_run ();
+}
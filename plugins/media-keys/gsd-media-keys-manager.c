@@ -2543,8 +2543,12 @@ do_action (GsdMediaKeysManager *manager,
            MediaKeyType         type,
            gint64               timestamp)
 {
+        gint64 span;
+
         g_debug ("Launching action for key type '%d' (on device id %d)", type, deviceid);
 
+        span = gnome_settings_profile_span_begin ();
+
         switch (type) {
         case TOUCHPAD_KEY:
                 do_touchpad_action (manager);
@@ -2702,6 +2706,8 @@ do_action (GsdMediaKeysManager *manager,
                 g_assert_not_reached ();
         }
 
+        gnome_settings_profile_span_end ("media-keys", "key-action", span);
+
         return FALSE;
 }
 
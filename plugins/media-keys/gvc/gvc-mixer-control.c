@@ -50,6 +50,12 @@
 
 #define RECONNECT_DELAY 5
 
+/* Subscription events for the same object arriving within this
+ * window only cause a single info request */
+#define UPDATE_WINDOW_MS 50
+
+#define PENDING_UPDATE_KEY(facility, index) ((((gint64) (facility)) << 32) | (guint32) (index))
+
 enum {
         PROP_0,
         PROP_NAME
@@ -88,6 +94,12 @@ struct GvcMixerControlPrivate
         GHashTable       *ui_outputs; /* UI visible outputs */
         GHashTable       *ui_inputs;  /* UI visible inputs */
 
+        /* Secondary indexes, so that matching streams with devices
+         * doesn't need to walk the tables above */
+        GHashTable       *ui_outputs_by_port; /* key = ui_device_index_key () */
+        GHashTable       *ui_inputs_by_port;  /* key = ui_device_index_key () */
+        GHashTable       *streams_by_name;    /* sinks and sources, key = stream name */
+
         /* When we change profile on a device that is not the server default sink,
          * it will jump back to the default sink set by the server to prevent the
          * audio setup from being 'outputless'.
@@ -98,6 +110,13 @@ struct GvcMixerControlPrivate
         guint            profile_swapping_device_id;
 
         GvcMixerControlState state;
+
+        /* Coalesced subscription events, see queue_update () */
+        GQueue            pending_updates; /* PENDING_UPDATE_KEY (facility, index), in arrival order */
+        GHashTable       *pending_update_links; /* key -> link in pending_updates */
+        guint             pending_updates_id;
+        guint             n_events_received;
+        guint             n_requests_issued;
 };
 
 enum {
@@ -1055,34 +1074,40 @@ _set_default_sink (GvcMixerControl *control,
         }
 }
 
-static gboolean
-_stream_has_name (gpointer        key,
-                  GvcMixerStream *stream,
-                  const char     *name)
+static GvcMixerStream *
+find_stream_for_name (GvcMixerControl *control,
+                      const char      *name)
 {
-        const char *t_name;
+        if (name == NULL)
+                return NULL;
 
-        t_name = gvc_mixer_stream_get_name (stream);
+        return g_hash_table_lookup (control->priv->streams_by_name, name);
+}
 
-        if (t_name != NULL
-            && name != NULL
-            && strcmp (t_name, name) == 0) {
-                return TRUE;
-        }
+/* Only sinks and sources are looked up by name, see update_server () */
+static void
+set_stream_name (GvcMixerControl *control,
+                 GvcMixerStream  *stream,
+                 const char      *name)
+{
+        const char *old_name;
 
-        return FALSE;
+        old_name = gvc_mixer_stream_get_name (stream);
+        if (old_name != NULL &&
+            g_hash_table_lookup (control->priv->streams_by_name, old_name) == stream)
+                g_hash_table_remove (control->priv->streams_by_name, old_name);
+
+        gvc_mixer_stream_set_name (stream, name);
+
+        if (name != NULL)
+                g_hash_table_insert (control->priv->streams_by_name, g_strdup (name), stream);
 }
 
-static GvcMixerStream *
-find_stream_for_name (GvcMixerControl *control,
-                      const char      *name)
+static char *
+ui_device_index_key (guint       card_index,
+                     const char *port_name)
 {
-        GvcMixerStream *stream;
-
-        stream = g_hash_table_find (control->priv->all_streams,
-                                    (GHRFunc)_stream_has_name,
-                                    (char *)name);
-        return stream;
+        return g_strdup_printf ("%u:%s", card_index, port_name);
 }
 
 static void
@@ -1157,6 +1182,12 @@ remove_stream (GvcMixerControl *control,
 
         id = gvc_mixer_stream_get_id (stream);
 
+        if (gvc_mixer_stream_get_name (stream) != NULL &&
+            g_hash_table_lookup (control->priv->streams_by_name,
+                                 gvc_mixer_stream_get_name (stream)) == stream)
+                g_hash_table_remove (control->priv->streams_by_name,
+                                     gvc_mixer_stream_get_name (stream));
+
         if (id == control->priv->default_sink_id) {
                 _set_default_sink (control, NULL);
         } else if (id == control->priv->default_source_id) {
@@ -1187,7 +1218,7 @@ add_stream (GvcMixerControl *control,
 
 /* This method will match individual stream ports against its corresponding device
  * It does this by:
- * - iterates through our devices and finds the one where the card-id on the device is the same as the card-id on the stream
+ * - looking up the device where the card-id on the device is the same as the card-id on the stream
  *   and the port-name on the device is the same as the streamport-name.
  * This should always find a match and is used exclusively by sync_devices().
  */
@@ -1196,68 +1227,37 @@ match_stream_with_devices (GvcMixerControl    *control,
                            GvcMixerStreamPort *stream_port,
                            GvcMixerStream     *stream)
 {
-        GList                   *devices, *d;
+        GvcMixerUIDevice        *device;
         guint                    stream_card_id;
         guint                    stream_id;
-        gboolean                 in_possession = FALSE;
+        char                    *key;
 
         stream_id      =  gvc_mixer_stream_get_id (stream);
         stream_card_id =  gvc_mixer_stream_get_card_index (stream);
 
-        devices  = g_hash_table_get_values (GVC_IS_MIXER_SOURCE (stream) ? control->priv->ui_inputs : control->priv->ui_outputs);
+        key = ui_device_index_key (stream_card_id, stream_port->port);
+        device = g_hash_table_lookup (GVC_IS_MIXER_SOURCE (stream) ? control->priv->ui_inputs_by_port : control->priv->ui_outputs_by_port,
+                                      key);
+        g_free (key);
 
-        for (d = devices; d != NULL; d = d->next) {
-                GvcMixerUIDevice *device;
-                gint              device_stream_id;
-                gchar            *device_port_name;
-                gchar            *origin;
-                gchar            *description;
-                GvcMixerCard     *card;
-                gint              card_id;
-
-                device = d->data;
-                g_object_get (G_OBJECT (device),
-                             "stream-id", &device_stream_id,
-                             "card", &card,
-                             "origin", &origin,
-                             "description", &description,
-                             "port-name", &device_port_name,
-                              NULL);
-
-                card_id = gvc_mixer_card_get_index (card);
-
-                g_debug ("Attempt to match_stream update_with_existing_outputs - Try description : '%s', origin : '%s', device port name : '%s', card : %p, AGAINST stream port: '%s', sink card id %i",
-                         description,
-                         origin,
-                         device_port_name,
-                         card,
+        if (device == NULL) {
+                g_debug ("Attempt to match_stream update_with_existing_outputs - No device for stream port: '%s', sink card id %u",
                          stream_port->port,
                          stream_card_id);
+                return FALSE;
+        }
 
-                if (stream_card_id == card_id &&
-                    g_strcmp0 (device_port_name, stream_port->port) == 0) {
-                        g_debug ("Match device with stream: We have a match with description: '%s', origin: '%s', cached already with device id %u, so set stream id to %i",
-                                 description,
-                                 origin,
-                                 gvc_mixer_ui_device_get_id (device),
-                                 stream_id);
-
-                        g_object_set (G_OBJECT (device),
-                                      "stream-id", (gint)stream_id,
-                                      NULL);
-                        in_possession = TRUE;
-                }
-
-                g_free (device_port_name);
-                g_free (origin);
-                g_free (description);
+        g_debug ("Match device with stream: We have a match with description: '%s', origin: '%s', cached already with device id %u, so set stream id to %i",
+                 gvc_mixer_ui_device_get_description (device),
+                 gvc_mixer_ui_device_get_origin (device),
+                 gvc_mixer_ui_device_get_id (device),
+                 stream_id);
 
-                if (in_possession == TRUE)
-                        break;
-        }
+        g_object_set (G_OBJECT (device),
+                      "stream-id", (gint)stream_id,
+                      NULL);
 
-        g_list_free (devices);
-        return in_possession;
+        return TRUE;
 }
 
 /*
@@ -1491,7 +1491,7 @@ update_sink (GvcMixerControl    *control,
         }
 
         max_volume = pa_cvolume_max (&info->volume);
-        gvc_mixer_stream_set_name (stream, info->name);
+        set_stream_name (control, stream, info->name);
         gvc_mixer_stream_set_card_index (stream, info->card);
         gvc_mixer_stream_set_description (stream, info->description);
         set_icon_name_from_proplist (stream, info->proplist, "audio-card");
@@ -1618,7 +1618,7 @@ update_source (GvcMixerControl      *control,
 
         max_volume = pa_cvolume_max (&info->volume);
 
-        gvc_mixer_stream_set_name (stream, info->name);
+        set_stream_name (control, stream, info->name);
         gvc_mixer_stream_set_card_index (stream, info->card);
         gvc_mixer_stream_set_description (stream, info->description);
         set_icon_name_from_proplist (stream, info->proplist, "audio-input-microphone");
@@ -1901,6 +1901,7 @@ create_ui_device_from_port (GvcMixerControl* control,
         GvcMixerUIDeviceDirection  direction;
         GObject                   *object;
         GvcMixerUIDevice          *uidevice;
+        char                      *key;
         gboolean                   available = port->available != PA_PORT_AVAILABLE_NO;
 
         direction = (is_card_port_an_output (port) == TRUE) ? UIDeviceOutput : UIDeviceInput;
@@ -1920,6 +1921,13 @@ create_ui_device_from_port (GvcMixerControl* control,
         g_hash_table_insert (is_card_port_an_output (port) ? control->priv->ui_outputs : control->priv->ui_inputs,
                              GUINT_TO_POINTER (gvc_mixer_ui_device_get_id (uidevice)),
                              g_object_ref (uidevice));
+        /* sync_devices () may later clear the device's port, so keep the
+         * key it was indexed under to remove it with in remove_card () */
+        key = ui_device_index_key (gvc_mixer_card_get_index (card), port->port);
+        g_object_set_data_full (object, "gvc-index-key", g_strdup (key), g_free);
+        g_hash_table_insert (is_card_port_an_output (port) ? control->priv->ui_outputs_by_port : control->priv->ui_inputs_by_port,
+                             key,
+                             g_object_ref (uidevice));
 
 
         if (available) {
@@ -1948,40 +1956,28 @@ match_card_port_with_existing_device (GvcMixerControl   *control,
                                       GvcMixerCard      *card,
                                       gboolean           available)
 {
-        GList                   *d;
-        GList                   *devices;
         GvcMixerUIDevice        *device;
         gboolean                 is_output = is_card_port_an_output (card_port);
+        char                    *key;
 
-        devices  = g_hash_table_get_values (is_output ? control->priv->ui_outputs : control->priv->ui_inputs);
+        key = ui_device_index_key (gvc_mixer_card_get_index (card), card_port->port);
+        device = g_hash_table_lookup (is_output ? control->priv->ui_outputs_by_port : control->priv->ui_inputs_by_port,
+                                      key);
+        g_free (key);
 
-        for (d = devices; d != NULL; d = d->next) {
-                GvcMixerCard *device_card;
-                gchar        *device_port_name;
-
-                device = d->data;
-                g_object_get (G_OBJECT (device),
-                             "card", &device_card,
-                             "port-name", &device_port_name,
-                              NULL);
-
-                if (g_strcmp0 (card_port->port, device_port_name) == 0 &&
-                        device_card == card) {
-                        g_debug ("Found the relevant device %s, update its port availability flag to %i, is_output %i",
-                                 device_port_name,
-                                 available,
-                                 is_output);
-                        g_object_set (G_OBJECT (device),
-                                      "port-available", available, NULL);
-                        g_signal_emit (G_OBJECT (control),
-                                       is_output ? signals[available ? OUTPUT_ADDED : OUTPUT_REMOVED] : signals[available ? INPUT_ADDED : INPUT_REMOVED],
-                                       0,
-                                       gvc_mixer_ui_device_get_id (device));
-               }
-               g_free (device_port_name);
-        }
+        if (device == NULL)
+                return;
 
-        g_list_free (devices);
+        g_debug ("Found the relevant device %s, update its port availability flag to %i, is_output %i",
+                 card_port->port,
+                 available,
+                 is_output);
+        g_object_set (G_OBJECT (device),
+                      "port-available", available, NULL);
+        g_signal_emit (G_OBJECT (control),
+                       is_output ? signals[available ? OUTPUT_ADDED : OUTPUT_REMOVED] : signals[available ? INPUT_ADDED : INPUT_REMOVED],
+                       0,
+                       gvc_mixer_ui_device_get_id (device));
 }
 
 static void
@@ -2616,6 +2612,7 @@ remove_card (GvcMixerControl *control,
         for (d = devices; d != NULL; d = d->next) {
                 GvcMixerCard *card;
                 GvcMixerUIDevice *device = d->data;
+                const char *key;
 
                 g_object_get (G_OBJECT (device), "card", &card, NULL);
 
@@ -2626,6 +2623,10 @@ remove_card (GvcMixerControl *control,
                                        gvc_mixer_ui_device_get_id (device));
                         g_debug ("Card removal remove device %s",
                                  gvc_mixer_ui_device_get_description (device));
+                        key = g_object_get_data (G_OBJECT (device), "gvc-index-key");
+                        if (key != NULL)
+                                g_hash_table_remove (gvc_mixer_ui_device_is_output (device) ? control->priv->ui_outputs_by_port : control->priv->ui_inputs_by_port,
+                                                     key);
                         g_hash_table_remove (gvc_mixer_ui_device_is_output (device) ? control->priv->ui_outputs : control->priv->ui_inputs,
                                              GUINT_TO_POINTER (gvc_mixer_ui_device_get_id (device)));
                 }
@@ -2776,6 +2777,134 @@ remove_source_output (GvcMixerControl *control,
         remove_stream (control, stream);
 }
 
+static void
+dispatch_update (GvcMixerControl              *control,
+                 pa_subscription_event_type_t  facility,
+                 int                           index)
+{
+        switch (facility) {
+        case PA_SUBSCRIPTION_EVENT_SINK:
+                req_update_sink_info (control, index);
+                break;
+        case PA_SUBSCRIPTION_EVENT_SOURCE:
+                req_update_source_info (control, index);
+                break;
+        case PA_SUBSCRIPTION_EVENT_SINK_INPUT:
+                req_update_sink_input_info (control, index);
+                break;
+        case PA_SUBSCRIPTION_EVENT_SOURCE_OUTPUT:
+                req_update_source_output_info (control, index);
+                break;
+        case PA_SUBSCRIPTION_EVENT_CLIENT:
+                req_update_client_info (control, index);
+                break;
+        case PA_SUBSCRIPTION_EVENT_SERVER:
+                req_update_server_info (control, index);
+                break;
+        case PA_SUBSCRIPTION_EVENT_CARD:
+                req_update_card (control, index);
+                break;
+        default:
+                g_assert_not_reached ();
+        }
+
+        control->priv->n_requests_issued++;
+}
+
+static void
+clear_pending_updates (GvcMixerControl *control)
+{
+        if (control->priv->pending_updates_id != 0) {
+                g_source_remove (control->priv->pending_updates_id);
+                control->priv->pending_updates_id = 0;
+        }
+        if (control->priv->pending_update_links != NULL)
+                g_hash_table_remove_all (control->priv->pending_update_links);
+        g_queue_foreach (&control->priv->pending_updates, (GFunc) g_free, NULL);
+        g_queue_clear (&control->priv->pending_updates);
+}
+
+/* Runs at the end of each update window. Anything queued in the
+ * meantime is requested in the order it first arrived, and the window
+ * stays open until one passes without events. */
+static gboolean
+dispatch_pending_updates (gpointer data)
+{
+        GvcMixerControl *control = GVC_MIXER_CONTROL (data);
+        gint64 *key;
+
+        if (g_queue_is_empty (&control->priv->pending_updates) ||
+            control->priv->pa_context == NULL ||
+            pa_context_get_state (control->priv->pa_context) != PA_CONTEXT_READY) {
+                control->priv->pending_updates_id = 0;
+                clear_pending_updates (control);
+                return FALSE;
+        }
+
+        while ((key = g_queue_pop_head (&control->priv->pending_updates)) != NULL) {
+                dispatch_update (control,
+                                 (pa_subscription_event_type_t) (*key >> 32),
+                                 (int) (guint32) (*key & G_MAXUINT32));
+                g_hash_table_remove (control->priv->pending_update_links, key);
+                g_free (key);
+        }
+
+        g_debug ("%u subscription events received, %u info requests issued",
+                 control->priv->n_events_received,
+                 control->priv->n_requests_issued);
+
+        return TRUE;
+}
+
+static void
+queue_update (GvcMixerControl              *control,
+              pa_subscription_event_type_t  facility,
+              uint32_t                      index)
+{
+        gint64 *key;
+
+        /* The first event of a burst goes out straight away, only
+         * the ones following it within the window are held back */
+        if (control->priv->pending_updates_id == 0) {
+                dispatch_update (control, facility, index);
+                control->priv->pending_updates_id = g_timeout_add (UPDATE_WINDOW_MS,
+                                                                   dispatch_pending_updates,
+                                                                   control);
+                return;
+        }
+
+        key = g_new (gint64, 1);
+        *key = PENDING_UPDATE_KEY (facility, index);
+
+        /* Already queued, keep its place */
+        if (g_hash_table_contains (control->priv->pending_update_links, key)) {
+                g_free (key);
+                return;
+        }
+
+        g_queue_push_tail (&control->priv->pending_updates, key);
+        g_hash_table_insert (control->priv->pending_update_links, key,
+                             g_queue_peek_tail_link (&control->priv->pending_updates));
+}
+
+static void
+unqueue_update (GvcMixerControl              *control,
+                pa_subscription_event_type_t  facility,
+                uint32_t                      index)
+{
+        gint64 key;
+        GList *link;
+
+        key = PENDING_UPDATE_KEY (facility, index);
+        link = g_hash_table_lookup (control->priv->pending_update_links, &key);
+        if (link == NULL)
+                return;
+
+        g_hash_table_remove (control->priv->pending_update_links, &key);
+        g_free (link->data);
+        g_queue_delete_link (&control->priv->pending_updates, link);
+}
+
 static void
 _pa_context_subscribe_cb (pa_context                  *context,
                           pa_subscription_event_type_t t,
@@ -2783,58 +2912,60 @@ _pa_context_subscribe_cb (pa_context                  *context,
                           void                        *userdata)
 {
         GvcMixerControl *control = GVC_MIXER_CONTROL (userdata);
+        pa_subscription_event_type_t facility;
+
+        control->priv->n_events_received++;
+
+        facility = t & PA_SUBSCRIPTION_EVENT_FACILITY_MASK;
+
+        /* Removals are handled straight away, anything else is
+         * re-queried through queue_update () */
+        if ((t & PA_SUBSCRIPTION_EVENT_TYPE_MASK) != PA_SUBSCRIPTION_EVENT_REMOVE ||
+            facility == PA_SUBSCRIPTION_EVENT_SERVER) {
+                switch (facility) {
+                case PA_SUBSCRIPTION_EVENT_SINK:
+                case PA_SUBSCRIPTION_EVENT_SOURCE:
+                case PA_SUBSCRIPTION_EVENT_SINK_INPUT:
+                case PA_SUBSCRIPTION_EVENT_SOURCE_OUTPUT:
+                case PA_SUBSCRIPTION_EVENT_CLIENT:
+                case PA_SUBSCRIPTION_EVENT_SERVER:
+                case PA_SUBSCRIPTION_EVENT_CARD:
+                        queue_update (control, facility, index);
+                        break;
+                default:
+                        break;
+                }
+                return;
+        }
+
+        unqueue_update (control, facility, index);
 
-        switch (t & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) {
+        switch (facility) {
         case PA_SUBSCRIPTION_EVENT_SINK:
-                if ((t & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_REMOVE) {
-                        remove_sink (control, index);
-                } else {
-                        req_update_sink_info (control, index);
-                }
+                remove_sink (control, index);
                 break;
 
         case PA_SUBSCRIPTION_EVENT_SOURCE:
-                if ((t & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_REMOVE) {
-                        remove_source (control, index);
-                } else {
-                        req_update_source_info (control, index);
-                }
+                remove_source (control, index);
                 break;
 
         case PA_SUBSCRIPTION_EVENT_SINK_INPUT:
-                if ((t & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_REMOVE) {
-                        remove_sink_input (control, index);
-                } else {
-                        req_update_sink_input_info (control, index);
-                }
+                remove_sink_input (control, index);
                 break;
 
         case PA_SUBSCRIPTION_EVENT_SOURCE_OUTPUT:
-                if ((t & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_REMOVE) {
-                        remove_source_output (control, index);
-                } else {
-                        req_update_source_output_info (control, index);
-                }
+                remove_source_output (control, index);
                 break;
 
         case PA_SUBSCRIPTION_EVENT_CLIENT:
-                if ((t & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_REMOVE) {
-                        remove_client (control, index);
-                } else {
-                        req_update_client_info (control, index);
-                }
+                remove_client (control, index);
                 break;
 
-        case PA_SUBSCRIPTION_EVENT_SERVER:
-                req_update_server_info (control, index);
+        case PA_SUBSCRIPTION_EVENT_CARD:
+                remove_card (control, index);
                 break;
 
-        case PA_SUBSCRIPTION_EVENT_CARD:
-                if ((t & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_REMOVE) {
-                        remove_card (control, index);
-                } else {
-                        req_update_card (control, index);
-                }
+        default:
                 break;
         }
 }
@@ -2952,6 +3083,8 @@ idle_reconnect (gpointer data)
 
         g_return_val_if_fail (control, FALSE);
 
+        clear_pending_updates (control);
+
         if (control->priv->pa_context) {
                 pa_context_unref (control->priv->pa_context);
                 control->priv->pa_context = NULL;
@@ -3051,6 +3184,12 @@ gvc_mixer_control_dispose (GObject *object)
                 control->priv->reconnect_id = 0;
         }
 
+        clear_pending_updates (control);
+        if (control->priv->pending_update_links != NULL) {
+                g_hash_table_destroy (control->priv->pending_update_links);
+                control->priv->pending_update_links = NULL;
+        }
+
         if (control->priv->pa_context != NULL) {
                 pa_context_unref (control->priv->pa_context);
                 control->priv->pa_context = NULL;
@@ -3107,6 +3246,18 @@ gvc_mixer_control_dispose (GObject *object)
                 g_hash_table_destroy (control->priv->ui_inputs);
                 control->priv->ui_inputs = NULL;
         }
+        if (control->priv->ui_outputs_by_port != NULL) {
+                g_hash_table_destroy (control->priv->ui_outputs_by_port);
+                control->priv->ui_outputs_by_port = NULL;
+        }
+        if (control->priv->ui_inputs_by_port != NULL) {
+                g_hash_table_destroy (control->priv->ui_inputs_by_port);
+                control->priv->ui_inputs_by_port = NULL;
+        }
+        if (control->priv->streams_by_name != NULL) {
+                g_hash_table_destroy (control->priv->streams_by_name);
+                control->priv->streams_by_name = NULL;
+        }
 
         G_OBJECT_CLASS (gvc_mixer_control_parent_class)->dispose (object);
 }
@@ -3322,9 +3473,16 @@ gvc_mixer_control_init (GvcMixerControl *control)
         control->priv->cards = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)g_object_unref);
         control->priv->ui_outputs = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)g_object_unref);
         control->priv->ui_inputs = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)g_object_unref);
+        control->priv->ui_outputs_by_port = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_object_unref);
+        control->priv->ui_inputs_by_port = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_object_unref);
+        control->priv->streams_by_name = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
         control->priv->clients = g_hash_table_new_full (NULL, NULL, NULL, (GDestroyNotify)g_free);
 
+        /* The keys are owned by the queue */
+        g_queue_init (&control->priv->pending_updates);
+        control->priv->pending_update_links = g_hash_table_new (g_int64_hash, g_int64_equal);
+
         control->priv->state = GVC_STATE_CLOSED;
 }
 
@@ -0,0 +1,295 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Checks how the mixer control coalesces subscription events: the first
+ * event of a burst is requested straight away, later ones in the order
+ * they arrived, and a volume storm from another client against a
+ * private PulseAudio with a null sink ends with the last volume.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+#include <pulse/pulseaudio.h>
+
+/* Every info request the control makes is logged here before it goes
+ * out to the server */
+static GPtrArray *requests;
+
+static pa_operation *
+recording_get_sink_info_by_index (pa_context *c, uint32_t idx, pa_sink_info_cb_t cb, void *userdata)
+{
+        g_ptr_array_add (requests, g_strdup_printf ("sink:%u", idx));
+        return pa_context_get_sink_info_by_index (c, idx, cb, userdata);
+}
+
+static pa_operation *
+recording_get_source_info_by_index (pa_context *c, uint32_t idx, pa_source_info_cb_t cb, void *userdata)
+{
+        g_ptr_array_add (requests, g_strdup_printf ("source:%u", idx));
+        return pa_context_get_source_info_by_index (c, idx, cb, userdata);
+}
+
+static pa_operation *
+recording_get_client_info (pa_context *c, uint32_t idx, pa_client_info_cb_t cb, void *userdata)
+{
+        g_ptr_array_add (requests, g_strdup_printf ("client:%u", idx));
+        return pa_context_get_client_info (c, idx, cb, userdata);
+}
+
+#define pa_context_get_sink_info_by_index recording_get_sink_info_by_index
+#define pa_context_get_source_info_by_index recording_get_source_info_by_index
+#define pa_context_get_client_info recording_get_client_info
+
+#include "gvc-mixer-control.c"
+
+#undef pa_context_get_sink_info_by_index
+#undef pa_context_get_source_info_by_index
+#undef pa_context_get_client_info
+
+/* Volume changes the storm makes, as fast as the client can send them */
+#define STORM_CHANGES 300
+
+static GPid server_pid;
+static GvcMixerControl *control;
+
+static void
+iterate_until_idle (void)
+{
+        /* The window closes once one passes without events */
+        while (control->priv->pending_updates_id != 0)
+                g_main_context_iteration (NULL, TRUE);
+        while (g_main_context_iteration (NULL, FALSE))
+                ;
+}
+
+static void
+subscribe_event (pa_subscription_event_type_t t,
+                 uint32_t                     index)
+{
+        _pa_context_subscribe_cb (control->priv->pa_context, t, index, control);
+}
+
+static void
+assert_requests (const char * const *expected)
+{
+        guint i;
+
+        for (i = 0; expected[i] != NULL; i++) {
+                g_assert_cmpuint (i, <, requests->len);
+                g_assert_cmpstr (g_ptr_array_index (requests, i), ==, expected[i]);
+        }
+        g_assert_cmpuint (requests->len, ==, i);
+}
+
+static void
+test_first_event_immediate (void)
+{
+        const char *once[] = { "sink:0", NULL };
+        const char *twice[] = { "sink:0", "sink:0", NULL };
+        int i;
+
+        iterate_until_idle ();
+        g_ptr_array_set_size (requests, 0);
+
+        /* nothing waits for the window on the first event ... */
+        subscribe_event (PA_SUBSCRIPTION_EVENT_SINK | PA_SUBSCRIPTION_EVENT_CHANGE, 0);
+        assert_requests (once);
+
+        /* ... the rest of the burst is one more request at its end */
+        for (i = 0; i < 10; i++)
+                subscribe_event (PA_SUBSCRIPTION_EVENT_SINK | PA_SUBSCRIPTION_EVENT_CHANGE, 0);
+        assert_requests (once);
+
+        iterate_until_idle ();
+        assert_requests (twice);
+}
+
+static void
+test_arrival_order (void)
+{
+        const char *expected[] = { "client:1000", "source:0", "sink:0", "client:1002", NULL };
+
+        iterate_until_idle ();
+        g_ptr_array_set_size (requests, 0);
+
+        subscribe_event (PA_SUBSCRIPTION_EVENT_CLIENT | PA_SUBSCRIPTION_EVENT_NEW, 1000);
+        subscribe_event (PA_SUBSCRIPTION_EVENT_SOURCE | PA_SUBSCRIPTION_EVENT_CHANGE, 0);
+        subscribe_event (PA_SUBSCRIPTION_EVENT_SINK | PA_SUBSCRIPTION_EVENT_CHANGE, 0);
+        subscribe_event (PA_SUBSCRIPTION_EVENT_CLIENT | PA_SUBSCRIPTION_EVENT_NEW, 1001);
+        subscribe_event (PA_SUBSCRIPTION_EVENT_SOURCE | PA_SUBSCRIPTION_EVENT_CHANGE, 0);
+        subscribe_event (PA_SUBSCRIPTION_EVENT_CLIENT | PA_SUBSCRIPTION_EVENT_NEW, 1002);
+        /* gone before the window ended, never requested */
+        subscribe_event (PA_SUBSCRIPTION_EVENT_CLIENT | PA_SUBSCRIPTION_EVENT_REMOVE, 1001);
+
+        iterate_until_idle ();
+        assert_requests (expected);
+}
+
+static void
+test_volume_storm (void)
+{
+        pa_glib_mainloop *mainloop;
+        pa_context *context;
+        GvcMixerStream *sink;
+        pa_cvolume volume;
+        guint events, issued;
+        gint64 start, elapsed;
+        int i;
+
+        sink = gvc_mixer_control_get_default_sink (control);
+        g_assert (sink != NULL);
+
+        /* another client, so the changes only reach the control
+         * through subscription events */
+        mainloop = pa_glib_mainloop_new (NULL);
+        context = pa_context_new (pa_glib_mainloop_get_api (mainloop), "test-gvc-coalesce storm");
+        g_assert_cmpint (pa_context_connect (context, NULL, PA_CONTEXT_NOFLAGS, NULL), ==, 0);
+        while (pa_context_get_state (context) != PA_CONTEXT_READY) {
+                g_assert (PA_CONTEXT_IS_GOOD (pa_context_get_state (context)));
+                g_main_context_iteration (NULL, TRUE);
+        }
+
+        iterate_until_idle ();
+        events = control->priv->n_events_received;
+        issued = control->priv->n_requests_issued;
+        start = g_get_monotonic_time ();
+
+        for (i = 1; i <= STORM_CHANGES; i++) {
+                pa_cvolume_set (&volume, 2, PA_VOLUME_NORM * i / STORM_CHANGES / 2);
+                pa_operation_unref (pa_context_set_sink_volume_by_index (context,
+                                                                         gvc_mixer_stream_get_index (sink),
+                                                                         &volume, NULL, NULL));
+                /* let some of the events in while the storm goes on */
+                if (i % 10 == 0)
+                        g_main_context_iteration (NULL, FALSE);
+        }
+
+        while (gvc_mixer_stream_get_volume (sink) != PA_VOLUME_NORM / 2 &&
+               g_get_monotonic_time () - start < 5 * G_USEC_PER_SEC)
+                g_main_context_iteration (NULL, TRUE);
+        iterate_until_idle ();
+        elapsed = (g_get_monotonic_time () - start) / 1000;
+        events = control->priv->n_events_received - events;
+        issued = control->priv->n_requests_issued - issued;
+
+        g_test_message ("%d volume changes in %" G_GINT64_FORMAT " ms: %u events received, %u info requests issued",
+                        STORM_CHANGES, elapsed, events, issued);
+
+        /* at most one request when the storm starts and one per window */
+        g_assert_cmpuint (issued, <=, elapsed / UPDATE_WINDOW_MS + 2);
+        g_assert_cmpuint (gvc_mixer_stream_get_volume (sink), ==, PA_VOLUME_NORM / 2);
+
+        pa_context_disconnect (context);
+        pa_context_unref (context);
+        pa_glib_mainloop_free (mainloop);
+}
+
+static gboolean
+start_server (void)
+{
+        char *runtime_dir;
+        char *socket_arg;
+        char *argv[] = {
+                "pulseaudio", "-n", "--daemonize=no", "--exit-idle-time=-1",
+                "--use-pid-file=no", "--disable-shm",
+                "-L", "module-null-sink",
+                "-L", NULL,
+                NULL
+        };
+        char *server;
+        GError *error = NULL;
+
+        runtime_dir = g_dir_make_tmp ("usd-test-gvc-XXXXXX", NULL);
+        g_setenv ("PULSE_RUNTIME_PATH", runtime_dir, TRUE);
+        g_setenv ("PULSE_STATE_PATH", runtime_dir, TRUE);
+
+        socket_arg = g_strdup_printf ("module-native-protocol-unix auth-anonymous=1 socket=%s/native", runtime_dir);
+        argv[9] = socket_arg;
+
+        if (!g_spawn_async (NULL, argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
+                            NULL, NULL, &server_pid, &error)) {
+                g_print ("Could not start pulseaudio: %s\n", error->message);
+                g_error_free (error);
+                g_free (socket_arg);
+                g_free (runtime_dir);
+                return FALSE;
+        }
+        g_free (socket_arg);
+
+        server = g_strdup_printf ("unix:%s/native", runtime_dir);
+        g_setenv ("PULSE_SERVER", server, TRUE);
+        g_free (server);
+        g_free (runtime_dir);
+
+        return TRUE;
+}
+
+static gboolean
+wait_for_ready (void)
+{
+        gint64 end = g_get_monotonic_time () + 5 * G_USEC_PER_SEC;
+
+        while (g_get_monotonic_time () < end) {
+                if (gvc_mixer_control_get_state (control) == GVC_STATE_READY &&
+                    gvc_mixer_control_get_default_sink (control) != NULL)
+                        return TRUE;
+                g_main_context_iteration (NULL, TRUE);
+        }
+
+        return FALSE;
+}
+
+int
+main (int argc, char **argv)
+{
+        int ret;
+
+        g_test_init (&argc, &argv, NULL);
+
+        if (!start_server ())
+                return 77;
+
+        requests = g_ptr_array_new_with_free_func (g_free);
+
+        control = gvc_mixer_control_new ("test-gvc-coalesce");
+        gvc_mixer_control_open (control);
+
+        if (!wait_for_ready ()) {
+                g_print ("Could not connect to the test sound server, skipping\n");
+                kill (server_pid, SIGTERM);
+                return 77;
+        }
+
+        g_test_add_func ("/gvc/coalesce/first-event-immediate", test_first_event_immediate);
+        g_test_add_func ("/gvc/coalesce/arrival-order", test_arrival_order);
+        g_test_add_func ("/gvc/coalesce/volume-storm", test_volume_storm);
+
+        ret = g_test_run ();
+
+        gvc_mixer_control_close (control);
+        g_object_unref (control);
+        g_ptr_array_unref (requests);
+
+        kill (server_pid, SIGTERM);
+        waitpid (server_pid, NULL, 0);
+        g_spawn_close_pid (server_pid);
+
+        return ret;
+}
@@ -0,0 +1,286 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Checks the mixer control's port and name indexes: feeds made-up cards
+ * and sinks to a control that isn't connected to any server, then makes
+ * sure the lookups done on every stream and card update never walk the
+ * device or stream tables, and that removing a card drops its devices
+ * from the indexes even once their port was cleared.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+/* Every walk over a whole table is counted here; the indexed lookups
+ * must not need any, whatever the number of cards */
+static guint n_walks;
+
+static GList *
+counting_get_values (GHashTable *hash_table)
+{
+        n_walks++;
+        return g_hash_table_get_values (hash_table);
+}
+
+static gpointer
+counting_find (GHashTable *hash_table,
+               GHRFunc     predicate,
+               gpointer    user_data)
+{
+        n_walks++;
+        return g_hash_table_find (hash_table, predicate, user_data);
+}
+
+#define g_hash_table_get_values counting_get_values
+#define g_hash_table_find counting_find
+
+#include "gvc-mixer-control.c"
+
+#define N_CARDS 50
+
+static const char *output_ports[] = { "analog-output-speaker", "analog-output-headphones" };
+
+typedef struct {
+        GvcMixerControl *control;
+        char           **sink_names;
+} Topology;
+
+static void
+add_card (GvcMixerControl *control,
+          guint            index)
+{
+        pa_card_profile_info profile = { "output:analog-stereo", "Analog Stereo Output", 1, 0, 100 };
+        pa_card_profile_info *port_profiles[] = { &profile };
+        pa_card_port_info ports[G_N_ELEMENTS (output_ports)];
+        pa_card_port_info *port_ptrs[G_N_ELEMENTS (output_ports)];
+        pa_card_info info;
+        char *name;
+        guint i;
+
+        memset (&info, 0, sizeof (info));
+        memset (ports, 0, sizeof (ports));
+
+        for (i = 0; i < G_N_ELEMENTS (output_ports); i++) {
+                ports[i].name = output_ports[i];
+                ports[i].description = output_ports[i];
+                ports[i].priority = i;
+                ports[i].available = PA_PORT_AVAILABLE_YES;
+                ports[i].direction = PA_DIRECTION_OUTPUT;
+                ports[i].n_profiles = 1;
+                ports[i].profiles = port_profiles;
+                port_ptrs[i] = &ports[i];
+        }
+
+        name = g_strdup_printf ("alsa_card.test_%u", index);
+        info.index = index;
+        info.name = name;
+        info.driver = "test";
+        info.n_profiles = 1;
+        info.profiles = &profile;
+        info.active_profile = &profile;
+        info.n_ports = G_N_ELEMENTS (output_ports);
+        info.ports = port_ptrs;
+        info.proplist = pa_proplist_new ();
+        pa_proplist_sets (info.proplist, "device.description", name);
+
+        update_card (control, &info);
+
+        pa_proplist_free (info.proplist);
+        g_free (name);
+}
+
+static char *
+add_sink (GvcMixerControl *control,
+          guint            index)
+{
+        pa_sink_port_info ports[G_N_ELEMENTS (output_ports)];
+        pa_sink_port_info *port_ptrs[G_N_ELEMENTS (output_ports)];
+        pa_sink_info info;
+        char *name;
+        guint i;
+
+        memset (&info, 0, sizeof (info));
+        memset (ports, 0, sizeof (ports));
+
+        for (i = 0; i < G_N_ELEMENTS (output_ports); i++) {
+                ports[i].name = output_ports[i];
+                ports[i].description = output_ports[i];
+                ports[i].priority = i;
+                ports[i].available = PA_PORT_AVAILABLE_YES;
+                port_ptrs[i] = &ports[i];
+        }
+
+        name = g_strdup_printf ("alsa_output.test_%u.analog-stereo", index);
+        info.index = index;
+        info.name = name;
+        info.description = name;
+        info.card = index;
+        pa_channel_map_init_stereo (&info.channel_map);
+        pa_cvolume_set (&info.volume, 2, PA_VOLUME_NORM);
+        info.base_volume = PA_VOLUME_NORM;
+        info.n_ports = G_N_ELEMENTS (output_ports);
+        info.ports = port_ptrs;
+        info.active_port = port_ptrs[0];
+        info.proplist = pa_proplist_new ();
+
+        update_sink (control, &info);
+
+        pa_proplist_free (info.proplist);
+
+        return name;
+}
+
+static void
+topology_init (Topology *topology,
+               guint     n_cards)
+{
+        guint i;
+
+        topology->control = gvc_mixer_control_new ("test-gvc-indexes");
+        topology->sink_names = g_new0 (char *, n_cards + 1);
+
+        for (i = 0; i < n_cards; i++)
+                add_card (topology->control, i);
+        for (i = 0; i < n_cards; i++)
+                topology->sink_names[i] = add_sink (topology->control, i);
+}
+
+static void
+topology_clear (Topology *topology)
+{
+        g_object_unref (topology->control);
+        g_strfreev (topology->sink_names);
+}
+
+/* match_stream_with_devices () is done by sync_devices () for every
+ * port of a new sink or source */
+static void
+test_port_match (void)
+{
+        Topology topology;
+        GvcMixerStream *stream;
+        const GList *ports;
+        guint i;
+
+        topology_init (&topology, N_CARDS);
+
+        n_walks = 0;
+        for (i = 0; i < N_CARDS; i++) {
+                stream = g_hash_table_lookup (topology.control->priv->sinks,
+                                              GUINT_TO_POINTER (i));
+                ports = gvc_mixer_stream_get_ports (stream);
+                g_assert (match_stream_with_devices (topology.control, ports->data, stream));
+        }
+        g_assert_cmpuint (n_walks, ==, 0);
+
+        topology_clear (&topology);
+}
+
+/* find_stream_for_name () is done on every server info update */
+static void
+test_name_lookup (void)
+{
+        Topology topology;
+        guint i;
+
+        topology_init (&topology, N_CARDS);
+
+        n_walks = 0;
+        for (i = 0; i < N_CARDS; i++)
+                g_assert (find_stream_for_name (topology.control,
+                                                topology.sink_names[i]) != NULL);
+        g_assert (find_stream_for_name (topology.control, "alsa_output.missing") == NULL);
+        g_assert_cmpuint (n_walks, ==, 0);
+
+        topology_clear (&topology);
+}
+
+/* match_card_port_with_existing_device () is done when a port's
+ * availability changes */
+static void
+test_port_availability (void)
+{
+        Topology topology;
+        GvcMixerCard *card;
+        guint i;
+
+        topology_init (&topology, N_CARDS);
+
+        n_walks = 0;
+        for (i = 0; i < N_CARDS; i++) {
+                card = g_hash_table_lookup (topology.control->priv->cards,
+                                            GUINT_TO_POINTER (i));
+                match_card_port_with_existing_device (topology.control,
+                                                      gvc_mixer_card_get_ports (card)->data,
+                                                      card,
+                                                      i % 2);
+        }
+        g_assert_cmpuint (n_walks, ==, 0);
+
+        topology_clear (&topology);
+}
+
+/* sync_devices () clears the port of a device whose stream has no ports,
+ * as with Bluetooth headsets; removing its card must still drop it from
+ * the port index rather than leave a stale entry behind */
+static void
+test_remove_portless (void)
+{
+        Topology topology;
+        GList *devices, *d;
+        char *key;
+
+        topology_init (&topology, 2);
+
+        devices = g_hash_table_get_values (topology.control->priv->ui_outputs);
+        for (d = devices; d != NULL; d = d->next) {
+                GvcMixerCard *card;
+
+                g_object_get (d->data, "card", &card, NULL);
+                if (gvc_mixer_card_get_index (card) == 0)
+                        g_object_set (d->data, "port-name", NULL, NULL);
+        }
+        g_list_free (devices);
+
+        remove_card (topology.control, 0);
+
+        g_assert_cmpuint (g_hash_table_size (topology.control->priv->ui_outputs_by_port),
+                          ==, G_N_ELEMENTS (output_ports));
+
+        key = ui_device_index_key (0, output_ports[0]);
+        g_assert (g_hash_table_lookup (topology.control->priv->ui_outputs_by_port, key) == NULL);
+        g_free (key);
+
+        key = ui_device_index_key (1, output_ports[0]);
+        g_assert (g_hash_table_lookup (topology.control->priv->ui_outputs_by_port, key) != NULL);
+        g_free (key);
+
+        topology_clear (&topology);
+}
+
+int
+main (int argc, char **argv)
+{
+        g_test_init (&argc, &argv, NULL);
+
+        g_test_add_func ("/gvc/indexes/port-match", test_port_match);
+        g_test_add_func ("/gvc/indexes/name-lookup", test_name_lookup);
+        g_test_add_func ("/gvc/indexes/port-availability", test_port_availability);
+        g_test_add_func ("/gvc/indexes/remove-portless", test_remove_portless);
+
+        return g_test_run ();
+}
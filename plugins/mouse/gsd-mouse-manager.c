@@ -1151,6 +1151,10 @@ device_added_cb (GdkDeviceManager *device_manager,
                  GdkDevice        *device,
                  GsdMouseManager  *manager)
 {
+        gint64 span;
+
+        span = gnome_settings_profile_span_begin ();
+
         if (device_is_ignored (manager, device) == FALSE) {
                 if (run_custom_command (device, COMMAND_DEVICE_ADDED) == FALSE) {
                         set_mouse_settings (manager, device);
@@ -1167,6 +1171,8 @@ device_added_cb (GdkDeviceManager *device_manager,
                 /* If a mouse was to appear... */
                 ensure_touchpad_active (manager);
         }
+
+        gnome_settings_profile_span_end ("input", "hotplug", span);
 }
 
 static void
@@ -1175,6 +1181,9 @@ device_removed_cb (GdkDeviceManager *device_manager,
                    GsdMouseManager  *manager)
 {
 	int id;
+        gint64 span;
+
+        span = gnome_settings_profile_span_begin ();
 
 	/* Remove the device from the hash table so that
 	 * device_is_ignored () doesn't check for blacklisted devices */
@@ -1191,6 +1200,8 @@ device_removed_cb (GdkDeviceManager *device_manager,
                 if (gdk_device_get_source (device) != GDK_SOURCE_TOUCHPAD)
                         ensure_touchpad_active (manager);
         }
+
+        gnome_settings_profile_span_end ("input", "hotplug", span);
 }
 
 static void
@@ -24,6 +24,7 @@
 #include "config.h"
 
 #include <fcntl.h>
+#include <math.h>
 #include <glib.h>
 #include <gtk/gtk.h>
 #include <gdk/gdk.h>
@@ -55,11 +56,17 @@ struct GsdOrientationManagerPrivate
         char *sysfs_path;
         OrientationUp prev_orientation;
 
+        /* Candidate orientation waiting for the settle timeout */
+        OrientationUp pending_orientation;
+        guint settle_id;
+
         /* DBus */
         GDBusNodeInfo   *introspection_data;
         GDBusConnection *connection;
         GDBusProxy      *xrandr_proxy;
         GCancellable    *cancellable;
+        GsdRRRotation    queued_rotation;
+        gboolean         rotation_queued;
 
         /* Notifications */
         GUdevClient *client;
@@ -91,6 +98,13 @@ static gpointer manager_object = NULL;
 #define MPU_THRESHOLD 12000
 #define MPU_POLL_INTERVAL 1
 
+/* How long a new orientation has to be reported before we rotate */
+#define ORIENTATION_SETTLE_MS 500
+
+/* How far past the 45° boundary the MPU6050 has to be tilted before
+ * we leave the current orientation */
+#define MPU_HYSTERESIS_DEGREES 10.0
+
 static gboolean is_mpu6050 = FALSE;
 static char *mpu6050_accel_x = NULL;
 static char *mpu6050_accel_y = NULL;
@@ -133,6 +147,7 @@ gsd_orientation_manager_init (GsdOrientationManager *manager)
 {
         manager->priv = GSD_ORIENTATION_MANAGER_GET_PRIVATE (manager);
         manager->priv->prev_orientation = ORIENTATION_UNDEFINED;
+        manager->priv->pending_orientation = ORIENTATION_UNDEFINED;
 }
 
 static GsdRRRotation
@@ -203,6 +218,9 @@ get_orientation_from_device (GUdevDevice *dev)
         return orientation_from_string (value);
 }
 
+static void do_xrandr_action (GsdOrientationManager *manager,
+                              GsdRRRotation          rotation);
+
 static void
 on_xrandr_action_call_finished (GObject               *source_object,
                                 GAsyncResult          *res,
@@ -213,6 +231,11 @@ on_xrandr_action_call_finished (GObject               *source_object,
 
         variant = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &error);
 
+        if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                g_error_free (error);
+                return;
+        }
+
         g_object_unref (manager->priv->cancellable);
         manager->priv->cancellable = NULL;
 
@@ -222,6 +245,12 @@ on_xrandr_action_call_finished (GObject               *source_object,
         } else {
                 g_variant_unref (variant);
         }
+
+        /* Send the rotation that arrived while the call was in flight */
+        if (manager->priv->rotation_queued) {
+                manager->priv->rotation_queued = FALSE;
+                do_xrandr_action (manager, manager->priv->queued_rotation);
+        }
 }
 
 static void
@@ -238,7 +267,9 @@ do_xrandr_action (GsdOrientationManager *manager,
         }
 
         if (priv->cancellable != NULL) {
-                g_debug ("xrandr action already in flight");
+                g_debug ("xrandr action already in flight, queueing rotation");
+                priv->queued_rotation = rotation;
+                priv->rotation_queued = TRUE;
                 return;
         }
 
@@ -276,6 +307,68 @@ do_rotation (GsdOrientationManager *manager)
         do_xrandr_action (manager, rotation);
 }
 
+static void
+cancel_settle (GsdOrientationManager *manager)
+{
+        if (manager->priv->settle_id != 0) {
+                g_source_remove (manager->priv->settle_id);
+                manager->priv->settle_id = 0;
+        }
+        manager->priv->pending_orientation = manager->priv->prev_orientation;
+}
+
+static gboolean
+settle_timeout_cb (GsdOrientationManager *manager)
+{
+        GsdOrientationManagerPrivate *priv = manager->priv;
+
+        priv->settle_id = 0;
+
+        if (priv->pending_orientation == priv->prev_orientation)
+                return FALSE;
+
+        priv->prev_orientation = priv->pending_orientation;
+        g_debug ("Orientation settled on '%s', switching screen rotation",
+                 orientation_to_string (priv->prev_orientation));
+
+        do_rotation (manager);
+
+        return FALSE;
+}
+
+/* Only rotate once the accelerometer has reported the same orientation
+ * for ORIENTATION_SETTLE_MS, so that a device held around the boundary
+ * between two orientations doesn't cause a mode-set on every reading */
+static void
+queue_orientation (GsdOrientationManager *manager,
+                   OrientationUp          orientation)
+{
+        GsdOrientationManagerPrivate *priv = manager->priv;
+
+        if (orientation == ORIENTATION_UNDEFINED)
+                return;
+
+        if (orientation == priv->pending_orientation)
+                return;
+
+        if (orientation == priv->prev_orientation) {
+                g_debug ("Orientation went back to '%s' before settling",
+                         orientation_to_string (orientation));
+                cancel_settle (manager);
+                return;
+        }
+
+        g_debug ("Orientation candidate '%s', waiting %d ms for it to settle",
+                 orientation_to_string (orientation), ORIENTATION_SETTLE_MS);
+
+        if (priv->settle_id != 0)
+                g_source_remove (priv->settle_id);
+        priv->pending_orientation = orientation;
+        priv->settle_id = g_timeout_add (ORIENTATION_SETTLE_MS,
+                                         (GSourceFunc) settle_timeout_cb,
+                                         manager);
+}
+
 static void
 client_uevent_cb (GUdevClient           *client,
                   gchar                 *action,
@@ -300,13 +393,7 @@ client_uevent_cb (GUdevClient           *client,
         g_debug ("Received an event from the accelerometer");
 
         orientation = get_orientation_from_device (device);
-        if (orientation != manager->priv->prev_orientation) {
-                manager->priv->prev_orientation = orientation;
-                g_debug ("Orientation changed to '%s', switching screen rotation",
-                         orientation_to_string (manager->priv->prev_orientation));
-
-                do_rotation (manager);
-        }
+        queue_orientation (manager, orientation);
 }
 
 static void
@@ -321,15 +408,35 @@ orientation_lock_changed_cb (GSettings             *settings,
                 return;
 
         manager->priv->orientation_lock = new;
-	
-        if (new == FALSE) {
-                if (is_mpu6050) {
-                        g_timeout_add_seconds(MPU_POLL_INTERVAL, (GSourceFunc) mpu_timer, manager);
+
+        if (new != FALSE) {
+                cancel_settle (manager);
+                return;
+        }
+
+        if (is_mpu6050) {
+                g_timeout_add_seconds(MPU_POLL_INTERVAL, (GSourceFunc) mpu_timer, manager);
+        } else if (manager->priv->sysfs_path != NULL) {
+                GUdevDevice *dev;
+
+                /* uevents are ignored while locked, so pick up the
+                 * current orientation from the device */
+                dev = g_udev_client_query_by_sysfs_path (manager->priv->client,
+                                                         manager->priv->sysfs_path);
+                if (dev != NULL) {
+                        OrientationUp orientation;
+
+                        orientation = get_orientation_from_device (dev);
+                        if (orientation != ORIENTATION_UNDEFINED)
+                                manager->priv->prev_orientation = orientation;
+                        manager->priv->pending_orientation = manager->priv->prev_orientation;
+                        g_object_unref (dev);
                 }
-                /* Handle the rotations that could have occurred while
-                 * we were locked */
-                do_rotation (manager);
         }
+
+        /* Handle the rotations that could have occurred while
+         * we were locked */
+        do_rotation (manager);
 }
 
 static void
@@ -445,10 +552,76 @@ static int read_sysfs_attr_as_int(const char *filename) {
 	return i;
 }
 
+static double
+orientation_to_mpu_angle (OrientationUp orientation)
+{
+        switch (orientation) {
+        case ORIENTATION_NORMAL:
+                return 0.0;
+        case ORIENTATION_RIGHT_UP:
+                return 90.0;
+        case ORIENTATION_BOTTOM_UP:
+                return 180.0;
+        case ORIENTATION_LEFT_UP:
+                return -90.0;
+        default:
+                g_assert_not_reached ();
+        }
+}
+
+static double
+angle_distance (double a,
+                double b)
+{
+        double d;
+
+        d = fmod (fabs (a - b), 360.0);
+        return d > 180.0 ? 360.0 - d : d;
+}
+
+/* Map the gravity vector to the nearest orientation, but only leave
+ * the current one once we're MPU_HYSTERESIS_DEGREES past the boundary */
+static OrientationUp
+orientation_from_mpu (int           x,
+                      int           y,
+                      OrientationUp current)
+{
+        const OrientationUp orientations[] = {
+                ORIENTATION_NORMAL,
+                ORIENTATION_RIGHT_UP,
+                ORIENTATION_BOTTOM_UP,
+                ORIENTATION_LEFT_UP
+        };
+        OrientationUp nearest = ORIENTATION_UNDEFINED;
+        double angle, best = 360.0;
+        guint i;
+
+        /* Lying flat, the screen plane tells us nothing */
+        if (hypot (x, y) < MPU_THRESHOLD)
+                return current;
+
+        angle = atan2 (y, x) * 180.0 / G_PI;
+
+        for (i = 0; i < G_N_ELEMENTS (orientations); i++) {
+                double d = angle_distance (angle, orientation_to_mpu_angle (orientations[i]));
+                if (d < best) {
+                        best = d;
+                        nearest = orientations[i];
+                }
+        }
+
+        if (current != ORIENTATION_UNDEFINED &&
+            nearest != current &&
+            angle_distance (angle, orientation_to_mpu_angle (current)) < 45.0 + MPU_HYSTERESIS_DEGREES)
+                return current;
+
+        return nearest;
+}
+
 static gboolean mpu_timer(GsdOrientationManager *manager) {
 	int x, y;
 	static gboolean first = TRUE;
-	OrientationUp orientation = manager->priv->prev_orientation;
+	OrientationUp orientation;
 
         if (manager->priv->xrandr_proxy == NULL)
                 return TRUE;
@@ -456,25 +629,23 @@ static gboolean mpu_timer(GsdOrientationManager *manager) {
 	x = read_sysfs_attr_as_int(mpu6050_accel_x);
 	y = read_sysfs_attr_as_int(mpu6050_accel_y);
 
-	if (x > MPU_THRESHOLD)
-		orientation = ORIENTATION_NORMAL;
-	if (x < -MPU_THRESHOLD)
-		orientation = ORIENTATION_BOTTOM_UP;
-	if (y > MPU_THRESHOLD)
-		orientation = ORIENTATION_RIGHT_UP;
-	if (y < -MPU_THRESHOLD)
-		orientation = ORIENTATION_LEFT_UP;
+        if (manager->priv->orientation_lock)
+                return FALSE;
 
-        if (orientation != manager->priv->prev_orientation || first) {
+        if (first) {
                 first = FALSE;
-                manager->priv->prev_orientation = orientation;
-                g_debug ("Orientation changed to '%s', switching screen rotation",
-                         orientation_to_string (manager->priv->prev_orientation));
-
+                manager->priv->prev_orientation = orientation_from_mpu (x, y, ORIENTATION_UNDEFINED);
+                if (manager->priv->prev_orientation == ORIENTATION_UNDEFINED)
+                        manager->priv->prev_orientation = ORIENTATION_NORMAL;
+                manager->priv->pending_orientation = manager->priv->prev_orientation;
                 do_rotation (manager);
+                return TRUE;
         }
 
-        return !manager->priv->orientation_lock;
+        orientation = orientation_from_mpu (x, y, manager->priv->prev_orientation);
+        queue_orientation (manager, orientation);
+
+        return TRUE;
 }
 
 static gboolean
@@ -501,6 +672,7 @@ gsd_orientation_manager_idle_cb (GsdOrientationManager *manager)
         g_debug ("Found accelerometer at sysfs path '%s'", manager->priv->sysfs_path);
 
         manager->priv->prev_orientation = get_orientation_from_device (dev);
+        manager->priv->pending_orientation = manager->priv->prev_orientation;
 
         /* Poll the sysfs attributes exposed by MPU6050 as it is not an uevent based input driver */
         if (g_strcmp0 (g_udev_device_get_sysfs_attr (dev, "name"), "mpu6050") == 0) {
@@ -550,6 +722,18 @@ gsd_orientation_manager_stop (GsdOrientationManager *manager)
 
         g_debug ("Stopping orientation manager");
 
+        if (p->settle_id != 0) {
+                g_source_remove (p->settle_id);
+                p->settle_id = 0;
+        }
+
+        if (p->cancellable) {
+                g_cancellable_cancel (p->cancellable);
+                g_object_unref (p->cancellable);
+                p->cancellable = NULL;
+        }
+        p->rotation_queued = FALSE;
+
         if (p->settings) {
                 g_object_unref (p->settings);
                 p->settings = NULL;
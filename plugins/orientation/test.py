@@ -0,0 +1,169 @@
+#!/usr/bin/env python
+'''GNOME settings daemon tests for orientation plugin.
+
+A fake accelerometer is set up with umockdev, and the plugin is run under
+umockdev's preload library so that it sees the fake device and its uevents.
+The XRANDR plugin is replaced by a mock that records the RotateTo calls.
+'''
+
+__license__ = 'GPL v2 or later'
+
+import unittest
+import subprocess
+import sys
+import time
+import os
+import os.path
+
+project_root = os.path.dirname(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+builddir = os.environ.get('BUILDDIR', os.path.dirname(__file__))
+
+sys.path.insert(0, os.path.join(project_root, 'tests'))
+sys.path.insert(0, builddir)
+import gsdtestcase
+
+import dbus
+import dbusmock
+
+from gi.repository import Gio
+
+try:
+    import gi
+    gi.require_version('UMockdev', '1.0')
+    from gi.repository import UMockdev
+    have_umockdev = subprocess.call(['which', 'umockdev-wrapper'], stdout=subprocess.PIPE) == 0
+except (ImportError, ValueError):
+    have_umockdev = False
+
+XRANDR_NAME = 'org.gnome.SettingsDaemon.XRANDR'
+XRANDR_PATH = '/org/gnome/SettingsDaemon/XRANDR'
+XRANDR_IFACE = 'org.gnome.SettingsDaemon.XRANDR_2'
+
+# GsdRRRotation values
+ROTATION_90 = 2
+ROTATION_180 = 4
+
+# ORIENTATION_SETTLE_MS in the plugin
+SETTLE = 0.5
+
+
+@unittest.skipUnless(have_umockdev, 'umockdev not available')
+class OrientationPluginTest(gsdtestcase.GSDTestCase):
+    '''Test the orientation plugin'''
+
+    def setUp(self):
+        self.testbed = UMockdev.Testbed.new()
+        self.accel = self.testbed.add_device(
+            'input', 'accel', None,
+            ['name', 'Fake accelerometer'],
+            ['ID_INPUT', '1',
+             'ID_INPUT_ACCELEROMETER', '1',
+             'ID_INPUT_ACCELEROMETER_ORIENTATION', 'normal'])
+
+        (self.xrandr, self.obj_xrandr) = self.spawn_server(
+            XRANDR_NAME, XRANDR_PATH, XRANDR_IFACE, stdout=subprocess.PIPE)
+        self.xrandr_mock = dbus.Interface(self.obj_xrandr, dbusmock.MOCK_IFACE)
+        self.xrandr_mock.AddMethod('', 'RotateTo', 'ix', '', '')
+
+        self.settings_touchscreen = Gio.Settings('org.gnome.settings-daemon.peripherals.touchscreen')
+
+        self.plugin_log_write = open(os.path.join(self.workdir, 'plugin_orientation.log'), 'wb')
+        self.daemon = subprocess.Popen(
+            ['umockdev-wrapper', os.path.join(builddir, 'usd-test-orientation')],
+            stdout=self.plugin_log_write,
+            stderr=subprocess.STDOUT)
+        self.plugin_log = open(self.plugin_log_write.name)
+
+        # wait until the plugin found the accelerometer and the XRANDR proxy
+        self.wait_for_log('Found accelerometer at sysfs path')
+        time.sleep(0.5)
+
+    def tearDown(self):
+        daemon_running = self.daemon.poll() == None
+        if daemon_running:
+            self.daemon.terminate()
+            self.daemon.wait()
+        self.plugin_log.close()
+        self.plugin_log_write.close()
+
+        self.xrandr.terminate()
+        self.xrandr.wait()
+
+        self.settings_touchscreen.reset('orientation-lock')
+        Gio.Settings.sync()
+
+        del self.testbed
+
+        self.assertTrue(daemon_running, 'daemon died during the test')
+
+    def wait_for_log(self, message, timeout=5):
+        log = ''
+        while timeout > 0:
+            log += self.plugin_log.read()
+            if message in log:
+                return
+            time.sleep(0.1)
+            timeout -= 0.1
+        self.fail('timed out waiting for "%s" in the plugin log:\n%s' % (message, log))
+
+    def set_orientation(self, orientation):
+        self.testbed.set_property(self.accel, 'ID_INPUT_ACCELEROMETER_ORIENTATION', orientation)
+        self.testbed.uevent(self.accel, 'change')
+
+    def rotations(self):
+        return [int(c[2][0]) for c in self.xrandr_mock.GetCalls() if c[1] == 'RotateTo']
+
+    def test_rotate_after_settle(self):
+        '''A new orientation rotates the screen once it settled'''
+
+        self.set_orientation('left-up')
+        time.sleep(SETTLE / 2)
+        self.assertEqual(self.rotations(), [])
+
+        time.sleep(SETTLE + 0.5)
+        self.assertEqual(self.rotations(), [ROTATION_90])
+
+        # repeated readings of the same orientation don't rotate again
+        self.set_orientation('left-up')
+        time.sleep(SETTLE + 0.5)
+        self.assertEqual(self.rotations(), [ROTATION_90])
+
+    def test_jitter(self):
+        '''Flapping around a boundary never rotates'''
+
+        for i in range(20):
+            self.set_orientation('left-up' if i % 2 == 0 else 'normal')
+            time.sleep(0.1)
+
+        time.sleep(SETTLE + 0.5)
+        self.assertEqual(self.rotations(), [])
+
+    def test_last_orientation_wins(self):
+        '''Only the orientation that settles is applied'''
+
+        self.set_orientation('left-up')
+        time.sleep(0.1)
+        self.set_orientation('bottom-up')
+
+        time.sleep(SETTLE + 0.5)
+        self.assertEqual(self.rotations(), [ROTATION_180])
+
+    def test_lock(self):
+        '''Nothing rotates while locked, unlocking applies the current orientation'''
+
+        self.settings_touchscreen['orientation-lock'] = True
+        Gio.Settings.sync()
+        time.sleep(0.5)
+
+        self.set_orientation('bottom-up')
+        time.sleep(SETTLE + 0.5)
+        self.assertEqual(self.rotations(), [])
+
+        self.settings_touchscreen['orientation-lock'] = False
+        Gio.Settings.sync()
+        time.sleep(0.5)
+        self.assertEqual(self.rotations(), [ROTATION_180])
+
+
+if __name__ == '__main__':
+    unittest.main(testRunner=unittest.TextTestRunner(stream=sys.stdout, verbosity=2))
@@ -30,6 +30,7 @@
 #include <gdk/gdkx.h>
 #include <X11/extensions/XTest.h>
 #include <X11/extensions/dpms.h>
+#include <X11/extensions/scrnsaver.h>
 #include <canberra-gtk.h>
 
 #include "gpm-common.h"
@@ -38,7 +39,6 @@
 #include "gsd-backlight-linux.h"
 #include "gsd-rr.h"
 
-#define XSCREENSAVER_WATCHDOG_TIMEOUT           120 /* seconds */
 #define UPS_SOUND_LOOP_ID                        99
 #define GSD_POWER_MANAGER_CRITICAL_ALERT_TIMEOUT  5 /* seconds */
 
@@ -1075,10 +1075,11 @@ out:
         return ret;
 }
 
-/* This timer goes off every few minutes, whether the user is idle or not,
-   to try and clean up anything that has gone wrong.
+/* The X server's own screensaver must stay off, since we blank the screen
+   ourselves.
 
-   It calls disable_builtin_screensaver() so that if xset has been used,
+   disable_builtin_screensaver() gets called at startup and then whenever
+   the server says its screensaver came on, so that if xset has been used,
    or some other program (like xlock) has messed with the XSetScreenSaver()
    settings, they will be set back to sensible values (if a server extension
    is in use, messing with xlock can cause the screensaver to never get a wakeup
@@ -1088,8 +1089,8 @@ out:
    This code was originally part of gnome-screensaver, see
    http://git.gnome.org/browse/gnome-screensaver/tree/src/gs-watcher-x11.c?id=fec00b12ec46c86334cfd36b37771cc4632f0d4d#n530
  */
-static gboolean
-disable_builtin_screensaver (gpointer unused)
+static void
+disable_builtin_screensaver (void)
 {
         int current_server_timeout, current_server_interval;
         int current_prefer_blank,   current_allow_exp;
@@ -1142,25 +1143,91 @@ disable_builtin_screensaver (gpointer unused)
 
                 XSync (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), FALSE);
         }
+}
 
-        return TRUE;
+/* Nothing tells us when the screensaver settings change, but the server
+   does tell us when its screensaver turns on, which only happens once
+   something re-enabled it and its timeout then ran out; put the settings
+   back and undo the blanking then. This costs nothing while nothing
+   changes, unlike polling. */
+static int screensaver_event_base = -1;
+
+static GdkFilterReturn
+screensaver_event_filter (GdkXEvent *gdk_xevent,
+                          GdkEvent  *event,
+                          gpointer   data)
+{
+        XEvent *xevent = (XEvent *) gdk_xevent;
+        XScreenSaverNotifyEvent *notify;
+
+        if (xevent->type != screensaver_event_base + ScreenSaverNotify)
+                return GDK_FILTER_CONTINUE;
+
+        notify = (XScreenSaverNotifyEvent *) xevent;
+
+        /* Forced by a client rather than by the timeout, like our own
+         * DPMSForceLevel() when blanking; resetting would unblank */
+        if (notify->forced)
+                return GDK_FILTER_CONTINUE;
+
+        if (notify->state == ScreenSaverOn || notify->state == ScreenSaverCycle) {
+                g_debug ("server builtin screensaver came on, turning it off again");
+                disable_builtin_screensaver ();
+                XForceScreenSaver (notify->display, ScreenSaverReset);
+        }
+
+        return GDK_FILTER_CONTINUE;
 }
 
-guint
+void
 gsd_power_enable_screensaver_watchdog (void)
 {
+        Display *dpy = GDK_DISPLAY_XDISPLAY (gdk_display_get_default ());
         int dummy;
 
         /* Make sure that Xorg's DPMS extension never gets in our
          * way. The defaults are now applied in Fedora 20 from
          * being "0" by default to being "600" by default */
         gdk_error_trap_push ();
-        if (DPMSQueryExtension(GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), &dummy, &dummy))
-                DPMSSetTimeouts (GDK_DISPLAY_XDISPLAY (gdk_display_get_default ()), 0, 0, 0);
+        if (DPMSQueryExtension(dpy, &dummy, &dummy))
+                DPMSSetTimeouts (dpy, 0, 0, 0);
+        gdk_error_trap_pop_ignored ();
+
+        disable_builtin_screensaver ();
+
+        if (screensaver_event_base >= 0)
+                return;
+
+        if (!XScreenSaverQueryExtension (dpy, &screensaver_event_base, &dummy)) {
+                g_warning ("MIT-SCREEN-SAVER extension not available, "
+                           "not watching the server builtin screensaver");
+                return;
+        }
+
+        gdk_error_trap_push ();
+        XScreenSaverSelectInput (dpy, DefaultRootWindow (dpy), ScreenSaverNotifyMask);
         gdk_error_trap_pop_ignored ();
-        return g_timeout_add_seconds (XSCREENSAVER_WATCHDOG_TIMEOUT,
-                                      disable_builtin_screensaver,
-                                      NULL);
+
+        gdk_window_add_filter (NULL, screensaver_event_filter, NULL);
+}
+
+void
+gsd_power_disable_screensaver_watchdog (void)
+{
+        Display *dpy;
+
+        if (screensaver_event_base < 0)
+                return;
+
+        dpy = GDK_DISPLAY_XDISPLAY (gdk_display_get_default ());
+
+        gdk_window_remove_filter (NULL, screensaver_event_filter, NULL);
+
+        gdk_error_trap_push ();
+        XScreenSaverSelectInput (dpy, DefaultRootWindow (dpy), 0);
+        gdk_error_trap_pop_ignored ();
+
+        screensaver_event_base = -1;
 }
 
 static GsdRROutput *
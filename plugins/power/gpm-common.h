@@ -44,7 +44,8 @@ gchar           *gpm_upower_get_device_description      (UpDevice       *device)
 
 /* Power helpers */
 gboolean         gsd_power_is_hardware_a_vm             (void);
-guint            gsd_power_enable_screensaver_watchdog  (void);
+void             gsd_power_enable_screensaver_watchdog  (void);
+void             gsd_power_disable_screensaver_watchdog (void);
 void             reset_idletime                         (void);
 
 /* Backlight helpers */
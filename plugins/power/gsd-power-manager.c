@@ -80,6 +80,14 @@
 /* Keep this in sync with gnome-shell */
 #define SCREENSAVER_FADE_TIME                           10 /* seconds */
 
+/* How long to wait for the screensaver to lock before letting a suspend
+ * go ahead anyway; well below logind's InhibitDelayMaxSec */
+#define SCREENSAVER_LOCK_TIMEOUT                        2000 /* ms */
+
+/* How long to wait for logind to say whether it can suspend or
+ * hibernate, a critical action may be waiting on the answer */
+#define LOGIND_CAN_TIMEOUT                              5000 /* ms */
+
 /* Time between notifying the user about a critical action and executing it.
  * This can be changed with the GSD_ACTION_DELAY constant. */
 #ifndef GSD_ACTION_DELAY
@@ -137,6 +145,13 @@ typedef enum {
         GSD_POWER_IDLE_MODE_SLEEP
 } GsdPowerIdleMode;
 
+/* What logind last said about CanSuspend and CanHibernate */
+typedef enum {
+        GSD_POWER_CAN_UNKNOWN,
+        GSD_POWER_CAN_NO,
+        GSD_POWER_CAN_YES
+} GsdPowerCan;
+
 struct GsdPowerManagerPrivate
 {
         /* D-Bus */
@@ -172,6 +187,15 @@ struct GsdPowerManagerPrivate
         GIcon                   *previous_icon;
         GPtrArray               *devices_array;
         UpDevice                *device_composite;
+        /* Sums over the batteries' snapshots, redone whenever one of
+         * them changes, see engine_sum_batteries() */
+        gint                     battery_count;
+        gint                     battery_charging;
+        gint                     battery_discharging;
+        gint                     battery_not_full;
+        gdouble                  battery_energy;
+        gdouble                  battery_energy_full;
+        gdouble                  battery_energy_rate;
         GsdRRScreen           *rr_screen;
         NotifyNotification      *notification_ups_discharging;
         NotifyNotification      *notification_low;
@@ -186,7 +210,11 @@ struct GsdPowerManagerPrivate
 
         /* Keyboard */
         GDBusProxy              *upower_kdb_proxy;
+        gboolean                 kbd_available;
         gint                     kbd_brightness_max;
+        gint                     kbd_brightness_now;     /* cached, as last set or signalled */
+        gint                     kbd_brightness_pending; /* waiting to be sent, or -1 */
+        gboolean                 kbd_set_in_flight;
         gint                     kbd_brightness_old;
         gint                     kbd_brightness_pre_dim;
 
@@ -200,6 +228,11 @@ struct GsdPowerManagerPrivate
         gboolean                 inhibit_lid_switch_action;
         gint                     inhibit_suspend_fd;
         gboolean                 inhibit_suspend_taken;
+        GsdPowerCan              can_suspend;    /* as last asked, so that */
+        GsdPowerCan              can_hibernate;  /* acting rarely waits on logind */
+        guint                    can_pending;    /* questions not answered yet */
+        gboolean                 critical_action_waiting;
+        gboolean                 critical_action_is_ups;
         guint                    inhibit_lid_switch_timer_id;
         gboolean                 is_virtual_machine;
 
@@ -213,14 +246,26 @@ struct GsdPowerManagerPrivate
 
         guint                    temporary_unidle_on_ac_id;
         GsdPowerIdleMode         previous_idle_mode;
-
-        guint                    xscreensaver_watchdog_timer_id;
 };
 
 enum {
         PROP_0,
 };
 
+/* What we last saw of a device, attached to it as "engine-snapshot" */
+typedef struct {
+        UpDeviceKind             kind;
+        UpDeviceState            state;
+        gboolean                 is_present;
+        gdouble                  percentage;
+        gdouble                  energy;
+        gdouble                  energy_full;
+        gdouble                  energy_rate;
+        gint64                   time_to_empty;
+        gint64                   time_to_full;
+        guint                    warning_level;
+} EngineSnapshot;
+
 static void     gsd_power_manager_class_init  (GsdPowerManagerClass *klass);
 static void     gsd_power_manager_init        (GsdPowerManager      *power_manager);
 
@@ -239,6 +284,8 @@ static gboolean  idle_is_session_inhibited (GsdPowerManager *manager, guint mask
 static void      idle_set_mode (GsdPowerManager *manager, GsdPowerIdleMode mode);
 static void      idle_triggered_idle_cb (GsdIdleMonitor *monitor, guint watch_id, gpointer user_data);
 static void      idle_became_active_cb (GsdIdleMonitor *monitor, guint watch_id, gpointer user_data);
+static GsdPowerCan manager_critical_action_can (GsdPowerManager *manager, gboolean is_ups);
+static void      manager_critical_action_take (GsdPowerManager *manager, gboolean is_ups);
 
 G_DEFINE_TYPE (GsdPowerManager, gsd_power_manager, G_TYPE_OBJECT)
 
@@ -702,66 +749,108 @@ engine_recalculate_state (GsdPowerManager *manager)
                 engine_emit_changed (manager, icon_changed, state_changed);
 }
 
-static UpDevice *
-engine_get_composite_device (GsdPowerManager *manager,
-                             UpDevice *original_device)
+static gboolean
+engine_snapshot_equal (const EngineSnapshot *a,
+                       const EngineSnapshot *b)
 {
-        guint battery_devices = 0;
-        GPtrArray *array;
-        UpDevice *device;
-        UpDeviceKind kind;
-        UpDeviceKind original_kind;
+        return a->kind == b->kind &&
+               a->state == b->state &&
+               a->is_present == b->is_present &&
+               a->percentage == b->percentage &&
+               a->energy == b->energy &&
+               a->energy_full == b->energy_full &&
+               a->energy_rate == b->energy_rate &&
+               a->time_to_empty == b->time_to_empty &&
+               a->time_to_full == b->time_to_full &&
+               a->warning_level == b->warning_level;
+}
+
+/* Sums the batteries up from their snapshots, rather than adjusting
+ * the sums, so that rounding errors don't pile up */
+static void
+engine_sum_batteries (GsdPowerManager *manager)
+{
+        GsdPowerManagerPrivate *priv = manager->priv;
         guint i;
 
-        /* get the type of the original device */
-        g_object_get (original_device,
-                      "kind", &original_kind,
+        priv->battery_count = 0;
+        priv->battery_charging = 0;
+        priv->battery_discharging = 0;
+        priv->battery_not_full = 0;
+        priv->battery_energy = 0.0;
+        priv->battery_energy_full = 0.0;
+        priv->battery_energy_rate = 0.0;
+
+        for (i = 0; i < priv->devices_array->len; i++) {
+                EngineSnapshot *snapshot;
+
+                snapshot = g_object_get_data (g_ptr_array_index (priv->devices_array, i),
+                                              "engine-snapshot");
+                if (snapshot == NULL || snapshot->kind != UP_DEVICE_KIND_BATTERY)
+                        continue;
+
+                priv->battery_count++;
+                if (snapshot->state == UP_DEVICE_STATE_CHARGING)
+                        priv->battery_charging++;
+                if (snapshot->state == UP_DEVICE_STATE_DISCHARGING)
+                        priv->battery_discharging++;
+                if (snapshot->state != UP_DEVICE_STATE_FULLY_CHARGED)
+                        priv->battery_not_full++;
+                priv->battery_energy += snapshot->energy;
+                priv->battery_energy_full += snapshot->energy_full;
+                priv->battery_energy_rate += snapshot->energy_rate;
+        }
+}
+
+/* UpDevice notifies all of its properties whenever upowerd says that
+ * something changed, so this is where we find out whether anything did.
+ * Returns TRUE if so, after updating the battery sums. The device has
+ * to be in devices_array already. */
+static gboolean
+engine_snapshot_device (GsdPowerManager *manager,
+                        UpDevice        *device)
+{
+        EngineSnapshot *snapshot;
+        EngineSnapshot *old;
+
+        snapshot = g_new0 (EngineSnapshot, 1);
+        g_object_get (device,
+                      "kind", &snapshot->kind,
+                      "state", &snapshot->state,
+                      "is-present", &snapshot->is_present,
+                      "percentage", &snapshot->percentage,
+                      "energy", &snapshot->energy,
+                      "energy-full", &snapshot->energy_full,
+                      "energy-rate", &snapshot->energy_rate,
+                      "time-to-empty", &snapshot->time_to_empty,
+                      "time-to-full", &snapshot->time_to_full,
+                      "warning-level", &snapshot->warning_level,
                       NULL);
 
-        /* find out how many batteries in the system */
-        array = manager->priv->devices_array;
-        for (i=0;i<array->len;i++) {
-                device = g_ptr_array_index (array, i);
-                g_object_get (device,
-                              "kind", &kind,
-                              NULL);
-                if (kind == original_kind)
-                        battery_devices++;
+        old = g_object_get_data (G_OBJECT (device), "engine-snapshot");
+        if (old != NULL && engine_snapshot_equal (old, snapshot)) {
+                g_free (snapshot);
+                return FALSE;
         }
 
-        /* just use the original device if only one primary battery */
-        if (battery_devices <= 1)
-                return original_device;
+        g_object_set_data_full (G_OBJECT (device), "engine-snapshot", snapshot, g_free);
+        engine_sum_batteries (manager);
 
-        /* use the composite device */
-        device = manager->priv->device_composite;
+        return TRUE;
+}
 
-        /* return composite device or original device */
-        return device;
+/* The sums need redoing once the device is out of devices_array */
+static void
+engine_forget_device (GsdPowerManager *manager,
+                      UpDevice        *device)
+{
+        g_object_set_data (G_OBJECT (device), "engine-snapshot", NULL);
 }
 
 static UpDevice *
-engine_update_composite_device (GsdPowerManager *manager,
-                                UpDevice *original_device)
+engine_get_composite_device (GsdPowerManager *manager,
+                             UpDevice *original_device)
 {
-        guint i;
-        gdouble percentage = 0.0;
-        gdouble energy = 0.0;
-        gdouble energy_full = 0.0;
-        gdouble energy_rate = 0.0;
-        gdouble energy_total = 0.0;
-        gdouble energy_full_total = 0.0;
-        gdouble energy_rate_total = 0.0;
-        gint64 time_to_empty = 0;
-        gint64 time_to_full = 0;
-        guint battery_devices = 0;
-        gboolean is_charging = FALSE;
-        gboolean is_discharging = FALSE;
-        gboolean is_fully_charged = TRUE;
-        GPtrArray *array;
-        UpDevice *device;
-        UpDeviceState state;
-        UpDeviceKind kind;
         UpDeviceKind original_kind;
 
         /* get the type of the original device */
@@ -769,84 +858,86 @@ engine_update_composite_device (GsdPowerManager *manager,
                       "kind", &original_kind,
                       NULL);
 
-        /* update the composite device */
-        array = manager->priv->devices_array;
-        for (i=0;i<array->len;i++) {
-                device = g_ptr_array_index (array, i);
-                g_object_get (device,
-                              "kind", &kind,
-                              "state", &state,
-                              "energy", &energy,
-                              "energy-full", &energy_full,
-                              "energy-rate", &energy_rate,
-                              NULL);
-                if (kind != original_kind)
-                        continue;
+        /* just use the original device if only one primary battery */
+        if (original_kind != UP_DEVICE_KIND_BATTERY ||
+            manager->priv->battery_count <= 1)
+                return original_device;
 
-                /* one of these will be charging or discharging */
-                if (state == UP_DEVICE_STATE_CHARGING)
-                        is_charging = TRUE;
-                if (state == UP_DEVICE_STATE_DISCHARGING)
-                        is_discharging = TRUE;
-                if (state != UP_DEVICE_STATE_FULLY_CHARGED)
-                        is_fully_charged = FALSE;
+        /* use the composite device */
+        return manager->priv->device_composite;
+}
 
-                /* sum up composite */
-                energy_total += energy;
-                energy_full_total += energy_full;
-                energy_rate_total += energy_rate;
-                battery_devices++;
-        }
+/* Sets the composite battery from the sums, if they say something new */
+static void
+engine_refresh_composite_device (GsdPowerManager *manager)
+{
+        GsdPowerManagerPrivate *priv = manager->priv;
+        EngineSnapshot *old;
+        EngineSnapshot composite = { 0 };
 
-        /* just use the original device if only one primary battery */
-        if (battery_devices == 1) {
-                g_debug ("using original device as only one primary battery");
-                device = original_device;
-                goto out;
-        }
+        if (priv->battery_count <= 1)
+                return;
+
+        composite.kind = UP_DEVICE_KIND_BATTERY;
+        composite.is_present = TRUE;
+        composite.energy = priv->battery_energy;
+        composite.energy_full = priv->battery_energy_full;
+        composite.energy_rate = priv->battery_energy_rate;
 
         /* use percentage weighted for each battery capacity */
-        if (energy_full_total > 0.0)
-                percentage = 100.0 * energy_total / energy_full_total;
+        if (composite.energy_full > 0.0)
+                composite.percentage = 100.0 * composite.energy / composite.energy_full;
 
         /* set composite state */
-        if (is_charging)
-                state = UP_DEVICE_STATE_CHARGING;
-        else if (is_discharging)
-                state = UP_DEVICE_STATE_DISCHARGING;
-        else if (is_fully_charged)
-                state = UP_DEVICE_STATE_FULLY_CHARGED;
+        if (priv->battery_charging > 0)
+                composite.state = UP_DEVICE_STATE_CHARGING;
+        else if (priv->battery_discharging > 0)
+                composite.state = UP_DEVICE_STATE_DISCHARGING;
+        else if (priv->battery_not_full == 0)
+                composite.state = UP_DEVICE_STATE_FULLY_CHARGED;
         else
-                state = UP_DEVICE_STATE_UNKNOWN;
+                composite.state = UP_DEVICE_STATE_UNKNOWN;
 
         /* calculate a quick and dirty time remaining value */
-        if (energy_rate_total > 0) {
-                if (state == UP_DEVICE_STATE_DISCHARGING)
-                        time_to_empty = 3600 * (energy_total / energy_rate_total);
-                else if (state == UP_DEVICE_STATE_CHARGING)
-                        time_to_full = 3600 * ((energy_full_total - energy_total) / energy_rate_total);
+        if (composite.energy_rate > 0) {
+                if (composite.state == UP_DEVICE_STATE_DISCHARGING)
+                        composite.time_to_empty = 3600 * (composite.energy / composite.energy_rate);
+                else if (composite.state == UP_DEVICE_STATE_CHARGING)
+                        composite.time_to_full = 3600 * ((composite.energy_full - composite.energy) / composite.energy_rate);
         }
 
-        /* okay, we can use the composite device */
-        device = manager->priv->device_composite;
+        old = g_object_get_data (G_OBJECT (priv->device_composite), "engine-snapshot");
+        if (old != NULL && engine_snapshot_equal (old, &composite))
+                return;
 
         g_debug ("printing composite device");
-        g_object_set (device,
-                      "energy", energy,
-                      "energy-full", energy_full,
-                      "energy-rate", energy_rate,
-                      "time-to-empty", time_to_empty,
-                      "time-to-full", time_to_full,
-                      "percentage", percentage,
-                      "state", state,
+        g_object_set (priv->device_composite,
+                      "energy", composite.energy,
+                      "energy-full", composite.energy_full,
+                      "energy-rate", composite.energy_rate,
+                      "time-to-empty", composite.time_to_empty,
+                      "time-to-full", composite.time_to_full,
+                      "percentage", composite.percentage,
+                      "state", composite.state,
                       NULL);
 
-        /* force update of icon */
-        if (engine_recalculate_state_icon (manager))
-                engine_emit_changed (manager, TRUE, FALSE);
-out:
-        /* return composite device or original device */
-        return device;
+        g_object_set_data_full (G_OBJECT (priv->device_composite), "engine-snapshot",
+                                g_memdup (&composite, sizeof (composite)), g_free);
+}
+
+static UpDevice *
+engine_update_composite_device (GsdPowerManager *manager,
+                                UpDevice *original_device)
+{
+        /* just use the original device if only one primary battery */
+        if (manager->priv->battery_count <= 1) {
+                g_debug ("using original device as only one primary battery");
+                return original_device;
+        }
+
+        engine_refresh_composite_device (manager);
+
+        return manager->priv->device_composite;
 }
 
 static void
@@ -857,6 +948,9 @@ engine_device_add (GsdPowerManager *manager, UpDevice *device)
         UpDeviceKind kind;
         UpDevice *composite;
 
+        g_ptr_array_add (manager->priv->devices_array, g_object_ref(device));
+        engine_snapshot_device (manager, device);
+
         /* assign warning */
         warning = engine_get_warning (manager, device);
         g_object_set_data (G_OBJECT(device),
@@ -891,8 +985,6 @@ engine_device_add (GsdPowerManager *manager, UpDevice *device)
                                    GUINT_TO_POINTER(state));
         }
 
-        g_ptr_array_add (manager->priv->devices_array, g_object_ref(device));
-
         g_signal_connect (device, "notify::state",
                           G_CALLBACK (device_properties_changed_cb), manager);
         g_signal_connect (device, "notify::warning-level",
@@ -917,6 +1009,8 @@ engine_coldplug (GsdPowerManager *manager)
                 device = g_ptr_array_index (array, i);
                 engine_device_add (manager, device);
         }
+
+        engine_recalculate_state (manager);
 out:
         if (array != NULL)
                 g_ptr_array_unref (array);
@@ -927,8 +1021,15 @@ out:
 static void
 engine_device_added_cb (UpClient *client, UpDevice *device, GsdPowerManager *manager)
 {
-        /* add to list */
-        g_ptr_array_add (manager->priv->devices_array, g_object_ref (device));
+        guint i;
+
+        for (i = 0; i < manager->priv->devices_array->len; i++) {
+                if (g_ptr_array_index (manager->priv->devices_array, i) == device)
+                        return;
+        }
+
+        /* add to list, and to the composite battery */
+        engine_device_add (manager, device);
 
         engine_recalculate_state (manager);
 }
@@ -942,7 +1043,13 @@ engine_device_removed_cb (UpClient *client, const char *object_path, GsdPowerMan
                 UpDevice *device = g_ptr_array_index (manager->priv->devices_array, i);
 
                 if (g_strcmp0 (object_path, up_device_get_object_path (device)) == 0) {
+                        g_signal_handlers_disconnect_by_data (device, manager);
+                        engine_forget_device (manager, device);
                         g_ptr_array_remove_index (manager->priv->devices_array, i);
+
+                        engine_sum_batteries (manager);
+                        engine_refresh_composite_device (manager);
+                        engine_recalculate_state (manager);
                         break;
                 }
         }
@@ -1056,60 +1163,178 @@ engine_ups_discharging (GsdPowerManager *manager, UpDevice *device)
         g_free (remaining_text);
 }
 
-static GsdPowerActionType
-manager_critical_action_get (GsdPowerManager *manager,
+typedef struct {
+        GsdPowerManager *manager;
+        GsdPowerCan     *can;
+        GCancellable    *cancellable;
+} LogindCanCall;
+
+static void
+logind_can_cb (GObject      *source_object,
+               GAsyncResult *res,
+               gpointer      user_data)
+{
+        LogindCanCall *call = user_data;
+        GsdPowerManager *manager = call->manager;
+        GsdPowerCan *can = call->can;
+        GVariant *result;
+        GError *error = NULL;
+        const char *s;
+
+        result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &error);
+
+        /* asked before the manager got stopped, which forgot about it */
+        if (call->cancellable != manager->priv->bus_cancellable) {
+                g_clear_error (&error);
+                g_clear_pointer (&result, g_variant_unref);
+                goto out;
+        }
+
+        if (result == NULL) {
+                /* a logind that doesn't have the method can't do it;
+                 * anything else keeps what we knew, and a timeout or
+                 * cancellation still counts as an answer so that nothing
+                 * waits on it forever */
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        g_warning ("Failed to ask logind what it can do: %s", error->message);
+                if (g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD))
+                        *can = GSD_POWER_CAN_NO;
+                g_error_free (error);
+        } else {
+                g_variant_get (result, "(&s)", &s);
+                *can = g_strcmp0 (s, "yes") == 0 ? GSD_POWER_CAN_YES : GSD_POWER_CAN_NO;
+                g_variant_unref (result);
+        }
+
+        manager->priv->can_pending--;
+
+        /* the critical action was waiting for this answer */
+        if (manager->priv->critical_action_waiting &&
+            (manager->priv->can_pending == 0 ||
+             manager_critical_action_can (manager, manager->priv->critical_action_is_ups) != GSD_POWER_CAN_UNKNOWN)) {
+                manager->priv->critical_action_waiting = FALSE;
+                manager_critical_action_take (manager, manager->priv->critical_action_is_ups);
+        }
+
+out:
+        g_clear_object (&call->cancellable);
+        g_object_unref (call->manager);
+        g_free (call);
+}
+
+static void
+logind_ask_can (GsdPowerManager *manager,
+                const gchar     *method,
+                GsdPowerCan     *can)
+{
+        LogindCanCall *call;
+
+        call = g_new (LogindCanCall, 1);
+        call->manager = g_object_ref (manager);
+        call->can = can;
+        call->cancellable = manager->priv->bus_cancellable != NULL ?
+                            g_object_ref (manager->priv->bus_cancellable) : NULL;
+
+        manager->priv->can_pending++;
+        g_dbus_proxy_call (manager->priv->logind_proxy,
+                           method,
+                           NULL,
+                           G_DBUS_CALL_FLAGS_NONE,
+                           LOGIND_CAN_TIMEOUT,
+                           call->cancellable,
+                           logind_can_cb,
+                           call);
+}
+
+/* Asked ahead of time, since when a battery goes critical is no time to
+ * wait on a busy logind */
+static void
+logind_refresh_capabilities (GsdPowerManager *manager)
+{
+        if (manager->priv->logind_proxy == NULL ||
+            manager->priv->can_pending > 0)
+                return;
+
+        logind_ask_can (manager, "CanSuspend", &manager->priv->can_suspend);
+        logind_ask_can (manager, "CanHibernate", &manager->priv->can_hibernate);
+}
+
+/* Whether logind can do the configured critical action */
+static GsdPowerCan
+manager_critical_action_can (GsdPowerManager *manager,
                              gboolean         is_ups)
 {
         GsdPowerActionType policy;
-        GVariant *result = NULL;
 
         policy = g_settings_get_enum (manager->priv->settings, "critical-battery-action");
 
-        if (policy == GSD_POWER_ACTION_SUSPEND) {
-                if (is_ups == FALSE) {
-                        result = g_dbus_proxy_call_sync (manager->priv->logind_proxy,
-                                                         "CanSuspend",
-                                                         NULL,
-                                                         G_DBUS_CALL_FLAGS_NONE,
-                                                         -1, NULL, NULL);
-                }
-        } else if (policy == GSD_POWER_ACTION_HIBERNATE) {
-                result = g_dbus_proxy_call_sync (manager->priv->logind_proxy,
-                                                 "CanHibernate",
-                                                 NULL,
-                                                 G_DBUS_CALL_FLAGS_NONE,
-                                                 -1, NULL, NULL);
-        } else {
-                /* Other actions need no check */
-                return policy;
-        }
+        if (policy == GSD_POWER_ACTION_SUSPEND)
+                return is_ups ? GSD_POWER_CAN_NO : manager->priv->can_suspend;
+        if (policy == GSD_POWER_ACTION_HIBERNATE)
+                return manager->priv->can_hibernate;
+
+        /* Other actions need no check */
+        return GSD_POWER_CAN_YES;
+}
+
+static GsdPowerActionType
+manager_critical_action_get (GsdPowerManager *manager,
+                             gboolean         is_ups)
+{
+        GsdPowerActionType policy;
+        GsdPowerCan can;
 
-        if (result) {
-                const char *s;
+        policy = g_settings_get_enum (manager->priv->settings, "critical-battery-action");
+        can = manager_critical_action_can (manager, is_ups);
 
-                g_variant_get (result, "(s)", &s);
-                if (g_strcmp0 (s, "yes") != 0)
-                        policy = GSD_POWER_ACTION_SHUTDOWN;
+        /* this gets asked when warning about the action too, so the
+         * answer is fresh by the time it is taken */
+        if (policy == GSD_POWER_ACTION_SUSPEND ||
+            policy == GSD_POWER_ACTION_HIBERNATE)
+                logind_refresh_capabilities (manager);
 
-                g_variant_unref (result);
-        } else {
+        /* until logind answers, the configured action is what we
+         * warn about */
+        if (can == GSD_POWER_CAN_NO)
                 policy = GSD_POWER_ACTION_SHUTDOWN;
-        }
 
         return policy;
 }
 
+static void
+manager_critical_action_take (GsdPowerManager *manager,
+                              gboolean         is_ups)
+{
+        GsdPowerActionType action_type;
+
+        action_type = manager_critical_action_get (manager, is_ups);
+
+        /* logind never answered, so don't count on it */
+        if (manager_critical_action_can (manager, is_ups) == GSD_POWER_CAN_UNKNOWN)
+                action_type = GSD_POWER_ACTION_SHUTDOWN;
+
+        do_power_action_type (manager, action_type);
+}
+
 static gboolean
 manager_critical_action_do (GsdPowerManager *manager,
                             gboolean         is_ups)
 {
-        GsdPowerActionType action_type;
-
         /* stop playing the alert as it's too late to do anything now */
         play_loop_stop (&manager->priv->critical_alert_timeout_id);
 
-        action_type = manager_critical_action_get (manager, is_ups);
-        do_power_action_type (manager, action_type);
+        /* logind hasn't answered yet, act once it does */
+        if (manager_critical_action_can (manager, is_ups) == GSD_POWER_CAN_UNKNOWN) {
+                logind_refresh_capabilities (manager);
+                if (manager->priv->can_pending > 0) {
+                        g_debug ("waiting for logind before the critical action");
+                        manager->priv->critical_action_waiting = TRUE;
+                        manager->priv->critical_action_is_ups = is_ups;
+                        return FALSE;
+                }
+        }
+
+        manager_critical_action_take (manager, is_ups);
 
         return FALSE;
 }
@@ -1611,6 +1836,10 @@ device_properties_changed_cb (UpDevice *device, GParamSpec *pspec, GsdPowerManag
         GsdPowerManagerWarning warning_old;
         GsdPowerManagerWarning warning;
 
+        /* nothing we show depends on what changed, if anything did */
+        if (!engine_snapshot_device (manager, device))
+                return;
+
         /* get device properties */
         g_object_get (device,
                       "kind", &kind,
@@ -1921,54 +2150,154 @@ is_action_inhibited (GsdPowerManager *manager, GsdPowerActionType action_type)
         return is_inhibited;
 }
 
-static gboolean
+/* The keyboard backlight level is cached, and kept current from UPower's
+ * BrightnessChanged signal, so reading it costs nothing. Writes go out
+ * one at a time without blocking; a new value replaces any that hasn't
+ * been sent yet, so that a burst of key presses ends up as at most two
+ * calls to UPower. */
+static gint
 upower_kbd_get_brightness (GsdPowerManager *manager)
 {
-        GVariant *k_now = NULL;
+        if (!manager->priv->kbd_available)
+                return -1;
+
+        return manager->priv->kbd_brightness_now;
+}
+
+static void upower_kbd_send_brightness (GsdPowerManager *manager);
+
+static void
+upower_kbd_get_brightness_cb (GObject      *source_object,
+                              GAsyncResult *res,
+                              gpointer      user_data)
+{
+        GsdPowerManager *manager;
+        GVariant *k_now;
         GError *error = NULL;
-        gint now;
+        gint now = -1;
 
-        k_now = g_dbus_proxy_call_sync (manager->priv->upower_kdb_proxy,
-                                        "GetBrightness",
-                                        NULL,
-                                        G_DBUS_CALL_FLAGS_NONE,
-                                        -1,
-                                        NULL,
-                                        &error);
+        k_now = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &error);
         if (k_now == NULL) {
+                if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                        g_error_free (error);
+                        return;
+                }
                 if (error->domain != G_DBUS_ERROR ||
                     error->code != G_DBUS_ERROR_UNKNOWN_METHOD) {
                         g_warning ("Failed to get brightness: %s",
                                    error->message);
                 }
+                g_error_free (error);
+        } else {
+                g_variant_get (k_now, "(i)", &now);
+                g_variant_unref (k_now);
+        }
+
+        manager = GSD_POWER_MANAGER (user_data);
+
+        if (!manager->priv->kbd_available) {
+                /* first read: set brightness to max if not currently set
+                 * so is something sensible */
+                manager->priv->kbd_available = TRUE;
+                if (now < 0) {
+                        upower_kbd_set_brightness (manager, manager->priv->kbd_brightness_max, NULL);
+                        return;
+                }
+        }
 
+        /* a write that is still on its way is newer than this */
+        if (now >= 0 &&
+            !manager->priv->kbd_set_in_flight &&
+            manager->priv->kbd_brightness_pending < 0)
+                manager->priv->kbd_brightness_now = now;
+}
+
+static void
+upower_kbd_refresh_brightness (GsdPowerManager *manager)
+{
+        g_dbus_proxy_call (manager->priv->upower_kdb_proxy,
+                           "GetBrightness",
+                           NULL,
+                           G_DBUS_CALL_FLAGS_NONE,
+                           -1,
+                           manager->priv->bus_cancellable,
+                           upower_kbd_get_brightness_cb,
+                           manager);
+}
+
+static void
+upower_kbd_set_brightness_cb (GObject      *source_object,
+                              GAsyncResult *res,
+                              gpointer      user_data)
+{
+        GsdPowerManager *manager;
+        GVariant *retval;
+        GError *error = NULL;
+
+        retval = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &error);
+        if (retval == NULL && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
                 g_error_free (error);
-                return -1;
+                return;
         }
 
-        g_variant_get (k_now, "(i)", &now);
-        g_variant_unref (k_now);
+        manager = GSD_POWER_MANAGER (user_data);
+        manager->priv->kbd_set_in_flight = FALSE;
 
-        return now;
+        if (retval == NULL) {
+                g_warning ("Failed to set keyboard brightness: %s", error->message);
+                g_error_free (error);
+        } else {
+                g_variant_unref (retval);
+        }
+
+        if (manager->priv->kbd_brightness_pending >= 0)
+                upower_kbd_send_brightness (manager);
+        else if (retval == NULL)
+                upower_kbd_refresh_brightness (manager); /* the cache is wrong now */
+}
+
+static void
+upower_kbd_send_brightness (GsdPowerManager *manager)
+{
+        gint value = manager->priv->kbd_brightness_pending;
+
+        manager->priv->kbd_brightness_pending = -1;
+        manager->priv->kbd_set_in_flight = TRUE;
+
+        g_dbus_proxy_call (manager->priv->upower_kdb_proxy,
+                           "SetBrightness",
+                           g_variant_new ("(i)", value),
+                           G_DBUS_CALL_FLAGS_NONE,
+                           -1,
+                           manager->priv->bus_cancellable,
+                           upower_kbd_set_brightness_cb,
+                           manager);
 }
 
 static gboolean
 upower_kbd_set_brightness (GsdPowerManager *manager, guint value, GError **error)
 {
-        GVariant *retval;
-
-        /* update h/w value */
-        retval = g_dbus_proxy_call_sync (manager->priv->upower_kdb_proxy,
-                                         "SetBrightness",
-                                         g_variant_new ("(i)", (gint) value),
-                                         G_DBUS_CALL_FLAGS_NONE,
-                                         -1,
-                                         NULL,
-                                         error);
-        if (retval == NULL)
+        if (!manager->priv->kbd_available) {
+                g_set_error_literal (error,
+                                     GSD_POWER_MANAGER_ERROR,
+                                     GSD_POWER_MANAGER_ERROR_FAILED,
+                                     "Keyboard backlight not available");
                 return FALSE;
+        }
+
+        if (!manager->priv->kbd_set_in_flight &&
+            manager->priv->kbd_brightness_pending < 0 &&
+            manager->priv->kbd_brightness_now == (gint) value)
+                return TRUE;
+
+        manager->priv->kbd_brightness_now = value;
+        manager->priv->kbd_brightness_pending = value;
+
+        if (manager->priv->kbd_set_in_flight)
+                g_debug ("keyboard brightness %i queued behind a write in flight", value);
+        else
+                upower_kbd_send_brightness (manager);
 
-        g_variant_unref (retval);
         return TRUE;
 }
 
@@ -2103,26 +2432,56 @@ do_lid_open_action (GsdPowerManager *manager)
 }
 
 static void
-lock_screensaver (GsdPowerManager *manager)
+lock_screensaver_cb (GObject      *source_object,
+                     GAsyncResult *res,
+                     gpointer      user_data)
 {
+        GTask *task = user_data;
+        GVariant *result;
+        GError *error = NULL;
+
+        result = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &error);
+        if (result == NULL) {
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        g_warning ("Failed to lock the screen: %s", error->message);
+                g_task_return_error (task, error);
+        } else {
+                g_variant_unref (result);
+                g_task_return_boolean (task, TRUE);
+        }
+        g_object_unref (task);
+}
+
+/* Completes once the screensaver is locked, or has failed to lock within
+ * SCREENSAVER_LOCK_TIMEOUT, so that nothing waits on it for long */
+static void
+lock_screensaver (GsdPowerManager     *manager,
+                  GAsyncReadyCallback  callback,
+                  gpointer             user_data)
+{
+        GTask *task;
         gboolean do_lock;
 
-        do_lock = g_settings_get_boolean (manager->priv->settings_screensaver,
-                                          "lock-enabled");
-        if (!do_lock) {
-                g_dbus_proxy_call_sync (G_DBUS_PROXY (manager->priv->screensaver_proxy),
-                                        "SetActive",
-                                        g_variant_new ("(b)", TRUE),
-                                        G_DBUS_CALL_FLAGS_NONE,
-                                        -1, NULL, NULL);
+        task = g_task_new (manager, manager->priv->bus_cancellable, callback, user_data);
+
+        if (manager->priv->screensaver_proxy == NULL) {
+                g_task_return_new_error (task, GSD_POWER_MANAGER_ERROR,
+                                         GSD_POWER_MANAGER_ERROR_FAILED,
+                                         "No screensaver");
+                g_object_unref (task);
                 return;
         }
 
-        g_dbus_proxy_call_sync (G_DBUS_PROXY (manager->priv->screensaver_proxy),
-                                "Lock",
-                                NULL,
-                                G_DBUS_CALL_FLAGS_NONE,
-                                -1, NULL, NULL);
+        do_lock = g_settings_get_boolean (manager->priv->settings_screensaver,
+                                          "lock-enabled");
+        g_dbus_proxy_call (G_DBUS_PROXY (manager->priv->screensaver_proxy),
+                           do_lock ? "Lock" : "SetActive",
+                           do_lock ? NULL : g_variant_new ("(b)", TRUE),
+                           G_DBUS_CALL_FLAGS_NONE,
+                           SCREENSAVER_LOCK_TIMEOUT,
+                           manager->priv->bus_cancellable,
+                           lock_screensaver_cb,
+                           task);
 }
 
 static void
@@ -2150,12 +2509,12 @@ do_lid_closed_action (GsdPowerManager *manager)
                         g_debug ("Suspend is inhibited but lid is closed, locking the screen");
                         /* We put the screensaver on * as we're not suspending,
                          * but the lid is closed */
-                        lock_screensaver (manager);
+                        lock_screensaver (manager, NULL, NULL);
                 }
         }
         else {
                 if (manager->priv->inhibit_lid_switch_action)
-                        lock_screensaver (manager);
+                        lock_screensaver (manager, NULL, NULL);
         }
 }
 
@@ -2294,7 +2653,7 @@ kbd_backlight_dim (GsdPowerManager *manager,
         gint max;
         gint now;
 
-        if (manager->priv->upower_kdb_proxy == NULL)
+        if (!manager->priv->kbd_available)
                 return TRUE;
 
         now = upower_kbd_get_brightness (manager);
@@ -2404,7 +2763,7 @@ idle_set_mode (GsdPowerManager *manager, GsdPowerIdleMode mode)
                 backlight_disable (manager);
 
                 /* only toggle keyboard if present and not already toggled */
-                if (manager->priv->upower_kdb_proxy &&
+                if (manager->priv->kbd_available &&
                     manager->priv->kbd_brightness_old == -1) {
                         if (upower_kbd_toggle (manager, &error) < 0) {
                                 g_warning ("failed to turn the kbd backlight off: %s",
@@ -2446,7 +2805,7 @@ idle_set_mode (GsdPowerManager *manager, GsdPowerIdleMode mode)
                 }
 
                 /* only toggle keyboard if present and already toggled off */
-                if (manager->priv->upower_kdb_proxy &&
+                if (manager->priv->kbd_available &&
                     manager->priv->kbd_brightness_old != -1) {
                         if (upower_kbd_toggle (manager, &error) < 0) {
                                 g_warning ("failed to turn the kbd backlight on: %s",
@@ -2798,58 +3157,90 @@ screensaver_signal_cb (GDBusProxy *proxy,
 }
 
 static void
-power_keyboard_proxy_ready_cb (GObject             *source_object,
-                               GAsyncResult        *res,
-                               gpointer             user_data)
+power_keyboard_signal_cb (GDBusProxy  *proxy,
+                          const gchar *sender_name,
+                          const gchar *signal_name,
+                          GVariant    *parameters,
+                          gpointer     user_data)
 {
-        GVariant *k_max = NULL;
-        GError *error = NULL;
         GsdPowerManager *manager = GSD_POWER_MANAGER (user_data);
+        gint value;
 
-        manager->priv->upower_kdb_proxy = g_dbus_proxy_new_for_bus_finish (res, &error);
-        if (manager->priv->upower_kdb_proxy == NULL) {
-                g_warning ("Could not connect to UPower: %s",
-                           error->message);
-                g_error_free (error);
-                goto out;
-        }
+        if (g_strcmp0 (signal_name, "BrightnessChanged") == 0)
+                g_variant_get (parameters, "(i)", &value);
+        else if (g_strcmp0 (signal_name, "BrightnessChangedWithSource") == 0)
+                g_variant_get (parameters, "(i&s)", &value, NULL);
+        else
+                return;
+
+        /* our own writes echo back, ignore those still in progress */
+        if (manager->priv->kbd_set_in_flight ||
+            manager->priv->kbd_brightness_pending >= 0)
+                return;
+
+        manager->priv->kbd_brightness_now = value;
+}
+
+static void
+power_keyboard_max_brightness_cb (GObject      *source_object,
+                                  GAsyncResult *res,
+                                  gpointer      user_data)
+{
+        GsdPowerManager *manager;
+        GVariant *k_max;
+        GError *error = NULL;
 
-        k_max = g_dbus_proxy_call_sync (manager->priv->upower_kdb_proxy,
-                                        "GetMaxBrightness",
-                                        NULL,
-                                        G_DBUS_CALL_FLAGS_NONE,
-                                        -1,
-                                        NULL,
-                                        &error);
+        k_max = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &error);
         if (k_max == NULL) {
-                if (error->domain != G_DBUS_ERROR ||
-                    error->code != G_DBUS_ERROR_UNKNOWN_METHOD) {
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED) &&
+                    (error->domain != G_DBUS_ERROR ||
+                     error->code != G_DBUS_ERROR_UNKNOWN_METHOD)) {
                         g_warning ("Failed to get max brightness: %s",
                                    error->message);
                 }
                 g_error_free (error);
-                goto out;
+                return;
         }
 
+        manager = GSD_POWER_MANAGER (user_data);
         g_variant_get (k_max, "(i)", &manager->priv->kbd_brightness_max);
+        g_variant_unref (k_max);
 
-        /* set brightness to max if not currently set so is something
-         * sensible */
-        if (upower_kbd_get_brightness (manager) < 0) {
-                gboolean ret;
-                ret = upower_kbd_set_brightness (manager,
-                                                 manager->priv->kbd_brightness_max,
-                                                 &error);
-                if (!ret) {
-                        g_warning ("failed to initialize kbd backlight to %i: %s",
-                                   manager->priv->kbd_brightness_max,
+        upower_kbd_refresh_brightness (manager);
+}
+
+static void
+power_keyboard_proxy_ready_cb (GObject             *source_object,
+                               GAsyncResult        *res,
+                               gpointer             user_data)
+{
+        GError *error = NULL;
+        GDBusProxy *proxy;
+        GsdPowerManager *manager;
+
+        proxy = g_dbus_proxy_new_for_bus_finish (res, &error);
+        if (proxy == NULL) {
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        g_warning ("Could not connect to UPower: %s",
                                    error->message);
-                        g_error_free (error);
-                }
+                g_error_free (error);
+                return;
         }
-out:
-        if (k_max != NULL)
-                g_variant_unref (k_max);
+
+        manager = GSD_POWER_MANAGER (user_data);
+        manager->priv->upower_kdb_proxy = proxy;
+
+        g_signal_connect (proxy, "g-signal",
+                          G_CALLBACK (power_keyboard_signal_cb), manager);
+
+        g_dbus_proxy_call (proxy,
+                           "GetMaxBrightness",
+                           NULL,
+                           G_DBUS_CALL_FLAGS_NONE,
+                           -1,
+                           manager->priv->bus_cancellable,
+                           power_keyboard_max_brightness_cb,
+                           manager);
 }
 
 static void
@@ -3155,9 +3546,37 @@ received_sigusr2 (GsdPowerManager *manager)
 }
 #endif /* GSD_MOCK */
 
+static void
+suspend_locked_cb (GObject      *source_object,
+                   GAsyncResult *res,
+                   gpointer      user_data)
+{
+        GsdPowerManager *manager = GSD_POWER_MANAGER (source_object);
+        GError *error = NULL;
+
+        if (!g_task_propagate_boolean (G_TASK (res), &error) &&
+            g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                g_error_free (error);
+                return;
+        }
+        g_clear_error (&error);
+
+        /* locked, or given up on it: let the suspend go ahead */
+        backlight_disable (manager);
+        uninhibit_suspend (manager);
+}
+
 static void
 handle_suspend_actions (GsdPowerManager *manager)
 {
+        /* the delay inhibitor holds the suspend back until the screen
+         * is locked, so that it never comes back up unlocked */
+        if (g_settings_get_boolean (manager->priv->settings_screensaver, "lock-enabled")) {
+                g_debug ("Locking the screen before suspend");
+                lock_screensaver (manager, suspend_locked_cb, NULL);
+                return;
+        }
+
         backlight_disable (manager);
         uninhibit_suspend (manager);
 }
@@ -3180,6 +3599,9 @@ handle_resume_actions (GsdPowerManager *manager)
 
         /* set up the delay again */
         inhibit_suspend (manager);
+
+        /* things like swap may have changed while asleep */
+        logind_refresh_capabilities (manager);
 }
 
 static void
@@ -3241,6 +3663,7 @@ gsd_power_manager_start (GsdPowerManager *manager,
                           manager);
         /* Set up a delay inhibitor to be informed about suspend attempts */
         inhibit_suspend (manager);
+        logind_refresh_capabilities (manager);
 
         /* track the active session */
         manager->priv->session = gnome_settings_bus_get_session_proxy ();
@@ -3255,6 +3678,8 @@ gsd_power_manager_start (GsdPowerManager *manager,
 
         manager->priv->kbd_brightness_old = -1;
         manager->priv->kbd_brightness_pre_dim = -1;
+        manager->priv->kbd_brightness_now = -1;
+        manager->priv->kbd_brightness_pending = -1;
         manager->priv->pre_dim_brightness = -1;
         manager->priv->settings = g_settings_new (GSD_POWER_SETTINGS_SCHEMA);
         g_signal_connect (manager->priv->settings, "changed",
@@ -3284,7 +3709,7 @@ gsd_power_manager_start (GsdPowerManager *manager,
                                   UPOWER_DBUS_NAME,
                                   UPOWER_DBUS_PATH_KBDBACKLIGHT,
                                   UPOWER_DBUS_INTERFACE_KBDBACKLIGHT,
-                                  NULL,
+                                  manager->priv->bus_cancellable,
                                   power_keyboard_proxy_ready_cb,
                                   manager);
 
@@ -3352,7 +3777,7 @@ gsd_power_manager_start (GsdPowerManager *manager,
         engine_coldplug (manager);
         idle_configure (manager);
 
-        manager->priv->xscreensaver_watchdog_timer_id = gsd_power_enable_screensaver_watchdog ();
+        gsd_power_enable_screensaver_watchdog ();
 
         /* don't blank inside a VM */
         manager->priv->is_virtual_machine = gsd_power_is_hardware_a_vm ();
@@ -3381,6 +3806,13 @@ gsd_power_manager_stop (GsdPowerManager *manager)
                 manager->priv->bus_cancellable = NULL;
         }
 
+        /* the answers to questions still in flight get ignored, so
+         * nothing is pending any more, and nothing waits */
+        manager->priv->can_pending = 0;
+        manager->priv->critical_action_waiting = FALSE;
+        manager->priv->can_suspend = GSD_POWER_CAN_UNKNOWN;
+        manager->priv->can_hibernate = GSD_POWER_CAN_UNKNOWN;
+
         if (manager->priv->introspection_data) {
                 g_dbus_node_info_unref (manager->priv->introspection_data);
                 manager->priv->introspection_data = NULL;
@@ -3408,6 +3840,14 @@ gsd_power_manager_stop (GsdPowerManager *manager)
 
         g_clear_object (&manager->priv->logind_proxy);
 
+        if (manager->priv->upower_kdb_proxy != NULL) {
+                g_signal_handlers_disconnect_by_data (manager->priv->upower_kdb_proxy, manager);
+                g_clear_object (&manager->priv->upower_kdb_proxy);
+        }
+        manager->priv->kbd_available = FALSE;
+        manager->priv->kbd_set_in_flight = FALSE;
+        manager->priv->kbd_brightness_pending = -1;
+
         if (manager->priv->rr_screen) {
                 g_signal_handlers_disconnect_by_data (manager->priv->rr_screen, manager);
                 g_clear_object (&manager->priv->rr_screen);
@@ -3415,8 +3855,10 @@ gsd_power_manager_stop (GsdPowerManager *manager)
 
         devices = manager->priv->devices_array;
         if (devices != NULL) {
-                for (i = 0; i < devices->len; i++)
+                for (i = 0; i < devices->len; i++) {
                         g_signal_handlers_disconnect_by_data (g_ptr_array_index (devices, i), manager);
+                        engine_forget_device (manager, g_ptr_array_index (devices, i));
+                }
                 g_ptr_array_unref (devices);
                 manager->priv->devices_array = NULL;
         }
@@ -3433,10 +3875,7 @@ gsd_power_manager_stop (GsdPowerManager *manager)
 
         g_clear_object (&manager->priv->idle_monitor);
 
-        if (manager->priv->xscreensaver_watchdog_timer_id > 0) {
-                g_source_remove (manager->priv->xscreensaver_watchdog_timer_id);
-                manager->priv->xscreensaver_watchdog_timer_id = 0;
-        }
+        gsd_power_disable_screensaver_watchdog ();
 }
 
 static void
@@ -11,6 +11,7 @@ import sys
 import time
 import os
 import os.path
+import re
 import signal
 
 project_root = os.path.dirname(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
@@ -24,7 +25,7 @@ import gsdpowerenums
 
 import dbus
 
-from gi.repository import Gio
+from gi.repository import Gio, GLib
 
 
 class PowerPluginTest(gsdtestcase.GSDTestCase):
@@ -82,27 +83,7 @@ class PowerPluginTest(gsdtestcase.GSDTestCase):
         self.settings_gsd_power['active'] = False
         Gio.Settings.sync()
         self.plugin_log_write = open(os.path.join(self.workdir, 'plugin_power.log'), 'wb')
-        # avoid painfully long delays of actions for tests
-        env = os.environ.copy()
-        env['GSD_DISABLE_BACKLIGHT_HELPER'] = '1'
-        self.daemon = subprocess.Popen(
-            [os.path.join(builddir, 'usd-test-power')],
-            # comment out this line if you want to see the logs in real time
-            stdout=self.plugin_log_write,
-            stderr=subprocess.STDOUT,
-            env=env)
-
-        # you can use this for reading the current daemon log in tests
-        self.plugin_log = open(self.plugin_log_write.name)
-
-        # wait until plugin is ready
-        timeout = 100
-        while timeout > 0:
-            time.sleep(0.1)
-            timeout -= 1
-            log = self.plugin_log.read()
-            if 'System inhibitor fd is' in log:
-                break
+        self.start_daemon()
 
         # always start with zero idle time
         self.reset_idle_timer()
@@ -150,6 +131,31 @@ class PowerPluginTest(gsdtestcase.GSDTestCase):
         # we check this at the end so that the other cleanup always happens
         self.assertTrue(daemon_running or self.daemon_death_expected, 'daemon died during the test')
 
+    def start_daemon(self):
+        '''Start the power plugin and wait until it is ready'''
+
+        # avoid painfully long delays of actions for tests
+        env = os.environ.copy()
+        env['GSD_DISABLE_BACKLIGHT_HELPER'] = '1'
+        self.daemon = subprocess.Popen(
+            [os.path.join(builddir, 'usd-test-power')],
+            # comment out this line if you want to see the logs in real time
+            stdout=self.plugin_log_write,
+            stderr=subprocess.STDOUT,
+            env=env)
+
+        # you can use this for reading the current daemon log in tests
+        self.plugin_log = open(self.plugin_log_write.name)
+
+        # wait until plugin is ready
+        timeout = 100
+        while timeout > 0:
+            time.sleep(0.1)
+            timeout -= 1
+            log = self.plugin_log.read()
+            if 'System inhibitor fd is' in log:
+                break
+
     def stop_session(self):
         '''Stop GNOME session'''
 
@@ -298,6 +304,23 @@ class PowerPluginTest(gsdtestcase.GSDTestCase):
         else:
             self.fail('timed out waiting for blank')
 
+    def check_dpms_off(self, seconds):
+        '''Check that the monitor stays off for the given time after blanking'''
+
+        def dpms_state():
+            out = subprocess.check_output(['xset', 'q']).decode()
+            m = re.search(r'Monitor is (\w+)', out)
+            return m.group(1) if m else None
+
+        if dpms_state() is None:
+            # no DPMS on this X server
+            return
+
+        end = time.time() + seconds
+        while time.time() < end:
+            self.assertEqual(dpms_state(), 'Off', 'monitor came back on after blanking')
+            time.sleep(0.2)
+
     def check_unblank(self, timeout):
         '''Check that unblank is requested.
 
@@ -337,6 +360,7 @@ class PowerPluginTest(gsdtestcase.GSDTestCase):
 
         # blank is supposed to happen straight away
         self.check_blank(2)
+        self.check_dpms_off(2)
 
         # wiggle the mouse now and check for unblank; this is expected to pop up
         # the locked screen saver
@@ -651,6 +675,256 @@ class PowerPluginTest(gsdtestcase.GSDTestCase):
 
         self.check_for_suspend(5)
 
+    def test_composite_battery_quiet(self):
+        '''unchanged battery refreshes don't re-emit the power state'''
+
+        bat1_path = self.obj_upower.AddDischargingBattery('mock_BAT1', 'Bat1', 30.0, 1200)
+        obj_bat1 = self.system_bus_con.get_object('org.freedesktop.UPower', bat1_path)
+        self.obj_upower.EmitSignal('', 'DeviceAdded', 's', [bat1_path],
+                                   dbus_interface='org.freedesktop.DBus.Mock')
+        bat2_path = self.obj_upower.AddDischargingBattery('mock_BAT2', 'Bat2', 40.0, 1600)
+        self.obj_upower.EmitSignal('', 'DeviceAdded', 's', [bat2_path],
+                                   dbus_interface='org.freedesktop.DBus.Mock')
+        time.sleep(1)
+
+        changes = []
+        bus = Gio.bus_get_sync(Gio.BusType.SESSION, None)
+        sub_id = bus.signal_subscribe(None, 'org.freedesktop.DBus.Properties', 'PropertiesChanged',
+                                      '/org/gnome/SettingsDaemon/Power', None,
+                                      Gio.DBusSignalFlags.NONE,
+                                      lambda *args: changes.append(args[5]), None)
+
+        def run_loop(timeout):
+            ctx = GLib.MainContext.default()
+            end = time.time() + timeout
+            while time.time() < end:
+                while ctx.iteration(False):
+                    pass
+                time.sleep(0.05)
+
+        def refresh_bat1():
+            obj_bat1.EmitSignal('', 'Changed', '', [], dbus_interface='org.freedesktop.DBus.Mock')
+            self.obj_upower.EmitSignal('', 'DeviceChanged', 's', [bat1_path],
+                                       dbus_interface='org.freedesktop.DBus.Mock')
+
+        updating = 'updating because %s changed' % bat1_path
+        self.plugin_log.read()
+
+        # upowerd sending the same values over and over again
+        for i in range(50):
+            refresh_bat1()
+        run_loop(2)
+        self.assertEqual(changes, [])
+        # nothing was recomputed either
+        log = self.plugin_log.read()
+        self.assertFalse(updating in log, log)
+
+        # the warning level on its own is news
+        try:
+            obj_bat1.AddProperty('org.freedesktop.UPower.Device', 'WarningLevel',
+                                 dbus.UInt32(3, variant_level=1),
+                                 dbus_interface='org.freedesktop.DBus.Mock')
+        except dbus.exceptions.DBusException:
+            obj_bat1.Set('org.freedesktop.UPower.Device', 'WarningLevel',
+                         dbus.UInt32(3, variant_level=1),
+                         dbus_interface=dbus.PROPERTIES_IFACE)
+        refresh_bat1()
+        run_loop(1)
+        log = self.plugin_log.read()
+        self.assertEqual(log.count(updating), 1, log)
+
+        # a real change gets through
+        obj_bat1.Set('org.freedesktop.UPower.Device', 'TimeToEmpty',
+                     dbus.Int64(600, variant_level=1),
+                     dbus_interface=dbus.PROPERTIES_IFACE)
+        obj_bat1.Set('org.freedesktop.UPower.Device', 'Energy',
+                     dbus.Double(10.0, variant_level=1),
+                     dbus_interface=dbus.PROPERTIES_IFACE)
+        obj_bat1.Set('org.freedesktop.UPower.Device', 'State',
+                     dbus.UInt32(1, variant_level=1),
+                     dbus_interface=dbus.PROPERTIES_IFACE)
+        refresh_bat1()
+        run_loop(2)
+        self.assertGreater(len(changes), 0)
+
+        bus.signal_unsubscribe(sub_id)
+
+    def test_kbd_backlight_async(self):
+        '''keyboard backlight steps don't wait for a slow UPower'''
+
+        self.daemon.terminate()
+        self.daemon.wait()
+        self.plugin_log.close()
+
+        # each write takes a while, like a slow EC would
+        self.obj_upower.AddObject('/org/freedesktop/UPower/KbdBacklight',
+                                  'org.freedesktop.UPower.KbdBacklight',
+                                  {}, [
+                                      ('GetMaxBrightness', '', 'i', 'ret = 10'),
+                                      ('GetBrightness', '', 'i', 'ret = getattr(self, "brightness", 2)'),
+                                      ('SetBrightness', 'i', '',
+                                       'time.sleep(0.5); self.brightness = args[0]; '
+                                       'self.EmitSignal("org.freedesktop.UPower.KbdBacklight", '
+                                       '"BrightnessChanged", "i", [args[0]])'),
+                                  ], dbus_interface='org.freedesktop.DBus.Mock')
+        obj_kbd = self.system_bus_con.get_object('org.freedesktop.UPower',
+                                                 '/org/freedesktop/UPower/KbdBacklight')
+
+        self.start_daemon()
+        time.sleep(0.5)
+
+        obj_kbd_gsd = self.session_bus_con.get_object('org.gnome.SettingsDaemon.Power',
+                                                      '/org/gnome/SettingsDaemon/Power')
+        start = time.time()
+        for i in range(8):
+            percentage = obj_kbd_gsd.StepUp(dbus_interface='org.gnome.SettingsDaemon.Power.Keyboard')
+        # none of the steps waited for a write
+        self.assertLess(time.time() - start, 0.5)
+        self.assertEqual(percentage, 100)
+
+        time.sleep(2)
+        calls = [c for c in obj_kbd.GetCalls(dbus_interface='org.freedesktop.DBus.Mock')
+                 if c[1] == 'SetBrightness']
+        # the first step goes out at once, the rest are folded into one
+        self.assertLess(len(calls), 8)
+        self.assertEqual(calls[-1][2], [10])
+        self.assertEqual(obj_kbd.GetBrightness(dbus_interface='org.freedesktop.UPower.KbdBacklight'), 10)
+
+    def test_builtin_screensaver_guard(self):
+        '''the X server's own screensaver gets turned off again'''
+
+        def server_timeout():
+            out = subprocess.check_output(['xset', 'q']).decode()
+            m = re.search(r'timeout:\s+(\d+)', out)
+            return int(m.group(1))
+
+        # turned off at startup
+        self.assertEqual(server_timeout(), 0)
+
+        # someone turns it back on; nothing notices until it comes on
+        # after its timeout, and then it is turned off again
+        subprocess.check_call(['xset', 's', '1', '0'])
+        self.assertEqual(server_timeout(), 1)
+        time.sleep(3)
+        self.assertEqual(server_timeout(), 0)
+
+    def test_lock_before_suspend(self):
+        '''the screen is locked before a suspend is let through'''
+
+        self.settings_screensaver['lock-enabled'] = True
+
+        # a screensaver that takes a while to lock
+        self.obj_screensaver.AddMethod('org.gnome.ScreenSaver', 'Lock', '', '',
+                                       'time.sleep(1)',
+                                       dbus_interface='org.freedesktop.DBus.Mock')
+        self.plugin_log.read()
+
+        self.obj_logind.EmitSignal('org.freedesktop.login1.Manager', 'PrepareForSleep',
+                                   'b', [True], dbus_interface='org.freedesktop.DBus.Mock')
+
+        # held back while locking
+        time.sleep(0.5)
+        log = self.plugin_log.read()
+        self.assertTrue('Locking the screen before suspend' in log, log)
+        self.assertFalse('TESTSUITE: Blanked screen' in log, log)
+
+        # and let through once locked
+        time.sleep(1.5)
+        log += self.plugin_log.read()
+        self.assertTrue('TESTSUITE: Blanked screen' in log, log)
+
+        calls = self.obj_screensaver.GetCalls(dbus_interface='org.freedesktop.DBus.Mock')
+        self.assertTrue([c for c in calls if c[1] == 'Lock'])
+
+    def test_lock_before_suspend_timeout(self):
+        '''a screensaver that never locks doesn't hold back a suspend'''
+
+        self.settings_screensaver['lock-enabled'] = True
+
+        self.obj_screensaver.AddMethod('org.gnome.ScreenSaver', 'Lock', '', '',
+                                       'time.sleep(10)',
+                                       dbus_interface='org.freedesktop.DBus.Mock')
+        self.plugin_log.read()
+
+        self.obj_logind.EmitSignal('org.freedesktop.login1.Manager', 'PrepareForSleep',
+                                   'b', [True], dbus_interface='org.freedesktop.DBus.Mock')
+
+        time.sleep(3)
+        log = self.plugin_log.read()
+        self.assertTrue('Failed to lock the screen' in log, log)
+        self.assertTrue('TESTSUITE: Blanked screen' in log, log)
+
+    def test_action_critical_battery_cannot_suspend(self):
+        '''critical battery powers off when logind said it can't suspend'''
+
+        self.daemon.terminate()
+        self.daemon.wait()
+        self.plugin_log.close()
+
+        self.obj_logind.AddMethods('', [
+            ('CanSuspend', '', 's', 'ret = "no"'),
+            ('CanHibernate', '', 's', 'ret = "no"'),
+        ], dbus_interface='org.freedesktop.DBus.Mock')
+        self.settings_gsd_power['critical-battery-action'] = 'suspend'
+        Gio.Settings.sync()
+
+        self.start_daemon()
+
+        bat_path = self.obj_upower.AddDischargingBattery('mock_BAT', 'Mock Bat', 2.0, 30)
+        self.obj_upower.EmitSignal('', 'DeviceAdded', 's', [bat_path],
+                                   dbus_interface='org.freedesktop.DBus.Mock')
+
+        timeout = 10
+        log = b''
+        while timeout > 0:
+            time.sleep(1)
+            timeout -= 1
+            try:
+                log += self.logind.stdout.read() or b''
+            except IOError:
+                pass
+            if b' PowerOff ' in log:
+                break
+        else:
+            self.fail('timed out waiting for logind PowerOff() call')
+        self.assertFalse(b' Suspend ' in log)
+
+    def test_action_critical_battery_slow_logind(self):
+        '''the critical action waits for logind to say what it can do'''
+
+        self.daemon.terminate()
+        self.daemon.wait()
+        self.plugin_log.close()
+
+        # still not answered when the action is due
+        self.obj_logind.AddMethods('', [
+            ('CanSuspend', '', 's', 'time.sleep(3); ret = "yes"'),
+        ], dbus_interface='org.freedesktop.DBus.Mock')
+        self.settings_gsd_power['critical-battery-action'] = 'suspend'
+        Gio.Settings.sync()
+
+        self.start_daemon()
+
+        bat_path = self.obj_upower.AddDischargingBattery('mock_BAT', 'Mock Bat', 2.0, 30)
+        self.obj_upower.EmitSignal('', 'DeviceAdded', 's', [bat_path],
+                                   dbus_interface='org.freedesktop.DBus.Mock')
+
+        timeout = 10
+        log = b''
+        while timeout > 0:
+            time.sleep(1)
+            timeout -= 1
+            try:
+                log += self.logind.stdout.read() or b''
+            except IOError:
+                pass
+            if b' Suspend ' in log or b' PowerOff ' in log:
+                break
+        else:
+            self.fail('timed out waiting for logind Suspend() call')
+        self.assertTrue(b' Suspend ' in log, log)
+        self.assertFalse(b' PowerOff ' in log, log)
+
     def test_forced_logout(self):
         '''Test forced logout'''
 
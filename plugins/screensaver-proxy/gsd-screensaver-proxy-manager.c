@@ -139,46 +139,286 @@ struct GsdScreensaverProxyManagerPrivate
         GDBusNodeInfo           *introspection_data2;
         guint                    name_id;
 
-        GHashTable              *watch_ht;  /* key = sender, value = name watch id */
+        GHashTable              *watch_ht;  /* key = sender, value = GsdScreensaverProxySender */
         GHashTable              *cookie_ht; /* key = cookie, value = sender */
+        guint                    next_cookie;
+
+        /* all the clients' cookies share a single session inhibitor */
+        guint                    upstream_cookie;
+        struct GsdScreensaverProxyUpstream *upstream_call; /* Inhibit in flight */
+        GList                   *pending;   /* Inhibit calls waiting for it */
 };
 
 static void     gsd_screensaver_proxy_manager_class_init  (GsdScreensaverProxyManagerClass *klass);
 static void     gsd_screensaver_proxy_manager_init        (GsdScreensaverProxyManager      *screensaver_proxy_manager);
 static void     gsd_screensaver_proxy_manager_finalize    (GObject             *object);
+static void     name_vanished_cb                          (GDBusConnection            *connection,
+                                                           const gchar                *name,
+                                                           GsdScreensaverProxyManager *manager);
 
 G_DEFINE_TYPE (GsdScreensaverProxyManager, gsd_screensaver_proxy_manager, G_TYPE_OBJECT)
 
 static gpointer manager_object = NULL;
 
+typedef struct {
+        guint    watch_id;
+        GList   *cookies;
+} GsdScreensaverProxySender;
+
+typedef struct {
+        GDBusMethodInvocation   *invocation;
+        guint                    cookie;
+} GsdScreensaverProxyPending;
+
+/* Outlives the manager being stopped, so that a session inhibitor we get
+ * afterwards can be released */
+typedef struct GsdScreensaverProxyUpstream {
+        GsdScreensaverProxyManager *manager; /* NULL once stopped */
+        GsdSessionManager          *session;
+} GsdScreensaverProxyUpstream;
+
+static void
+sender_free (GsdScreensaverProxySender *info)
+{
+        g_bus_unwatch_name (info->watch_id);
+        g_list_free (info->cookies);
+        g_slice_free (GsdScreensaverProxySender, info);
+}
+
+/* With a caller, only removes the cookie if the caller got it */
+static void
+remove_cookie (GsdScreensaverProxyManager *manager,
+               guint                       cookie,
+               const char                 *caller)
+{
+        GsdScreensaverProxySender *info;
+        const char *sender;
+
+        sender = g_hash_table_lookup (manager->priv->cookie_ht, GUINT_TO_POINTER (cookie));
+        if (sender == NULL) {
+                g_debug ("Ignoring unknown cookie %u", cookie);
+                return;
+        }
+        if (caller != NULL && g_strcmp0 (caller, sender) != 0) {
+                g_debug ("Ignoring cookie %u from %s, it belongs to %s",
+                         cookie, caller, sender);
+                return;
+        }
+
+        g_debug ("Removing cookie %u from the list for %s", cookie, sender);
+
+        info = g_hash_table_lookup (manager->priv->watch_ht, sender);
+        info->cookies = g_list_remove (info->cookies, GUINT_TO_POINTER (cookie));
+
+        /* no need to keep watching senders without inhibitors */
+        if (info->cookies == NULL)
+                g_hash_table_remove (manager->priv->watch_ht, sender);
+
+        g_hash_table_remove (manager->priv->cookie_ht, GUINT_TO_POINTER (cookie));
+}
+
+/* Drops the single session manager inhibitor once the last of the
+ * clients' cookies is gone */
+static void
+update_upstream (GsdScreensaverProxyManager *manager)
+{
+        if (g_hash_table_size (manager->priv->cookie_ht) > 0 ||
+            manager->priv->upstream_call != NULL ||
+            manager->priv->upstream_cookie == 0)
+                return;
+
+        g_debug ("Releasing session inhibitor %u", manager->priv->upstream_cookie);
+        g_dbus_proxy_call (G_DBUS_PROXY (manager->priv->session),
+                           "Uninhibit",
+                           g_variant_new ("(u)", manager->priv->upstream_cookie),
+                           G_DBUS_CALL_FLAGS_NONE,
+                           -1, NULL, NULL, NULL);
+        manager->priv->upstream_cookie = 0;
+}
+
+static void
+upstream_inhibit_cb (GObject                     *source_object,
+                     GAsyncResult                *res,
+                     GsdScreensaverProxyUpstream *call)
+{
+        GsdScreensaverProxyManager *manager = call->manager;
+        GsdScreensaverProxyPending *pending;
+        GError *error = NULL;
+        GVariant *ret;
+        GList *l, *list;
+        guint cookie;
+
+        ret = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &error);
+
+        if (manager == NULL) {
+                /* we stopped meanwhile, which already dealt with the
+                 * callers, but the session is inhibited all the same */
+                if (ret != NULL) {
+                        g_variant_get (ret, "(u)", &cookie);
+                        g_debug ("Releasing session inhibitor %u we got after stopping", cookie);
+                        g_dbus_proxy_call (G_DBUS_PROXY (call->session),
+                                           "Uninhibit",
+                                           g_variant_new ("(u)", cookie),
+                                           G_DBUS_CALL_FLAGS_NONE,
+                                           -1, NULL, NULL, NULL);
+                        g_variant_unref (ret);
+                } else {
+                        g_error_free (error);
+                }
+                g_object_unref (call->session);
+                g_slice_free (GsdScreensaverProxyUpstream, call);
+                return;
+        }
+
+        g_object_unref (call->session);
+        g_slice_free (GsdScreensaverProxyUpstream, call);
+        manager->priv->upstream_call = NULL;
+        list = manager->priv->pending;
+        manager->priv->pending = NULL;
+
+        if (ret != NULL) {
+                g_variant_get (ret, "(u)", &manager->priv->upstream_cookie);
+                g_variant_unref (ret);
+                g_debug ("Got session inhibitor %u for %u callers",
+                         manager->priv->upstream_cookie, g_list_length (list));
+        } else {
+                g_warning ("Failed to inhibit the session: %s", error->message);
+        }
+
+        for (l = list; l != NULL; l = l->next) {
+                pending = l->data;
+                if (error == NULL) {
+                        g_dbus_method_invocation_return_value (pending->invocation,
+                                                               g_variant_new ("(u)", pending->cookie));
+                } else {
+                        remove_cookie (manager, pending->cookie, NULL);
+                        g_dbus_method_invocation_return_gerror (pending->invocation, error);
+                }
+                g_slice_free (GsdScreensaverProxyPending, pending);
+        }
+        g_list_free (list);
+
+        if (error != NULL)
+                g_error_free (error);
+
+        /* everyone might have uninhibited while we were waiting */
+        update_upstream (manager);
+}
+
+static void
+handle_inhibit (GsdScreensaverProxyManager *manager,
+                const gchar                *sender,
+                GVariant                   *parameters,
+                GDBusMethodInvocation      *invocation)
+{
+        GsdScreensaverProxySender *info;
+        GsdScreensaverProxyPending *pending;
+        const char *app_id;
+        const char *reason;
+        guint cookie;
+
+        g_variant_get (parameters, "(&s&s)", &app_id, &reason);
+
+        /* our own cookies, the session manager only ever sees one */
+        cookie = ++manager->priv->next_cookie;
+        if (cookie == 0)
+                cookie = ++manager->priv->next_cookie;
+
+        g_hash_table_insert (manager->priv->cookie_ht,
+                             GUINT_TO_POINTER (cookie),
+                             g_strdup (sender));
+
+        info = g_hash_table_lookup (manager->priv->watch_ht, sender);
+        if (info == NULL) {
+                info = g_slice_new0 (GsdScreensaverProxySender);
+                info->watch_id = g_bus_watch_name_on_connection (manager->priv->connection,
+                                                                 sender,
+                                                                 G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                                                 NULL,
+                                                                 (GBusNameVanishedCallback) name_vanished_cb,
+                                                                 manager,
+                                                                 NULL);
+                g_hash_table_insert (manager->priv->watch_ht, g_strdup (sender), info);
+        }
+        info->cookies = g_list_prepend (info->cookies, GUINT_TO_POINTER (cookie));
+
+        g_debug ("Adding cookie %u for %s (%s)", cookie, sender, app_id);
+
+        if (manager->priv->upstream_cookie != 0) {
+                g_dbus_method_invocation_return_value (invocation,
+                                                       g_variant_new ("(u)", cookie));
+                return;
+        }
+
+        /* reply once the session manager has been inhibited */
+        pending = g_slice_new (GsdScreensaverProxyPending);
+        pending->invocation = invocation;
+        pending->cookie = cookie;
+        manager->priv->pending = g_list_prepend (manager->priv->pending, pending);
+
+        if (manager->priv->upstream_call != NULL)
+                return;
+
+        manager->priv->upstream_call = g_slice_new (GsdScreensaverProxyUpstream);
+        manager->priv->upstream_call->manager = manager;
+        manager->priv->upstream_call->session = g_object_ref (manager->priv->session);
+        g_dbus_proxy_call (G_DBUS_PROXY (manager->priv->session),
+                           "Inhibit",
+                           g_variant_new ("(susu)",
+                                          app_id, 0, reason, GSM_INHIBITOR_FLAG_IDLE),
+                           G_DBUS_CALL_FLAGS_NONE,
+                           -1, NULL,
+                           (GAsyncReadyCallback) upstream_inhibit_cb,
+                           manager->priv->upstream_call);
+}
+
 static void
 name_vanished_cb (GDBusConnection            *connection,
                   const gchar                *name,
                   GsdScreensaverProxyManager *manager)
 {
-        GHashTableIter iter;
-        gpointer cookie_ptr;
-        const char *sender;
+        GsdScreensaverProxySender *info;
+        GList *cookies, *l;
 
-        /* Look for all the cookies under that name,
-         * and call uninhibit for them */
-        g_hash_table_iter_init (&iter, manager->priv->cookie_ht);
-        while (g_hash_table_iter_next (&iter, &cookie_ptr, (gpointer *) &sender)) {
-                if (g_strcmp0 (sender, name) == 0) {
-                        guint cookie = GPOINTER_TO_UINT (cookie_ptr);
-
-                        g_dbus_proxy_call_sync (G_DBUS_PROXY (manager->priv->session),
-                                                "Uninhibit",
-                                                g_variant_new ("(u)", cookie),
-                                                G_DBUS_CALL_FLAGS_NONE,
-                                                -1, NULL, NULL);
-                        g_debug ("Removing cookie %u for sender %s",
-                                 cookie, sender);
-                        g_hash_table_iter_remove (&iter);
-                }
+        info = g_hash_table_lookup (manager->priv->watch_ht, name);
+        if (info == NULL)
+                return;
+
+        /* removing the last cookie frees info */
+        cookies = g_list_copy (info->cookies);
+        for (l = cookies; l != NULL; l = l->next)
+                remove_cookie (manager, GPOINTER_TO_UINT (l->data), NULL);
+        g_list_free (cookies);
+
+        update_upstream (manager);
+}
+
+static void
+screensaver_call_cb (GObject               *source_object,
+                     GAsyncResult          *res,
+                     GDBusMethodInvocation *invocation)
+{
+        GError *error = NULL;
+        GVariant *ret;
+
+        ret = g_dbus_proxy_call_finish (G_DBUS_PROXY (source_object), res, &error);
+        if (ret == NULL) {
+                g_dbus_method_invocation_return_gerror (invocation, error);
+                g_error_free (error);
+                return;
+        }
+
+        if (g_strcmp0 (g_dbus_method_invocation_get_method_name (invocation), "SetActive") == 0) {
+                g_variant_unref (ret);
+
+                /* Returning the actual Activate state here is not possible,
+                 * as calling GetActive at this point might return an invalid
+                 * value if the activation process is still ongoing. */
+                ret = g_variant_ref (g_dbus_method_invocation_get_parameters (invocation));
         }
 
-        g_hash_table_remove (manager->priv->watch_ht, name);
+        g_dbus_method_invocation_return_value (invocation, ret);
+        g_variant_unref (ret);
 }
 
 static void
@@ -192,8 +432,6 @@ handle_method_call (GDBusConnection       *connection,
                     gpointer               user_data)
 {
         GsdScreensaverProxyManager *manager = GSD_SCREENSAVER_PROXY_MANAGER (user_data);
-        GError *error = NULL;
-        GVariant *ret = NULL;
 
         /* Check session pointer as a proxy for whether the manager is in the
            start or stop state */
@@ -205,84 +443,35 @@ handle_method_call (GDBusConnection       *connection,
                  interface_name, method_name);
 
         if (g_strcmp0 (method_name, "Inhibit") == 0) {
-                const char *app_id;
-                const char *reason;
-                guint cookie;
-
-                g_variant_get (parameters,
-                               "(ss)", &app_id, &reason);
-
-                ret = g_dbus_proxy_call_sync (G_DBUS_PROXY (manager->priv->session),
-                                              "Inhibit",
-                                              g_variant_new ("(susu)",
-                                                             app_id, 0, reason, GSM_INHIBITOR_FLAG_IDLE),
-                                              G_DBUS_CALL_FLAGS_NONE,
-                                              -1, NULL, &error);
-                g_variant_get (ret, "(u)", &cookie);
-                g_hash_table_insert (manager->priv->cookie_ht,
-                                     GUINT_TO_POINTER (cookie),
-                                     g_strdup (sender));
-                if (g_hash_table_lookup (manager->priv->watch_ht, sender) == NULL) {
-                        guint watch_id;
-
-                        watch_id = g_bus_watch_name_on_connection (manager->priv->connection,
-                                                                   sender,
-                                                                   G_BUS_NAME_WATCHER_FLAGS_NONE,
-                                                                   NULL,
-                                                                   (GBusNameVanishedCallback) name_vanished_cb,
-                                                                   manager,
-                                                                   NULL);
-                        g_hash_table_insert (manager->priv->watch_ht,
-                                             g_strdup (sender),
-                                             GUINT_TO_POINTER (watch_id));
-                }
+                handle_inhibit (manager, sender, parameters, invocation);
         } else if (g_strcmp0 (method_name, "UnInhibit") == 0) {
                 guint cookie;
 
                 g_variant_get (parameters, "(u)", &cookie);
-                g_dbus_proxy_call_sync (G_DBUS_PROXY (manager->priv->session),
-                                        "Uninhibit",
-                                        parameters,
-                                        G_DBUS_CALL_FLAGS_NONE,
-                                        -1, NULL, NULL);
-                g_debug ("Removing cookie %u from the list for %s", cookie, sender);
-                g_hash_table_remove (manager->priv->cookie_ht, GUINT_TO_POINTER (cookie));
+                remove_cookie (manager, cookie, sender);
+                update_upstream (manager);
+                g_dbus_method_invocation_return_value (invocation, NULL);
         } else if (g_strcmp0 (method_name, "Lock") == 0 ||
                    g_strcmp0 (method_name, "SimulateUserActivity") == 0 ||
                    g_strcmp0 (method_name, "GetActive") == 0 ||
                    g_strcmp0 (method_name, "GetActiveTime") == 0 ||
                    g_strcmp0 (method_name, "SetActive") == 0) {
-
-                ret = g_dbus_proxy_call_sync (G_DBUS_PROXY (manager->priv->screensaver),
-                                              method_name,
-                                              parameters,
-                                              G_DBUS_CALL_FLAGS_NONE,
-                                              -1, NULL, &error);
-
-                if (error == NULL && g_strcmp0 (method_name, "SetActive") == 0) {
-                        g_variant_unref (ret);
-
-                        /* Returning the actual Activate state here is not possible,
-                         * as calling GetActive at this point might return an invalid
-                         * value if the activation process is still ongoing. */
-                        ret = g_variant_ref (parameters);
-                }
+                g_dbus_proxy_call (G_DBUS_PROXY (manager->priv->screensaver),
+                                   method_name,
+                                   parameters,
+                                   G_DBUS_CALL_FLAGS_NONE,
+                                   -1, NULL,
+                                   (GAsyncReadyCallback) screensaver_call_cb,
+                                   invocation);
         } else if (g_strcmp0 (method_name, "GetSessionIdleTime") == 0) {
                 GsdIdleMonitor *idle_monitor = gsd_idle_monitor_get_core ();
                 gint64 idle_time_ms = gsd_idle_monitor_get_idletime (idle_monitor);
-                ret = g_variant_new ("(u)", idle_time_ms / 1000);
+                g_dbus_method_invocation_return_value (invocation,
+                                                       g_variant_new ("(u)", idle_time_ms / 1000));
         } else {
                 goto unimplemented;
         }
 
-        if (error != NULL) {
-                g_dbus_method_invocation_return_gerror (invocation, error);
-                g_error_free (error);
-                return;
-        }
-
-        g_dbus_method_invocation_return_value (invocation, ret);
-
         return;
 
 unimplemented:
@@ -374,7 +563,7 @@ gsd_screensaver_proxy_manager_start (GsdScreensaverProxyManager *manager,
         manager->priv->watch_ht = g_hash_table_new_full (g_str_hash,
                                                          g_str_equal,
                                                          (GDestroyNotify) g_free,
-                                                         (GDestroyNotify) g_bus_unwatch_name);
+                                                         (GDestroyNotify) sender_free);
         manager->priv->cookie_ht = g_hash_table_new_full (g_direct_hash,
                                                           g_direct_equal,
                                                           NULL,
@@ -386,7 +575,32 @@ gsd_screensaver_proxy_manager_start (GsdScreensaverProxyManager *manager,
 void
 gsd_screensaver_proxy_manager_stop (GsdScreensaverProxyManager *manager)
 {
+        GsdScreensaverProxyPending *pending;
+        GList *l;
+
         g_debug ("Stopping screensaver_proxy manager");
+
+        /* the reply to an Inhibit in flight releases what it got */
+        if (manager->priv->upstream_call != NULL) {
+                manager->priv->upstream_call->manager = NULL;
+                manager->priv->upstream_call = NULL;
+        }
+
+        for (l = manager->priv->pending; l != NULL; l = l->next) {
+                pending = l->data;
+                g_dbus_method_invocation_return_dbus_error (pending->invocation,
+                                                            "org.freedesktop.DBus.Error.NotSupported",
+                                                            "This method is not implemented");
+                g_slice_free (GsdScreensaverProxyPending, pending);
+        }
+        g_list_free (manager->priv->pending);
+        manager->priv->pending = NULL;
+
+        if (manager->priv->cookie_ht != NULL)
+                g_hash_table_remove_all (manager->priv->cookie_ht);
+        if (manager->priv->session != NULL)
+                update_upstream (manager);
+
         g_clear_object (&manager->priv->session);
         g_clear_object (&manager->priv->screensaver);
         g_clear_pointer (&manager->priv->watch_ht, g_hash_table_destroy);
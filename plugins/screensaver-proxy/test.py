@@ -0,0 +1,149 @@
+#!/usr/bin/env python
+'''GNOME settings daemon tests for screensaver-proxy plugin.'''
+
+__license__ = 'GPL v2 or later'
+
+import unittest
+import subprocess
+import sys
+import time
+import os
+import os.path
+import threading
+
+project_root = os.path.dirname(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+builddir = os.environ.get('BUILDDIR', os.path.dirname(__file__))
+
+sys.path.insert(0, os.path.join(project_root, 'tests'))
+sys.path.insert(0, builddir)
+import gsdtestcase
+
+import dbus
+import dbusmock
+
+SS_NAME = 'org.freedesktop.ScreenSaver'
+SS_PATH = '/org/freedesktop/ScreenSaver'
+SS_IFACE = 'org.freedesktop.ScreenSaver'
+
+
+class ScreensaverProxyPluginTest(gsdtestcase.GSDTestCase):
+    '''Test the screensaver-proxy plugin'''
+
+    def setUp(self):
+        # fake session manager, handing out increasing cookies
+        (self.session, self.obj_session_mgr) = self.spawn_server(
+            'org.gnome.SessionManager', '/org/gnome/SessionManager',
+            'org.gnome.SessionManager', stdout=subprocess.PIPE)
+        self.session_mock = dbus.Interface(self.obj_session_mgr, dbusmock.MOCK_IFACE)
+        self.session_mock.AddMethod('', 'Inhibit', 'susu', 'u',
+                                    'self.cookie = getattr(self, "cookie", 0) + 1\n'
+                                    'ret = dbus.UInt32(self.cookie)')
+        self.session_mock.AddMethod('', 'Uninhibit', 'u', '', '')
+
+        (self.screensaver, self.obj_screensaver) = self.spawn_server_template(
+            'gnome_screensaver', stdout=subprocess.PIPE)
+
+        self.plugin_log_write = open(os.path.join(self.workdir, 'plugin_screensaver_proxy.log'), 'wb')
+        self.daemon = subprocess.Popen(
+            [os.path.join(builddir, 'usd-test-screensaver-proxy')],
+            stdout=self.plugin_log_write,
+            stderr=subprocess.STDOUT)
+
+        self.wait_for_bus_object(SS_NAME, SS_PATH)
+        self.proxy = dbus.Interface(self.session_bus_con.get_object(SS_NAME, SS_PATH), SS_IFACE)
+
+    def tearDown(self):
+        daemon_running = self.daemon.poll() == None
+        if daemon_running:
+            self.daemon.terminate()
+            self.daemon.wait()
+        self.plugin_log_write.close()
+
+        self.screensaver.terminate()
+        self.screensaver.wait()
+        self.session.terminate()
+        self.session.wait()
+
+        self.assertTrue(daemon_running, 'daemon died during the test')
+
+    def session_calls(self, method):
+        return [c for c in self.session_mock.GetCalls() if c[1] == method]
+
+    def wait_for_session_calls(self, method, count, timeout=5):
+        while timeout > 0:
+            if len(self.session_calls(method)) >= count:
+                break
+            time.sleep(0.1)
+            timeout -= 0.1
+        return self.session_calls(method)
+
+    def test_multiplex(self):
+        '''Many cookies share one session inhibitor'''
+
+        cookies = [self.proxy.Inhibit('flood', 'test %i' % i) for i in range(200)]
+        self.assertEqual(len(set(cookies)), len(cookies))
+        self.assertEqual(len(self.session_calls('Inhibit')), 1)
+
+        for cookie in cookies[:-1]:
+            self.proxy.UnInhibit(cookie)
+        self.assertEqual(len(self.session_calls('Uninhibit')), 0)
+
+        self.proxy.UnInhibit(cookies[-1])
+        calls = self.wait_for_session_calls('Uninhibit', 1)
+        self.assertEqual(len(calls), 1)
+        self.assertEqual(calls[0][2], [1])
+
+        # inhibiting again takes a new session inhibitor
+        cookie = self.proxy.Inhibit('flood', 'again')
+        self.assertEqual(len(self.session_calls('Inhibit')), 2)
+        self.proxy.UnInhibit(cookie)
+        self.assertEqual(self.wait_for_session_calls('Uninhibit', 2)[1][2], [2])
+
+    def test_sender_vanished(self):
+        '''Inhibitors go away with their client'''
+
+        subprocess.check_call([sys.executable, '-c',
+                               'import dbus; '
+                               'dbus.SessionBus().get_object("%s", "%s").Inhibit("app", "gone", dbus_interface="%s")'
+                               % (SS_NAME, SS_PATH, SS_IFACE)])
+        self.assertEqual(len(self.wait_for_session_calls('Uninhibit', 1)), 1)
+
+    def test_foreign_cookie(self):
+        '''Clients can only uninhibit their own cookies'''
+
+        cookie = self.proxy.Inhibit('app', 'mine')
+        subprocess.check_call([sys.executable, '-c',
+                               'import dbus; '
+                               'dbus.SessionBus().get_object("%s", "%s").UnInhibit(%i, dbus_interface="%s")'
+                               % (SS_NAME, SS_PATH, cookie, SS_IFACE)])
+        time.sleep(0.5)
+        self.assertEqual(len(self.session_calls('Uninhibit')), 0)
+
+        self.proxy.UnInhibit(cookie)
+        self.assertEqual(len(self.wait_for_session_calls('Uninhibit', 1)), 1)
+
+    def test_not_blocking(self):
+        '''Other callers are served while the session manager is slow'''
+
+        self.session_mock.AddMethod('', 'Inhibit', 'susu', 'u',
+                                    'time.sleep(2)\n'
+                                    'ret = dbus.UInt32(1)')
+
+        def inhibit():
+            con = dbus.bus.BusConnection(os.environ['DBUS_SESSION_BUS_ADDRESS'])
+            con.get_object(SS_NAME, SS_PATH).Inhibit('slow', 'test', dbus_interface=SS_IFACE)
+            con.close()
+
+        thread = threading.Thread(target=inhibit)
+        thread.start()
+        time.sleep(0.2)
+
+        start = time.time()
+        self.proxy.GetSessionIdleTime()
+        self.assertLess(time.time() - start, 1.0)
+
+        thread.join()
+
+
+if __name__ == '__main__':
+    unittest.main(testRunner=unittest.TextTestRunner(stream=sys.stdout, verbosity=2))
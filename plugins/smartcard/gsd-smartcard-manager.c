@@ -49,6 +49,7 @@
 #include <pk11func.h>
 #include <secmod.h>
 #include <secerr.h>
+#include <pkcs11.h>
 
 #ifndef GSD_SMARTCARD_MANAGER_DRIVER
 #define GSD_SMARTCARD_MANAGER_DRIVER LIBDIR"/pkcs11/libcoolkeypk11.so"
@@ -66,8 +67,13 @@
 #define GSD_OPEN_FILE_DESCRIPTORS_DIR "/proc/self/fd"
 #endif
 
+/* How often the thread shared by the modules that can't block waiting
+ * for slot events checks their slots */
+#define GSD_SMARTCARD_MANAGER_POLL_INTERVAL 1
+
 typedef enum _GsdSmartcardManagerState GsdSmartcardManagerState;
 typedef struct _GsdSmartcardManagerWorker GsdSmartcardManagerWorker;
+typedef struct _GsdSmartcardManagerEvent GsdSmartcardManagerEvent;
 
 enum _GsdSmartcardManagerState {
         GSD_SMARTCARD_MANAGER_STATE_STOPPED = 0,
@@ -83,26 +89,44 @@ struct _GsdSmartcardManagerPrivate {
 
         GList        *workers;
 
+        /* Modules that can't wait for slot events get no thread of
+         * their own; a single thread checks all their slots */
+        GThread      *poll_thread;
+        GMutex        poll_lock;
+        GCond         poll_cond;
+        GList        *polled_workers;
+        gboolean      poll_wakeup;
+        gboolean      poll_stopping;
+
         GPid smartcard_event_watcher_pid;
         GHashTable *smartcards;
 
-        guint poll_timeout_id;
-
         guint32 is_unstoppable : 1;
         guint32 nss_is_loaded : 1;
 };
 
 struct _GsdSmartcardManagerWorker {
         GsdSmartcardManager *manager;
-        int manager_fd;
+        volatile gint ref_count;
+        volatile gint cancelled;
 
         GThread      *thread;
         SECMODModule *module;
+
+        /* only touched from the thread watching the module */
         GHashTable *smartcards;
-        int fd;
-        GSource *event_source;
 
-        guint32 nss_is_loaded : 1;
+        /* FALSE for modules whose slots the poll thread checks */
+        guint32 has_slot_events : 1;
+};
+
+struct _GsdSmartcardManagerEvent {
+        GsdSmartcardManagerWorker *worker;
+
+        /* 'I' or 'R', or '\0' if the worker thread gave up */
+        char event_type;
+        char *card_name;
+        GError *error;
 };
 
 static void gsd_smartcard_manager_finalize (GObject *object);
@@ -129,15 +153,10 @@ static GsdSmartcardManagerWorker *gsd_smartcard_manager_create_worker (GsdSmartc
                                                                        SECMODModule         *module);
 
 static GsdSmartcardManagerWorker * gsd_smartcard_manager_worker_new (GsdSmartcardManager *manager,
-                                                                     int                  worker_fd,
-                                                                     int                  manager_fd,
                                                                      SECMODModule        *module);
-static void gsd_smartcard_manager_worker_free (GsdSmartcardManagerWorker *worker);
-static gboolean open_pipe (int *write_fd, int *read_fd);
-static gboolean read_bytes (int fd, gpointer bytes, gsize num_bytes);
-static gboolean write_bytes (int fd, gconstpointer bytes, gsize num_bytes);
-static GsdSmartcard *read_smartcard (int fd, SECMODModule *module);
-static gboolean write_smartcard (int fd, GsdSmartcard *card);
+static GsdSmartcardManagerWorker * gsd_smartcard_manager_worker_ref (GsdSmartcardManagerWorker *worker);
+static void gsd_smartcard_manager_worker_unref (GsdSmartcardManagerWorker *worker);
+static void gsd_smartcard_manager_worker_check_all_slots (GsdSmartcardManagerWorker *worker);
 
 enum {
         PROP_0 = 0,
@@ -351,8 +370,9 @@ gsd_smartcard_manager_init (GsdSmartcardManager *manager)
         manager->priv = G_TYPE_INSTANCE_GET_PRIVATE (manager,
                                                      GSD_TYPE_SMARTCARD_MANAGER,
                                                      GsdSmartcardManagerPrivate);
-        manager->priv->poll_timeout_id = 0;
         manager->priv->is_unstoppable = FALSE;
+        g_mutex_init (&manager->priv->poll_lock);
+        g_cond_init (&manager->priv->poll_cond);
 
         manager->priv->smartcards =
                 g_hash_table_new_full (g_str_hash,
@@ -375,6 +395,8 @@ gsd_smartcard_manager_finalize (GObject *object)
 
         g_hash_table_destroy (manager->priv->smartcards);
         manager->priv->smartcards = NULL;
+        g_mutex_clear (&manager->priv->poll_lock);
+        g_cond_clear (&manager->priv->poll_cond);
 
         gobject_class->finalize (object);
 }
@@ -439,59 +461,55 @@ gsd_smartcard_manager_emit_smartcard_removed (GsdSmartcardManager *manager,
         manager->priv->is_unstoppable = FALSE;
 }
 
+static void
+gsd_smartcard_manager_event_free (GsdSmartcardManagerEvent *event)
+{
+        gsd_smartcard_manager_worker_unref (event->worker);
+        g_free (event->card_name);
+        if (event->error != NULL) {
+                g_error_free (event->error);
+        }
+        g_slice_free (GsdSmartcardManagerEvent, event);
+}
+
 static gboolean
-gsd_smartcard_manager_check_for_and_process_events (GIOChannel          *io_channel,
-                                                    GIOCondition         condition,
-                                                    GsdSmartcardManagerWorker *worker)
+gsd_smartcard_manager_process_event (GsdSmartcardManagerEvent *event)
 {
-        GsdSmartcard *card;
+        GsdSmartcardManagerWorker *worker;
         GsdSmartcardManager *manager;
-        gboolean should_stop;
-        guchar event_type;
+        GsdSmartcard *card;
         char *card_name;
-        int fd;
 
+        worker = event->worker;
         manager = worker->manager;
 
-        g_debug ("event!");
-        card = NULL;
-        should_stop = (condition & G_IO_HUP) || (condition & G_IO_ERR);
-
-        if (should_stop) {
-                g_debug ("received %s on event socket, stopping "
-                          "manager...",
-                          (condition & G_IO_HUP) && (condition & G_IO_ERR)?
-                          "error and hangup" :
-                          (condition & G_IO_HUP)?
-                          "hangup" : "error");
+        /* raced with the worker being stopped */
+        if (g_atomic_int_get (&worker->cancelled)) {
+                g_debug ("dropping event from stopped worker");
+                return FALSE;
         }
 
-        if (!(condition & G_IO_IN)) {
-                g_debug ("nevermind outta here!");
-                goto out;
-        }
+        if (event->event_type == '\0') {
+                GError *error;
 
-        fd = g_io_channel_unix_get_fd (io_channel);
+                g_debug ("worker for module '%s' stopped, stopping manager...",
+                         worker->module->commonName);
 
-        event_type = '\0';
-        if (!read_bytes (fd, &event_type, 1)) {
-                g_debug ("could not read event type, stopping");
-                should_stop = TRUE;
-                goto out;
-        }
-
-        card = read_smartcard (fd, worker->module);
+                error = g_error_new (GSD_SMARTCARD_MANAGER_ERROR,
+                                     GSD_SMARTCARD_MANAGER_ERROR_WATCHING_FOR_EVENTS,
+                                     "%s", event->error != NULL ? event->error->message : _("received error or hang up from event source"));
 
-        if (card == NULL) {
-                g_debug ("could not read card, stopping");
-                should_stop = TRUE;
-                goto out;
+                gsd_smartcard_manager_emit_error (manager, error);
+                g_error_free (error);
+                gsd_smartcard_manager_stop_now (manager);
+                return FALSE;
         }
 
+        card = _gsd_smartcard_new_from_name (worker->module, event->card_name);
         card_name = gsd_smartcard_get_name (card);
-        g_debug ("card '%s' had event %c", card_name, event_type);
+        g_debug ("card '%s' had event %c", card_name, event->event_type);
 
-        switch (event_type) {
+        switch (event->event_type) {
                 case 'I':
                         g_hash_table_replace (manager->priv->smartcards,
                                               card_name, card);
@@ -512,29 +530,39 @@ gsd_smartcard_manager_check_for_and_process_events (GIOChannel          *io_chan
                         break;
 
                 default:
-                        g_free (card_name);
-                        card_name = NULL;
-                        g_object_unref (card);
-
-                        should_stop = TRUE;
-                        break;
+                        g_assert_not_reached ();
         }
 
-out:
-        if (should_stop) {
-                GError *error;
-
-                error = g_error_new (GSD_SMARTCARD_MANAGER_ERROR,
-                                     GSD_SMARTCARD_MANAGER_ERROR_WATCHING_FOR_EVENTS,
-                                     "%s", (condition & G_IO_IN) ? g_strerror (errno) : _("received error or hang up from event source"));
+        return FALSE;
+}
 
-                gsd_smartcard_manager_emit_error (manager, error);
-                g_error_free (error);
-                gsd_smartcard_manager_stop_now (manager);
-                return FALSE;
-        }
+/* Called from the worker thread. Events are dispatched from an idle
+ * source rather than a pipe, so there's nothing to read back and no fd
+ * per module.
+ */
+static void
+gsd_smartcard_manager_worker_queue_event (GsdSmartcardManagerWorker *worker,
+                                          char                       event_type,
+                                          GsdSmartcard              *card,
+                                          GError                    *error)
+{
+        GsdSmartcardManagerEvent *event;
+        GSource *source;
 
-        return TRUE;
+        event = g_slice_new0 (GsdSmartcardManagerEvent);
+        event->worker = gsd_smartcard_manager_worker_ref (worker);
+        event->event_type = event_type;
+        event->card_name = card != NULL ? gsd_smartcard_get_name (card) : NULL;
+        event->error = error;
+
+        source = g_idle_source_new ();
+        g_source_set_priority (source, G_PRIORITY_DEFAULT);
+        g_source_set_callback (source,
+                               (GSourceFunc) gsd_smartcard_manager_process_event,
+                               event,
+                               (GDestroyNotify) gsd_smartcard_manager_event_free);
+        g_source_attach (source, NULL);
+        g_source_unref (source);
 }
 
 static void
@@ -549,6 +577,35 @@ stop_manager (GsdSmartcardManager *manager)
         g_debug ("smartcard manager stopped");
 }
 
+/* Takes the worker off the poll thread, and stops the thread along with
+ * the last one */
+static void
+gsd_smartcard_manager_remove_polled_worker (GsdSmartcardManager       *manager,
+                                            GsdSmartcardManagerWorker *worker)
+{
+        GsdSmartcardManagerPrivate *priv = manager->priv;
+        GThread *thread = NULL;
+        GList *node;
+
+        g_mutex_lock (&priv->poll_lock);
+        node = g_list_find (priv->polled_workers, worker);
+        if (node != NULL)
+                priv->polled_workers = g_list_delete_link (priv->polled_workers, node);
+        if (priv->polled_workers == NULL && priv->poll_thread != NULL) {
+                priv->poll_stopping = TRUE;
+                g_cond_signal (&priv->poll_cond);
+                thread = priv->poll_thread;
+                priv->poll_thread = NULL;
+        }
+        g_mutex_unlock (&priv->poll_lock);
+
+        if (node != NULL)
+                gsd_smartcard_manager_worker_unref (worker);
+
+        if (thread != NULL)
+                g_thread_join (thread);
+}
+
 static void
 stop_worker (GsdSmartcardManagerWorker *worker)
 {
@@ -556,63 +613,27 @@ stop_worker (GsdSmartcardManagerWorker *worker)
 
         manager = worker->manager;
 
-        if (worker->event_source != NULL) {
-                g_source_destroy (worker->event_source);
-                worker->event_source = NULL;
-        }
+        g_atomic_int_set (&worker->cancelled, TRUE);
 
-        if (worker->thread != NULL) {
+        /* nothing may still be calling into the module once NSS gets
+         * shut down with the last worker */
+        if (worker->has_slot_events) {
                 SECMOD_CancelWait (worker->module);
+                g_thread_join (worker->thread);
                 worker->thread = NULL;
+        } else {
+                gsd_smartcard_manager_remove_polled_worker (manager, worker);
         }
 
         SECMOD_DestroyModule (worker->module);
         manager->priv->workers = g_list_remove (manager->priv->workers, worker);
+        gsd_smartcard_manager_worker_unref (worker);
 
         if (manager->priv->workers == NULL && manager->priv->state != GSD_SMARTCARD_MANAGER_STATE_STOPPED) {
                 stop_manager (manager);
         }
 }
 
-static void
-gsd_smartcard_manager_event_processing_stopped_handler (GsdSmartcardManagerWorker *worker)
-{
-        worker->event_source = NULL;
-
-        stop_worker (worker);
-}
-
-static gboolean
-open_pipe (int *write_fd,
-           int *read_fd)
-{
-        int pipe_fds[2] = { -1, -1 };
-
-        g_assert (write_fd != NULL);
-        g_assert (read_fd != NULL);
-
-        if (pipe (pipe_fds) < 0) {
-                return FALSE;
-        }
-
-        if (fcntl (pipe_fds[0], F_SETFD, FD_CLOEXEC) < 0) {
-                close (pipe_fds[0]);
-                close (pipe_fds[1]);
-                return FALSE;
-        }
-
-        if (fcntl (pipe_fds[1], F_SETFD, FD_CLOEXEC) < 0) {
-                close (pipe_fds[0]);
-                close (pipe_fds[1]);
-                return FALSE;
-        }
-
-        *read_fd = pipe_fds[0];
-        *write_fd = pipe_fds[1];
-
-        return TRUE;
-}
-
 static void
 gsd_smartcard_manager_stop_watching_for_events (GsdSmartcardManager  *manager)
 {
@@ -864,8 +885,6 @@ start_worker (GsdSmartcardManager  *manager,
               SECMODModule         *module,
               GError              **error)
 {
-        GIOChannel *io_channel;
-        GSource *source;
         GsdSmartcardManagerWorker *worker;
 
         worker = gsd_smartcard_manager_create_worker (manager, module);
@@ -876,27 +895,8 @@ start_worker (GsdSmartcardManager  *manager,
                              GSD_SMARTCARD_MANAGER_ERROR_WATCHING_FOR_EVENTS,
                              _("could not watch for incoming card events - %s"),
                              g_strerror (errno));
-
-                goto out;
         }
 
-        io_channel = g_io_channel_unix_new (worker->manager_fd);
-
-        source = g_io_create_watch (io_channel, G_IO_IN | G_IO_HUP);
-        g_io_channel_unref (io_channel);
-        io_channel = NULL;
-
-        worker->event_source = source;
-
-        g_source_set_callback (worker->event_source,
-                               (GSourceFunc) (GIOFunc)
-                               gsd_smartcard_manager_check_for_and_process_events,
-                               worker,
-                               (GDestroyNotify)
-                               gsd_smartcard_manager_event_processing_stopped_handler);
-        g_source_attach (worker->event_source, NULL);
-        g_source_unref (worker->event_source);
-out:
         return worker;
 }
 
@@ -1039,17 +1039,14 @@ gsd_smartcard_manager_login_card_is_inserted (GsdSmartcardManager *manager)
 
 static GsdSmartcardManagerWorker *
 gsd_smartcard_manager_worker_new (GsdSmartcardManager *manager,
-                                  int                 worker_fd,
-                                  int                 manager_fd,
                                   SECMODModule        *module)
 {
         GsdSmartcardManagerWorker *worker;
 
         worker = g_slice_new0 (GsdSmartcardManagerWorker);
         worker->manager = manager;
-        worker->fd = worker_fd;
-        worker->manager_fd = manager_fd;
-        worker->module = module;
+        worker->ref_count = 1;
+        worker->module = SECMOD_ReferenceModule (module);
 
         worker->smartcards =
                 g_hash_table_new_full ((GHashFunc) slot_id_hash,
@@ -1060,184 +1057,82 @@ gsd_smartcard_manager_worker_new (GsdSmartcardManager *manager,
         return worker;
 }
 
-static void
-gsd_smartcard_manager_worker_free (GsdSmartcardManagerWorker *worker)
+static GsdSmartcardManagerWorker *
+gsd_smartcard_manager_worker_ref (GsdSmartcardManagerWorker *worker)
 {
-        if (worker->smartcards != NULL) {
-                g_hash_table_destroy (worker->smartcards);
-                worker->smartcards = NULL;
-        }
+        g_atomic_int_inc (&worker->ref_count);
 
-        g_slice_free (GsdSmartcardManagerWorker, worker);
+        return worker;
 }
 
-static gboolean
-read_bytes (int      fd,
-            gpointer bytes,
-            gsize    num_bytes)
+static void
+gsd_smartcard_manager_worker_unref (GsdSmartcardManagerWorker *worker)
 {
-        size_t bytes_left;
-        size_t total_bytes_read;
-        ssize_t bytes_read;
-
-        bytes_left = (size_t) num_bytes;
-        total_bytes_read = 0;
-
-        do {
-                bytes_read = read (fd,
-                                   (char *) bytes + total_bytes_read,
-                                   bytes_left);
-                g_assert (bytes_read <= (ssize_t) bytes_left);
-
-                if (bytes_read <= 0) {
-                        if ((bytes_read < 0) && (errno == EINTR || errno == EAGAIN)) {
-                                continue;
-                        }
-
-                        bytes_left = 0;
-                } else {
-                        bytes_left -= bytes_read;
-                        total_bytes_read += bytes_read;
-                }
-        } while (bytes_left > 0);
+        if (!g_atomic_int_dec_and_test (&worker->ref_count))
+                return;
 
-        if (total_bytes_read <  (size_t) num_bytes) {
-                return FALSE;
+        if (worker->smartcards != NULL) {
+                g_hash_table_destroy (worker->smartcards);
+                worker->smartcards = NULL;
         }
 
-        return TRUE;
-}
-
-static gboolean
-write_bytes (int           fd,
-             gconstpointer bytes,
-             gsize         num_bytes)
-{
-        size_t bytes_left;
-        size_t total_bytes_written;
-        ssize_t bytes_written;
-
-        bytes_left = (size_t) num_bytes;
-        total_bytes_written = 0;
-
-        do {
-                bytes_written = write (fd,
-                                       (char *) bytes + total_bytes_written,
-                                       bytes_left);
-                g_assert (bytes_written <= (ssize_t) bytes_left);
-
-                if (bytes_written <= 0) {
-                        if ((bytes_written < 0) && (errno == EINTR || errno == EAGAIN)) {
-                                continue;
-                        }
-
-                        bytes_left = 0;
-                } else {
-                        bytes_left -= bytes_written;
-                        total_bytes_written += bytes_written;
-                }
-        } while (bytes_left > 0);
-
-        if (total_bytes_written <  (size_t) num_bytes) {
-                return FALSE;
-        }
+        SECMOD_DestroyModule (worker->module);
 
-        return TRUE;
+        g_slice_free (GsdSmartcardManagerWorker, worker);
 }
 
-static GsdSmartcard *
-read_smartcard (int           fd,
-                SECMODModule *module)
+/* Compares what's in the slot now with the card we last saw there, and
+ * reports the difference. The slot id and series together uniquely
+ * identify a card; you can never have two cards with the same slot id at
+ * the same time, so we key off of it.
+ */
+static void
+gsd_smartcard_manager_worker_check_slot (GsdSmartcardManagerWorker *worker,
+                                         PK11SlotInfo              *slot)
 {
+        CK_SLOT_ID slot_id, *key;
+        int slot_series;
+        gboolean is_present;
         GsdSmartcard *card;
-        char *card_name;
-        gsize card_name_size;
-
-        card_name_size = 0;
-        if (!read_bytes (fd, &card_name_size, sizeof (card_name_size))) {
-                return NULL;
-        }
-
-        card_name = g_slice_alloc0 (card_name_size);
-        if (!read_bytes (fd, card_name, card_name_size)) {
-                g_slice_free1 (card_name_size, card_name);
-                return NULL;
-        }
-        card = _gsd_smartcard_new_from_name (module, card_name);
-        g_slice_free1 (card_name_size, card_name);
-
-        return card;
-}
 
-static gboolean
-write_smartcard (int          fd,
-                    GsdSmartcard *card)
-{
-        gsize card_name_size;
-        char *card_name;
+        /* PK11_IsPresent() refreshes the series if the token changed */
+        is_present = PK11_IsPresent (slot);
+        slot_id = PK11_GetSlotID (slot);
+        slot_series = PK11_GetSlotSeries (slot);
 
-        card_name = gsd_smartcard_get_name (card);
-        card_name_size = strlen (card_name) + 1;
+        card = g_hash_table_lookup (worker->smartcards, &slot_id);
 
-        if (!write_bytes (fd, &card_name_size, sizeof (card_name_size))) {
-                g_free (card_name);
-                return FALSE;
+        if (card != NULL &&
+            (!is_present || gsd_smartcard_get_slot_series (card) != slot_series)) {
+                /* a different card in the slot than before means the
+                 * old one went away; we don't want unpaired insertion
+                 * events */
+                gsd_smartcard_manager_worker_queue_event (worker, 'R', card, NULL);
+                g_hash_table_remove (worker->smartcards, &slot_id);
+                card = NULL;
         }
 
-        if (!write_bytes (fd, card_name, card_name_size)) {
-                g_free (card_name);
-                return FALSE;
-        }
-        g_free (card_name);
-
-        return TRUE;
-}
-
-static gboolean
-gsd_smartcard_manager_worker_emit_smartcard_removed (GsdSmartcardManagerWorker  *worker,
-                                                     GsdSmartcard               *card,
-                                                     GError                    **error)
-{
-        g_debug ("card '%s' removed!", gsd_smartcard_get_name (card));
+        if (card == NULL && is_present) {
+                card = _gsd_smartcard_new (worker->module,
+                                           slot_id, slot_series);
 
-        if (!write_bytes (worker->fd, "R", 1)) {
-                goto error_out;
-        }
+                key = g_new (CK_SLOT_ID, 1);
+                *key = slot_id;
+                g_hash_table_replace (worker->smartcards, key, card);
 
-        if (!write_smartcard (worker->fd, card)) {
-                goto error_out;
+                gsd_smartcard_manager_worker_queue_event (worker, 'I', card, NULL);
         }
-
-        return TRUE;
-
-error_out:
-        g_set_error (error, GSD_SMARTCARD_MANAGER_ERROR,
-                     GSD_SMARTCARD_MANAGER_ERROR_REPORTING_EVENTS,
-                     "%s", g_strerror (errno));
-        return FALSE;
 }
 
-static gboolean
-gsd_smartcard_manager_worker_emit_smartcard_inserted (GsdSmartcardManagerWorker  *worker,
-                                                      GsdSmartcard               *card,
-                                                      GError                    **error)
+static void
+gsd_smartcard_manager_worker_check_all_slots (GsdSmartcardManagerWorker *worker)
 {
-        g_debug ("card '%s' inserted!", gsd_smartcard_get_name (card));
-        if (!write_bytes (worker->fd, "I", 1)) {
-                goto error_out;
-        }
+        int i;
 
-        if (!write_smartcard (worker->fd, card)) {
-                goto error_out;
+        for (i = 0; i < worker->module->slotCount; i++) {
+                gsd_smartcard_manager_worker_check_slot (worker,
+                                                         worker->module->slots[i]);
         }
-
-        return TRUE;
-
-error_out:
-        g_set_error (error, GSD_SMARTCARD_MANAGER_ERROR,
-                     GSD_SMARTCARD_MANAGER_ERROR_REPORTING_EVENTS,
-                     "%s", g_strerror (errno));
-        return FALSE;
 }
 
 static gboolean
@@ -1245,18 +1140,20 @@ gsd_smartcard_manager_worker_watch_for_and_process_event (GsdSmartcardManagerWor
                                                           GError                    **error)
 {
         PK11SlotInfo *slot;
-        CK_SLOT_ID slot_id, *key = NULL;
-        int slot_series, card_slot_series;
-        GsdSmartcard *card;
-        GError *processing_error;
-        gboolean ret;
 
         g_debug ("waiting for card event");
-        ret = FALSE;
 
-        slot = SECMOD_WaitForAnyTokenEvent (worker->module, 0, PR_SecondsToInterval (1));
+        /* The module blocks in C_WaitForSlotEvent() until something
+         * happens, so the latency only matters if NSS ends up simulating
+         * events for it after all */
+        slot = SECMOD_WaitForAnyTokenEvent (worker->module, 0,
+                                            PR_SecondsToInterval (GSD_SMARTCARD_MANAGER_POLL_INTERVAL));
 
-        processing_error = NULL;
+        if (g_atomic_int_get (&worker->cancelled)) {
+                if (slot != NULL)
+                        PK11_FreeSlot (slot);
+                return FALSE;
+        }
 
         if (slot == NULL) {
                 int error_code;
@@ -1274,126 +1171,142 @@ gsd_smartcard_manager_worker_watch_for_and_process_event (GsdSmartcardManagerWor
                              GSD_SMARTCARD_MANAGER_ERROR_WITH_NSS,
                              _("encountered unexpected error while "
                                "waiting for smartcard events"));
-                goto out;
+                return FALSE;
         }
 
-        /* the slot id and series together uniquely identify a card.
-         * You can never have two cards with the same slot id at the
-         * same time, however (I think), so we can key off of it.
-         */
-        slot_id = PK11_GetSlotID (slot);
-        slot_series = PK11_GetSlotSeries (slot);
+        gsd_smartcard_manager_worker_check_slot (worker, slot);
+        PK11_FreeSlot (slot);
 
-        /* First check to see if there is a card that we're currently
-         * tracking in the slot.
-         */
-        key = g_new (CK_SLOT_ID, 1);
-        *key = slot_id;
-        card = g_hash_table_lookup (worker->smartcards, key);
+        return TRUE;
+}
 
-        if (card != NULL) {
-                card_slot_series = gsd_smartcard_get_slot_series (card);
-        } else {
-                card_slot_series = -1;
+static gpointer
+gsd_smartcard_manager_worker_run (GsdSmartcardManagerWorker *worker)
+{
+        GError *error;
+        gboolean should_continue;
+
+        /* catch up with anything that happened before we started
+         * waiting, NSS only reports changes */
+        gsd_smartcard_manager_worker_check_all_slots (worker);
+
+        do
+        {
+                error = NULL;
+                should_continue = gsd_smartcard_manager_worker_watch_for_and_process_event (worker, &error);
         }
+        while (should_continue);
 
-        if (PK11_IsPresent (slot)) {
-                /* Now, check to see if their is a new card in the slot.
-                 * If there was a different card in the slot now than
-                 * there was before, then we need to emit a removed signal
-                 * for the old card (we don't want unpaired insertion events).
-                 */
-                if ((card != NULL) &&
-                    card_slot_series != slot_series) {
-                        if (!gsd_smartcard_manager_worker_emit_smartcard_removed (worker, card, &processing_error)) {
-                                g_propagate_error (error, processing_error);
-                                goto out;
-                        }
-                }
+        if (!g_atomic_int_get (&worker->cancelled)) {
+                if (error != NULL)
+                        g_debug ("could not process card event - %s", error->message);
 
-                card = _gsd_smartcard_new (worker->module,
-                                           slot_id, slot_series);
+                /* let the main loop know we're gone */
+                gsd_smartcard_manager_worker_queue_event (worker, '\0', NULL, error);
+        } else if (error != NULL) {
+                g_error_free (error);
+        }
 
-                g_hash_table_replace (worker->smartcards,
-                                      key, card);
-                key = NULL;
+        gsd_smartcard_manager_worker_unref (worker);
 
-                if (!gsd_smartcard_manager_worker_emit_smartcard_inserted (worker, card, &processing_error)) {
-                        g_propagate_error (error, processing_error);
-                        goto out;
+        return NULL;
+}
+
+static gpointer
+gsd_smartcard_manager_poll_run (GsdSmartcardManager *manager)
+{
+        GsdSmartcardManagerPrivate *priv = manager->priv;
+        GsdSmartcardManagerWorker *worker;
+        GList *workers, *node;
+        gint64 end_time;
+
+        g_mutex_lock (&priv->poll_lock);
+        while (!priv->poll_stopping) {
+                workers = g_list_copy (priv->polled_workers);
+                g_list_foreach (workers, (GFunc) gsd_smartcard_manager_worker_ref, NULL);
+                priv->poll_wakeup = FALSE;
+                g_mutex_unlock (&priv->poll_lock);
+
+                /* PK11_IsPresent() may block on the token, so this
+                 * stays off the main loop, and off the lock */
+                for (node = workers; node != NULL; node = node->next) {
+                        worker = node->data;
+                        if (!g_atomic_int_get (&worker->cancelled))
+                                gsd_smartcard_manager_worker_check_all_slots (worker);
+                        gsd_smartcard_manager_worker_unref (worker);
                 }
-        } else {
-                /* if we aren't tracking the card, just discard the event.
-                 * We don't want unpaired remove events.  Note on startup
-                 * NSS will generate an "insertion" event if a card is
-                 * already inserted in the slot.
-                 */
-                if ((card != NULL)) {
-                        /* FIXME: i'm not sure about this code.  Maybe we
-                         * shouldn't do this at all, or maybe we should do it
-                         * n times (where n = slot_series - card_slot_series + 1)
-                         *
-                         * Right now, i'm just doing it once.
-                         */
-                        if ((slot_series - card_slot_series) > 1) {
-
-                                if (!gsd_smartcard_manager_worker_emit_smartcard_removed (worker, card, &processing_error)) {
-                                        g_propagate_error (error, processing_error);
-                                        goto out;
-                                }
-                                g_hash_table_remove (worker->smartcards, key);
-
-                                card = _gsd_smartcard_new (worker->module,
-                                                                slot_id, slot_series);
-                                g_hash_table_replace (worker->smartcards,
-                                                      key, card);
-                                key = NULL;
-                                if (!gsd_smartcard_manager_worker_emit_smartcard_inserted (worker, card, &processing_error)) {
-                                        g_propagate_error (error, processing_error);
-                                        goto out;
-                                }
-                        }
+                g_list_free (workers);
 
-                        if (!gsd_smartcard_manager_worker_emit_smartcard_removed (worker, card, &processing_error)) {
-                                g_propagate_error (error, processing_error);
-                                goto out;
-                        }
+                end_time = g_get_monotonic_time () +
+                           GSD_SMARTCARD_MANAGER_POLL_INTERVAL * G_TIME_SPAN_SECOND;
 
-                        g_hash_table_remove (worker->smartcards, key);
-                        card = NULL;
-                } else {
-                        g_debug ("got spurious remove event");
+                g_mutex_lock (&priv->poll_lock);
+                while (!priv->poll_stopping && !priv->poll_wakeup) {
+                        if (!g_cond_wait_until (&priv->poll_cond, &priv->poll_lock, end_time))
+                                break;
                 }
         }
+        g_mutex_unlock (&priv->poll_lock);
 
-        ret = TRUE;
-
-out:
-        g_free (key);
-        PK11_FreeSlot (slot);
-
-        return ret;
+        return NULL;
 }
 
-static void
-gsd_smartcard_manager_worker_run (GsdSmartcardManagerWorker *worker)
+/* Hands the worker over to the poll thread, starting it if needed */
+static gboolean
+gsd_smartcard_manager_add_polled_worker (GsdSmartcardManager       *manager,
+                                         GsdSmartcardManagerWorker *worker)
 {
-        GError *error;
-        gboolean should_continue;
+        GsdSmartcardManagerPrivate *priv = manager->priv;
 
-        do
-        {
-                error = NULL;
-                should_continue = gsd_smartcard_manager_worker_watch_for_and_process_event (worker, &error);
+        g_mutex_lock (&priv->poll_lock);
+        priv->polled_workers = g_list_prepend (priv->polled_workers,
+                                               gsd_smartcard_manager_worker_ref (worker));
+
+        /* catch up with the slots of the new module straight away */
+        priv->poll_wakeup = TRUE;
+        g_cond_signal (&priv->poll_cond);
+
+        if (priv->poll_thread == NULL) {
+                priv->poll_stopping = FALSE;
+                priv->poll_thread = g_thread_try_new ("smartcard-poll",
+                                                      (GThreadFunc) gsd_smartcard_manager_poll_run,
+                                                      manager, NULL);
         }
-        while (should_continue);
 
-        if (error != NULL)  {
-                g_debug ("could not process card event - %s", error->message);
-                g_error_free (error);
+        if (priv->poll_thread == NULL) {
+                priv->polled_workers = g_list_remove (priv->polled_workers, worker);
+                g_mutex_unlock (&priv->poll_lock);
+                gsd_smartcard_manager_worker_unref (worker);
+                return FALSE;
         }
+        g_mutex_unlock (&priv->poll_lock);
+
+        return TRUE;
+}
 
-        gsd_smartcard_manager_worker_free (worker);
+/* Whether the module implements C_WaitForSlotEvent(), i.e. whether a
+ * thread can block on it without NSS falling back to polling the slots.
+ * Any event this consumes gets picked up by the initial slot check.
+ */
+static gboolean
+module_has_slot_events (SECMODModule *module)
+{
+        CK_FUNCTION_LIST_PTR functions;
+        CK_SLOT_ID slot_id;
+        CK_RV rv;
+
+        /* NSS never calls into modules that aren't thread safe
+         * concurrently, so it simulates events for them too */
+        if (!module->isThreadSafe)
+                return FALSE;
+
+        functions = (CK_FUNCTION_LIST_PTR) module->functionList;
+        if (functions == NULL || functions->C_WaitForSlotEvent == NULL)
+                return FALSE;
+
+        rv = functions->C_WaitForSlotEvent (CKF_DONT_BLOCK, &slot_id, NULL);
+
+        return rv == CKR_OK || rv == CKR_NO_EVENT;
 }
 
 static GsdSmartcardManagerWorker *
@@ -1401,25 +1314,32 @@ gsd_smartcard_manager_create_worker (GsdSmartcardManager  *manager,
                                      SECMODModule         *module)
 {
         GsdSmartcardManagerWorker *worker;
-        int write_fd, read_fd;
 
-        write_fd = -1;
-        read_fd = -1;
-        if (!open_pipe (&write_fd, &read_fd)) {
-                return NULL;
-        }
+        worker = gsd_smartcard_manager_worker_new (manager, module);
+        worker->has_slot_events = module_has_slot_events (module);
+
+        if (!worker->has_slot_events) {
+                g_debug ("module '%s' can't wait for slot events, polling it",
+                         module->commonName);
 
-        worker = gsd_smartcard_manager_worker_new (manager,
-                                                   write_fd,
-                                                   read_fd,
-                                                   module);
+                if (!gsd_smartcard_manager_add_polled_worker (manager, worker)) {
+                        gsd_smartcard_manager_worker_unref (worker);
+                        return NULL;
+                }
+
+                return worker;
+        }
 
-        worker->thread = g_thread_create ((GThreadFunc)
-                                          gsd_smartcard_manager_worker_run,
-                                          worker, FALSE, NULL);
+        /* the thread holds its own reference, dropped when it exits, and
+         * gets joined by stop_worker() */
+        gsd_smartcard_manager_worker_ref (worker);
+        worker->thread = g_thread_try_new ("smartcard-worker",
+                                           (GThreadFunc) gsd_smartcard_manager_worker_run,
+                                           worker, NULL);
 
         if (worker->thread == NULL) {
-                gsd_smartcard_manager_worker_free (worker);
+                gsd_smartcard_manager_worker_unref (worker);
+                gsd_smartcard_manager_worker_unref (worker);
                 return NULL;
         }
 
@@ -1455,7 +1375,8 @@ static void
 on_device_inserted (GsdSmartcardManager *manager,
                     GsdSmartcard        *card)
 {
-        g_print ("smartcard inserted!\n");
+        g_print ("%" G_GINT64_FORMAT ": smartcard inserted!\n",
+                 g_get_real_time ());
         g_print ("Please remove it.\n");
 }
 
@@ -1463,7 +1384,8 @@ static void
 on_device_removed (GsdSmartcardManager *manager,
                    GsdSmartcard        *card)
 {
-        g_print ("smartcard removed!\n");
+        g_print ("%" G_GINT64_FORMAT ": smartcard removed!\n",
+                 g_get_real_time ());
 
         if (should_exit_on_next_remove) {
                 g_main_loop_quit (event_loop);
@@ -1484,8 +1406,9 @@ main (int   argc,
         g_log_set_always_fatal (G_LOG_LEVEL_ERROR
                                 | G_LOG_LEVEL_CRITICAL | G_LOG_LEVEL_WARNING);
 
+        /* an explicit module, e.g. SoftHSM, for scripted tests */
         g_message ("creating instance of 'smartcard manager' object...");
-        manager = gsd_smartcard_manager_new (NULL);
+        manager = gsd_smartcard_manager_new (argc > 1 ? argv[1] : NULL);
         g_message ("'smartcard manager' object created successfully");
 
         g_signal_connect (manager, "smartcard-inserted",
@@ -0,0 +1,285 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Runs the smartcard manager against a SoftHSM token in a throwaway
+ * configuration and checks that inserting and removing it gets reported.
+ * SoftHSM can't wait for slot events, so this goes through the shared
+ * poll thread. Its slots can't be unplugged either, so the test decides
+ * whether the token is present. Needs softhsm2-util and the SoftHSM
+ * module, SOFTHSM2_MODULE can point at the latter.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <pk11func.h>
+#include <secmod.h>
+
+#define TEST_TOKEN_LABEL "usd-test"
+
+static char *nss_db_dir;
+static volatile gint token_present;
+
+static PRBool test_is_present (PK11SlotInfo *slot);
+static PRBool test_has_removable_slots (SECMODModule *module);
+
+#define GSD_SMARTCARD_MANAGER_NSS_DB nss_db_dir
+#define PK11_IsPresent test_is_present
+#define SECMOD_HasRemovableSlots test_has_removable_slots
+
+#include "gsd-smartcard-manager.c"
+
+#undef PK11_IsPresent
+#undef SECMOD_HasRemovableSlots
+
+/* Only our token, and only while the test says it's plugged in */
+static PRBool
+test_is_present (PK11SlotInfo *slot)
+{
+        if (!PK11_IsPresent (slot))
+                return PR_FALSE;
+        if (strcmp (PK11_GetTokenName (slot), TEST_TOKEN_LABEL) != 0)
+                return PR_FALSE;
+
+        return g_atomic_int_get (&token_present) ? PR_TRUE : PR_FALSE;
+}
+
+static PRBool
+test_has_removable_slots (SECMODModule *module)
+{
+        return PR_TRUE;
+}
+
+static char *module_path;
+static char *tmp_dir;
+
+static const char *module_paths[] = {
+        "/usr/lib/softhsm/libsofthsm2.so",
+        "/usr/lib/x86_64-linux-gnu/softhsm/libsofthsm2.so",
+        "/usr/lib64/pkcs11/libsofthsm2.so",
+        "/usr/lib/x86_64-linux-gnu/pkcs11/libsofthsm2.so",
+        NULL
+};
+
+static char *
+find_module (void)
+{
+        const char *path;
+        guint i;
+
+        path = g_getenv ("SOFTHSM2_MODULE");
+        if (path != NULL)
+                return g_file_test (path, G_FILE_TEST_EXISTS) ? g_strdup (path) : NULL;
+
+        for (i = 0; module_paths[i] != NULL; i++) {
+                if (g_file_test (module_paths[i], G_FILE_TEST_EXISTS))
+                        return g_strdup (module_paths[i]);
+        }
+
+        return NULL;
+}
+
+static gboolean
+setup_token (const char *softhsm_util)
+{
+        GError *error = NULL;
+        char *token_dir;
+        char *conf;
+        char *contents;
+        char *argv[] = { (char *) softhsm_util, "--init-token", "--free",
+                         "--label", TEST_TOKEN_LABEL,
+                         "--so-pin", "1234", "--pin", "1234", NULL };
+        int status;
+
+        token_dir = g_build_filename (tmp_dir, "tokens", NULL);
+        g_mkdir (token_dir, 0700);
+        nss_db_dir = g_build_filename (tmp_dir, "nssdb", NULL);
+        g_mkdir (nss_db_dir, 0700);
+
+        contents = g_strdup_printf ("directories.tokendir = %s\n"
+                                    "objectstore.backend = file\n"
+                                    "log.level = ERROR\n",
+                                    token_dir);
+        conf = g_build_filename (tmp_dir, "softhsm2.conf", NULL);
+        g_file_set_contents (conf, contents, -1, &error);
+        g_assert_no_error (error);
+        g_setenv ("SOFTHSM2_CONF", conf, TRUE);
+
+        g_spawn_sync (NULL, argv, NULL, G_SPAWN_STDOUT_TO_DEV_NULL,
+                      NULL, NULL, NULL, NULL, &status, &error);
+        g_assert_no_error (error);
+
+        g_free (conf);
+        g_free (contents);
+        g_free (token_dir);
+
+        return g_spawn_check_exit_status (status, NULL);
+}
+
+typedef struct {
+        GMainLoop *loop;
+        char      *inserted;
+        char      *removed;
+} Events;
+
+static void
+on_inserted (GsdSmartcardManager *manager,
+             GsdSmartcard        *card,
+             Events              *events)
+{
+        g_free (events->inserted);
+        events->inserted = gsd_smartcard_get_name (card);
+        g_main_loop_quit (events->loop);
+}
+
+static void
+on_removed (GsdSmartcardManager *manager,
+            GsdSmartcard        *card,
+            Events              *events)
+{
+        g_free (events->removed);
+        events->removed = gsd_smartcard_get_name (card);
+        g_main_loop_quit (events->loop);
+}
+
+static gboolean
+on_timeout (gpointer data)
+{
+        g_assert_not_reached ();
+        return FALSE;
+}
+
+/* A few poll intervals is plenty */
+static void
+wait_for_event (Events *events)
+{
+        guint id;
+
+        id = g_timeout_add_seconds (5 * GSD_SMARTCARD_MANAGER_POLL_INTERVAL, on_timeout, NULL);
+        g_main_loop_run (events->loop);
+        g_source_remove (id);
+}
+
+static void
+test_insert_remove (void)
+{
+        GsdSmartcardManager *manager;
+        GError *error = NULL;
+        Events events = { NULL, };
+        int i;
+
+        events.loop = g_main_loop_new (NULL, FALSE);
+        g_atomic_int_set (&token_present, FALSE);
+
+        manager = gsd_smartcard_manager_new (module_path);
+        g_signal_connect (manager, "smartcard-inserted", G_CALLBACK (on_inserted), &events);
+        g_signal_connect (manager, "smartcard-removed", G_CALLBACK (on_removed), &events);
+
+        g_assert (gsd_smartcard_manager_start (manager, &error));
+        g_assert_no_error (error);
+
+        /* no thread of its own, the shared one polls it */
+        g_assert (manager->priv->poll_thread != NULL);
+        g_assert_cmpuint (g_list_length (manager->priv->polled_workers), ==, 1);
+        g_assert (((GsdSmartcardManagerWorker *) manager->priv->workers->data)->thread == NULL);
+
+        for (i = 0; i < 2; i++) {
+                g_atomic_int_set (&token_present, TRUE);
+                wait_for_event (&events);
+                g_assert_cmpstr (events.inserted, ==, TEST_TOKEN_LABEL);
+                g_assert (events.removed == NULL);
+                g_clear_pointer (&events.inserted, g_free);
+
+                g_atomic_int_set (&token_present, FALSE);
+                wait_for_event (&events);
+                g_assert_cmpstr (events.removed, ==, TEST_TOKEN_LABEL);
+                g_assert (events.inserted == NULL);
+                g_clear_pointer (&events.removed, g_free);
+        }
+
+        /* the poll thread is joined before NSS goes away */
+        gsd_smartcard_manager_stop (manager);
+        g_assert (manager->priv->poll_thread == NULL);
+        g_assert (manager->priv->polled_workers == NULL);
+        g_assert (!manager->priv->nss_is_loaded);
+
+        g_object_unref (manager);
+        g_main_loop_unref (events.loop);
+}
+
+static void
+remove_tree (const char *path)
+{
+        GDir *dir;
+        const char *name;
+        char *child;
+
+        if (g_file_test (path, G_FILE_TEST_IS_DIR)) {
+                dir = g_dir_open (path, 0, NULL);
+                while (dir != NULL && (name = g_dir_read_name (dir)) != NULL) {
+                        child = g_build_filename (path, name, NULL);
+                        remove_tree (child);
+                        g_free (child);
+                }
+                if (dir != NULL)
+                        g_dir_close (dir);
+                g_rmdir (path);
+        } else {
+                g_unlink (path);
+        }
+}
+
+int
+main (int argc, char **argv)
+{
+        char *softhsm_util;
+        int ret;
+
+        g_type_init ();
+        g_test_init (&argc, &argv, NULL);
+
+        softhsm_util = g_find_program_in_path ("softhsm2-util");
+        module_path = find_module ();
+        if (softhsm_util == NULL || module_path == NULL) {
+                g_print ("SoftHSM not installed, skipping\n");
+                return 77;
+        }
+
+        tmp_dir = g_dir_make_tmp ("test-smartcard-softhsm-XXXXXX", NULL);
+        g_assert (tmp_dir != NULL);
+
+        if (!setup_token (softhsm_util)) {
+                g_print ("could not create a SoftHSM token, skipping\n");
+                remove_tree (tmp_dir);
+                return 77;
+        }
+        g_free (softhsm_util);
+
+        g_test_add_func ("/smartcard/softhsm/insert-remove", test_insert_remove);
+        ret = g_test_run ();
+
+        remove_tree (tmp_dir);
+        g_free (tmp_dir);
+        g_free (nss_db_dir);
+        g_free (module_path);
+
+        return ret;
+}
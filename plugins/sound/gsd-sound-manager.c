@@ -37,19 +37,49 @@
 #include <glib/gstdio.h>
 #include <gtk/gtk.h>
 #include <pulse/pulseaudio.h>
+#include <pulse/glib-mainloop.h>
 
 #include "gsd-sound-manager.h"
 #include "gnome-settings-profile.h"
 
 #define GSD_SOUND_MANAGER_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), GSD_TYPE_SOUND_MANAGER, GsdSoundManagerPrivate))
 
+/* Same as CA_PROP_CANBERRA_XDG_THEME_NAME, set by libcanberra
+ * on the samples it uploads */
+#define PROP_XDG_THEME_NAME "canberra.xdg-theme.name"
+
+#define RECONNECT_TIMEOUT 5 /* seconds */
+
 struct GsdSoundManagerPrivate
 {
         GSettings *settings;
         GList     *monitors;
         guint      timeout;
+
+        /* Long-lived connection to the sound server, so that
+         * flushing the cache never blocks the main loop */
+        pa_glib_mainloop *pa_mainloop;
+        pa_context       *pa_context;
+        guint             reconnect_id;
+
+        /* Themes whose samples should be dropped on the next flush */
+        GHashTable *dirty_themes;
+        gboolean    dirty_all;
+        gboolean    flush_pending;
+
+        /* Flushes waiting on the sound server, see flushes_cancel() */
+        GList      *flushes;
 };
 
+typedef struct {
+        GsdSoundManager *manager;
+        pa_operation    *op;
+        GHashTable      *themes;
+        gboolean         all;
+        guint            n_removed;
+        gint64           start_time;
+} FlushData;
+
 static void gsd_sound_manager_class_init (GsdSoundManagerClass *klass);
 static void gsd_sound_manager_init (GsdSoundManager *sound_manager);
 static void gsd_sound_manager_finalize (GObject *object);
@@ -58,10 +88,59 @@ G_DEFINE_TYPE (GsdSoundManager, gsd_sound_manager, G_TYPE_OBJECT)
 
 static gpointer manager_object = NULL;
 
+static void
+flush_data_free (FlushData *data)
+{
+        if (data->op != NULL)
+                pa_operation_unref (data->op);
+        if (data->themes != NULL)
+                g_hash_table_destroy (data->themes);
+        g_free (data);
+}
+
+/* The sound server never answers a flush whose context went away, so
+ * the data would leak. Drop them, and mark their themes dirty again so
+ * that the next connection flushes them. */
+static void
+flushes_cancel (GsdSoundManager *manager)
+{
+        GsdSoundManagerPrivate *priv = manager->priv;
+
+        while (priv->flushes != NULL) {
+                FlushData *data = priv->flushes->data;
+
+                priv->flushes = g_list_delete_link (priv->flushes, priv->flushes);
+
+                pa_operation_cancel (data->op);
+                if (priv->dirty_themes != NULL) {
+                        GHashTableIter iter;
+                        gpointer theme;
+
+                        g_hash_table_iter_init (&iter, data->themes);
+                        while (g_hash_table_iter_next (&iter, &theme, NULL))
+                                g_hash_table_add (priv->dirty_themes, g_strdup (theme));
+                        priv->dirty_all |= data->all;
+                        priv->flush_pending = TRUE;
+                }
+                flush_data_free (data);
+        }
+}
+
 static void
 sample_info_cb (pa_context *c, const pa_sample_info *i, int eol, void *userdata)
 {
+        FlushData *data = userdata;
         pa_operation *o;
+        const char *theme;
+
+        if (eol) {
+                g_debug ("Sample cache flushed, %u samples dropped in %" G_GINT64_FORMAT " ms",
+                         data->n_removed,
+                         (g_get_monotonic_time () - data->start_time) / 1000);
+                data->manager->priv->flushes = g_list_remove (data->manager->priv->flushes, data);
+                flush_data_free (data);
+                return;
+        }
 
         if (!i)
                 return;
@@ -73,6 +152,12 @@ sample_info_cb (pa_context *c, const pa_sample_info *i, int eol, void *userdata)
         if (!(pa_proplist_gets (i->proplist, PA_PROP_EVENT_ID)))
                 return;
 
+        /* Samples without a theme name could come from any theme */
+        theme = pa_proplist_gets (i->proplist, PROP_XDG_THEME_NAME);
+        if (!data->all && theme != NULL &&
+            !g_hash_table_contains (data->themes, theme))
+                return;
+
         g_debug ("Dropping sample %s from cache", i->name);
 
         if (!(o = pa_context_remove_sample (c, i->name, NULL, NULL))) {
@@ -81,114 +166,145 @@ sample_info_cb (pa_context *c, const pa_sample_info *i, int eol, void *userdata)
         }
 
         pa_operation_unref (o);
+        data->n_removed++;
 
         /* We won't wait until the operation is actually executed to
          * speed things up a bit.*/
 }
 
 static void
-flush_cache (void)
+flush_cache (GsdSoundManager *manager)
 {
-        pa_mainloop *ml = NULL;
-        pa_context *c = NULL;
-        pa_proplist *pl = NULL;
-        pa_operation *o = NULL;
-
-        g_debug ("Flushing sample cache");
+        GsdSoundManagerPrivate *priv = manager->priv;
+        pa_operation *o;
+        FlushData *data;
 
-        if (!(ml = pa_mainloop_new ())) {
-                g_debug ("Failed to allocate pa_mainloop");
-                goto fail;
+        if (priv->pa_context == NULL ||
+            pa_context_get_state (priv->pa_context) != PA_CONTEXT_READY) {
+                g_debug ("Not connected to the sound server, delaying cache flush");
+                priv->flush_pending = TRUE;
+                return;
         }
 
-        if (!(pl = pa_proplist_new ())) {
-                g_debug ("Failed to allocate pa_proplist");
-                goto fail;
-        }
+        priv->flush_pending = FALSE;
 
-        pa_proplist_sets (pl, PA_PROP_APPLICATION_NAME, PACKAGE_NAME);
-        pa_proplist_sets (pl, PA_PROP_APPLICATION_VERSION, PACKAGE_VERSION);
-        pa_proplist_sets (pl, PA_PROP_APPLICATION_ID, "org.gnome.SettingsDaemon");
+        if (!priv->dirty_all && g_hash_table_size (priv->dirty_themes) == 0)
+                return;
 
-        if (!(c = pa_context_new_with_proplist (pa_mainloop_get_api (ml), PACKAGE_NAME, pl))) {
-                g_debug ("Failed to allocate pa_context");
-                goto fail;
-        }
+        g_debug ("Flushing sample cache");
 
-        pa_proplist_free (pl);
-        pl = NULL;
+        /* Take the current set of dirty themes, anything changing
+         * from now on will need another flush */
+        data = g_new0 (FlushData, 1);
+        data->manager = manager;
+        data->themes = priv->dirty_themes;
+        data->all = priv->dirty_all;
+        data->start_time = g_get_monotonic_time ();
+        priv->dirty_themes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        priv->dirty_all = FALSE;
 
-        if (pa_context_connect (c, NULL, PA_CONTEXT_NOAUTOSPAWN, NULL) < 0) {
-                g_debug ("pa_context_connect(): %s", pa_strerror (pa_context_errno (c)));
-                goto fail;
+        /* Enumerate all cached samples */
+        if (!(o = pa_context_get_sample_info_list (priv->pa_context, sample_info_cb, data))) {
+                g_debug ("pa_context_get_sample_info_list(): %s", pa_strerror (pa_context_errno (priv->pa_context)));
+                flush_data_free (data);
+                return;
         }
 
-        /* Wait until the connection is established */
-        while (pa_context_get_state (c) != PA_CONTEXT_READY) {
-
-                if (!PA_CONTEXT_IS_GOOD (pa_context_get_state (c))) {
-                        g_debug ("Connection failed: %s", pa_strerror (pa_context_errno (c)));
-                        goto fail;
-                }
+        data->op = o;
+        priv->flushes = g_list_prepend (priv->flushes, data);
+}
 
-                if (pa_mainloop_iterate (ml, TRUE, NULL) < 0) {
-                        g_debug ("pa_mainloop_iterate() failed");
-                        goto fail;
-                }
-        }
+static gboolean connect_context (GsdSoundManager *manager);
 
-        /* Enumerate all cached samples */
-        if (!(o = pa_context_get_sample_info_list (c, sample_info_cb, NULL))) {
-                g_debug ("pa_context_get_sample_info_list(): %s", pa_strerror (pa_context_errno (c)));
-                goto fail;
+static void
+context_state_cb (pa_context *c, void *userdata)
+{
+        GsdSoundManager *manager = userdata;
+        GsdSoundManagerPrivate *priv = manager->priv;
+
+        switch (pa_context_get_state (c)) {
+        case PA_CONTEXT_READY:
+                g_debug ("Connected to the sound server");
+                if (priv->flush_pending)
+                        flush_cache (manager);
+                break;
+        case PA_CONTEXT_FAILED:
+        case PA_CONTEXT_TERMINATED:
+                g_debug ("Connection to the sound server lost: %s", pa_strerror (pa_context_errno (c)));
+                flushes_cancel (manager);
+                pa_context_set_state_callback (c, NULL, NULL);
+                pa_context_unref (c);
+                priv->pa_context = NULL;
+                if (priv->reconnect_id == 0)
+                        priv->reconnect_id = g_timeout_add_seconds (RECONNECT_TIMEOUT,
+                                                                    (GSourceFunc) connect_context,
+                                                                    manager);
+                break;
+        default:
+                break;
         }
+}
 
-        /* Wait until our operation is finished and there's nothing
-         * more queued to send to the server */
-        while (pa_operation_get_state (o) == PA_OPERATION_RUNNING || pa_context_is_pending (c)) {
+static gboolean
+connect_context (GsdSoundManager *manager)
+{
+        GsdSoundManagerPrivate *priv = manager->priv;
+        pa_proplist *pl;
 
-                if (!PA_CONTEXT_IS_GOOD (pa_context_get_state (c))) {
-                        g_debug ("Connection failed: %s", pa_strerror (pa_context_errno (c)));
-                        goto fail;
-                }
+        priv->reconnect_id = 0;
 
-                if (pa_mainloop_iterate (ml, TRUE, NULL) < 0) {
-                        g_debug ("pa_mainloop_iterate() failed");
-                        goto fail;
-                }
-        }
+        pl = pa_proplist_new ();
+        pa_proplist_sets (pl, PA_PROP_APPLICATION_NAME, PACKAGE_NAME);
+        pa_proplist_sets (pl, PA_PROP_APPLICATION_VERSION, PACKAGE_VERSION);
+        pa_proplist_sets (pl, PA_PROP_APPLICATION_ID, "org.gnome.SettingsDaemon");
 
-        g_debug ("Sample cache flushed");
+        priv->pa_context = pa_context_new_with_proplist (pa_glib_mainloop_get_api (priv->pa_mainloop),
+                                                         PACKAGE_NAME, pl);
+        pa_proplist_free (pl);
 
-fail:
-        if (o) {
-                pa_operation_cancel (o);
-                pa_operation_unref (o);
+        if (priv->pa_context == NULL) {
+                g_debug ("Failed to allocate pa_context");
+                return FALSE;
         }
 
-        if (c) {
-                pa_context_disconnect (c);
-                pa_context_unref (c);
-        }
+        pa_context_set_state_callback (priv->pa_context, context_state_cb, manager);
 
-        if (pl)
-                pa_proplist_free (pl);
+        /* NOFAIL makes the context wait for the server to show up
+         * instead of failing straight away */
+        if (pa_context_connect (priv->pa_context, NULL,
+                                PA_CONTEXT_NOAUTOSPAWN | PA_CONTEXT_NOFAIL, NULL) < 0) {
+                g_debug ("pa_context_connect(): %s", pa_strerror (pa_context_errno (priv->pa_context)));
+                pa_context_set_state_callback (priv->pa_context, NULL, NULL);
+                pa_context_unref (priv->pa_context);
+                priv->pa_context = NULL;
+        }
 
-        if (ml)
-                pa_mainloop_free (ml);
+        return FALSE;
 }
 
 static gboolean
 flush_cb (GsdSoundManager *manager)
 {
-        flush_cache ();
+        flush_cache (manager);
         manager->priv->timeout = 0;
         return FALSE;
 }
 
 static void
-trigger_flush (GsdSoundManager *manager)
+trigger_flush (GsdSoundManager *manager,
+               const char      *theme)
 {
+        if (theme == NULL) {
+                manager->priv->dirty_all = TRUE;
+        } else {
+                char *current;
+
+                g_hash_table_add (manager->priv->dirty_themes, g_strdup (theme));
+
+                /* The current theme might inherit from the changed one */
+                current = g_settings_get_string (manager->priv->settings, "theme-name");
+                g_hash_table_add (manager->priv->dirty_themes, current);
+        }
 
         if (manager->priv->timeout)
                 g_source_remove (manager->priv->timeout);
@@ -203,7 +319,10 @@ settings_changed_cb (GSettings       *settings,
 		     const char      *key,
 		     GsdSoundManager *manager)
 {
-        trigger_flush (manager);
+        /* Samples are cached by event ID, so switching themes
+         * means every themed sample is stale */
+        if (g_strcmp0 (key, "theme-name") == 0)
+                trigger_flush (manager, NULL);
 }
 
 static void
@@ -221,8 +340,14 @@ file_monitor_changed_cb (GFileMonitor *monitor,
                          GFileMonitorEvent event,
                          GsdSoundManager *manager)
 {
-        g_debug ("Theme dir changed");
-        trigger_flush (manager);
+        char *theme;
+
+        /* We only monitor the base directories, so the changed
+         * file is the theme directory itself */
+        theme = g_file_get_basename (file);
+        g_debug ("Theme dir %s changed", theme);
+        trigger_flush (manager, theme);
+        g_free (theme);
 }
 
 static gboolean
@@ -264,6 +389,10 @@ gsd_sound_manager_start (GsdSoundManager *manager,
         g_debug ("Starting sound manager");
         gnome_settings_profile_start (NULL);
 
+        manager->priv->dirty_themes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        manager->priv->pa_mainloop = pa_glib_mainloop_new (g_main_context_default ());
+        connect_context (manager);
+
         /* We listen for change of the selected theme ... */
         register_config_callback (manager);
 
@@ -311,6 +440,30 @@ gsd_sound_manager_stop (GsdSoundManager *manager)
                 manager->priv->timeout = 0;
         }
 
+        if (manager->priv->reconnect_id) {
+                g_source_remove (manager->priv->reconnect_id);
+                manager->priv->reconnect_id = 0;
+        }
+
+        flushes_cancel (manager);
+
+        if (manager->priv->pa_context != NULL) {
+                pa_context_set_state_callback (manager->priv->pa_context, NULL, NULL);
+                pa_context_disconnect (manager->priv->pa_context);
+                pa_context_unref (manager->priv->pa_context);
+                manager->priv->pa_context = NULL;
+        }
+
+        if (manager->priv->pa_mainloop != NULL) {
+                pa_glib_mainloop_free (manager->priv->pa_mainloop);
+                manager->priv->pa_mainloop = NULL;
+        }
+
+        if (manager->priv->dirty_themes != NULL) {
+                g_hash_table_destroy (manager->priv->dirty_themes);
+                manager->priv->dirty_themes = NULL;
+        }
+
         while (manager->priv->monitors) {
                 g_file_monitor_cancel (G_FILE_MONITOR (manager->priv->monitors->data));
                 g_object_unref (manager->priv->monitors->data);
@@ -0,0 +1,309 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Runs the sample cache flush against a private PulseAudio with a null
+ * sink, while the server is stopped, and checks that the main loop keeps
+ * running meanwhile, that only the changed theme's samples go, and that
+ * nothing is left behind when the manager stops mid-flush.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "gsd-sound-manager.c"
+
+/* How long the sound server stops answering during a flush */
+#define SERVER_STALL_MSEC 1000
+/* How long the main loop may go without running, well below the stall */
+#define MAX_MAIN_LOOP_STALL_MSEC 200
+
+static GPid server_pid;
+static char *runtime_dir;
+static GsdSoundManager *manager;
+
+/* Main loop heartbeat, see run_main_loop() */
+static gint64 last_beat;
+static gint64 max_stall;
+
+static gboolean
+heartbeat_cb (gpointer user_data)
+{
+        gint64 now = g_get_monotonic_time ();
+
+        max_stall = MAX (max_stall, now - last_beat);
+        last_beat = now;
+
+        return TRUE;
+}
+
+static gboolean
+quit_cb (gpointer user_data)
+{
+        g_main_loop_quit (user_data);
+        return FALSE;
+}
+
+static void
+run_main_loop (guint msec)
+{
+        GMainLoop *loop;
+        guint beat_id;
+
+        loop = g_main_loop_new (NULL, FALSE);
+        last_beat = g_get_monotonic_time ();
+        beat_id = g_timeout_add (10, heartbeat_cb, NULL);
+        g_timeout_add (msec, quit_cb, loop);
+        g_main_loop_run (loop);
+        g_source_remove (beat_id);
+        g_main_loop_unref (loop);
+}
+
+static gboolean
+wait_for_ready (void)
+{
+        gint64 end = g_get_monotonic_time () + 5 * G_USEC_PER_SEC;
+
+        while (g_get_monotonic_time () < end) {
+                if (manager->priv->pa_context != NULL &&
+                    pa_context_get_state (manager->priv->pa_context) == PA_CONTEXT_READY)
+                        return TRUE;
+                g_main_context_iteration (NULL, TRUE);
+        }
+
+        return FALSE;
+}
+
+/* Samples as libcanberra uploads them: a bit of silence with the event
+ * ID and theme name attached */
+static void
+upload_done_cb (pa_stream *s, int success, void *userdata)
+{
+        gboolean *done = userdata;
+
+        g_assert (success);
+        *done = TRUE;
+}
+
+static void
+stream_write_cb (pa_stream *s, size_t length, void *userdata)
+{
+        gboolean *done = userdata;
+        void *silence;
+
+        silence = g_malloc0 (length);
+        pa_stream_write (s, silence, length, g_free, 0, PA_SEEK_RELATIVE);
+        pa_stream_set_write_callback (s, NULL, NULL);
+        pa_operation_unref (pa_stream_finish_upload (s, upload_done_cb, done));
+}
+
+static void
+upload_sample (const char *name,
+               const char *event_id,
+               const char *theme)
+{
+        pa_sample_spec spec = { PA_SAMPLE_S16LE, 44100, 1 };
+        pa_proplist *pl;
+        pa_stream *s;
+        gboolean done = FALSE;
+
+        pl = pa_proplist_new ();
+        pa_proplist_sets (pl, PA_PROP_EVENT_ID, event_id);
+        if (theme != NULL)
+                pa_proplist_sets (pl, PROP_XDG_THEME_NAME, theme);
+
+        s = pa_stream_new_with_proplist (manager->priv->pa_context, name, &spec, NULL, pl);
+        pa_proplist_free (pl);
+        g_assert (s != NULL);
+
+        pa_stream_set_write_callback (s, stream_write_cb, &done);
+        g_assert_cmpint (pa_stream_connect_upload (s, 4410 * 2), ==, 0);
+
+        while (!done)
+                g_main_context_iteration (NULL, TRUE);
+
+        pa_stream_disconnect (s);
+        pa_stream_unref (s);
+}
+
+static void
+list_cb (pa_context *c, const pa_sample_info *i, int eol, void *userdata)
+{
+        GPtrArray *names = userdata;
+
+        if (eol)
+                g_ptr_array_add (names, NULL);
+        else if (i != NULL)
+                g_ptr_array_add (names, g_strdup (i->name));
+}
+
+static gboolean
+has_sample (const char *name)
+{
+        GPtrArray *names;
+        gboolean found = FALSE;
+        guint i;
+
+        names = g_ptr_array_new_with_free_func (g_free);
+        pa_operation_unref (pa_context_get_sample_info_list (manager->priv->pa_context, list_cb, names));
+        while (names->len == 0 || g_ptr_array_index (names, names->len - 1) != NULL)
+                g_main_context_iteration (NULL, TRUE);
+
+        for (i = 0; i + 1 < names->len; i++)
+                found |= (g_strcmp0 (g_ptr_array_index (names, i), name) == 0);
+        g_ptr_array_unref (names);
+
+        return found;
+}
+
+static void
+stall_server (void)
+{
+        kill (server_pid, SIGSTOP);
+}
+
+static gboolean
+resume_server_cb (gpointer user_data)
+{
+        kill (server_pid, SIGCONT);
+        return FALSE;
+}
+
+static void
+test_flush_theme (void)
+{
+        upload_sample ("test-changed", "bell", "test-changed");
+        upload_sample ("test-other", "message", "test-other");
+        upload_sample ("test-unthemed", "dialog-warning", NULL);
+        g_assert (has_sample ("test-changed"));
+        g_assert (has_sample ("test-other"));
+
+        /* the server stops answering just as the theme changes */
+        stall_server ();
+        trigger_flush (manager, "test-changed");
+        g_timeout_add (SERVER_STALL_MSEC, resume_server_cb, NULL);
+
+        max_stall = 0;
+        run_main_loop (SERVER_STALL_MSEC + 1000);
+
+        g_test_message ("longest main loop stall during the flush: %" G_GINT64_FORMAT " ms",
+                        max_stall / 1000);
+        g_assert_cmpint (max_stall / 1000, <, MAX_MAIN_LOOP_STALL_MSEC);
+
+        g_assert (manager->priv->flushes == NULL);
+        g_assert (!has_sample ("test-changed"));
+        g_assert (!has_sample ("test-unthemed"));
+        g_assert (has_sample ("test-other"));
+}
+
+static void
+test_stop_mid_flush (void)
+{
+        upload_sample ("test-stopped", "bell", "test-changed");
+
+        /* flush_cb fires while the server can't answer */
+        stall_server ();
+        trigger_flush (manager, "test-changed");
+        run_main_loop (700);
+        g_assert (manager->priv->flushes != NULL);
+
+        gsd_sound_manager_stop (manager);
+        g_assert (manager->priv->flushes == NULL);
+
+        resume_server_cb (NULL);
+}
+
+static gboolean
+start_server (void)
+{
+        char *socket_arg;
+        char *argv[] = {
+                "pulseaudio", "-n", "--daemonize=no", "--exit-idle-time=-1",
+                "--use-pid-file=no", "--disable-shm",
+                "-L", "module-null-sink",
+                "-L", NULL,
+                NULL
+        };
+        char *server;
+        GError *error = NULL;
+
+        runtime_dir = g_dir_make_tmp ("usd-test-sound-XXXXXX", NULL);
+        g_setenv ("PULSE_RUNTIME_PATH", runtime_dir, TRUE);
+        g_setenv ("PULSE_STATE_PATH", runtime_dir, TRUE);
+
+        socket_arg = g_strdup_printf ("module-native-protocol-unix auth-anonymous=1 socket=%s/native", runtime_dir);
+        argv[9] = socket_arg;
+
+        if (!g_spawn_async (NULL, argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
+                            NULL, NULL, &server_pid, &error)) {
+                g_print ("Could not start pulseaudio: %s\n", error->message);
+                g_error_free (error);
+                g_free (socket_arg);
+                return FALSE;
+        }
+        g_free (socket_arg);
+
+        server = g_strdup_printf ("unix:%s/native", runtime_dir);
+        g_setenv ("PULSE_SERVER", server, TRUE);
+        g_free (server);
+
+        return TRUE;
+}
+
+int
+main (int argc, char **argv)
+{
+        GSettingsSchema *schema;
+        int ret;
+
+        g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
+
+        g_test_init (&argc, &argv, NULL);
+
+        schema = g_settings_schema_source_lookup (g_settings_schema_source_get_default (),
+                                                  "org.gnome.desktop.sound", TRUE);
+        if (schema == NULL) {
+                g_print ("org.gnome.desktop.sound not installed, skipping\n");
+                return 77;
+        }
+        g_settings_schema_unref (schema);
+
+        if (!start_server ())
+                return 77;
+
+        /* a started manager, without the directory monitors */
+        manager = g_object_new (GSD_TYPE_SOUND_MANAGER, NULL);
+        manager->priv->dirty_themes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        manager->priv->pa_mainloop = pa_glib_mainloop_new (g_main_context_default ());
+        register_config_callback (manager);
+        connect_context (manager);
+
+        if (!wait_for_ready ()) {
+                g_print ("Could not connect to the test sound server, skipping\n");
+                kill (server_pid, SIGTERM);
+                return 77;
+        }
+
+        g_test_add_func ("/sound/flush-theme", test_flush_theme);
+        g_test_add_func ("/sound/stop-mid-flush", test_stop_mid_flush);
+
+        ret = g_test_run ();
+
+        g_object_unref (manager);
+
+        kill (server_pid, SIGCONT);
+        kill (server_pid, SIGTERM);
+        waitpid (server_pid, NULL, 0);
+        g_spawn_close_pid (server_pid);
+
+        return ret;
+}
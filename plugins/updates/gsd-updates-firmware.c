@@ -47,11 +47,17 @@
 static void     gsd_updates_firmware_finalize   (GObject          *object);
 
 #define GSD_UPDATES_FIRMWARE_GET_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), GSD_UPDATES_TYPE_FIRMWARE, GsdUpdatesFirmwarePrivate))
+/* both can be overridden at build time to test against fake directories */
+#ifndef GSD_UPDATES_FIRMWARE_MISSING_DIR
 #define GSD_UPDATES_FIRMWARE_MISSING_DIR                "/run/udev/firmware-missing"
+#endif
+#ifndef GSD_UPDATES_FIRMWARE_LOADING_DIR
 #define GSD_UPDATES_FIRMWARE_LOADING_DIR                "/lib/firmware"
+#endif
 #define GSD_UPDATES_FIRMWARE_LOGIN_DELAY                10 /* seconds */
 #define GSD_UPDATES_FIRMWARE_PROCESS_DELAY              2 /* seconds */
 #define GSD_UPDATES_FIRMWARE_INSERT_DELAY               2 /* seconds */
+#define GSD_UPDATES_FIRMWARE_MISSING_TIMEOUT            (24 * 60 * 60) /* seconds */
 #define GSD_UPDATES_FIRMWARE_DEVICE_REBIND_PROGRAM      "/usr/sbin/pk-device-rebind"
 
 struct GsdUpdatesFirmwarePrivate
@@ -60,8 +66,17 @@ struct GsdUpdatesFirmwarePrivate
         GFileMonitor            *monitor;
         GPtrArray               *array_requested;
         PkTask                  *task;
+        PkControl               *control;
         GPtrArray               *packages_found;
         guint                    timeout_id;
+        guint                    process_id;
+        GCancellable            *cancellable;
+        /* firmware filename -> PkPackage */
+        GHashTable              *package_cache;
+        /* firmware filename -> monotonic time it had no single package */
+        GHashTable              *missing_cache;
+        /* missing-firmware symlink target -> sysfs path */
+        GHashTable              *device_cache;
 };
 
 typedef enum {
@@ -78,10 +93,24 @@ typedef struct {
         FirmwareSubsystem        subsystem;
 } GsdUpdatesFirmwareRequest;
 
+typedef struct {
+        GsdUpdatesFirmware      *firmware;
+        GCancellable            *cancellable;
+        GPtrArray               *filenames;
+        guint                    pending;
+} GsdUpdatesFirmwareResolve;
+
+typedef struct {
+        GsdUpdatesFirmwareResolve *resolve;
+        /* NULL for the search covering all the filenames */
+        gchar                   *filename;
+} GsdUpdatesFirmwareSearch;
+
 G_DEFINE_TYPE (GsdUpdatesFirmware, gsd_updates_firmware, G_TYPE_OBJECT)
 
 static void install_package_ids (GsdUpdatesFirmware *firmware);
 static void ignore_devices (GsdUpdatesFirmware *firmware);
+static void process_requests (GsdUpdatesFirmware *firmware);
 
 static gboolean
 subsystem_can_replug (FirmwareSubsystem subsystem)
@@ -354,6 +383,10 @@ install_packages_cb (GObject *object,
                 goto out;
         }
 
+        /* what was missing isn't any more */
+        g_hash_table_remove_all (firmware->priv->package_cache);
+        g_hash_table_remove_all (firmware->priv->missing_cache);
+
         /* go through all the requests, and find the worst type */
         array = firmware->priv->array_requested;
         for (i=0; i<array->len; i++) {
@@ -461,118 +494,254 @@ ignore_devices (GsdUpdatesFirmware *firmware)
         g_string_free (string, TRUE);
 }
 
-static PkPackage *
-check_available (GsdUpdatesFirmware *firmware, const gchar *filename)
+static void
+resolve_free (GsdUpdatesFirmwareResolve *resolve)
+{
+        g_object_unref (resolve->firmware);
+        g_object_unref (resolve->cancellable);
+        g_ptr_array_unref (resolve->filenames);
+        g_free (resolve);
+}
+
+static gboolean
+check_results (PkClient *client, GAsyncResult *res, PkResults **results_out)
 {
-        guint length = 0;
-        GPtrArray *array = NULL;
         GError *error = NULL;
-        PkPackage *item = NULL;
-        PkBitfield filter;
-        PkResults *results;
-        gchar **values = NULL;
         PkError *error_code = NULL;
+        PkResults *results;
 
-        /* search for newest not installed package */
-        filter = pk_bitfield_from_enums (PK_FILTER_ENUM_NOT_INSTALLED,
-                                         PK_FILTER_ENUM_NEWEST, -1);
-        values = g_strsplit (filename, "&", -1);
-        results = pk_client_search_files (PK_CLIENT(firmware->priv->task),
-                                          filter,
-                                          values,
-                                          NULL,
-                                          NULL, NULL,
-                                          &error);
+        results = pk_client_generic_finish (client, res, &error);
         if (results == NULL) {
-                g_warning ("failed to search file %s: %s",
-                           filename, error->message);
+                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                        g_warning ("failed to search for firmware: %s", error->message);
                 g_error_free (error);
-                goto out;
+                return FALSE;
         }
 
-        /* check error code */
         error_code = pk_results_get_error_code (results);
         if (error_code != NULL) {
-                g_warning ("failed to search file: %s, %s",
+                g_warning ("failed to search for firmware: %s, %s",
                            pk_error_enum_to_string (pk_error_get_code (error_code)),
                            pk_error_get_details (error_code));
-                goto out;
+                g_object_unref (error_code);
+                g_object_unref (results);
+                return FALSE;
         }
 
-        /* make sure we have one package */
-        array = pk_results_get_package_array (results);
-        if (array->len == 0)
+        *results_out = results;
+        return TRUE;
+}
+
+/* A file provided by no package, or by more than one, is remembered as
+ * missing for a while so we don't search again on every scan */
+static void
+add_missing (GsdUpdatesFirmware *firmware, const gchar *filename)
+{
+        gint64 *checked;
+
+        checked = g_new (gint64, 1);
+        *checked = g_get_monotonic_time ();
+        g_hash_table_insert (firmware->priv->missing_cache,
+                             g_strdup (filename), checked);
+}
+
+static gboolean
+is_resolved (GsdUpdatesFirmware *firmware, const gchar *filename)
+{
+        gint64 *checked;
+
+        if (g_hash_table_lookup (firmware->priv->package_cache, filename) != NULL)
+                return TRUE;
+
+        checked = g_hash_table_lookup (firmware->priv->missing_cache, filename);
+        if (checked == NULL)
+                return FALSE;
+        if (g_get_monotonic_time () - *checked <
+            (gint64) GSD_UPDATES_FIRMWARE_MISSING_TIMEOUT * G_USEC_PER_SEC)
+                return TRUE;
+
+        g_hash_table_remove (firmware->priv->missing_cache, filename);
+        return FALSE;
+}
+
+static void
+add_result (GsdUpdatesFirmware *firmware, const gchar *filename, GPtrArray *packages)
+{
+        if (packages->len == 1) {
+                g_hash_table_insert (firmware->priv->package_cache,
+                                     g_strdup (filename),
+                                     g_object_ref (g_ptr_array_index (packages, 0)));
+                return;
+        }
+
+        if (packages->len == 0)
                 g_debug ("no package providing %s found", filename);
-        else if (array->len != 1)
-                g_warning ("not one package providing %s found (%i)", filename, length);
         else
-                item = g_object_ref (g_ptr_array_index (array, 0));
+                g_warning ("not one package providing %s found (%u)", filename, packages->len);
+        add_missing (firmware, filename);
+}
+
+static void search_files (GsdUpdatesFirmwareResolve *resolve, const gchar *filename);
+
+static void
+search_files_cb (GObject *object,
+                 GAsyncResult *res,
+                 GsdUpdatesFirmwareSearch *search)
+{
+        GsdUpdatesFirmwareResolve *resolve = search->resolve;
+        GsdUpdatesFirmware *firmware = resolve->firmware;
+        PkResults *results = NULL;
+        GPtrArray *packages;
+        guint i;
+
+        if (!check_results (PK_CLIENT (object), res, &results))
+                goto out;
+
+        packages = pk_results_get_package_array (results);
+        if (search->filename != NULL) {
+                add_result (firmware, search->filename, packages);
+        } else if (packages->len == 0) {
+                /* the common case: nothing provides any of them */
+                for (i=0; i<resolve->filenames->len; i++)
+                        add_result (firmware, g_ptr_array_index (resolve->filenames, i), packages);
+        } else if (resolve->filenames->len == 1) {
+                add_result (firmware, g_ptr_array_index (resolve->filenames, 0), packages);
+        } else {
+                /* Which package provides which file would take GetFiles,
+                 * which downloads packages that aren't installed on some
+                 * backends, so search again for each file instead. The
+                 * searches all run at the same time. */
+                for (i=0; i<resolve->filenames->len; i++)
+                        search_files (resolve, g_ptr_array_index (resolve->filenames, i));
+        }
+        g_ptr_array_unref (packages);
+        g_object_unref (results);
 out:
-        g_strfreev (values);
-        if (error_code != NULL)
-                g_object_unref (error_code);
-        if (array != NULL)
-                g_ptr_array_unref (array);
-        if (results != NULL)
-                g_object_unref (results);
-        return item;
+        if (--resolve->pending == 0) {
+                if (!g_cancellable_is_cancelled (resolve->cancellable))
+                        process_requests (firmware);
+                resolve_free (resolve);
+        }
+        g_free (search->filename);
+        g_free (search);
 }
 
+/* each request may list alternatives separated by '&' */
 static void
-remove_duplicate (GPtrArray *array)
+add_search_values (GHashTable *values, const gchar *filename)
 {
-        guint i, j;
-        const gchar *val;
-        const gchar *val_tmp;
+        gchar **split;
+        guint i;
+
+        split = g_strsplit (filename, "&", -1);
+        for (i=0; split[i] != NULL; i++)
+                g_hash_table_add (values, split[i]);
+        /* the strings now belong to the hash table */
+        g_free (split);
+}
+
+/* Searches for the newest not installed packages providing filename, or
+ * any of the requested files if NULL */
+static void
+search_files (GsdUpdatesFirmwareResolve *resolve, const gchar *filename)
+{
+        GsdUpdatesFirmwareSearch *search;
+        GHashTable *values;
+        PkBitfield filter;
+        gchar **strv;
+        GList *keys, *l;
+        guint i;
+
+        values = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        if (filename != NULL) {
+                add_search_values (values, filename);
+        } else {
+                for (i=0; i<resolve->filenames->len; i++)
+                        add_search_values (values, g_ptr_array_index (resolve->filenames, i));
+        }
+
+        strv = g_new0 (gchar *, g_hash_table_size (values) + 1);
+        keys = g_hash_table_get_keys (values);
+        for (l = keys, i = 0; l != NULL; l = l->next, i++)
+                strv[i] = l->data;
+        g_list_free (keys);
 
-        /* remove each duplicate entry */
+        search = g_new0 (GsdUpdatesFirmwareSearch, 1);
+        search->resolve = resolve;
+        search->filename = g_strdup (filename);
+        resolve->pending++;
+
+        filter = pk_bitfield_from_enums (PK_FILTER_ENUM_NOT_INSTALLED,
+                                         PK_FILTER_ENUM_NEWEST, -1);
+        pk_client_search_files_async (PK_CLIENT(resolve->firmware->priv->task),
+                                      filter,
+                                      strv,
+                                      resolve->cancellable,
+                                      NULL, NULL,
+                                      (GAsyncReadyCallback) search_files_cb,
+                                      search);
+
+        /* only the array, the strings are owned by the hash table */
+        g_free (strv);
+        g_hash_table_destroy (values);
+}
+
+/* Looks up all the requested files we don't already know about with a
+ * single search, rather than a blocking round-trip per file. Only when
+ * packages were found for several files does each get its own search.
+ */
+static void
+resolve_requests (GsdUpdatesFirmware *firmware)
+{
+        GsdUpdatesFirmwareResolve *resolve;
+        const GsdUpdatesFirmwareRequest *req;
+        GPtrArray *array;
+        guint i;
+
+        /* a new scan supersedes the one in progress */
+        g_cancellable_cancel (firmware->priv->cancellable);
+        g_object_unref (firmware->priv->cancellable);
+        firmware->priv->cancellable = g_cancellable_new ();
+
+        resolve = g_new0 (GsdUpdatesFirmwareResolve, 1);
+        resolve->firmware = g_object_ref (firmware);
+        resolve->cancellable = g_object_ref (firmware->priv->cancellable);
+        resolve->filenames = g_ptr_array_new_with_free_func (g_free);
+
+        array = firmware->priv->array_requested;
         for (i=0; i<array->len; i++) {
-                val = g_ptr_array_index (array, i);
-                for (j=i+1; j<array->len; j++) {
-                        val_tmp = g_ptr_array_index (array, j);
-                        if (g_strcmp0 (val_tmp, val) == 0)
-                                g_ptr_array_remove_index_fast (array, j);
-                }
+                req = g_ptr_array_index (array, i);
+                if (is_resolved (firmware, req->filename))
+                        continue;
+                g_ptr_array_add (resolve->filenames, g_strdup (req->filename));
+        }
+
+        if (resolve->filenames->len == 0) {
+                g_debug ("all requested firmware already resolved");
+                process_requests (firmware);
+                resolve_free (resolve);
+                return;
         }
+
+        g_debug ("searching for %u requested firmware", resolve->filenames->len);
+        search_files (resolve, NULL);
 }
 
-static gboolean
-delay_timeout_cb (gpointer data)
+static void
+show_notification (GsdUpdatesFirmware *firmware)
 {
         guint i;
         gboolean ret;
         GString *string;
-        GsdUpdatesFirmware *firmware = GSD_UPDATES_FIRMWARE (data);
         NotifyNotification *notification;
         GPtrArray *array;
         GError *error = NULL;
-        PkPackage *item = NULL;
         const GsdUpdatesFirmwareRequest *req;
         gboolean has_data = FALSE;
 
         /* message string */
         string = g_string_new ("");
-
-        /* try to find each firmware file in an available package */
         array = firmware->priv->array_requested;
-        for (i=0; i<array->len; i++) {
-                req = g_ptr_array_index (array, i);
-                /* save to new array if we found one package for this file */
-                item = check_available (firmware, req->filename);
-                if (item != NULL) {
-                        g_ptr_array_add (firmware->priv->packages_found, item);
-                        g_object_unref (item);
-                }
-        }
-
-        /* nothing to do */
-        if (firmware->priv->packages_found->len == 0) {
-                g_debug ("no packages providing any of the missing firmware");
-                goto out;
-        }
-
-        /* check we don't want the same package more than once */
-        remove_duplicate (firmware->priv->packages_found);
 
         /* have we got any models to array */
         for (i=0; i<array->len; i++) {
@@ -618,8 +787,64 @@ delay_timeout_cb (gpointer data)
                 g_error_free (error);
         }
 
-out:
         g_string_free (string, TRUE);
+}
+
+static void
+process_requests (GsdUpdatesFirmware *firmware)
+{
+        const GsdUpdatesFirmwareRequest *req;
+        PkPackage *item;
+        PkPackage *found;
+        GPtrArray *array;
+        guint i, j;
+
+        /* rebuild from the cache, only wanting each package once */
+        g_ptr_array_set_size (firmware->priv->packages_found, 0);
+        array = firmware->priv->array_requested;
+        for (i=0; i<array->len; i++) {
+                req = g_ptr_array_index (array, i);
+                item = g_hash_table_lookup (firmware->priv->package_cache,
+                                            req->filename);
+                if (item == NULL)
+                        continue;
+                for (j=0; j<firmware->priv->packages_found->len; j++) {
+                        found = g_ptr_array_index (firmware->priv->packages_found, j);
+                        if (g_strcmp0 (pk_package_get_id (found),
+                                       pk_package_get_id (item)) == 0)
+                                break;
+                }
+                if (j == firmware->priv->packages_found->len)
+                        g_ptr_array_add (firmware->priv->packages_found,
+                                         g_object_ref (item));
+        }
+
+        /* nothing to do */
+        if (firmware->priv->packages_found->len == 0) {
+                g_debug ("no packages providing any of the missing firmware");
+                return;
+        }
+
+        show_notification (firmware);
+}
+
+/* The package lists changed, so something may provide what didn't
+ * have a package before */
+static void
+updates_changed_cb (PkControl *control, GsdUpdatesFirmware *firmware)
+{
+        g_debug ("package cache changed, forgetting missing firmware");
+        g_hash_table_remove_all (firmware->priv->missing_cache);
+}
+
+static gboolean
+delay_timeout_cb (gpointer data)
+{
+        GsdUpdatesFirmware *firmware = GSD_UPDATES_FIRMWARE (data);
+
+        firmware->priv->process_id = 0;
+        resolve_requests (firmware);
+
         /* never repeat */
         return FALSE;
 }
@@ -748,34 +973,26 @@ udev_text_decode (const gchar *data)
 static gchar *
 get_device (GsdUpdatesFirmware *firmware, const gchar *filename)
 {
-        GFile *file;
-        GFileInfo *info;
-        const gchar *symlink_path;
+        gchar *symlink_path;
         gchar *syspath = NULL;
         GError *error = NULL;
         gchar *target = NULL;
         gchar *tmp;
 
-        /* get the file data */
-        file = g_file_new_for_path (filename);
-        info = g_file_query_info (file,
-                                  G_FILE_ATTRIBUTE_STANDARD_SYMLINK_TARGET,
-                                  G_FILE_QUERY_INFO_NONE,
-                                  NULL,
-                                  &error);
-        if (info == NULL) {
+        /* /devices/pci0000:00/0000:00:1d.0/usb5/5-2/firmware/5-2 */
+        symlink_path = g_file_read_link (filename, &error);
+        if (symlink_path == NULL) {
                 g_warning ("Failed to get symlink: %s",
                            error->message);
                 g_error_free (error);
                 goto out;
         }
 
-        /* /devices/pci0000:00/0000:00:1d.0/usb5/5-2/firmware/5-2 */
-        symlink_path = g_file_info_get_symlink_target (info);
-        if (symlink_path == NULL) {
-                g_warning ("failed to get symlink target");
+        /* we've walked this one before */
+        target = g_strdup (g_hash_table_lookup (firmware->priv->device_cache,
+                                                symlink_path));
+        if (target != NULL)
                 goto out;
-        }
 
         /* prepend sys to make '/sys/devices/pci0000:00/0000:00:1d.0/usb5/5-2/firmware/5-2' */
         syspath = g_strconcat ("/sys", symlink_path, NULL);
@@ -784,17 +1001,18 @@ get_device (GsdUpdatesFirmware *firmware, const gchar *filename)
         tmp = &syspath[strlen (syspath)];
         while (tmp != NULL) {
                 *tmp = '\0';
-                g_debug ("testing %s", target);
+                g_debug ("testing %s", syspath);
                 if (g_file_test (syspath, G_FILE_TEST_EXISTS)) {
                         target = g_strdup (syspath);
+                        g_hash_table_insert (firmware->priv->device_cache,
+                                             g_strdup (symlink_path),
+                                             g_strdup (target));
                         goto out;
                 }
                 tmp = g_strrstr (syspath, "/");
         }
 out:
-        if (info != NULL)
-                g_object_unref (info);
-        g_object_unref (file);
+        g_free (symlink_path);
         g_free (syspath);
         return target;
 }
@@ -865,7 +1083,6 @@ scan_directory (GsdUpdatesFirmware *firmware)
         guint i;
         GPtrArray *array;
         const GsdUpdatesFirmwareRequest *req;
-        guint scan_id = 0;
 
         /* should we check and show the user */
         ret = g_settings_get_boolean (firmware->priv->settings,
@@ -920,11 +1137,13 @@ scan_directory (GsdUpdatesFirmware *firmware)
         }
 
         /* don't spam the user at startup, so wait a little delay */
-        if (array->len > 0) {
-                scan_id = g_timeout_add_seconds (GSD_UPDATES_FIRMWARE_PROCESS_DELAY,
-                                                 delay_timeout_cb,
-                                                 firmware);
-                g_source_set_name_by_id (scan_id, "[GsdUpdatesFirmware] process");
+        if (array->len > 0 && firmware->priv->process_id == 0) {
+                firmware->priv->process_id =
+                        g_timeout_add_seconds (GSD_UPDATES_FIRMWARE_PROCESS_DELAY,
+                                               delay_timeout_cb,
+                                               firmware);
+                g_source_set_name_by_id (firmware->priv->process_id,
+                                         "[GsdUpdatesFirmware] process");
         }
 }
 
@@ -975,11 +1194,23 @@ gsd_updates_firmware_init (GsdUpdatesFirmware *firmware)
         firmware->priv->timeout_id = 0;
         firmware->priv->packages_found = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
         firmware->priv->array_requested = g_ptr_array_new_with_free_func ((GDestroyNotify) request_free);
+        firmware->priv->cancellable = g_cancellable_new ();
+        firmware->priv->package_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                               g_free, g_object_unref);
+        firmware->priv->missing_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                               g_free, g_free);
+        firmware->priv->device_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                              g_free, g_free);
         firmware->priv->settings = g_settings_new (GSD_SETTINGS_SCHEMA);
         firmware->priv->task = pk_task_new ();
         g_object_set (firmware->priv->task,
                       "background", TRUE,
                       NULL);
+        firmware->priv->control = pk_control_new ();
+        g_signal_connect (firmware->priv->control, "updates-changed",
+                          G_CALLBACK (updates_changed_cb), firmware);
+        g_signal_connect (firmware->priv->control, "repo-list-changed",
+                          G_CALLBACK (updates_changed_cb), firmware);
 
         /* setup watch for new hardware */
         file = g_file_new_for_path (GSD_UPDATES_FIRMWARE_MISSING_DIR);
@@ -1019,14 +1250,23 @@ gsd_updates_firmware_finalize (GObject *object)
         firmware = GSD_UPDATES_FIRMWARE (object);
 
         g_return_if_fail (firmware->priv != NULL);
+        g_cancellable_cancel (firmware->priv->cancellable);
+        g_object_unref (firmware->priv->cancellable);
+        g_hash_table_destroy (firmware->priv->package_cache);
+        g_hash_table_destroy (firmware->priv->missing_cache);
+        g_hash_table_destroy (firmware->priv->device_cache);
         g_ptr_array_unref (firmware->priv->array_requested);
         g_ptr_array_unref (firmware->priv->packages_found);
         g_object_unref (PK_CLIENT(firmware->priv->task));
+        g_signal_handlers_disconnect_by_data (firmware->priv->control, firmware);
+        g_object_unref (firmware->priv->control);
         g_object_unref (firmware->priv->settings);
         if (firmware->priv->monitor != NULL)
                 g_object_unref (firmware->priv->monitor);
         if (firmware->priv->timeout_id > 0)
                 g_source_remove (firmware->priv->timeout_id);
+        if (firmware->priv->process_id > 0)
+                g_source_remove (firmware->priv->process_id);
 
         G_OBJECT_CLASS (gsd_updates_firmware_parent_class)->finalize (object);
 }
@@ -0,0 +1,351 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Runs the missing firmware lookup against a fake missing-firmware
+ * directory and a stand-in for PackageKit's SearchFiles, and checks how
+ * many searches it takes, which packages get offered, and when files
+ * that had no package get looked up again.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include <libnotify/notify.h>
+#include <packagekit-glib2/packagekit.h>
+
+static char *missing_dir;
+static char *loading_dir;
+
+#define GSD_UPDATES_FIRMWARE_MISSING_DIR missing_dir
+#define GSD_UPDATES_FIRMWARE_LOADING_DIR loading_dir
+
+static void test_search_files_async (PkClient *client, PkBitfield filters, gchar **values,
+                                     GCancellable *cancellable,
+                                     PkProgressCallback progress_callback, gpointer progress_user_data,
+                                     GAsyncReadyCallback callback_ready, gpointer user_data);
+static PkResults *test_generic_finish (PkClient *client, GAsyncResult *res, GError **error);
+static gboolean test_notification_show (NotifyNotification *notification, GError **error);
+
+#define pk_client_search_files_async test_search_files_async
+#define pk_client_generic_finish test_generic_finish
+#define notify_notification_show test_notification_show
+
+#include "gsd-updates-firmware.c"
+
+/* Devices the fake missing firmware symlinks point at, each request
+ * needs its own */
+static const char *devices[] = { "null", "zero", "full", "random" };
+
+typedef struct {
+        GsdUpdatesFirmware *firmware;
+        char               *dir;
+        guint               n_devices;
+} Fixture;
+
+/* The stand-in backend: firmware path -> package id */
+static GHashTable *backend_files;
+static guint n_searches;
+static guint n_pending;
+static guint n_notifications;
+
+static void
+test_search_files_async (PkClient *client, PkBitfield filters, gchar **values,
+                         GCancellable *cancellable,
+                         PkProgressCallback progress_callback, gpointer progress_user_data,
+                         GAsyncReadyCallback callback_ready, gpointer user_data)
+{
+        GHashTable *found;
+        PkResults *results;
+        PkPackage *package;
+        const char *package_id;
+        GTask *task;
+        GList *ids, *l;
+        guint i;
+
+        found = g_hash_table_new (g_str_hash, g_str_equal);
+        for (i = 0; values[i] != NULL; i++) {
+                package_id = g_hash_table_lookup (backend_files, values[i]);
+                if (package_id != NULL)
+                        g_hash_table_add (found, (gpointer) package_id);
+        }
+
+        results = pk_results_new ();
+        ids = g_hash_table_get_keys (found);
+        for (l = ids; l != NULL; l = l->next) {
+                package = pk_package_new ();
+                pk_package_set_id (package, l->data, NULL);
+                pk_results_add_package (results, package);
+                g_object_unref (package);
+        }
+        g_list_free (ids);
+        g_hash_table_destroy (found);
+
+        n_searches++;
+        n_pending++;
+
+        /* GTask completes from the main loop, like a D-Bus reply */
+        task = g_task_new (client, cancellable, callback_ready, user_data);
+        g_task_return_pointer (task, results, g_object_unref);
+        g_object_unref (task);
+}
+
+static PkResults *
+test_generic_finish (PkClient *client, GAsyncResult *res, GError **error)
+{
+        n_pending--;
+        return g_task_propagate_pointer (G_TASK (res), error);
+}
+
+static gboolean
+test_notification_show (NotifyNotification *notification, GError **error)
+{
+        n_notifications++;
+        return TRUE;
+}
+
+static void
+provide_firmware (const char *name, const char *package_id)
+{
+        g_hash_table_insert (backend_files,
+                             g_build_filename (loading_dir, name, NULL),
+                             g_strdup (package_id));
+}
+
+/* Does what udev does when a driver asks for firmware that isn't there */
+static void
+add_missing_firmware (Fixture *fixture, const char *name, const char *package_id)
+{
+        char *path, *target;
+
+        g_assert_cmpuint (fixture->n_devices, <, G_N_ELEMENTS (devices));
+
+        path = g_build_filename (missing_dir, name, NULL);
+        target = g_strdup_printf ("/devices/virtual/mem/%s", devices[fixture->n_devices++]);
+        g_assert_cmpint (symlink (target, path), ==, 0);
+        g_free (target);
+        g_free (path);
+
+        if (package_id != NULL)
+                provide_firmware (name, package_id);
+}
+
+/* Scans the missing firmware directory and resolves what it finds,
+ * returns the number of searches it took */
+static guint
+scan (Fixture *fixture)
+{
+        guint searches;
+
+        searches = n_searches;
+        scan_directory (fixture->firmware);
+        resolve_requests (fixture->firmware);
+        while (n_pending > 0)
+                g_main_context_iteration (NULL, TRUE);
+
+        return n_searches - searches;
+}
+
+static void
+fixture_set_up (Fixture *fixture, gconstpointer user_data)
+{
+        fixture->dir = g_dir_make_tmp ("test-updates-firmware-XXXXXX", NULL);
+        g_assert (fixture->dir != NULL);
+
+        missing_dir = g_build_filename (fixture->dir, "missing", NULL);
+        loading_dir = g_build_filename (fixture->dir, "firmware", NULL);
+        g_assert_cmpint (g_mkdir (missing_dir, 0700), ==, 0);
+        g_assert_cmpint (g_mkdir (loading_dir, 0700), ==, 0);
+
+        backend_files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+        n_searches = 0;
+        n_notifications = 0;
+        fixture->n_devices = 0;
+
+        fixture->firmware = gsd_updates_firmware_new ();
+}
+
+static void
+fixture_tear_down (Fixture *fixture, gconstpointer user_data)
+{
+        const char *name;
+        char *path;
+        GDir *dir;
+
+        g_object_unref (fixture->firmware);
+        g_hash_table_destroy (backend_files);
+
+        dir = g_dir_open (missing_dir, 0, NULL);
+        while ((name = g_dir_read_name (dir)) != NULL) {
+                path = g_build_filename (missing_dir, name, NULL);
+                g_unlink (path);
+                g_free (path);
+        }
+        g_dir_close (dir);
+
+        g_rmdir (missing_dir);
+        g_rmdir (loading_dir);
+        g_rmdir (fixture->dir);
+        g_free (missing_dir);
+        g_free (loading_dir);
+        g_free (fixture->dir);
+}
+
+static void
+test_nothing_found (Fixture *fixture, gconstpointer user_data)
+{
+        add_missing_firmware (fixture, "a.bin", NULL);
+        add_missing_firmware (fixture, "b.bin", NULL);
+
+        /* one search for everything */
+        g_assert_cmpuint (scan (fixture), ==, 1);
+        g_assert_cmpuint (fixture->firmware->priv->packages_found->len, ==, 0);
+        g_assert_cmpuint (n_notifications, ==, 0);
+
+        /* and none on the next scan */
+        g_assert_cmpuint (scan (fixture), ==, 0);
+}
+
+static void
+test_several_found (Fixture *fixture, gconstpointer user_data)
+{
+        add_missing_firmware (fixture, "a.bin", "firmware-a;1.0;noarch;test");
+        add_missing_firmware (fixture, "b.bin", "firmware-b;1.0;noarch;test");
+        add_missing_firmware (fixture, "c.bin", NULL);
+
+        /* one search for everything, then one per file to tell which
+         * package provides what */
+        g_assert_cmpuint (scan (fixture), ==, 4);
+        g_assert_cmpuint (fixture->firmware->priv->packages_found->len, ==, 2);
+        g_assert_cmpuint (n_notifications, ==, 1);
+
+        g_assert_cmpuint (scan (fixture), ==, 0);
+        g_assert_cmpuint (fixture->firmware->priv->packages_found->len, ==, 2);
+}
+
+static void
+test_missing_forgotten (Fixture *fixture, gconstpointer user_data)
+{
+        char *path;
+        gint64 *checked;
+
+        add_missing_firmware (fixture, "a.bin", NULL);
+        g_assert_cmpuint (scan (fixture), ==, 1);
+
+        /* a package appears, but we don't know yet */
+        provide_firmware ("a.bin", "firmware-a;1.0;noarch;test");
+        g_assert_cmpuint (scan (fixture), ==, 0);
+        g_assert_cmpuint (n_notifications, ==, 0);
+
+        /* until the package lists change */
+        g_signal_emit_by_name (fixture->firmware->priv->control, "updates-changed");
+        g_assert_cmpuint (scan (fixture), ==, 1);
+        g_assert_cmpuint (fixture->firmware->priv->packages_found->len, ==, 1);
+        g_assert_cmpuint (n_notifications, ==, 1);
+
+        /* or we last looked long enough ago */
+        add_missing_firmware (fixture, "b.bin", NULL);
+        g_assert_cmpuint (scan (fixture), ==, 1);
+        provide_firmware ("b.bin", "firmware-b;1.0;noarch;test");
+        g_assert_cmpuint (scan (fixture), ==, 0);
+
+        path = g_build_filename (loading_dir, "b.bin", NULL);
+        checked = g_hash_table_lookup (fixture->firmware->priv->missing_cache, path);
+        g_assert (checked != NULL);
+        *checked -= (GSD_UPDATES_FIRMWARE_MISSING_TIMEOUT + 1) * G_USEC_PER_SEC;
+        g_free (path);
+
+        g_assert_cmpuint (scan (fixture), ==, 1);
+        g_assert_cmpuint (fixture->firmware->priv->packages_found->len, ==, 2);
+}
+
+static void
+test_superseded (Fixture *fixture, gconstpointer user_data)
+{
+        add_missing_firmware (fixture, "a.bin", "firmware-a;1.0;noarch;test");
+
+        /* a second scan before the first one's search finished
+         * cancels it, and only the second one notifies */
+        scan_directory (fixture->firmware);
+        resolve_requests (fixture->firmware);
+        g_assert_cmpuint (scan (fixture), ==, 1);
+        g_assert_cmpuint (n_searches, ==, 2);
+        g_assert_cmpuint (n_notifications, ==, 1);
+}
+
+int
+main (int argc, char **argv)
+{
+        GSettingsSchema *schema;
+        GSettings *settings;
+        GTestDBus *bus;
+        char *program;
+        int ret;
+
+        g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
+
+        g_test_init (&argc, &argv, NULL);
+
+        /* request_new() doesn't know the subsystem of the devices the
+         * fake requests point at, and says so */
+        g_log_set_always_fatal (G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL);
+
+        schema = g_settings_schema_source_lookup (g_settings_schema_source_get_default (),
+                                                  GSD_SETTINGS_SCHEMA, TRUE);
+        if (schema == NULL) {
+                g_print ("%s not installed, skipping\n", GSD_SETTINGS_SCHEMA);
+                return 77;
+        }
+        g_settings_schema_unref (schema);
+
+        if (!g_file_test ("/sys/devices/virtual/mem/null", G_FILE_TEST_EXISTS)) {
+                g_print ("No /sys/devices/virtual/mem devices, skipping\n");
+                return 77;
+        }
+
+        /* PkControl watches the system bus, give it an empty one */
+        program = g_find_program_in_path ("dbus-daemon");
+        if (program == NULL) {
+                g_print ("dbus-daemon not installed, skipping\n");
+                return 77;
+        }
+        g_free (program);
+
+        bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+        g_test_dbus_up (bus);
+        g_setenv ("DBUS_SYSTEM_BUS_ADDRESS", g_test_dbus_get_bus_address (bus), TRUE);
+
+        settings = g_settings_new (GSD_SETTINGS_SCHEMA);
+        g_settings_set_boolean (settings, GSD_SETTINGS_ENABLE_CHECK_FIRMWARE, TRUE);
+        g_settings_set_string (settings, GSD_SETTINGS_BANNED_FIRMWARE, "");
+        g_settings_set_string (settings, GSD_SETTINGS_IGNORED_DEVICES, "");
+
+        g_test_add ("/updates-firmware/nothing-found", Fixture, NULL,
+                    fixture_set_up, test_nothing_found, fixture_tear_down);
+        g_test_add ("/updates-firmware/several-found", Fixture, NULL,
+                    fixture_set_up, test_several_found, fixture_tear_down);
+        g_test_add ("/updates-firmware/missing-forgotten", Fixture, NULL,
+                    fixture_set_up, test_missing_forgotten, fixture_tear_down);
+        g_test_add ("/updates-firmware/superseded", Fixture, NULL,
+                    fixture_set_up, test_superseded, fixture_tear_down);
+
+        ret = g_test_run ();
+
+        g_object_unref (settings);
+        g_test_dbus_down (bus);
+        g_object_unref (bus);
+
+        return ret;
+}
@@ -1963,10 +1963,32 @@ find_button_with_index (GsdWacomDevice *device,
 	return button;
 }
 
+static int
+get_mode_index (GsdWacomDevice *device,
+		int             group_id,
+		int             mode)
+{
+	if (mode > 0)
+		return mode;
+	return GPOINTER_TO_INT (g_hash_table_lookup (device->priv->modes, GINT_TO_POINTER (group_id)));
+}
+
 GsdWacomTabletButton *
 gsd_wacom_device_get_button (GsdWacomDevice   *device,
 			     int               button,
 			     GtkDirectionType *dir)
+{
+	return gsd_wacom_device_get_button_for_mode (device, button, 0, dir);
+}
+
+/* Same as gsd_wacom_device_get_button(), but for ring and strip
+ * buttons, looks up the button for the given mode instead of the
+ * current one. A mode of 0 means the current mode. */
+GsdWacomTabletButton *
+gsd_wacom_device_get_button_for_mode (GsdWacomDevice   *device,
+				      int               button,
+				      int               mode,
+				      GtkDirectionType *dir)
 {
 	int index;
 
@@ -2009,19 +2031,19 @@ gsd_wacom_device_get_button (GsdWacomDevice   *device,
 	switch (button) {
 	case 90:
 	case 91:
-		index = GPOINTER_TO_INT (g_hash_table_lookup (device->priv->modes, GINT_TO_POINTER (1)));
+		index = get_mode_index (device, 1, mode);
 		return find_button_with_index (device, "left-ring", index);
 	case 92:
 	case 93:
-		index = GPOINTER_TO_INT (g_hash_table_lookup (device->priv->modes, GINT_TO_POINTER (2)));
+		index = get_mode_index (device, 2, mode);
 		return find_button_with_index (device, "right-ring", index);
 	case 94:
 	case 95:
-		index = GPOINTER_TO_INT (g_hash_table_lookup (device->priv->modes, GINT_TO_POINTER (3)));
+		index = get_mode_index (device, 3, mode);
 		return find_button_with_index (device, "left-strip", index);
 	case 96:
 	case 97:
-		index = GPOINTER_TO_INT (g_hash_table_lookup (device->priv->modes, GINT_TO_POINTER (4)));
+		index = get_mode_index (device, 4, mode);
 		return find_button_with_index (device, "right-strip", index);
 	default:
 		return NULL;
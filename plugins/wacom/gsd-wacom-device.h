@@ -177,6 +177,10 @@ GList          * gsd_wacom_device_get_buttons       (GsdWacomDevice *device);
 GsdWacomTabletButton *gsd_wacom_device_get_button   (GsdWacomDevice   *device,
 						     int               button,
 						     GtkDirectionType *dir);
+GsdWacomTabletButton *gsd_wacom_device_get_button_for_mode (GsdWacomDevice   *device,
+							    int               button,
+							    int               mode,
+							    GtkDirectionType *dir);
 int gsd_wacom_device_get_num_modes                  (GsdWacomDevice   *device,
 						     int               group_id);
 int gsd_wacom_device_get_current_mode               (GsdWacomDevice   *device,
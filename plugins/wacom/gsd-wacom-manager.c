@@ -78,6 +78,9 @@ struct GsdWacomManagerPrivate
         guint device_added_id;
         guint device_removed_id;
         GHashTable *devices; /* key = GdkDevice, value = GsdWacomDevice */
+        GHashTable *device_ids; /* key = XI2 device id, value = GsdWacomDevice */
+        GHashTable *pads; /* key = XI2 device id, value = GsdWacomPadActions */
+        guint keys_changed_id;
         GList *rr_screens;
 
         /* button capture */
@@ -88,6 +91,29 @@ struct GsdWacomManagerPrivate
         GtkWidget *osd_window;
 };
 
+/* A pad button action, precompiled from the button's GSettings so
+ * that filter_button_events() does not need to read or parse
+ * anything when a button is pressed. */
+typedef struct
+{
+        GsdWacomTabletButton *button;
+        GtkDirectionType      dir;
+        GsdWacomActionType    type;
+        guint                 keyval;
+        GdkModifierType       mods;
+} GsdWacomButtonAction;
+
+typedef struct
+{
+        GsdWacomDevice *device;
+        GHashTable     *actions; /* key = ACTION_KEY (button, mode), value = GsdWacomButtonAction */
+        GList          *settings; /* button GSettings we listen to */
+        gboolean        has_group[MAX_GROUP_ID + 1];
+} GsdWacomPadActions;
+
+/* Mode is 0 for normal buttons, and the ring/strip mode otherwise */
+#define ACTION_KEY(button, mode) GINT_TO_POINTER (((button) << 8) | (mode))
+
 static void     gsd_wacom_manager_class_init  (GsdWacomManagerClass *klass);
 static void     gsd_wacom_manager_init        (GsdWacomManager      *wacom_manager);
 static void     gsd_wacom_manager_finalize    (GObject              *object);
@@ -958,6 +984,198 @@ osd_window_update_viewable (GsdWacomManager      *manager,
 	return TRUE;
 }
 
+static char *
+get_elevator_shortcut_string (GSettings        *settings,
+			      GtkDirectionType  dir)
+{
+	char **strv, *str;
+
+	strv = g_settings_get_strv (settings, KEY_CUSTOM_ELEVATOR_ACTION);
+	if (strv == NULL)
+		return NULL;
+
+	if (g_strv_length (strv) >= 1 && dir == GTK_DIR_UP)
+		str = g_strdup (strv[0]);
+	else if (g_strv_length (strv) >= 2 && dir == GTK_DIR_DOWN)
+		str = g_strdup (strv[1]);
+	else
+		str = NULL;
+
+	g_strfreev (strv);
+
+	return str;
+}
+
+static void
+button_action_compile (GsdWacomButtonAction *action)
+{
+	GsdWacomTabletButton *wbutton;
+	char                 *str;
+	guint                *keycodes;
+
+	wbutton = action->button;
+	action->type = GSD_WACOM_ACTION_TYPE_NONE;
+	action->keyval = 0;
+	action->mods = 0;
+
+	/* Mode-switch buttons don't have settings */
+	if (wbutton->settings == NULL)
+		return;
+
+	action->type = g_settings_get_enum (wbutton->settings, KEY_ACTION_TYPE);
+
+	if (wbutton->type == WACOM_TABLET_BUTTON_TYPE_STRIP ||
+	    wbutton->type == WACOM_TABLET_BUTTON_TYPE_RING)
+		str = get_elevator_shortcut_string (wbutton->settings, action->dir);
+	else
+		str = g_settings_get_string (wbutton->settings, KEY_CUSTOM_ACTION);
+
+	if (str == NULL || *str == '\0') {
+		g_free (str);
+		return;
+	}
+
+	gtk_accelerator_parse_with_keycode (str, &action->keyval, &keycodes, &action->mods);
+	if (keycodes == NULL) {
+		g_warning ("Failed to find a keycode for shortcut '%s'", str);
+		action->keyval = 0;
+	}
+	g_free (keycodes);
+	g_free (str);
+}
+
+static void
+pad_actions_add (GsdWacomPadActions *pad,
+		 int                 button,
+		 int                 mode)
+{
+	GsdWacomButtonAction *action;
+	GsdWacomTabletButton *wbutton;
+	GtkDirectionType      dir;
+
+	dir = 0;
+	wbutton = gsd_wacom_device_get_button_for_mode (pad->device, button, mode, &dir);
+	if (wbutton == NULL)
+		return;
+
+	action = g_new0 (GsdWacomButtonAction, 1);
+	action->button = wbutton;
+	action->dir = dir;
+	button_action_compile (action);
+
+	if (wbutton->group_id > 0 && wbutton->group_id <= MAX_GROUP_ID)
+		pad->has_group[wbutton->group_id] = TRUE;
+
+	g_hash_table_insert (pad->actions, ACTION_KEY (button, mode), action);
+}
+
+static void
+pad_actions_compile (GsdWacomPadActions *pad)
+{
+	int button, mode;
+
+	g_hash_table_remove_all (pad->actions);
+	memset (pad->has_group, 0, sizeof (pad->has_group));
+
+	/* Normal buttons, see gsd_wacom_device_get_button() */
+	for (button = 1; button <= 26; button++)
+		pad_actions_add (pad, button, 0);
+
+	/* Rings and strips, one action per mode */
+	for (button = 90; button <= 97; button++) {
+		int group_id, num_modes;
+
+		group_id = (button - 90) / 2 + 1;
+		num_modes = gsd_wacom_device_get_num_modes (pad->device, group_id);
+		for (mode = 1; mode <= MAX (num_modes, 1); mode++)
+			pad_actions_add (pad, button, mode);
+	}
+
+	g_debug ("Compiled %d button actions for pad '%s'",
+		 g_hash_table_size (pad->actions),
+		 gsd_wacom_device_get_name (pad->device));
+}
+
+static void
+pad_button_settings_changed (GSettings          *settings,
+			     gchar              *key,
+			     GsdWacomPadActions *pad)
+{
+	pad_actions_compile (pad);
+}
+
+static GsdWacomPadActions *
+pad_actions_new (GsdWacomDevice *device)
+{
+	GsdWacomPadActions *pad;
+	GList *buttons, *l;
+
+	pad = g_new0 (GsdWacomPadActions, 1);
+	pad->device = g_object_ref (device);
+	pad->actions = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+
+	buttons = gsd_wacom_device_get_buttons (device);
+	for (l = buttons; l != NULL; l = l->next) {
+		GsdWacomTabletButton *wbutton = l->data;
+
+		if (wbutton->settings == NULL)
+			continue;
+		g_signal_connect (G_OBJECT (wbutton->settings), "changed",
+				  G_CALLBACK (pad_button_settings_changed), pad);
+		pad->settings = g_list_prepend (pad->settings, g_object_ref (wbutton->settings));
+	}
+	g_list_free (buttons);
+
+	pad_actions_compile (pad);
+
+	return pad;
+}
+
+static void
+pad_actions_free (GsdWacomPadActions *pad)
+{
+	GList *l;
+
+	for (l = pad->settings; l != NULL; l = l->next)
+		g_signal_handlers_disconnect_by_func (l->data, pad_button_settings_changed, pad);
+	g_list_free_full (pad->settings, g_object_unref);
+	g_hash_table_destroy (pad->actions);
+	g_object_unref (pad->device);
+	g_free (pad);
+}
+
+/* The compiled actions depend on the keymap, see button_action_compile() */
+static void
+keymap_keys_changed (GdkKeymap       *keymap,
+		     GsdWacomManager *manager)
+{
+	GHashTableIter iter;
+	gpointer pad;
+
+	g_hash_table_iter_init (&iter, manager->priv->pads);
+	while (g_hash_table_iter_next (&iter, NULL, &pad))
+		pad_actions_compile (pad);
+}
+
+static GsdWacomButtonAction *
+pad_actions_lookup (GsdWacomPadActions *pad,
+		    int                 button)
+{
+	int mode;
+
+	mode = 0;
+	if (button >= 90 && button <= 97) {
+		int group_id;
+
+		group_id = (button - 90) / 2 + 1;
+		if (!pad->has_group[group_id])
+			return NULL;
+		mode = gsd_wacom_device_get_current_mode (pad->device, group_id);
+	}
+
+	return g_hash_table_lookup (pad->actions, ACTION_KEY (button, mode));
+}
+
 static void
 device_added_cb (GdkDeviceManager *device_manager,
                  GdkDevice        *gdk_device,
@@ -975,6 +1193,14 @@ device_added_cb (GdkDeviceManager *device_manager,
 		 gsd_wacom_device_get_tool_name (device),
 		 gsd_wacom_device_type_to_string (gsd_wacom_device_get_device_type (device)));
 	g_hash_table_insert (manager->priv->devices, (gpointer) gdk_device, device);
+	g_hash_table_insert (manager->priv->device_ids,
+			     GINT_TO_POINTER (gdk_x11_device_get_id (gdk_device)),
+			     device);
+
+	if (gsd_wacom_device_get_device_type (device) == WACOM_TYPE_PAD)
+		g_hash_table_insert (manager->priv->pads,
+				     GINT_TO_POINTER (gdk_x11_device_get_id (gdk_device)),
+				     pad_actions_new (device));
 
 	settings = gsd_wacom_device_get_settings (device);
 	g_signal_connect (G_OBJECT (settings), "changed",
@@ -1008,6 +1234,8 @@ device_removed_cb (GdkDeviceManager *device_manager,
 {
 	g_debug ("Removing device '%s' from known devices list",
 		 gdk_device_get_name (gdk_device));
+	g_hash_table_remove (manager->priv->pads, GINT_TO_POINTER (gdk_x11_device_get_id (gdk_device)));
+	g_hash_table_remove (manager->priv->device_ids, GINT_TO_POINTER (gdk_x11_device_get_id (gdk_device)));
 	g_hash_table_remove (manager->priv->devices, gdk_device);
 
 	/* Enable this chunk of code if you want to valgrind
@@ -1022,25 +1250,7 @@ static GsdWacomDevice *
 device_id_to_device (GsdWacomManager *manager,
 		     int              deviceid)
 {
-	GList *devices, *l;
-	GsdWacomDevice *ret;
-
-	ret = NULL;
-	devices = g_hash_table_get_keys (manager->priv->devices);
-
-	for (l = devices; l != NULL; l = l->next) {
-		GdkDevice *device = l->data;
-		int id;
-
-		g_object_get (device, "device-id", &id, NULL);
-		if (id == deviceid) {
-			ret = g_hash_table_lookup (manager->priv->devices, device);
-			break;
-		}
-	}
-
-	g_list_free (devices);
-	return ret;
+	return g_hash_table_lookup (manager->priv->device_ids, GINT_TO_POINTER (deviceid));
 }
 
 struct {
@@ -1073,65 +1283,29 @@ send_modifiers (Display *display,
 	}
 }
 
-static char *
-get_elevator_shortcut_string (GSettings        *settings,
-			      GtkDirectionType  dir)
-{
-	char **strv, *str;
-
-	strv = g_settings_get_strv (settings, KEY_CUSTOM_ELEVATOR_ACTION);
-	if (strv == NULL)
-		return NULL;
-
-	if (g_strv_length (strv) >= 1 && dir == GTK_DIR_UP)
-		str = g_strdup (strv[0]);
-	else if (g_strv_length (strv) >= 2 && dir == GTK_DIR_DOWN)
-		str = g_strdup (strv[1]);
-	else
-		str = NULL;
-
-	g_strfreev (strv);
-
-	return str;
-}
-
 static void
-generate_key (GsdWacomTabletButton *wbutton,
+generate_key (GsdWacomButtonAction *action,
 	      int                   group,
 	      Display              *display,
-	      GtkDirectionType      dir,
 	      gboolean              is_press)
 {
-	char                 *str;
 	guint                 keyval;
-	guint                *keycodes;
 	guint                 keycode;
 	guint                 mods;
 	GdkKeymapKey         *keys;
 	int                   n_keys;
 	guint                 i;
 
-	if (wbutton->type == WACOM_TABLET_BUTTON_TYPE_STRIP ||
-	    wbutton->type == WACOM_TABLET_BUTTON_TYPE_RING)
-		str = get_elevator_shortcut_string (wbutton->settings, dir);
-	else
-		str = g_settings_get_string (wbutton->settings, KEY_CUSTOM_ACTION);
+	keyval = action->keyval;
+	mods = action->mods;
 
-	if (str == NULL)
-		return;
-
-	gtk_accelerator_parse_with_keycode (str, &keyval, &keycodes, &mods);
-	if (keycodes == NULL) {
-		g_warning ("Failed to find a keycode for shortcut '%s'", str);
-		g_free (str);
+	/* No shortcut set, or it failed to parse, see button_action_compile() */
+	if (keyval == 0)
 		return;
-	}
-	g_free (keycodes);
 
 	/* Now look for our own keycode, in the group as us */
 	if (!gdk_keymap_get_entries_for_keyval (gdk_keymap_get_default (), keyval, &keys, &n_keys)) {
 		g_warning ("Failed to find a keycode for keyval '%s' (0x%x)", gdk_keyval_name (keyval), keyval);
-		g_free (str);
 		return;
 	}
 
@@ -1155,12 +1329,11 @@ generate_key (GsdWacomTabletButton *wbutton,
 
 	if (keycode == 0) {
 		g_warning ("Not emitting '%s' (keyval: %d, keycode: %d mods: 0x%x), invalid keycode",
-			   str, keyval, keycode, mods);
-		g_free (str);
+			   gdk_keyval_name (keyval), keyval, keycode, mods);
 		return;
 	} else {
 		g_debug ("Emitting '%s' (keyval: %d, keycode: %d mods: 0x%x)",
-			 str, keyval, keycode, mods);
+			 gdk_keyval_name (keyval), keyval, keycode, mods);
 	}
 
 	/* And send out the keys! */
@@ -1172,9 +1345,7 @@ generate_key (GsdWacomTabletButton *wbutton,
 	if (is_press == FALSE)
 		send_modifiers (display, mods, FALSE);
 	if (gdk_error_trap_pop ())
-		g_warning ("Failed to generate fake key event '%s'", str);
-
-	g_free (str);
+		g_warning ("Failed to generate fake key event '%s'", gdk_keyval_name (keyval));
 }
 
 static void
@@ -1226,6 +1397,8 @@ filter_button_events (XEvent          *xevent,
 	XGenericEventCookie *cookie;
 	guint                deviceid;
 	GsdWacomDevice      *device;
+	GsdWacomPadActions  *pad;
+	GsdWacomButtonAction *action;
 	int                  button;
 	GsdWacomTabletButton *wbutton;
 	GtkDirectionType      dir;
@@ -1247,9 +1420,10 @@ filter_button_events (XEvent          *xevent,
 	xev = (XIDeviceEvent *) xiev;
 
 	deviceid = xev->sourceid;
-	device = device_id_to_device (manager, deviceid);
-	if (gsd_wacom_device_get_device_type (device) != WACOM_TYPE_PAD)
+	pad = g_hash_table_lookup (manager->priv->pads, GINT_TO_POINTER (deviceid));
+	if (pad == NULL)
 		return GDK_FILTER_CONTINUE;
+	device = pad->device;
 
 	if ((manager->priv->osd_window != NULL) &&
 	    (device != gsd_wacom_osd_window_get_device (GSD_WACOM_OSD_WINDOW(manager->priv->osd_window))))
@@ -1258,12 +1432,14 @@ filter_button_events (XEvent          *xevent,
 
 	button = xev->detail;
 
-	wbutton = gsd_wacom_device_get_button (device, button, &dir);
-	if (wbutton == NULL) {
+	action = pad_actions_lookup (pad, button);
+	if (action == NULL) {
 		g_warning ("Could not find matching button for '%d' on '%s'",
 			   button, gsd_wacom_device_get_name (device));
 		return GDK_FILTER_CONTINUE;
 	}
+	wbutton = action->button;
+	dir = action->dir;
 
 	g_debug ("Received event button %s '%s'%s ('%d') on device '%s' ('%d')",
 		 xiev->evtype == XI_ButtonPress ? "press" : "release",
@@ -1294,11 +1470,11 @@ filter_button_events (XEvent          *xevent,
 	emulate = osd_window_update_viewable (manager, wbutton, dir, xiev);
 
 	/* Nothing to do */
-	if (g_settings_get_enum (wbutton->settings, KEY_ACTION_TYPE) == GSD_WACOM_ACTION_TYPE_NONE)
+	if (action->type == GSD_WACOM_ACTION_TYPE_NONE)
 		return GDK_FILTER_REMOVE;
 
 	/* Show OSD window when requested */
-	if (g_settings_get_enum (wbutton->settings, KEY_ACTION_TYPE) == GSD_WACOM_ACTION_TYPE_HELP) {
+	if (action->type == GSD_WACOM_ACTION_TYPE_HELP) {
 		if (xiev->evtype == XI_ButtonRelease)
 			osd_window_toggle_visibility (manager, device);
 		return GDK_FILTER_REMOVE;
@@ -1308,14 +1484,14 @@ filter_button_events (XEvent          *xevent,
 		return GDK_FILTER_REMOVE;
 
 	/* Switch monitor */
-	if (g_settings_get_enum (wbutton->settings, KEY_ACTION_TYPE) == GSD_WACOM_ACTION_TYPE_SWITCH_MONITOR) {
+	if (action->type == GSD_WACOM_ACTION_TYPE_SWITCH_MONITOR) {
 		if (xiev->evtype == XI_ButtonRelease)
 			switch_monitor (device);
 		return GDK_FILTER_REMOVE;
 	}
 
 	/* Send a key combination out */
-	generate_key (wbutton, xev->group.effective, xev->display, dir, xiev->evtype == XI_ButtonPress ? True : False);
+	generate_key (action, xev->group.effective, xev->display, xiev->evtype == XI_ButtonPress ? True : False);
 
 	return GDK_FILTER_REMOVE;
 }
@@ -1351,9 +1527,15 @@ gsd_wacom_manager_idle_cb (GsdWacomManager *manager)
         gnome_settings_profile_start (NULL);
 
         manager->priv->devices = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_object_unref);
+        manager->priv->device_ids = g_hash_table_new (g_direct_hash, g_direct_equal);
+        manager->priv->pads = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                                     (GDestroyNotify) pad_actions_free);
 
         set_devicepresence_handler (manager);
 
+        manager->priv->keys_changed_id = g_signal_connect (gdk_keymap_get_default (), "keys-changed",
+                                                           G_CALLBACK (keymap_keys_changed), manager);
+
         devices = gdk_device_manager_list_devices (manager->priv->device_manager, GDK_DEVICE_TYPE_SLAVE);
         for (l = devices; l ; l = l->next)
 		device_added_cb (manager->priv->device_manager, l->data, manager);
@@ -1521,6 +1703,11 @@ gsd_wacom_manager_stop (GsdWacomManager *manager)
 	for (l = p->rr_screens; l != NULL; l = l->next)
 		g_signal_handlers_disconnect_by_func (l->data, on_screen_changed_cb, manager);
 
+        if (p->keys_changed_id != 0) {
+                g_signal_handler_disconnect (gdk_keymap_get_default (), p->keys_changed_id);
+                p->keys_changed_id = 0;
+        }
+
         g_clear_pointer (&p->osd_window, gtk_widget_destroy);
 }
 
@@ -1536,6 +1723,16 @@ gsd_wacom_manager_finalize (GObject *object)
 
         g_return_if_fail (wacom_manager->priv != NULL);
 
+        if (wacom_manager->priv->pads) {
+                g_hash_table_destroy (wacom_manager->priv->pads);
+                wacom_manager->priv->pads = NULL;
+        }
+
+        if (wacom_manager->priv->device_ids) {
+                g_hash_table_destroy (wacom_manager->priv->device_ids);
+                wacom_manager->priv->device_ids = NULL;
+        }
+
         if (wacom_manager->priv->devices) {
                 g_hash_table_destroy (wacom_manager->priv->devices);
                 wacom_manager->priv->devices = NULL;
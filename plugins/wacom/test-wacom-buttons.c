@@ -0,0 +1,275 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ *
+ * Feeds synthetic XI2 button events for a fake pad to the wacom
+ * manager's event filter, and checks which keys it sends out. Needs an
+ * X server for the keymap, such as Xvfb.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <X11/Xlib.h>
+#include <X11/XKBlib.h>
+#include <X11/extensions/XInput2.h>
+#include <X11/extensions/XTest.h>
+
+#include <glib.h>
+
+/* Every key the manager sends goes here instead of to the server */
+typedef struct {
+        KeySym   keysym;
+        gboolean is_press;
+} SentKey;
+
+static GArray *sent_keys;
+
+static int
+recording_fake_key_event (Display       *dpy,
+                          unsigned int   keycode,
+                          Bool           is_press,
+                          unsigned long  delay)
+{
+        SentKey key;
+
+        key.keysym = XkbKeycodeToKeysym (dpy, keycode, 0, 0);
+        key.is_press = is_press;
+        g_array_append_val (sent_keys, key);
+
+        return 1;
+}
+
+#define XTestFakeKeyEvent recording_fake_key_event
+
+#include "gsd-wacom-manager.c"
+
+#undef XTestFakeKeyEvent
+
+#define BUTTON_SCHEMA  "org.gnome.settings-daemon.peripherals.wacom.tablet-button"
+#define FAKE_OPCODE    131
+#define FAKE_DEVICE_ID 42
+
+static GsdWacomManager *manager;
+static GsdWacomDevice *pad;
+
+static void
+flush_main_context (void)
+{
+        while (g_main_context_iteration (NULL, FALSE))
+                ;
+}
+
+static void
+set_button_action (int         button,
+                   const char *accel)
+{
+        GsdWacomTabletButton *wbutton;
+        GtkDirectionType dir;
+
+        wbutton = gsd_wacom_device_get_button (pad, button, &dir);
+        g_assert (wbutton != NULL);
+        g_assert (wbutton->settings != NULL);
+
+        g_settings_set_enum (wbutton->settings, KEY_ACTION_TYPE, GSD_WACOM_ACTION_TYPE_CUSTOM);
+        g_settings_set_string (wbutton->settings, KEY_CUSTOM_ACTION, accel);
+        flush_main_context ();
+}
+
+static void
+send_button (int      button,
+             gboolean is_press)
+{
+        XIDeviceEvent xev;
+        XEvent xevent;
+        GdkFilterReturn ret;
+
+        memset (&xev, 0, sizeof (xev));
+        xev.type = GenericEvent;
+        xev.extension = FAKE_OPCODE;
+        xev.evtype = is_press ? XI_ButtonPress : XI_ButtonRelease;
+        xev.display = GDK_DISPLAY_XDISPLAY (gdk_display_get_default ());
+        xev.deviceid = FAKE_DEVICE_ID;
+        xev.sourceid = FAKE_DEVICE_ID;
+        xev.detail = button;
+
+        memset (&xevent, 0, sizeof (xevent));
+        xevent.xcookie.type = GenericEvent;
+        xevent.xcookie.extension = FAKE_OPCODE;
+        xevent.xcookie.evtype = xev.evtype;
+        xevent.xcookie.data = &xev;
+
+        ret = filter_button_events (&xevent, NULL, manager);
+        g_assert_cmpint (ret, ==, GDK_FILTER_REMOVE);
+}
+
+static void
+assert_sent (const KeySym *keysyms,
+             const gboolean *presses,
+             guint n)
+{
+        guint i;
+
+        g_assert_cmpuint (sent_keys->len, ==, n);
+        for (i = 0; i < n; i++) {
+                SentKey *key = &g_array_index (sent_keys, SentKey, i);
+
+                g_assert_cmpstr (XKeysymToString (key->keysym), ==, XKeysymToString (keysyms[i]));
+                g_assert_cmpint (key->is_press, ==, presses[i]);
+        }
+}
+
+static void
+test_custom_action (void)
+{
+        const KeySym keysyms[] = { XK_Control_L, XK_z, XK_z, XK_Control_L };
+        const gboolean presses[] = { TRUE, TRUE, FALSE, FALSE };
+
+        set_button_action (1, "<Control>z");
+
+        g_array_set_size (sent_keys, 0);
+        send_button (1, TRUE);
+        send_button (1, FALSE);
+        assert_sent (keysyms, presses, G_N_ELEMENTS (keysyms));
+
+        /* a settings change is picked up without a restart */
+        set_button_action (1, "<Shift>a");
+        g_array_set_size (sent_keys, 0);
+        send_button (1, TRUE);
+        send_button (1, FALSE);
+        g_assert_cmpuint (sent_keys->len, ==, 4);
+        g_assert_cmpstr (XKeysymToString (g_array_index (sent_keys, SentKey, 1).keysym), ==, "a");
+}
+
+static void
+test_no_action (void)
+{
+        GsdWacomTabletButton *wbutton;
+        GtkDirectionType dir;
+
+        wbutton = gsd_wacom_device_get_button (pad, 2, &dir);
+        g_settings_set_enum (wbutton->settings, KEY_ACTION_TYPE, GSD_WACOM_ACTION_TYPE_NONE);
+        flush_main_context ();
+
+        g_array_set_size (sent_keys, 0);
+        send_button (2, TRUE);
+        send_button (2, FALSE);
+        g_assert_cmpuint (sent_keys->len, ==, 0);
+}
+
+static gboolean
+run_setxkbmap (const char *layout)
+{
+        char *argv[] = { "setxkbmap", (char *) layout, NULL };
+        int status;
+
+        if (!g_spawn_sync (NULL, argv, NULL, G_SPAWN_SEARCH_PATH,
+                           NULL, NULL, NULL, NULL, &status, NULL))
+                return FALSE;
+
+        return g_spawn_check_exit_status (status, NULL);
+}
+
+static void
+test_layout_switch (void)
+{
+        const KeySym keysyms[] = { XK_adiaeresis, XK_adiaeresis };
+        const gboolean presses[] = { TRUE, FALSE };
+        gint64 end;
+
+        if (!run_setxkbmap ("us")) {
+                g_test_message ("setxkbmap not available, skipping");
+                return;
+        }
+        flush_main_context ();
+
+        /* no such key in this layout, nothing is sent */
+        set_button_action (1, "adiaeresis");
+        g_array_set_size (sent_keys, 0);
+        send_button (1, TRUE);
+        send_button (1, FALSE);
+        g_assert_cmpuint (sent_keys->len, ==, 0);
+
+        /* the actions get compiled again for the new keymap */
+        g_assert (run_setxkbmap ("de"));
+        end = g_get_monotonic_time () + 2 * G_USEC_PER_SEC;
+        while (g_get_monotonic_time () < end) {
+                flush_main_context ();
+                g_usleep (10000);
+        }
+
+        g_array_set_size (sent_keys, 0);
+        send_button (1, TRUE);
+        send_button (1, FALSE);
+        assert_sent (keysyms, presses, G_N_ELEMENTS (keysyms));
+
+        run_setxkbmap ("us");
+}
+
+int
+main (int argc, char **argv)
+{
+        GSettingsSchema *schema;
+        int ret;
+
+        g_setenv ("GSETTINGS_BACKEND", "memory", TRUE);
+
+        gtk_init (&argc, &argv);
+        g_test_init (&argc, &argv, NULL);
+
+        /* shortcuts that don't fit the keymap warn, which is expected */
+        g_log_set_always_fatal (G_LOG_FATAL_MASK | G_LOG_LEVEL_CRITICAL);
+
+        schema = g_settings_schema_source_lookup (g_settings_schema_source_get_default (),
+                                                  BUTTON_SCHEMA, TRUE);
+        if (schema == NULL) {
+                g_print ("%s not installed, skipping\n", BUTTON_SCHEMA);
+                return 77;
+        }
+        g_settings_schema_unref (schema);
+
+        pad = gsd_wacom_device_create_fake (WACOM_TYPE_PAD,
+                                            "Wacom Intuos4 6x9",
+                                            "Wacom Intuos4 6x9 pad");
+        if (pad == NULL) {
+                g_print ("libwacom doesn't know the Intuos4, skipping\n");
+                return 77;
+        }
+
+        sent_keys = g_array_new (FALSE, FALSE, sizeof (SentKey));
+
+        /* only what filter_button_events() needs of a started manager */
+        manager = g_object_new (GSD_TYPE_WACOM_MANAGER, NULL);
+        manager->priv->opcode = FAKE_OPCODE;
+        manager->priv->pads = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                                     (GDestroyNotify) pad_actions_free);
+        g_hash_table_insert (manager->priv->pads, GINT_TO_POINTER (FAKE_DEVICE_ID),
+                             pad_actions_new (pad));
+        manager->priv->keys_changed_id = g_signal_connect (gdk_keymap_get_default (), "keys-changed",
+                                                           G_CALLBACK (keymap_keys_changed), manager);
+
+        g_test_add_func ("/wacom-buttons/custom-action", test_custom_action);
+        g_test_add_func ("/wacom-buttons/no-action", test_no_action);
+        g_test_add_func ("/wacom-buttons/layout-switch", test_layout_switch);
+
+        ret = g_test_run ();
+
+        g_signal_handler_disconnect (gdk_keymap_get_default (), manager->priv->keys_changed_id);
+        manager->priv->keys_changed_id = 0;
+        g_object_unref (manager);
+        g_object_unref (pad);
+        g_array_unref (sent_keys);
+
+        return ret;
+}
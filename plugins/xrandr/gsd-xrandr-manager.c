@@ -66,6 +66,11 @@
  */
 #define CONFIRMATION_DIALOG_SECONDS 30
 
+/* How long RandR events have to stop for before we act on them, and the
+ * longest we wait after the first one of a burst */
+#define RANDR_SETTLE_MSEC     250
+#define RANDR_SETTLE_MAX_MSEC 1500
+
 /* name of the icon files (usd-xrandr.svg, etc.) */
 #define GSD_XRANDR_ICON_NAME "usd-xrandr"
 
@@ -98,6 +103,15 @@ static const gchar introspection_xml[] =
 "       <!-- Timestamp for the RANDR call itself -->"
 "       <arg name='timestamp' type='x' direction='in'/>"
 "    </method>"
+"    <!-- Emitted after every configuration change; on failure,"
+"    rolled_back tells whether the previous configuration was"
+"    restored. grab_usec is how long the X server was grabbed -->"
+"    <signal name='ConfigurationApplied'>"
+"       <arg name='success' type='b'/>"
+"       <arg name='rolled_back' type='b'/>"
+"       <arg name='error' type='s'/>"
+"       <arg name='grab_usec' type='x'/>"
+"    </signal>"
 "  </interface>"
 "</node>";
 
@@ -121,6 +135,13 @@ struct GsdXrandrManagerPrivate {
         /* Last time at which we got a "screen got reconfigured" event; see on_randr_event() */
         guint32 last_config_timestamp;
 
+        /* Burst of RandR events waiting to settle */
+        guint           settle_id;
+        gint64          settle_start;
+        guint           settle_events;
+        gboolean        settle_hotplug;
+        guint           settle_saved;     /* decisions not made thanks to coalescing */
+
 #ifdef HAVE_WACOM
         WacomDeviceDatabase *wacom_db;
 #endif /* HAVE_WACOM */
@@ -442,6 +463,47 @@ turn_off_laptop_display_in_configuration (GsdRRScreen *screen, GsdRRConfig *conf
         gsd_rr_config_sanitize (config);
 }
 
+/* Applies @config, recording how long the X server stayed grabbed and
+ * announcing the result on the bus */
+static gboolean
+apply_with_time (GsdXrandrManager *manager,
+                 GsdRRConfig      *config,
+                 guint32           timestamp,
+                 GError          **error)
+{
+        GsdXrandrManagerPrivate *priv = manager->priv;
+        GError *my_error = NULL;
+        gint64 begin, duration;
+        gboolean success, rolled_back;
+
+        success = gsd_rr_config_apply_with_time (config, priv->rw_screen, timestamp, &my_error);
+        rolled_back = !success && gsd_rr_screen_get_last_apply_rolled_back (priv->rw_screen);
+
+        gsd_rr_screen_get_last_grab (priv->rw_screen, &begin, &duration);
+        gnome_settings_profile_span_record ("xrandr", "grab", begin, duration);
+
+        if (rolled_back)
+                log_msg ("Rolled back to the previous configuration\n");
+
+        if (priv->connection != NULL)
+                g_dbus_connection_emit_signal (priv->connection,
+                                               NULL,
+                                               GSD_XRANDR_DBUS_PATH,
+                                               "org.gnome.SettingsDaemon.XRANDR_2",
+                                               "ConfigurationApplied",
+                                               g_variant_new ("(bbsx)",
+                                                              success,
+                                                              rolled_back,
+                                                              my_error ? my_error->message : "",
+                                                              duration),
+                                               NULL);
+
+        if (my_error)
+                g_propagate_error (error, my_error);
+
+        return success;
+}
+
 /* This function effectively centralizes the use of gsd_rr_config_apply_from_filename_with_time().
  *
  * Optionally filters out GSD_RR_ERROR_NO_MATCHING_CONFIG from the matching
@@ -491,7 +553,7 @@ apply_configuration_from_filename (GsdXrandrManager *manager,
                 turn_off_laptop_display_in_configuration (priv->rw_screen, config);
 
         gsd_rr_config_ensure_primary (config);
-	success = gsd_rr_config_apply_with_time (config, priv->rw_screen, timestamp, error);
+        success = apply_with_time (manager, config, timestamp, error);
 
         g_object_unref (config);
 
@@ -506,7 +568,6 @@ apply_configuration_from_filename (GsdXrandrManager *manager,
 static gboolean
 apply_configuration (GsdXrandrManager *manager, GsdRRConfig *config, guint32 timestamp, gboolean show_error, gboolean save_configuration)
 {
-        GsdXrandrManagerPrivate *priv = manager->priv;
         GError *error;
         gboolean success;
 
@@ -515,7 +576,7 @@ apply_configuration (GsdXrandrManager *manager, GsdRRConfig *config, guint32 tim
         print_configuration (config, "Applying Configuration");
 
         error = NULL;
-        success = gsd_rr_config_apply_with_time (config, priv->rw_screen, timestamp, &error);
+        success = apply_with_time (manager, config, timestamp, &error);
         if (success) {
                 if (save_configuration)
                         gsd_rr_config_save (config, NULL); /* NULL-GError - there's not much we can do if this fails */
@@ -1782,28 +1843,37 @@ use_stored_configuration_or_auto_configure_outputs (GsdXrandrManager *manager, g
                 log_msg ("Applied stored configuration\n");
 }
 
-static void
-on_randr_event (GsdRRScreen *screen, gpointer data)
+/* Runs once the RandR events of a burst have stopped coming, and makes
+ * one decision for all of them */
+static gboolean
+randr_settled_cb (gpointer data)
 {
         GsdXrandrManager *manager = GSD_XRANDR_MANAGER (data);
         GsdXrandrManagerPrivate *priv = manager->priv;
         guint32 change_timestamp, config_timestamp;
+        gint64 span;
 
-        if (!priv->running)
-                return;
+        priv->settle_id = 0;
 
-        gsd_rr_screen_get_timestamps (screen, &change_timestamp, &config_timestamp);
+        span = gnome_settings_profile_span_begin ();
+
+        gsd_rr_screen_get_timestamps (priv->rw_screen, &change_timestamp, &config_timestamp);
+
+        priv->settle_saved += priv->settle_events - 1;
 
         log_open ();
-        log_msg ("Got RANDR event with timestamps change=%u %c config=%u\n",
+        log_msg ("RANDR settled after %u events (%u decisions saved so far), timestamps change=%u %c config=%u\n",
+                 priv->settle_events, priv->settle_saved,
                  change_timestamp,
                  timestamp_relationship (change_timestamp, config_timestamp),
                  config_timestamp);
+        g_debug ("Coalesced %u RandR events, %u saved in total",
+                 priv->settle_events, priv->settle_saved);
 
-        if (change_timestamp >= config_timestamp) {
+        if (!priv->settle_hotplug) {
                 GsdRRConfig *rr_config;
 
-                /* The event is due to an explicit configuration change.
+                /* All the events were due to explicit configuration changes.
                  *
                  * If the change was performed by us, then we need to do nothing.
                  *
@@ -1817,7 +1887,7 @@ on_randr_event (GsdRRScreen *screen, gpointer data)
                         if (gsd_rr_config_applicable (rr_config, priv->rw_screen, NULL)) {
                                 print_configuration (rr_config, "Updating for primary");
                                 priv->last_config_timestamp = config_timestamp;
-                                gsd_rr_config_apply_with_time (rr_config, priv->rw_screen, config_timestamp, NULL);
+                                apply_with_time (manager, rr_config, config_timestamp, NULL);
                         }
                 }
                 g_object_unref (rr_config);
@@ -1825,10 +1895,10 @@ on_randr_event (GsdRRScreen *screen, gpointer data)
                 show_timestamps_dialog (manager, "ignoring since change > config");
                 log_msg ("  Ignoring event since change >= config\n");
         } else {
-                /* Here, config_timestamp > change_timestamp.  This means that
-                 * the screen got reconfigured because of hotplug/unplug; the X
-                 * server is just notifying us, and we need to configure the
-                 * outputs in a sane way.
+                /* At least one event had config_timestamp > change_timestamp.
+                 * This means that the screen got reconfigured because of
+                 * hotplug/unplug; the X server is just notifying us, and we
+                 * need to configure the outputs in a sane way.
                  */
 
                 show_timestamps_dialog (manager, "need to deal with reconfiguration, as config > change");
@@ -1842,6 +1912,56 @@ on_randr_event (GsdRRScreen *screen, gpointer data)
         }
 
         log_close ();
+
+        priv->settle_events = 0;
+        priv->settle_hotplug = FALSE;
+
+        gnome_settings_profile_span_end ("xrandr", "randr-settle", span);
+
+        return FALSE;
+}
+
+static void
+on_randr_event (GsdRRScreen *screen, gpointer data)
+{
+        GsdXrandrManager *manager = GSD_XRANDR_MANAGER (data);
+        GsdXrandrManagerPrivate *priv = manager->priv;
+        guint32 change_timestamp, config_timestamp;
+        gint64 span, now;
+        guint delay;
+
+        if (!priv->running)
+                return;
+
+        span = gnome_settings_profile_span_begin ();
+
+        gsd_rr_screen_get_timestamps (screen, &change_timestamp, &config_timestamp);
+
+        log_open ();
+        log_msg ("Got RANDR event with timestamps change=%u %c config=%u\n",
+                 change_timestamp,
+                 timestamp_relationship (change_timestamp, config_timestamp),
+                 config_timestamp);
+        log_close ();
+
+        /* Docks bring several outputs up one after the other, so wait
+         * for the events to stop before deciding what to do, but no
+         * longer than RANDR_SETTLE_MAX_MSEC after the first one */
+        now = g_get_monotonic_time ();
+        if (priv->settle_events == 0)
+                priv->settle_start = now;
+        priv->settle_events++;
+        if (change_timestamp < config_timestamp)
+                priv->settle_hotplug = TRUE;
+
+        if (priv->settle_id != 0)
+                g_source_remove (priv->settle_id);
+
+        delay = MIN (RANDR_SETTLE_MSEC,
+                     MAX (0, RANDR_SETTLE_MAX_MSEC - (now - priv->settle_start) / 1000));
+        priv->settle_id = g_timeout_add (delay, randr_settled_cb, manager);
+
+        gnome_settings_profile_span_end ("xrandr", "randr-event", span);
 }
 
 static void
@@ -2444,6 +2564,13 @@ gsd_xrandr_manager_stop (GsdXrandrManager *manager)
 
         manager->priv->running = FALSE;
 
+        if (manager->priv->settle_id != 0) {
+                g_source_remove (manager->priv->settle_id);
+                manager->priv->settle_id = 0;
+        }
+        manager->priv->settle_events = 0;
+        manager->priv->settle_hotplug = FALSE;
+
         if (manager->priv->bus_cancellable != NULL) {
                 g_cancellable_cancel (manager->priv->bus_cancellable);
                 g_object_unref (manager->priv->bus_cancellable);
@@ -2589,13 +2716,18 @@ handle_method_call (GDBusConnection       *connection,
                     gpointer               user_data)
 {
         GsdXrandrManager *manager = (GsdXrandrManager *) user_data;
+        gint64 span;
 
         g_debug ("Handling method call %s.%s", interface_name, method_name);
 
+        span = gnome_settings_profile_span_begin ();
+
         if (g_strcmp0 (interface_name, "org.gnome.SettingsDaemon.XRANDR_2") == 0)
                 handle_method_call_xrandr_2 (manager, method_name, parameters, invocation);
         else
                 g_warning ("unknown interface: %s", interface_name);
+
+        gnome_settings_profile_span_end ("dbus", g_intern_string (method_name), span);
 }
 
 
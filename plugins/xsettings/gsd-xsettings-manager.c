@@ -410,10 +410,15 @@ static gboolean
 notify_idle (gpointer data)
 {
         GnomeXSettingsManager *manager = data;
+        gint64 span;
         gint i;
+
+        span = gnome_settings_profile_span_begin ();
         for (i = 0; manager->priv->managers [i]; i++) {
                 xsettings_manager_notify (manager->priv->managers[i]);
         }
+        gnome_settings_profile_span_end ("xsettings", "notify", span);
+
         manager->priv->notify_idle_id = 0;
         return G_SOURCE_REMOVE;
 }
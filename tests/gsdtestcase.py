@@ -166,6 +166,8 @@ class GSDTestCase(dbusmock.DBusTestCase):
                 ('Suspend', 'b', '', ''),
                 ('Hibernate', 'b', '', ''),
                 ('Inhibit', 'ssss', 'h', 'ret = 5'),
+                ('CanSuspend', '', 's', 'ret = "yes"'),
+                ('CanHibernate', '', 's', 'ret = "yes"'),
             ], dbus_interface='org.freedesktop.DBus.Mock')
 
         # set log to nonblocking
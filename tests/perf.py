@@ -0,0 +1,303 @@
+#!/usr/bin/env python
+'''GNOME settings daemon performance regression tests
+
+Runs the whole daemon against the dummy X.org server and private D-Bus
+buses, injects scripted load and reads back the daemon's own trace spans
+(org.gnome.SettingsDaemon.DumpTrace) and X request counter
+(GetXRequestCount) to get per-scenario latency percentiles and request
+counts.
+
+Results are written as JSON to $PERF_RESULTS (default: perf-results.json in
+the build directory). If $PERF_BASELINE points to an earlier results file,
+each scenario is compared against it and the test fails when a latency
+percentile or the request count regressed by more than $PERF_TOLERANCE
+(default 0.5, i.e. 50%).
+'''
+
+__license__ = 'GPL v2 or later'
+
+import unittest
+import subprocess
+import sys
+import time
+import os
+import os.path
+import json
+
+project_root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, os.path.join(project_root, 'tests'))
+import gsdtestcase
+
+import dbus
+
+from gi.repository import GLib, Gio, GdkPixbuf
+
+top_builddir = gsdtestcase.top_builddir
+
+# Absolute slack, so that sub-millisecond noise doesn't count as regression
+LATENCY_SLACK_US = 500
+REQUEST_SLACK = 20
+
+
+def percentile(values, p):
+    '''Nearest-rank percentile of a list of numbers'''
+
+    if not values:
+        return 0
+    values = sorted(values)
+    rank = max(0, min(len(values) - 1, int(round(p / 100.0 * len(values) + 0.5)) - 1))
+    return values[rank]
+
+
+class PerfTest(gsdtestcase.GSDTestCase):
+    '''Latency and X request regression tests for the daemon'''
+
+    results = {}
+
+    @classmethod
+    def setUpClass(klass):
+        gsdtestcase.GSDTestCase.setUpClass()
+
+        klass.daemon_log = open(os.path.join(klass.workdir, 'daemon.log'), 'wb')
+        klass.daemon = subprocess.Popen(
+            [os.path.join(top_builddir, 'gnome-settings-daemon', 'unity-settings-daemon')],
+            stdout=klass.daemon_log,
+            stderr=subprocess.STDOUT)
+
+        klass.wait_for_bus_object('org.gnome.SettingsDaemon', '/org/gnome/SettingsDaemon')
+        klass.obj_daemon = klass.session_bus_con.get_object(
+            'org.gnome.SettingsDaemon', '/org/gnome/SettingsDaemon')
+
+        # plugins are activated from the main loop, give them time to settle
+        time.sleep(3)
+
+    @classmethod
+    def tearDownClass(klass):
+        klass.daemon.terminate()
+        klass.daemon.wait()
+        klass.daemon_log.close()
+
+        path = os.environ.get('PERF_RESULTS',
+                              os.path.join(top_builddir, 'tests', 'perf-results.json'))
+        with open(path, 'w') as f:
+            json.dump(klass.results, f, indent=2, sort_keys=True)
+        sys.stderr.write('Performance results written to %s\n' % path)
+
+        gsdtestcase.GSDTestCase.tearDownClass()
+
+    def dump_trace(self):
+        trace = self.obj_daemon.DumpTrace(dbus_interface='org.gnome.SettingsDaemon')
+        return json.loads(trace)['traceEvents']
+
+    def x_requests(self):
+        return int(self.obj_daemon.GetXRequestCount(dbus_interface='org.gnome.SettingsDaemon'))
+
+    def measure(self, scenario, category, name, load, settle=1.0):
+        '''Run load() and record the spans it caused'''
+
+        before = set((e['ts'], e['name']) for e in self.dump_trace())
+        requests = self.x_requests()
+
+        start = time.time()
+        load()
+        elapsed = time.time() - start
+        time.sleep(settle)
+
+        requests = self.x_requests() - requests
+        spans = [e['dur'] for e in self.dump_trace()
+                 if e.get('ph') == 'X' and e['cat'] == category and e['name'] == name and
+                 (e['ts'], e['name']) not in before]
+
+        result = {
+            'count': len(spans),
+            'p50_us': percentile(spans, 50),
+            'p90_us': percentile(spans, 90),
+            'p99_us': percentile(spans, 99),
+            'max_us': max(spans) if spans else 0,
+            'x_requests': requests,
+            'wall_s': round(elapsed, 3),
+        }
+        PerfTest.results[scenario] = result
+        self.check_baseline(scenario, result)
+        return result
+
+    def check_baseline(self, scenario, result):
+        path = os.environ.get('PERF_BASELINE')
+        if not path or not os.path.exists(path):
+            return
+        with open(path) as f:
+            baseline = json.load(f).get(scenario)
+        if not baseline:
+            return
+
+        tolerance = float(os.environ.get('PERF_TOLERANCE', '0.5'))
+        regressions = []
+        for key in ('p50_us', 'p90_us', 'p99_us'):
+            limit = baseline[key] * (1 + tolerance) + LATENCY_SLACK_US
+            if result[key] > limit:
+                regressions.append('%s %d > %d' % (key, result[key], limit))
+        limit = baseline['x_requests'] * (1 + tolerance) + REQUEST_SLACK
+        if result['x_requests'] > limit:
+            regressions.append('x_requests %d > %d' % (result['x_requests'], limit))
+
+        self.assertEqual(regressions, [], 'Regression in %s: %s' % (scenario, ', '.join(regressions)))
+
+    def test_randr_churn(self):
+        '''RandR screen size changes'''
+
+        out = subprocess.check_output(['xrandr']).decode()
+        sizes = [l.split()[0] for l in out.splitlines() if l.startswith('   ')][:2]
+        if len(sizes) < 2:
+            self.skipTest('X server only offers one mode')
+
+        def load():
+            for i in range(20):
+                subprocess.check_call(['xrandr', '-s', sizes[i % 2]])
+                time.sleep(0.1)
+            subprocess.check_call(['xrandr', '-s', sizes[0]])
+
+        result = self.measure('randr_churn', 'xrandr', 'randr-event', load, settle=2.0)
+        self.assertGreater(result['count'], 0)
+
+    def test_randr_burst(self):
+        '''Bursts of RandR changes get one decision each'''
+
+        out = subprocess.check_output(['xrandr']).decode()
+        sizes = [l.split()[0] for l in out.splitlines() if l.startswith('   ')][:2]
+        if len(sizes) < 2:
+            self.skipTest('X server only offers one mode')
+
+        before = set((e['ts'], e['name']) for e in self.dump_trace())
+
+        def load():
+            # like a dock bringing up its outputs one after the other
+            for burst in range(5):
+                for i in range(6):
+                    subprocess.check_call(['xrandr', '-s', sizes[i % 2]])
+                time.sleep(2)
+            subprocess.check_call(['xrandr', '-s', sizes[0]])
+
+        result = self.measure('randr_burst', 'xrandr', 'randr-settle', load, settle=2.0)
+        events = [e for e in self.dump_trace()
+                  if e.get('ph') == 'X' and e['cat'] == 'xrandr' and e['name'] == 'randr-event' and
+                  (e['ts'], e['name']) not in before]
+
+        self.assertGreater(result['count'], 0)
+        self.assertLess(result['count'], len(events))
+
+    def test_wallpaper_churn(self):
+        '''Wallpaper redraws on RandR changes with a large picture'''
+
+        out = subprocess.check_output(['xrandr']).decode()
+        sizes = [l.split()[0] for l in out.splitlines() if l.startswith('   ')][:2]
+        if len(sizes) < 2:
+            self.skipTest('X server only offers one mode')
+
+        # synthetic 8K picture, blocky noise so that it doesn't compress
+        # into nothing
+        path = os.path.join(self.workdir, 'wallpaper.png')
+        noise = GdkPixbuf.Pixbuf.new_from_bytes(GLib.Bytes.new(os.urandom(64 * 64 * 3)),
+                                                GdkPixbuf.Colorspace.RGB, False, 8,
+                                                64, 64, 64 * 3)
+        noise.scale_simple(7680, 4320, GdkPixbuf.InterpType.NEAREST).savev(path, 'png', [], [])
+
+        settings = Gio.Settings('org.gnome.desktop.background')
+        settings['picture-options'] = 'zoom'
+        settings['picture-uri'] = 'file://' + path
+        Gio.Settings.sync()
+        time.sleep(2)
+
+        def load():
+            for i in range(10):
+                subprocess.check_call(['xrandr', '-s', sizes[i % 2]])
+                time.sleep(0.5)
+            subprocess.check_call(['xrandr', '-s', sizes[0]])
+
+        # main loop time only; the decoding and scaling in the worker is
+        # recorded as 'render'
+        result = self.measure('wallpaper_churn', 'background', 'draw', load, settle=3.0)
+
+        settings.reset('picture-options')
+        settings.reset('picture-uri')
+        Gio.Settings.sync()
+
+        self.assertGreater(result['count'], 0)
+
+    def test_a11y_toggle(self):
+        '''Toggling sticky, slow and bounce keys'''
+
+        settings = Gio.Settings('org.gnome.desktop.a11y.keyboard')
+        keys = ['stickykeys-enable', 'slowkeys-enable', 'bouncekeys-enable']
+        before = set((e['ts'], e['name']) for e in self.dump_trace())
+
+        def load():
+            for i in range(20):
+                for key in keys:
+                    settings[key] = not settings[key]
+                    Gio.Settings.sync()
+                    time.sleep(0.02)
+            for key in keys:
+                settings.reset(key)
+            Gio.Settings.sync()
+
+        result = self.measure('a11y_toggle', 'a11y-keyboard', 'set-server', load)
+        self.assertGreater(result['count'], 0)
+
+        # The server echoing our own changes back must not cause any
+        # GSettings writes
+        writes = [e for e in self.dump_trace()
+                  if e.get('ph') == 'X' and e['cat'] == 'a11y-keyboard' and
+                  e['name'] == 'gsettings-write' and (e['ts'], e['name']) not in before]
+        PerfTest.results['a11y_toggle']['gsettings_writes'] = len(writes)
+        self.assertEqual(len(writes), 0)
+
+    def test_key_storm(self):
+        '''XTest media key storm'''
+
+        def load():
+            subprocess.check_call([os.path.join(top_builddir, 'tests', 'shiftkey'),
+                                   'XF86AudioMute', '200'])
+
+        result = self.measure('key_storm', 'media-keys', 'key-action', load)
+        self.assertGreater(result['count'], 0)
+
+    def test_gsettings_burst(self):
+        '''Burst of GSettings changes propagated through XSETTINGS'''
+
+        settings = Gio.Settings('org.gnome.desktop.interface')
+
+        def load():
+            for i in range(100):
+                settings['cursor-blink-time'] = 1000 + i
+                Gio.Settings.sync()
+            settings.reset('cursor-blink-time')
+            Gio.Settings.sync()
+
+        result = self.measure('gsettings_burst', 'xsettings', 'notify', load)
+        self.assertGreater(result['count'], 0)
+
+    def test_input_hotplug(self):
+        '''uinput device hotplug'''
+
+        try:
+            import evdev
+        except ImportError:
+            self.skipTest('python-evdev is not installed')
+        if not os.access('/dev/uinput', os.W_OK):
+            self.skipTest('/dev/uinput is not writable')
+
+        def load():
+            for i in range(10):
+                device = evdev.UInput(name='gsd-perf-test-%d' % i)
+                time.sleep(0.2)
+                device.close()
+                time.sleep(0.2)
+
+        # the mouse plugin's device added and removed handlers
+        result = self.measure('input_hotplug', 'input', 'hotplug', load, settle=2.0)
+        self.assertGreater(result['count'], 0, 'no hotplug handled, is the X server picking up uinput devices?')
+
+
+if __name__ == '__main__':
+    # run ourselves under dbus-launch and X.org like the plugin tests
+    unittest.main(testRunner=unittest.TextTestRunner(stream=sys.stdout, verbosity=2))
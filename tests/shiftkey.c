@@ -1,7 +1,7 @@
 /* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
  *
  * Test helper program to send a "left shift key" event via XTest, to reset the
- * idle timer.
+ * idle timer, or a burst of any other key.
  *
  * Copyright (C) 2013 Canonical Ltd.
  * Author: Martin Pitt <martin.pitt@ubuntu.com>
@@ -25,16 +25,31 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <X11/extensions/XTest.h>
 #include <X11/keysym.h>
 
 int
-main()
+main (int argc, char **argv)
 {
         Display *display = NULL;
         int event_base, error_base, major_version, minor_version;
+        KeySym keysym = XK_Shift_L;
         KeyCode keycode;
+        int count = 1;
+        int i;
+
+        /* Optionally: shiftkey <keysym name> <count> */
+        if (argc > 1) {
+                keysym = XStringToKeysym (argv[1]);
+                if (keysym == NoSymbol) {
+                        fprintf (stderr, "Error: Unknown keysym '%s'\n", argv[1]);
+                        return 1;
+                }
+        }
+        if (argc > 2)
+                count = atoi (argv[2]);
 
         display = XOpenDisplay (NULL);
 
@@ -48,10 +63,16 @@ main()
                 return 1;
         }
 
-        /* send a left shift key; first press, then release */
-        keycode = XKeysymToKeycode (display, XK_Shift_L);
-        XTestFakeKeyEvent (display, keycode, True, 0);
-        XTestFakeKeyEvent (display, keycode, False, 0);
+        /* send the key; first press, then release */
+        keycode = XKeysymToKeycode (display, keysym);
+        if (keycode == 0) {
+                fprintf (stderr, "Error: No keycode for keysym '%s'\n", XKeysymToString (keysym));
+                return 1;
+        }
+        for (i = 0; i < count; i++) {
+                XTestFakeKeyEvent (display, keycode, True, 0);
+                XTestFakeKeyEvent (display, keycode, False, 0);
+        }
 
         XCloseDisplay (display);
         return 0;